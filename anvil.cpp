@@ -7,7 +7,10 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <vector>
+
 #include "util.h"
+#include "rofile.h"
 #include "sys_journal.h"
 #include "dtable_factory.h"
 #include "ctable_factory.h"
@@ -69,6 +72,11 @@ int anvil_init(const char * path)
 	return r;
 }
 
+void anvil_set_block_cache(size_t bytes)
+{
+	rofile::set_shared_cache(bytes);
+}
+
 static inline int init_anvil_istr(anvil_istr * c, const istr & value)
 {
 	anvil_istr_union safer(c);
@@ -403,14 +411,14 @@ int anvil_dtype_get_str(const anvil_dtype * c, anvil_istr * value)
 {
 	anvil_dtype_union_const safer(c);
 	assert(safer->type == dtype::STRING);
-	return init_anvil_istr(value, safer->str);
+	return init_anvil_istr(value, safer->str());
 }
 
 int anvil_dtype_get_blb(const anvil_dtype * c, anvil_blob * value)
 {
 	anvil_dtype_union_const safer(c);
 	assert(safer->type == dtype::BLOB);
-	return init_anvil_blob(value, safer->blb);
+	return init_anvil_blob(value, safer->blb());
 }
 
 int anvil_dtype_compare(const anvil_dtype * a, const anvil_dtype * b)
@@ -485,6 +493,29 @@ int anvil_dtable_find_tx(const anvil_dtable * c, const anvil_dtype * key, anvil_
 	return init_anvil_blob(value, safer->find(*key_safer, atx));
 }
 
+int anvil_dtable_find_many(const anvil_dtable * c, const anvil_dtype * keys, size_t count, anvil_blob * values)
+{
+	return anvil_dtable_find_many_tx(c, keys, count, values, NO_ABORTABLE_TX);
+}
+
+int anvil_dtable_find_many_tx(const anvil_dtable * c, const anvil_dtype * keys, size_t count, anvil_blob * values, abortable_tx atx)
+{
+	anvil_dtable_union_const safer(c);
+	anvil_dtype_union_const keys_safer(keys);
+	std::vector<blob> results(count);
+	bool * found;
+	if(!count)
+		return 0;
+	found = new bool[count];
+	if(!found)
+		return -ENOMEM;
+	safer->lookup_many(keys_safer, count, &results[0], found, atx);
+	delete[] found;
+	for(size_t i = 0; i < count; i++)
+		init_anvil_blob(&values[i], results[i]);
+	return 0;
+}
+
 bool anvil_dtable_writable(const anvil_dtable * c)
 {
 	anvil_dtable_union_const safer(c);
@@ -30,8 +30,8 @@ struct anvil_istr
 typedef struct anvil_istr anvil_istr;
 struct anvil_blob
 {
-	/* sizeof(blob) */
-	uint8_t _space[sizeof(void *)];
+	/* sizeof(blob), which is BLOB_INLINE_SIZE + 1 */
+	uint8_t _space[16];
 };
 typedef struct anvil_blob anvil_blob;
 
@@ -60,7 +60,7 @@ struct anvil_dtype
 {
 	/* sizeof(dtype) */
 	/* use long instead of anvil_dtype_type for correct 64-bit alignment */
-	uint8_t _space[sizeof(long) + sizeof(double) + 2 * sizeof(void *)];
+	uint8_t _space[sizeof(long) + sizeof(anvil_blob)];
 };
 typedef struct anvil_dtype anvil_dtype;
 
@@ -95,6 +95,10 @@ typedef int (*blob_test)(const void *, size_t, void *);
 /* use Anvil runtime environment (journals, etc.) at this path */
 int anvil_init(const char * path);
 
+/* share one cache of file blocks, of this many bytes, among all the read-only
+ * files opened after this call; 0 (the default) gives each its own buffers */
+void anvil_set_block_cache(size_t bytes);
+
 /* istr */
 int anvil_istr_new(anvil_istr * c, const char * str);
 int anvil_istr_copy(anvil_istr * c, const anvil_istr * src);
@@ -180,6 +184,9 @@ bool anvil_dtable_contains(const anvil_dtable * c, const anvil_dtype * key);
 bool anvil_dtable_contains_tx(const anvil_dtable * c, const anvil_dtype * key, abortable_tx atx);
 int anvil_dtable_find(const anvil_dtable * c, const anvil_dtype * key, anvil_blob * value);
 int anvil_dtable_find_tx(const anvil_dtable * c, const anvil_dtype * key, anvil_blob * value, abortable_tx atx);
+/* looks up count keys at once; each of the values must be killed afterward */
+int anvil_dtable_find_many(const anvil_dtable * c, const anvil_dtype * keys, size_t count, anvil_blob * values);
+int anvil_dtable_find_many_tx(const anvil_dtable * c, const anvil_dtype * keys, size_t count, anvil_blob * values, abortable_tx atx);
 bool anvil_dtable_writable(const anvil_dtable * c);
 int anvil_dtable_insert(anvil_dtable * c, const anvil_dtype * key, const anvil_blob * value, bool append);
 int anvil_dtable_insert_tx(anvil_dtable * c, const anvil_dtype * key, const anvil_blob * value, bool append, abortable_tx atx);
@@ -367,7 +374,7 @@ public:
 	virtual int operator()(const dtype & key) const
 	{
 		assert(key.type == dtype::BLOB);
-		return test(&key.blb[0], key.blb.size(), user);
+		return test(&key.blb()[0], key.blb().size(), user);
 	}
 	
 	anvil_dtype_test(blob_test test, void * user) : test(test), user(user) {}
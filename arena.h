@@ -0,0 +1,118 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error arena.h is a C++ header file
+#endif
+
+/* An arena hands out memory from large chunks, and frees it all at once: there
+ * is no way to free an individual allocation. This is useful for structures
+ * that only grow until they are thrown away entirely, like the memtable in a
+ * journal dtable, which are then cheap to build and cheap to get rid of. */
+
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_ALIGN 8
+
+class arena
+{
+public:
+	inline arena(size_t chunk_size = ARENA_CHUNK_SIZE)
+		: chunks(NULL), chunk_size(chunk_size), offset(0), limit(0), total(0)
+	{
+	}
+	
+	inline ~arena()
+	{
+		clear();
+	}
+	
+	/* returns NULL if malloc() fails */
+	inline void * alloc(size_t size)
+	{
+		void * data;
+		size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+		if(offset + size > limit)
+		{
+			/* large allocations get their own chunk, leaving the current one */
+			if(size > chunk_size / 4)
+				return alloc_chunk(size, false);
+			if(!alloc_chunk(chunk_size, true))
+				return NULL;
+		}
+		data = &chunks->data[offset];
+		offset += size;
+		return data;
+	}
+	
+	/* frees all the memory allocated from the arena */
+	inline void clear()
+	{
+		while(chunks)
+		{
+			chunk * next = chunks->next;
+			free(chunks);
+			chunks = next;
+		}
+		offset = 0;
+		limit = 0;
+		total = 0;
+	}
+	
+	/* the total size of the chunks, including unused space */
+	inline size_t size() const
+	{
+		return total;
+	}
+	
+private:
+	struct chunk
+	{
+		chunk * next;
+		uint8_t data[0] __attribute__((aligned(ARENA_ALIGN)));
+	};
+	
+	inline void * alloc_chunk(size_t size, bool current)
+	{
+		chunk * next = (chunk *) malloc(sizeof(chunk) + size);
+		if(!next)
+			return NULL;
+		total += size;
+		if(current || !chunks)
+		{
+			next->next = chunks;
+			chunks = next;
+			if(current)
+			{
+				offset = 0;
+				limit = size;
+			}
+			else
+				/* the large allocation is now the current chunk, so it's full */
+				offset = limit = size;
+		}
+		else
+		{
+			/* keep allocating from the current chunk afterward */
+			next->next = chunks->next;
+			chunks->next = next;
+		}
+		return next->data;
+	}
+	
+	chunk * chunks;
+	size_t chunk_size, offset, limit, total;
+	
+	/* no copying */
+	arena(const arena &);
+	arena & operator=(const arena &);
+};
+
+#endif /* __ARENA_H */
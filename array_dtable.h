@@ -37,6 +37,14 @@ public:
 	virtual blob index(size_t index) const;
 	virtual bool contains_index(size_t index) const;
 	inline virtual size_t size() const { return key_count; }
+	inline virtual bool key_range(dtype * min, dtype * max) const
+	{
+		if(!array_size)
+			return false;
+		*min = min_key;
+		*max = (uint32_t) (min_key + array_size - 1);
+		return true;
+	}
 	
 	static inline bool static_indexed_access(const params & config) { return true; }
 	
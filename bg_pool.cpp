@@ -0,0 +1,93 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <errno.h>
+
+#include "bg_pool.h"
+
+int bg_pool::submit(job * job, priority priority)
+{
+	scopelock scope(lock);
+	if(stopping)
+		return -EINVAL;
+	/* start the workers lazily, so unused pools have no threads */
+	while(workers.size() < thread_count)
+	{
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, worker_static, this))
+			break;
+		workers.push_back(thread);
+	}
+	if(!workers.size())
+		return -ENOMEM;
+	queue.insert(entry(priority, next_sequence++, job));
+	scope.signal(wait);
+	return 0;
+}
+
+void bg_pool::loan_tokens()
+{
+	std::vector<bg_token *> tokens;
+	scopelock scope(lock);
+	for(std::set<job *>::iterator it = running.begin(); it != running.end(); ++it)
+		if((*it)->token->wanted())
+			tokens.push_back((*it)->token);
+	/* a job can't finish while it is waiting for its token, so
+	 * it is safe to loan these tokens without holding the lock;
+	 * their owners may have loaned them in the meantime though */
+	scope.unlock();
+	for(size_t i = 0; i < tokens.size(); i++)
+		tokens[i]->try_loan();
+}
+
+int bg_pool::set_threads(size_t count)
+{
+	scopelock scope(lock);
+	if(workers.size() || !count)
+		return -EINVAL;
+	thread_count = count;
+	return 0;
+}
+
+bg_pool::~bg_pool()
+{
+	scopelock scope(lock);
+	assert(queue.empty());
+	stopping = true;
+	scope.broadcast(wait);
+	scope.unlock();
+	for(size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+}
+
+void bg_pool::worker()
+{
+	scopelock scope(lock);
+	for(;;)
+	{
+		job * work;
+		while(queue.empty() && !stopping)
+			scope.wait(wait);
+		if(queue.empty())
+			break;
+		work = queue.begin()->work;
+		queue.erase(queue.begin());
+		running.insert(work);
+		scope.unlock();
+		work->run(work->token);
+		scope.lock();
+		running.erase(work);
+		scope.unlock();
+		work->done();
+		scope.lock();
+	}
+}
+
+void * bg_pool::worker_static(void * arg)
+{
+	((bg_pool *) arg)->worker();
+	return NULL;
+}
+
+bg_pool bg_pool::global_pool;
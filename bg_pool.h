@@ -0,0 +1,102 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __BG_POOL_H
+#define __BG_POOL_H
+
+#include <pthread.h>
+
+#ifndef __cplusplus
+#error bg_pool.h is a C++ header file
+#endif
+
+#include <set>
+#include <vector>
+
+#include "bg_token.h"
+
+/* A background pool is a fixed set of worker threads shared by many objects
+ * (e.g. all the managed dtables) for their background work, so that the
+ * number of threads, and of simultaneous digests competing for the disk, does
+ * not grow with the number of objects. Each job carries the bg_token of the
+ * object it works on, and the foreground thread loans it as usual. */
+
+#define BG_POOL_THREADS 2
+
+class bg_pool
+{
+public:
+	/* lower numbers run first */
+	enum priority { HIGH, NORMAL, LOW };
+	
+	class job
+	{
+	public:
+		virtual void run(bg_token * token) = 0;
+		/* called after run(), once the pool no longer refers to the job,
+		 * so that the job can be destroyed as soon as this is called */
+		virtual void done() {}
+		inline job(bg_token * token) : token(token) {}
+		virtual ~job() {}
+	private:
+		bg_token * const token;
+		friend class bg_pool;
+	};
+	
+	/* jobs with the same priority run in the order they were submitted; the
+	 * job must not be destroyed until it has finished running */
+	int submit(job * job, priority priority = NORMAL);
+	
+	/* loan the tokens of any running jobs that want them; when waiting for a
+	 * job to finish, call this instead of just loaning that job's token, as
+	 * it may be queued behind other jobs which are waiting for theirs */
+	void loan_tokens();
+	
+	/* must be called before any jobs are submitted */
+	int set_threads(size_t count);
+	inline size_t threads() const { return thread_count; }
+	/* the number of threads actually started */
+	inline size_t started() const { return workers.size(); }
+	
+	inline bg_pool(size_t threads = BG_POOL_THREADS) : thread_count(threads), next_sequence(0), stopping(false) {}
+	~bg_pool();
+	
+	static inline bg_pool * get_global_pool()
+	{
+		return &global_pool;
+	}
+	
+private:
+	struct entry
+	{
+		priority level;
+		size_t sequence;
+		job * work;
+		inline entry(priority level, size_t sequence, job * work) : level(level), sequence(sequence), work(work) {}
+		inline bool operator<(const entry & x) const
+		{
+			if(level != x.level)
+				return level < x.level;
+			return sequence < x.sequence;
+		}
+	};
+	
+	size_t thread_count, next_sequence;
+	bool stopping;
+	std::set<entry> queue;
+	std::set<job *> running;
+	std::vector<pthread_t> workers;
+	init_mutex lock;
+	init_cond wait;
+	
+	void worker();
+	static void * worker_static(void * arg);
+	
+	static bg_pool global_pool;
+	
+	void operator=(const bg_pool &);
+	bg_pool(const bg_pool &);
+};
+
+#endif /* __BG_POOL_H */
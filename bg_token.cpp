@@ -26,6 +26,22 @@ void bg_token::loan()
 	BGT_DEBUG("finished");
 }
 
+bool bg_token::try_loan()
+{
+	BGT_DEBUG("");
+	scopelock scope(lock);
+	if(!waiting)
+		return false;
+	assert(!held);
+	waiting = false;
+	held = 1;
+	scope.signal(wait);
+	while(held)
+		scope.wait(wait);
+	BGT_DEBUG("finished");
+	return true;
+}
+
 void bg_token::wait_to_loan()
 {
 	BGT_DEBUG("");
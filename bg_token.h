@@ -27,6 +27,9 @@ public:
 		return waiting;
 	}
 	void loan();
+	/* like loan(), but only if the token is (still) wanted, so other
+	 * threads may also loan it, as the background pool does */
+	bool try_loan();
 	/* be careful with this: if the background thread never
 	 * wants the token again, this will wait forever */
 	void wait_to_loan();
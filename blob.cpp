@@ -12,43 +12,31 @@
 const blob blob::dne;
 const blob blob::empty(0, NULL);
 
-blob::blob(size_t size, const void * data)
+void blob::init(size_t size, const void * data)
 {
+	if(size <= BLOB_INLINE_SIZE)
+	{
+		util::memcpy(space, data, size);
+		tag() = size + 1;
+		return;
+	}
 	internal = (blob_internal *) malloc(sizeof(*internal) + size);
 	assert(internal);
 	internal->size = size;
 	/* set(), not inc(), since we skipped the constructor */
 	internal->shares.set(1);
 	util::memcpy(internal->bytes, data, size);
+	tag() = BLOB_SHARED;
 }
 
-blob::blob(const char * string)
-{
-	size_t size = strlen(string);
-	internal = (blob_internal *) malloc(sizeof(*internal) + size);
-	assert(internal);
-	internal->size = size;
-	/* set(), not inc(), since we skipped the constructor */
-	internal->shares.set(1);
-	util::memcpy(internal->bytes, string, size);
-}
-
-blob::blob(const blob & x)
+blob::blob(size_t size, const void * data)
 {
-	if((internal = x.internal))
-		internal->shares.inc();
+	init(size, data);
 }
 
-blob & blob::operator=(const blob & x)
+blob::blob(const char * string)
 {
-	/* note that this includes the case where this == &x */
-	if(internal == x.internal)
-		return *this;
-	if(internal && !internal->shares.dec())
-		free(internal);
-	if((internal = x.internal))
-		internal->shares.inc();
-	return *this;
+	init(strlen(string), string);
 }
 
 template<class T>
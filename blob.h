@@ -22,6 +22,14 @@
 
 /* blobs, the storage units of dtables */
 
+/* Small blobs (like flattened uint32 and double keys, or short names) are
+ * stored inline, in the space that would otherwise hold the pointer to the
+ * shared data, so they need no allocation or atomic share counting. The last
+ * byte says which kind of blob it is: 0 if it doesn't exist (so a zeroed blob
+ * is a nonexistent one), the size plus one if it is inline, or BLOB_SHARED. */
+#define BLOB_INLINE_SIZE 15
+#define BLOB_SHARED 0xFF
+
 class blob_comparator;
 
 class blob
@@ -33,12 +41,26 @@ public:
 	static const blob empty;
 	
 	/* non-existent blob constructor */
-	inline blob() : internal(NULL) {}
+	inline blob() { internal = NULL; tag() = 0; }
 	/* other constructors */
 	blob(size_t size, const void * data);
 	blob(const char * string);
-	blob(const blob & x);
-	blob & operator=(const blob & x);
+	inline blob(const blob & x)
+	{
+		memcpy(space, x.space, sizeof(space));
+		if(shared())
+			internal->shares.inc();
+	}
+	inline blob & operator=(const blob & x)
+	{
+		/* this handles the case where this == &x */
+		if(x.shared())
+			x.internal->shares.inc();
+		if(shared() && !internal->shares.dec())
+			free(internal);
+		memcpy(space, x.space, sizeof(space));
+		return *this;
+	}
 	
 	static inline ssize_t locate(const blob * array, size_t size, const blob & key, const blob_comparator * blob_cmp = NULL)
 	{
@@ -53,57 +75,58 @@ public:
 	
 	inline ~blob()
 	{
-		if(internal && !internal->shares.dec())
+		if(shared() && !internal->shares.dec())
 			free(internal);
 	}
 	
 	inline const uint8_t & operator[](size_t i) const
 	{
-		assert(internal);
-		assert(i < internal->size);
-		return internal->bytes[i];
+		assert(exists());
+		assert(i < size());
+		return bytes()[i];
 	}
 	
 	template <class T>
 	inline const T & index(size_t i, size_t off = 0) const
 	{
-		assert(internal);
-		assert(off + (i + 1) * sizeof(T) <= internal->size);
-		return *(T *) (void *) &internal->bytes[off + i * sizeof(T)];
+		assert(exists());
+		assert(off + (i + 1) * sizeof(T) <= size());
+		return *(T *) (void *) &bytes()[off + i * sizeof(T)];
 	}
 	
 	inline const void * data() const
 	{
-		return internal ? &internal->bytes : NULL;
+		return exists() ? bytes() : NULL;
 	}
 	
 	inline size_t size() const
 	{
-		return internal ? internal->size : 0;
+		return shared() ? internal->size : tag() ? tag() - 1 : 0;
 	}
 	
+	/* inline blobs are never shared */
 	inline size_t shares() const
 	{
-		return internal ? internal->shares.get() : 0;
+		return shared() ? internal->shares.get() : exists();
 	}
 	
 	/* does this blob exist? */
 	inline bool exists() const
 	{
-		return internal != NULL;
+		return tag() != 0;
 	}
 	
 	inline int compare(const blob & x) const
 	{
 		int r;
-		size_t min;
-		if(internal == x.internal)
+		size_t min, size = this->size(), x_size = x.size();
+		if(shared() && x.shared() && internal == x.internal)
 			return 0;
-		if(!internal || !x.internal)
-			return internal ? 1 : -1;
-		min = (internal->size < x.internal->size) ? internal->size : x.internal->size;
-		r = memcmp(internal->bytes, x.internal->bytes, min);
-		return r ? r : (internal->size < x.internal->size) ? -1 : internal->size > x.internal->size;
+		if(!exists() || !x.exists())
+			return exists() ? 1 : x.exists() ? -1 : 0;
+		min = (size < x_size) ? size : x_size;
+		r = memcmp(bytes(), x.bytes(), min);
+		return r ? r : (size < x_size) ? -1 : size > x_size;
 	}
 	
 private:
@@ -114,7 +137,26 @@ private:
 		 * malloc, bypassing the atomic<size_t> constructor */
 		atomic<size_t> shares;
 		uint8_t bytes[0];
-	} * internal;
+	};
+	union
+	{
+		blob_internal * internal;
+		/* the inline data, and the tag in the last byte */
+		uint8_t space[BLOB_INLINE_SIZE + 1];
+	};
+	
+	inline uint8_t & tag() { return space[BLOB_INLINE_SIZE]; }
+	inline uint8_t tag() const { return space[BLOB_INLINE_SIZE]; }
+	inline bool shared() const { return tag() == BLOB_SHARED; }
+	inline const uint8_t * bytes() const { return shared() ? internal->bytes : space; }
+	void init(size_t size, const void * data);
+	
+	/* for blob_buffer, which takes over the share passed in */
+	inline void share(blob_internal * shared)
+	{
+		internal = shared;
+		tag() = BLOB_SHARED;
+	}
 	
 	template<class T>
 	static ssize_t locate_generic(T array, size_t size, const blob & key, const blob_comparator * blob_cmp);
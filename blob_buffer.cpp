@@ -38,18 +38,24 @@ blob_buffer::blob_buffer(const blob_buffer & x)
 
 blob_buffer & blob_buffer::operator=(const blob & x)
 {
+	int r;
 	if(internal && !internal->shares.dec())
 		free(internal);
-	if(x.internal)
+	buffer_capacity = 0;
+	internal = NULL;
+	if(x.shared())
 	{
 		buffer_capacity = x.internal->size;
 		internal = x.internal;
 		internal->shares.inc();
 	}
-	else
+	else if(x.exists())
 	{
-		buffer_capacity = 0;
-		internal = NULL;
+		/* inline blobs have nothing to share, so copy them */
+		r = set_capacity(x.size());
+		assert(r >= 0);
+		util::memcpy(internal->bytes, x.space, x.size());
+		internal->size = x.size();
 	}
 	return *this;
 }
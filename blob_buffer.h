@@ -145,11 +145,15 @@ public:
 	
 	inline operator blob() const
 	{
-		/* default constructor sets internal to NULL */
+		/* default constructor makes a nonexistent blob */
 		blob value;
-		value.internal = internal;
-		if(internal)
-			internal->shares.inc();
+		if(!internal)
+			return value;
+		/* small blobs are cheaper to copy than to share */
+		if(internal->size <= BLOB_INLINE_SIZE)
+			return blob(internal->size, internal->bytes);
+		internal->shares.inc();
+		value.share(internal);
 		return value;
 	}
 	
@@ -4,6 +4,10 @@
 
 #define _ATFILE_SOURCE
 
+#include <stdlib.h>
+
+#include <vector>
+
 #include "md5.h"
 #include "openat.h"
 
@@ -25,6 +29,59 @@ bool bloom_dtable::perf_enable = false;
 #define HASH_SIZE 16 /* MD5 */
 #define HASH_BITS (HASH_SIZE * 8)
 
+/* Blocked filters use a much cheaper 64-bit hash (based on MurmurHash64A)
+ * instead of MD5. The high 32 bits pick the cache line, and the low 32 bits
+ * are used with double hashing to pick the k bits within that line. */
+static uint64_t hash64(const void * data, size_t length)
+{
+	const uint64_t mul = 0xC6A4A7935BD1E995ULL;
+	const uint8_t * bytes = (const uint8_t *) data;
+	uint64_t hash = length * mul;
+	while(length >= sizeof(uint64_t))
+	{
+		uint64_t word;
+		util::memcpy(&word, bytes, sizeof(word));
+		word *= mul;
+		word ^= word >> 47;
+		word *= mul;
+		hash ^= word;
+		hash *= mul;
+		bytes += sizeof(word);
+		length -= sizeof(word);
+	}
+	if(length)
+	{
+		uint64_t word = 0;
+		util::memcpy(&word, bytes, length);
+		hash ^= word;
+		hash *= mul;
+	}
+	hash ^= hash >> 47;
+	hash *= mul;
+	hash ^= hash >> 47;
+	return hash;
+}
+
+static uint64_t hash64(const dtype & key)
+{
+	switch(key.type)
+	{
+		case dtype::UINT32:
+			return hash64(&key.u32, sizeof(key.u32));
+		case dtype::DOUBLE:
+			return hash64(&key.dbl, sizeof(key.dbl));
+		case dtype::STRING:
+			if(key.str())
+				return hash64(key.str().str(), key.str().length());
+			return hash64(NULL, 0);
+		case dtype::BLOB:
+			if(key.blb().exists())
+				return hash64(&key.blb()[0], key.blb().size());
+			return hash64(NULL, 0);
+	}
+	abort();
+}
+
 /* a little helper class to read bit arrays */
 class bitreader
 {
@@ -71,12 +128,30 @@ int bloom_dtable::bloom::init(int dfd, const char * file, size_t * m, size_t * k
 		return -1;
 	if(data->read_type(0, &header) < 0)
 		goto fail_close;
-	if(header.magic != BLOOM_DTABLE_MAGIC || header.version != BLOOM_DTABLE_VERSION)
+	if(header.magic != BLOOM_DTABLE_MAGIC)
+		goto fail_close;
+	if(header.version == BLOOM_DTABLE_BLOCKED_VERSION || header.version == BLOOM_DTABLE_BLOCKED_V1)
+	{
+		if(!header.m || header.m % BLOOM_DTABLE_LINE_BITS)
+			goto fail_close;
+		blocked = true;
+		lines = header.m / BLOOM_DTABLE_LINE_BITS;
+		odd_step = header.version != BLOOM_DTABLE_BLOCKED_V1;
+	}
+	else if(header.version == BLOOM_DTABLE_VERSION)
+	{
+		blocked = false;
+		lines = 0;
+	}
+	else
 		goto fail_close;
 	bytes = (header.m + 7) / 8;
-	filter = new uint8_t[bytes];
-	if(!filter)
+	/* align the filter so blocked lines are really cache lines */
+	if(posix_memalign((void **) &filter, BLOOM_DTABLE_LINE_BITS / 8, bytes))
+	{
+		filter = NULL;
 		goto fail_close;
+	}
 	if(data->read(sizeof(header), filter, bytes) != bytes)
 		goto fail_free;
 	*m = header.m;
@@ -95,21 +170,28 @@ int bloom_dtable::bloom::init(int dfd, const char * file, size_t * m, size_t * k
 	return 0;
 
 fail_free:
-	delete[] filter;
+	free(filter);
 	filter = NULL;
 fail_close:
 	delete data;
 	return -1;
 }
 
-int bloom_dtable::bloom::init(size_t bytes)
+int bloom_dtable::bloom::init(size_t bytes, bool blocked)
 {
 	if(filter)
 		deinit();
-	filter = new uint8_t[bytes];
-	if(!filter)
+	if(blocked && (!bytes || bytes % (BLOOM_DTABLE_LINE_BITS / 8)))
+		return -EINVAL;
+	if(posix_memalign((void **) &filter, BLOOM_DTABLE_LINE_BITS / 8, bytes))
+	{
+		filter = NULL;
 		return -ENOMEM;
+	}
 	util::memset(filter, 0, bytes);
+	this->blocked = blocked;
+	lines = blocked ? bytes / (BLOOM_DTABLE_LINE_BITS / 8) : 0;
+	odd_step = 1;
 #if BFDT_PERF_TEST
 	total_lookups = 0;
 	blocked_lookups = 0;
@@ -121,7 +203,7 @@ void bloom_dtable::bloom::deinit()
 {
 	if(filter)
 	{
-		delete[] filter;
+		free(filter);
 		filter = NULL;
 #if BFDT_PERF_TEST
 		if(perf_enable && total_lookups)
@@ -143,7 +225,7 @@ int bloom_dtable::bloom::write(int dfd, const char * file, size_t m, size_t k) c
 	bloom_dtable_header header;
 
 	header.magic = BLOOM_DTABLE_MAGIC;
-	header.version = BLOOM_DTABLE_VERSION;
+	header.version = blocked ? BLOOM_DTABLE_BLOCKED_VERSION : BLOOM_DTABLE_VERSION;
 	header.m = m;
 	header.k = k;
 	
@@ -193,10 +275,51 @@ void bloom_dtable::bloom::add(const uint8_t * hash, size_t k, size_t bits)
 		set(indices.next());
 }
 
+bool bloom_dtable::bloom::check_blocked(uint64_t hash, size_t k) const
+{
+	const uint8_t * line = &filter[(((hash >> 32) * lines) >> 32) * (BLOOM_DTABLE_LINE_BITS / 8)];
+	uint32_t probe = hash;
+	/* an odd step visits k different bits, since the line size is a power of 2 */
+	const uint32_t delta = (probe >> 17) | (probe << 15) | odd_step;
+#if BFDT_PERF_TEST
+	if(perf_enable)
+		total_lookups++;
+#endif
+	for(size_t i = 0; i < k; i++)
+	{
+		uint32_t bit = probe % BLOOM_DTABLE_LINE_BITS;
+		if(!(line[bit / 8] & (1 << (bit % 8))))
+		{
+#if BFDT_PERF_TEST
+			if(perf_enable)
+				blocked_lookups++;
+#endif
+			return false;
+		}
+		probe += delta;
+	}
+	return true;
+}
+
+void bloom_dtable::bloom::add_blocked(uint64_t hash, size_t k)
+{
+	uint8_t * line = &filter[(((hash >> 32) * lines) >> 32) * (BLOOM_DTABLE_LINE_BITS / 8)];
+	uint32_t probe = hash;
+	const uint32_t delta = (probe >> 17) | (probe << 15) | odd_step;
+	for(size_t i = 0; i < k; i++)
+	{
+		uint32_t bit = probe % BLOOM_DTABLE_LINE_BITS;
+		line[bit / 8] |= 1 << (bit % 8);
+		probe += delta;
+	}
+}
+
 bool bloom_dtable::bloom::check(const dtype & key, size_t k, size_t bits) const
 {
 	MD5_CTX ctx;
 	uint8_t hash[HASH_SIZE];
+	if(blocked)
+		return check_blocked(hash64(key), k);
 	MD5Init(&ctx);
 	switch(key.type)
 	{
@@ -209,13 +332,13 @@ bool bloom_dtable::bloom::check(const dtype & key, size_t k, size_t bits) const
 			MD5Final(hash, &ctx);
 			return check(hash, k, bits);
 		case dtype::STRING:
-			if(key.str)
-				MD5Update(&ctx, (const uint8_t *) key.str.str(), key.str.length());
+			if(key.str())
+				MD5Update(&ctx, (const uint8_t *) key.str().str(), key.str().length());
 			MD5Final(hash, &ctx);
 			return check(hash, k, bits);
 		case dtype::BLOB:
-			if(key.blb.exists())
-				MD5Update(&ctx, &key.blb[0], key.blb.size());
+			if(key.blb().exists())
+				MD5Update(&ctx, &key.blb()[0], key.blb().size());
 			MD5Final(hash, &ctx);
 			return check(hash, k, bits);
 	}
@@ -226,6 +349,8 @@ void bloom_dtable::bloom::add(const dtype & key, size_t k, size_t bits)
 {
 	MD5_CTX ctx;
 	uint8_t hash[HASH_SIZE];
+	if(blocked)
+		return add_blocked(hash64(key), k);
 	MD5Init(&ctx);
 	switch(key.type)
 	{
@@ -238,13 +363,13 @@ void bloom_dtable::bloom::add(const dtype & key, size_t k, size_t bits)
 			MD5Final(hash, &ctx);
 			return add(hash, k, bits);
 		case dtype::STRING:
-			if(key.str)
-				MD5Update(&ctx, (const uint8_t *) key.str.str(), key.str.length());
+			if(key.str())
+				MD5Update(&ctx, (const uint8_t *) key.str().str(), key.str().length());
 			MD5Final(hash, &ctx);
 			return add(hash, k, bits);
 		case dtype::BLOB:
-			if(key.blb.exists())
-				MD5Update(&ctx, &key.blb[0], key.blb.size());
+			if(key.blb().exists())
+				MD5Update(&ctx, &key.blb()[0], key.blb().size());
 			MD5Final(hash, &ctx);
 			return add(hash, k, bits);
 	}
@@ -271,6 +396,36 @@ blob bloom_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return base->lookup(key, found);
 }
 
+void bloom_dtable::lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	/* filter the whole batch first, then pass the survivors to the base */
+	std::vector<size_t> indices;
+	std::vector<dtype> batch;
+	std::vector<blob> batch_values;
+	bool * batch_found;
+	for(size_t i = 0; i < count; i++)
+	{
+		values[i] = blob();
+		found[i] = false;
+		if(filter.check(keys[i], k, bits))
+		{
+			indices.push_back(i);
+			batch.push_back(keys[i]);
+		}
+	}
+	if(batch.empty())
+		return;
+	batch_values.resize(batch.size());
+	batch_found = new bool[batch.size()];
+	base->lookup_sorted(&batch[0], batch.size(), &batch_values[0], batch_found);
+	for(size_t i = 0; i < batch.size(); i++)
+	{
+		values[indices[i]] = batch_values[i];
+		found[indices[i]] = batch_found[i];
+	}
+	delete[] batch_found;
+}
+
 bool bloom_dtable::static_indexed_access(const params & config)
 {
 	const dtable_factory * factory;
@@ -341,12 +496,16 @@ void bloom_dtable::deinit()
  * SHA1 it would be a 128KiB bloom filter with 20-bit indices.) */
 /* FIXME: Should this be given as index_bits instead, and divide to get k? It
  * might be more stable in case of hash changes. */
+/* If the "bloom_blocked" parameter is set, a blocked filter is built instead,
+ * and "bloom_k" is ignored. The filter is then sized according to the number
+ * of keys: the "bloom_bits" parameter gives the number of bits per key, and
+ * determines k. The default of 10 uses k = 7, for about 1% false positives. */
 int bloom_dtable::create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow)
 {
-	bool valid;
+	bool valid, blocked;
 	bloom filter;
 	int bf_dfd, r;
-	size_t m, k, bits;
+	size_t m, k, bits, key_bits = 0;
 	params base_config;
 	dtable::iter * iter;
 	dtable * base_dtable;
@@ -355,11 +514,28 @@ int bloom_dtable::create(int dfd, const char * file, const params & config, dtab
 		return -ENOENT;
 	if(!config.get("base_config", &base_config, params()))
 		return -EINVAL;
-	if(!config.get("bloom_k", &r, 8) || r < 5 || r > 32)
+	if(!config.get("bloom_blocked", &blocked, false))
 		return -EINVAL;
-	k = r;
-	bits = HASH_BITS / k;
-	m = 1 << bits;
+	if(blocked)
+	{
+		if(!config.get("bloom_bits", &r, 10) || r < 1 || r > 64)
+			return -EINVAL;
+		key_bits = r;
+		/* k = bits * ln(2) minimizes the false positive rate */
+		k = (key_bits * 69 + 50) / 100;
+		if(k < 1)
+			k = 1;
+		bits = 0;
+		m = 0;
+	}
+	else
+	{
+		if(!config.get("bloom_k", &r, 8) || r < 5 || r > 32)
+			return -EINVAL;
+		k = r;
+		bits = HASH_BITS / k;
+		m = 1 << bits;
+	}
 	
 	if(!source_shadow_ok(source, shadow))
 		return -EINVAL;
@@ -379,7 +555,23 @@ int bloom_dtable::create(int dfd, const char * file, const params & config, dtab
 	if(!base_dtable)
 		goto fail_reopen;
 	
-	r = filter.init((m + 7) / 8);
+	if(blocked)
+	{
+		size_t lines, keys = base_dtable->size();
+		if(keys == (size_t) -1)
+		{
+			/* the base does not know its size, so count the keys */
+			iter = base_dtable->iterator();
+			if(!iter)
+				goto fail_write;
+			for(keys = 0; iter->valid(); iter->next())
+				keys++;
+			delete iter;
+		}
+		lines = (keys * key_bits + BLOOM_DTABLE_LINE_BITS - 1) / BLOOM_DTABLE_LINE_BITS;
+		m = (lines ? lines : 1) * BLOOM_DTABLE_LINE_BITS;
+	}
+	r = filter.init((m + 7) / 8, blocked);
 	if(r < 0)
 		goto fail_write;
 	iter = base_dtable->iterator();
@@ -16,12 +16,20 @@
 #include "dtable_factory.h"
 
 /* The bloom filter dtable must be created with another read-only dtable, and
- * builds a bloom filter for the keys. Negative lookups are then very fast. */
+ * builds a bloom filter for the keys. Negative lookups are then very fast. The
+ * filter can also be "blocked": all the bits for a key are then in a single
+ * cache line, so a negative lookup costs only one cache miss. */
 
 #define BFDT_PERF_TEST 0
 
 #define BLOOM_DTABLE_MAGIC 0x1138B893
 #define BLOOM_DTABLE_VERSION 0
+/* version 1 blocked filters could use an even probe step */
+#define BLOOM_DTABLE_BLOCKED_V1 1
+#define BLOOM_DTABLE_BLOCKED_VERSION 2
+
+/* the size in bits of a cache line in a blocked filter */
+#define BLOOM_DTABLE_LINE_BITS 512
 
 class bloom_dtable : public dtable
 {
@@ -33,9 +41,11 @@ public:
 	}
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	virtual blob index(size_t index) const { return base->index(index); }
 	virtual bool contains_index(size_t index) const { return base->contains_index(index); }
 	virtual size_t size() const { return base->size(); }
+	virtual bool key_range(dtype * min, dtype * max) const { return base->key_range(min, max); }
 	
 	inline virtual int set_blob_cmp(const blob_comparator * cmp)
 	{
@@ -73,11 +83,11 @@ private:
 	class bloom
 	{
 	public:
-		bloom() : filter(NULL) {}
+		bloom() : filter(NULL), blocked(false), lines(0), odd_step(1) {}
 		/* for reading */
 		int init(int dfd, const char * file, size_t * m, size_t * k);
 		/* for writing */
-		int init(size_t bytes);
+		int init(size_t bytes, bool blocked = false);
 		int write(int dfd, const char * file, size_t m, size_t k) const;
 		void deinit();
 		~bloom()
@@ -98,7 +108,15 @@ private:
 		bool check(const dtype & key, size_t k, size_t bits) const;
 		void add(const dtype & key, size_t k, size_t bits);
 	private:
+		bool check_blocked(uint64_t hash, size_t k) const;
+		void add_blocked(uint64_t hash, size_t k);
+		
 		uint8_t * filter;
+		bool blocked;
+		/* the number of cache lines, if blocked */
+		size_t lines;
+		/* or'ed into the probe step, except for BLOOM_DTABLE_BLOCKED_V1 */
+		uint32_t odd_step;
 #if BFDT_PERF_TEST
 		istr dir_name, file_name;
 		mutable size_t total_lookups, blocked_lookups;
@@ -101,6 +101,19 @@ blob btree_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return base->index(index);
 }
 
+void btree_dtable::lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	/* neighboring keys will often be in the same leaf page */
+	leaf_hint hint;
+	io_limiter::defer defer;
+	scopelock scope(btree->lock, !btree->lock_free());
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t index = btree_lookup(dtype_static_test(keys[i], blob_cmp), &found[i], &hint, false);
+		values[i] = found[i] ? base->index(index) : blob();
+	}
+}
+
 blob btree_dtable::index(size_t index) const
 {
 	return base->index(index);
@@ -116,10 +129,14 @@ size_t btree_dtable::size() const
 	return base->size();
 }
 
+/* If the "mapped" parameter is set, the btree file is mapped into memory, so
+ * that lookups can run concurrently without locking; the base dtable has its
+ * own configuration for this. */
 int btree_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
 {
 	const dtable_factory * factory;
 	params base_config;
+	bool mapped;
 	int r, bt_dfd;
 	if(base)
 		deinit();
@@ -128,6 +145,8 @@ int btree_dtable::init(int dfd, const char * file, const params & config, sys_jo
 		return -ENOENT;
 	if(!config.get("base_config", &base_config, params()))
 		return -EINVAL;
+	if(!config.get("mapped", &mapped, false))
+		return -EINVAL;
 	if(!factory->indexed_access(base_config))
 		return -ENOSYS;
 	bt_dfd = openat(dfd, file, O_RDONLY);
@@ -141,7 +160,10 @@ int btree_dtable::init(int dfd, const char * file, const params & config, sys_jo
 	cmp_name = base->get_cmp_name();
 	
 	/* open the btree */
-	btree = rofile::open<BTREE_PAGE_KB, 8>(bt_dfd, "btree");
+	if(mapped)
+		btree = rofile::open_mapped<BTREE_PAGE_KB>(bt_dfd, "btree");
+	else
+		btree = rofile::open<BTREE_PAGE_KB, 8>(bt_dfd, "btree");
 	if(!btree)
 		goto fail_open;
 	r = btree->read_type(0, &header);
@@ -209,13 +231,28 @@ size_t btree_dtable::find_key(const T & test, const U * entries, size_t count, b
 }
 
 template<class T>
-size_t btree_dtable::btree_lookup(const T & test, bool * found) const
+size_t btree_dtable::btree_lookup(const T & test, bool * found, leaf_hint * hint, bool do_lock) const
 {
 	page_union page;
 	size_t depth = 1;
 	size_t keys, index;
 	bool full = header.root_page <= header.last_full;
-	scopelock scope(btree->lock);
+	/* a mapped btree can be searched concurrently */
+	io_limiter::defer defer;
+	scopelock scope(btree->lock, do_lock && !btree->lock_free());
+	if(hint && hint->leaf)
+	{
+		/* no key in another page falls between two keys in this one */
+		dtype low(hint->leaf[0].get_key());
+		dtype high(hint->leaf[hint->keys - 1].get_key());
+		if(test(low) <= 0 && test(high) >= 0)
+		{
+			index = find_key(test, hint->leaf, hint->keys, found);
+			return *found ? hint->leaf[index].index : header.key_count;
+		}
+		/* reading other pages may invalidate it */
+		hint->leaf = NULL;
+	}
 	page.page = btree->page(header.root_page);
 	
 	while(depth < header.depth)
@@ -254,6 +291,11 @@ size_t btree_dtable::btree_lookup(const T & test, bool * found) const
 	else
 		keys = BTREE_KEYS_PER_LEAF_PAGE;
 	index = find_key(test, page.leaf, keys, found);
+	if(hint && keys)
+	{
+		hint->leaf = page.leaf;
+		hint->keys = keys;
+	}
 	return *found ? page.leaf[index].index : header.key_count;
 }
 
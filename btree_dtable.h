@@ -33,9 +33,11 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	virtual blob index(size_t index) const;
 	virtual bool contains_index(size_t index) const;
 	virtual size_t size() const;
+	inline virtual bool key_range(dtype * min, dtype * max) const { return base->key_range(min, max); }
 	
 	inline virtual int set_blob_cmp(const blob_comparator * cmp)
 	{
@@ -153,12 +155,23 @@ private:
 	template<class T, class U>
 	static size_t find_key(const T & test, const U * entries, size_t count, bool * found);
 	
+	/* the last leaf page visited by btree_lookup(), which can be searched
+	 * directly for subsequent keys that fall within its range of keys */
+	struct leaf_hint
+	{
+		const record * leaf;
+		size_t keys;
+		inline leaf_hint() : leaf(NULL), keys(0) {}
+	};
+	
 	inline size_t btree_lookup(const dtype & key, bool * found) const
 	{
 		return btree_lookup(dtype_static_test(key, blob_cmp), found);
 	}
+	/* if hint is used and the btree is not lock_free(), the btree lock must
+	 * be held (and do_lock false) for as long as the hint will be used */
 	template<class T>
-	size_t btree_lookup(const T & test, bool * found) const;
+	size_t btree_lookup(const T & test, bool * found, leaf_hint * hint = NULL, bool do_lock = true) const;
 	
 	static int write_btree(int dfd, const char * name, const dtable * base);
 };
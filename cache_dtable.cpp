@@ -4,6 +4,26 @@
 
 #include "cache_dtable.h"
 
+/* a rough estimate of the memory used by a cache entry, including the
+ * hash map node and order queue overhead, for the "cache_bytes" budget */
+static size_t entry_bytes(const dtype & key, const blob & value)
+{
+	size_t bytes = 2 * sizeof(dtype) + sizeof(blob) + 4 * sizeof(void *);
+	switch(key.type)
+	{
+		case dtype::UINT32:
+		case dtype::DOUBLE:
+			break;
+		case dtype::STRING:
+			bytes += key.str().length() + 1;
+			break;
+		case dtype::BLOB:
+			bytes += key.blb().size();
+			break;
+	}
+	return bytes + value.size();
+}
+
 dtable::iter * cache_dtable::iterator(ATX_DEF) const
 {
 	/* use the underlying iterator directly; we don't want to kill our cache iterating
@@ -16,46 +36,100 @@ bool cache_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 {
 	if(atx != NO_ABORTABLE_TX)
 		return base->present(key, found, atx);
-	cache_map::const_iterator iter = cache.find(key);
-	if(iter != cache.end())
+	shard * s = get_shard(key);
+	scopelock scope(s->lock);
+	cache_map::iterator iter = s->cache.find(key);
+	if(iter != s->cache.end())
 	{
+		s->hits++;
+		(*iter).second.referenced = true;
 		*found = true;
 		return (*iter).second.value.exists();
 	}
+	s->misses++;
+	scope.unlock();
 	return base->present(key, found);
 }
 
-void cache_dtable::add_cache(const dtype & key, const blob & value, bool found) const
+void cache_dtable::evict(shard * s) const
 {
-	/* FIXME: this is a very simple eviction algorithm: evict
-	 * the oldest item, regardless of when it has been used */
-	assert(!cache.count(key));
-	if(cache_size)
+	/* CLOCK: skip (and clear) referenced entries, evicting the first unreferenced
+	 * one; this terminates since every skipped entry is cleared on the way */
+	while(!s->order.empty())
 	{
-		if(cache.size() == cache_size)
+		dtype key = s->order.front();
+		cache_map::iterator iter = s->cache.find(key);
+		s->order.pop();
+		assert(iter != s->cache.end());
+		if((*iter).second.referenced)
 		{
-			cache.erase(order.front());
-			order.pop();
+			(*iter).second.referenced = false;
+			s->order.push(key);
+			continue;
 		}
-		assert(cache.size() < cache_size);
+		s->bytes -= (*iter).second.bytes;
+		s->cache.erase(iter);
+		return;
+	}
+}
+
+void cache_dtable::add_cache(shard * s, const dtype & key, const blob & value, bool found) const
+{
+	entry e = {value, found, false, entry_bytes(key, value)};
+	/* another thread may have added it while we were looking it up */
+	if(s->cache.count(key))
+		return;
+	if(shard_bytes && e.bytes > shard_bytes)
+		return;
+	while(shard_entries && s->cache.size() >= shard_entries)
+		evict(s);
+	while(shard_bytes && s->bytes + e.bytes > shard_bytes)
+		evict(s);
+	s->cache[key] = e;
+	s->order.push(key);
+	s->bytes += e.bytes;
+	assert(s->cache.size() == s->order.size());
+}
+
+void cache_dtable::update_cache(shard * s, const dtype & key, const blob & value, bool found) const
+{
+	cache_map::iterator iter = s->cache.find(key);
+	if(iter == s->cache.end())
+	{
+		add_cache(s, key, value, found);
+		return;
 	}
-	cache[key] = (entry) {value, found};
-	order.push(key);
-	assert(cache.size() == order.size());
+	s->bytes -= (*iter).second.bytes;
+	(*iter).second.value = value;
+	(*iter).second.found = found;
+	(*iter).second.referenced = true;
+	(*iter).second.bytes = entry_bytes(key, value);
+	s->bytes += (*iter).second.bytes;
+	/* evict until it fits, which might end up evicting this entry */
+	while(shard_bytes && s->bytes > shard_bytes && s->cache.count(key))
+		evict(s);
 }
 
 blob cache_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 {
 	if(atx != NO_ABORTABLE_TX)
 		return base->lookup(key, found, atx);
-	cache_map::const_iterator iter = cache.find(key);
-	if(iter != cache.end())
+	shard * s = get_shard(key);
+	scopelock scope(s->lock);
+	cache_map::iterator iter = s->cache.find(key);
+	if(iter != s->cache.end())
 	{
+		s->hits++;
+		(*iter).second.referenced = true;
 		*found = (*iter).second.found;
 		return (*iter).second.value;
 	}
+	s->misses++;
+	/* don't hold the lock during the underlying lookup */
+	scope.unlock();
 	blob value = base->lookup(key, found);
-	add_cache(key, value, *found);
+	scope.lock();
+	add_cache(s, key, value, *found);
 	return value;
 }
 
@@ -63,18 +137,12 @@ int cache_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_
 {
 	if(atx != NO_ABORTABLE_TX)
 		return base->insert(key, blob, append, atx);
-	cache_map::iterator iter;
 	int value = base->insert(key, blob, append);
 	if(value < 0)
 		return value;
-	iter = cache.find(key);
-	if(iter != cache.end())
-	{
-		(*iter).second.found = true;
-		(*iter).second.value = blob;
-	}
-	else
-		add_cache(key, blob, true);
+	shard * s = get_shard(key);
+	scopelock scope(s->lock);
+	update_cache(s, key, blob, true);
 	return value;
 }
 
@@ -82,24 +150,35 @@ int cache_dtable::remove(const dtype & key, ATX_DEF)
 {
 	if(atx != NO_ABORTABLE_TX)
 		return base->remove(key, atx);
-	cache_map::iterator iter;
 	int value = base->remove(key);
 	if(value < 0)
 		return value;
-	iter = cache.find(key);
-	if(iter != cache.end())
+	shard * s = get_shard(key);
+	scopelock scope(s->lock);
+	update_cache(s, key, blob(), false);
+	return value;
+}
+
+void cache_dtable::cache_stats(size_t * hits, size_t * misses) const
+{
+	*hits = 0;
+	*misses = 0;
+	for(size_t i = 0; i < shards.size(); i++)
 	{
-		(*iter).second.found = false;
-		(*iter).second.value = blob();
+		scopelock scope(shards[i]->lock);
+		*hits += shards[i]->hits;
+		*misses += shards[i]->misses;
 	}
-	else
-		add_cache(key, blob(), false);
-	return value;
 }
 
+/* The "cache_size" parameter limits the number of cached entries, and the
+ * "cache_bytes" parameter limits their approximate total memory use; either
+ * may be 0 for no limit. The limits are divided evenly among the shards,
+ * whose number is given by "cache_shards". */
 int cache_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
 {
 	int r;
+	size_t cache_size, cache_bytes, shard_count;
 	const dtable_factory * factory;
 	params base_config;
 	if(base)
@@ -107,6 +186,12 @@ int cache_dtable::init(int dfd, const char * file, const params & config, sys_jo
 	if(!config.get("cache_size", &r, 0) || r < 0)
 		return -EINVAL;
 	cache_size = r;
+	if(!config.get("cache_bytes", &r, 0) || r < 0)
+		return -EINVAL;
+	cache_bytes = r;
+	if(!config.get("cache_shards", &r, CDTABLE_SHARDS) || r < 1)
+		return -EINVAL;
+	shard_count = r;
 	factory = dtable_factory::lookup(config, "base");
 	if(!factory)
 		return -EINVAL;
@@ -117,6 +202,19 @@ int cache_dtable::init(int dfd, const char * file, const params & config, sys_jo
 		return -1;
 	ktype = base->key_type();
 	cmp_name = base->get_cmp_name();
+	/* round up, so that small limits still cache something */
+	shard_entries = (cache_size + shard_count - 1) / shard_count;
+	shard_bytes = (cache_bytes + shard_count - 1) / shard_count;
+	for(size_t i = 0; i < shard_count; i++)
+	{
+		shard * s = new shard(blob_cmp);
+		if(!s)
+		{
+			deinit();
+			return -ENOMEM;
+		}
+		shards.push_back(s);
+	}
 	return 0;
 }
 
@@ -124,9 +222,9 @@ void cache_dtable::deinit()
 {
 	if(base)
 	{
-		cache.clear();
-		while(!order.empty())
-			order.pop();
+		for(size_t i = 0; i < shards.size(); i++)
+			delete shards[i];
+		shards.clear();
 		base->destroy();
 		base = NULL;
 		dtable::deinit();
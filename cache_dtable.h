@@ -14,11 +14,18 @@
 #endif
 
 #include <queue>
+#include <vector>
 #include <ext/hash_map>
 
+#include "locking.h"
 #include "dtable_factory.h"
 
-/* The cache dtable sits on top of another dtable, and merely adds caching. */
+/* The cache dtable sits on top of another dtable, and merely adds caching. The
+ * cache is split into shards by key hash, each with its own lock, so that many
+ * reader threads can share one cache dtable. Each shard evicts entries in CLOCK
+ * order: recently used entries get a second chance before being evicted. */
+
+#define CDTABLE_SHARDS 16
 
 class cache_dtable : public dtable
 {
@@ -26,6 +33,7 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	inline virtual bool key_range(dtype * min, dtype * max) const { return base->key_range(min, max); }
 	inline virtual bool writable() const { return base->writable(); }
 	virtual int insert(const dtype & key, const blob & blob, bool append = false, ATX_OPT);
 	virtual int remove(const dtype & key, ATX_OPT);
@@ -49,9 +57,12 @@ public:
 	
 	inline virtual int maintain(bool force = false) { return base->maintain(force); }
 	
+	/* sums the hit and miss counters of all the shards */
+	void cache_stats(size_t * hits, size_t * misses) const;
+	
 	DECLARE_WRAP_FACTORY(cache_dtable);
 	
-	inline cache_dtable() : base(NULL), chain(this), cache(10, blob_cmp, blob_cmp) {}
+	inline cache_dtable() : base(NULL), chain(this) {}
 	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
 	
 protected:
@@ -67,17 +78,45 @@ private:
 	{
 		blob value;
 		bool found;
+		/* the CLOCK reference bit */
+		bool referenced;
+		/* the approximate memory used by this entry */
+		size_t bytes;
 	};
 	
-	void add_cache(const dtype & key, const blob & value, bool found) const;
-	
 	typedef __gnu_cxx::hash_map<const dtype, entry, dtype_hashing_comparator, dtype_hashing_comparator> cache_map;
 	
+	struct shard
+	{
+		init_mutex lock;
+		cache_map cache;
+		std::queue<dtype> order;
+		size_t bytes;
+		size_t hits, misses;
+		inline shard(const blob_comparator * const & blob_cmp)
+			: cache(10, blob_cmp, blob_cmp), bytes(0), hits(0), misses(0)
+		{
+		}
+	};
+	
+	inline shard * get_shard(const dtype & key) const
+	{
+		dtype_hashing_comparator hash(blob_cmp);
+		/* mix the bits, since integer keys hash to themselves */
+		uint32_t mixed = hash(key) * 2654435761u;
+		return shards[(mixed >> 16) % shards.size()];
+	}
+	
+	/* these must be called with the shard lock held */
+	void add_cache(shard * s, const dtype & key, const blob & value, bool found) const;
+	void update_cache(shard * s, const dtype & key, const blob & value, bool found) const;
+	void evict(shard * s) const;
+	
 	dtable * base;
 	mutable chain_callback chain;
-	size_t cache_size;
-	mutable cache_map cache;
-	mutable std::queue<dtype> order;
+	/* the limits per shard; 0 is unlimited */
+	size_t shard_entries, shard_bytes;
+	std::vector<shard *> shards;
 };
 
 #endif /* __CACHE_DTABLE_H */
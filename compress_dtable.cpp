@@ -0,0 +1,649 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#define _ATFILE_SOURCE
+
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <string.h>
+
+#include "openat.h"
+
+#include "util.h"
+#include "rofile.h"
+#include "rwfile.h"
+#include "compress_dtable.h"
+
+/* The values are written to the data file in blocks. Decompressed, each block
+ * contains a count of the values in it, followed by the end offset of each
+ * value (relative to the start of the value bytes), followed by the bytes of
+ * all the values concatenated together. Values which do not exist are not
+ * stored in the blocks at all; the base dtable stores those directly. The
+ * value of each existing key in the base dtable is the index of its value, in
+ * order, among all the values stored in the data file. */
+
+/* The built-in "lz" codec is a simple byte-oriented LZ77 variant. Each sequence
+ * starts with a token byte: the high nibble is the number of literal bytes to
+ * copy and the low nibble is the length of the following match, less the
+ * minimum of 4. A nibble of 15 means more length bytes follow, each one added
+ * to the length until one is not 255. The literal bytes come next, and then
+ * the match offset as 2 little endian bytes. The last sequence in the block
+ * has only literals. It compresses and decompresses quickly without any
+ * dependencies, which is what we want for values read back in scans. */
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+static inline uint32_t lz_read32(const uint8_t * data)
+{
+	uint32_t value;
+	util::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static inline uint32_t lz_hash(uint32_t value)
+{
+	return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline bool lz_put_length(uint8_t ** out, const uint8_t * end, size_t length)
+{
+	while(length >= 255)
+	{
+		if(*out >= end)
+			return false;
+		*(*out)++ = 255;
+		length -= 255;
+	}
+	if(*out >= end)
+		return false;
+	*(*out)++ = length;
+	return true;
+}
+
+static inline bool lz_get_length(const uint8_t ** in, const uint8_t * end, size_t * length)
+{
+	uint8_t byte;
+	do {
+		if(*in >= end)
+			return false;
+		byte = *(*in)++;
+		*length += byte;
+	} while(byte == 255);
+	return true;
+}
+
+/* writes one sequence; match_length is 0 for the last one */
+static bool lz_put_sequence(uint8_t ** out, const uint8_t * end, const uint8_t * literals, size_t literal_length, size_t offset, size_t match_length)
+{
+	uint8_t * token = *out;
+	size_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+	if(*out >= end)
+		return false;
+	*token = ((literal_length < 15) ? literal_length : 15) << 4;
+	*token |= (match_code < 15) ? match_code : 15;
+	(*out)++;
+	if(literal_length >= 15 && !lz_put_length(out, end, literal_length - 15))
+		return false;
+	if((size_t) (end - *out) < literal_length)
+		return false;
+	util::memcpy(*out, literals, literal_length);
+	*out += literal_length;
+	if(!match_length)
+		return true;
+	if(end - *out < 2)
+		return false;
+	*(*out)++ = offset & 0xFF;
+	*(*out)++ = offset >> 8;
+	if(match_code >= 15 && !lz_put_length(out, end, match_code - 15))
+		return false;
+	return true;
+}
+
+/* returns the compressed size, or 0 if it would not fit in capacity */
+static size_t lz_compress(const uint8_t * in, size_t length, uint8_t * out, size_t capacity)
+{
+	uint32_t table[1 << LZ_HASH_BITS];
+	const uint8_t * end = in + length;
+	const uint8_t * anchor = in;
+	const uint8_t * scan = in;
+	uint8_t * op = out;
+	const uint8_t * out_end = out + capacity;
+	/* positions are stored incremented by 1, so 0 means empty */
+	util::memset(table, 0, sizeof(table));
+	while(scan + LZ_MIN_MATCH <= end)
+	{
+		uint32_t sequence = lz_read32(scan);
+		uint32_t hash = lz_hash(sequence);
+		size_t candidate = table[hash];
+		size_t position = scan - in;
+		table[hash] = position + 1;
+		if(candidate && position + 1 - candidate <= LZ_MAX_OFFSET && lz_read32(&in[candidate - 1]) == sequence)
+		{
+			const uint8_t * match = &in[candidate - 1];
+			size_t match_length = LZ_MIN_MATCH;
+			while(scan + match_length < end && match[match_length] == scan[match_length])
+				match_length++;
+			if(!lz_put_sequence(&op, out_end, anchor, scan - anchor, scan - match, match_length))
+				return 0;
+			scan += match_length;
+			anchor = scan;
+		}
+		else
+			scan++;
+	}
+	if(!lz_put_sequence(&op, out_end, anchor, end - anchor, 0, 0))
+		return 0;
+	return op - out;
+}
+
+/* returns true only if the data decompresses to exactly out_length bytes */
+static bool lz_decompress(const uint8_t * in, size_t length, uint8_t * out, size_t out_length)
+{
+	const uint8_t * end = in + length;
+	uint8_t * op = out;
+	const uint8_t * out_end = out + out_length;
+	while(in < end)
+	{
+		const uint8_t * match;
+		size_t literal_length, match_length, offset;
+		uint8_t token = *in++;
+		literal_length = token >> 4;
+		if(literal_length == 15 && !lz_get_length(&in, end, &literal_length))
+			return false;
+		if((size_t) (end - in) < literal_length || (size_t) (out_end - op) < literal_length)
+			return false;
+		util::memcpy(op, in, literal_length);
+		in += literal_length;
+		op += literal_length;
+		if(in == end)
+			break;
+		if(end - in < 2)
+			return false;
+		offset = in[0] | (in[1] << 8);
+		in += 2;
+		if(!offset || offset > (size_t) (op - out))
+			return false;
+		match_length = token & 15;
+		if(match_length == 15 && !lz_get_length(&in, end, &match_length))
+			return false;
+		match_length += LZ_MIN_MATCH;
+		if((size_t) (out_end - op) < match_length)
+			return false;
+		/* the match may overlap the output, so copy a byte at a time */
+		match = op - offset;
+		while(match_length--)
+			*op++ = *match++;
+	}
+	return op == out_end;
+}
+
+compress_dtable::iter::iter(dtable::iter * base, const compress_dtable * source)
+	: iter_source<compress_dtable, dtable_wrap_iter>(base, source)
+{
+	claim_base = true;
+}
+
+metablob compress_dtable::iter::meta() const
+{
+	/* can't really avoid reading the data */
+	return metablob(value());
+}
+
+blob compress_dtable::iter::value() const
+{
+	return dt_source->get_value(base->value());
+}
+
+dtable::iter * compress_dtable::iterator(ATX_DEF) const
+{
+	iter * value;
+	dtable::iter * source = base->iterator();
+	if(!source)
+		return NULL;
+	value = new iter(source, this);
+	if(!value)
+		delete source;
+	return value;
+}
+
+bool compress_dtable::present(const dtype & key, bool * found, ATX_DEF) const
+{
+	return base->present(key, found);
+}
+
+blob compress_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
+{
+	return get_value(base->lookup(key, found));
+}
+
+blob compress_dtable::index(size_t index) const
+{
+	return get_value(base->index(index));
+}
+
+bool compress_dtable::contains_index(size_t index) const
+{
+	return base->contains_index(index);
+}
+
+size_t compress_dtable::size() const
+{
+	return base->size();
+}
+
+blob compress_dtable::read_block(size_t number) const
+{
+	const block_entry & entry = blocks[number];
+	blob_buffer packed(entry.size);
+	packed.set_size(entry.size, false);
+	if(fp->read(entry.offset, &packed[0], entry.size) != (ssize_t) entry.size)
+		return blob();
+	if(entry.size == entry.raw_size)
+		return packed;
+	assert(codec == CODEC_LZ);
+	blob_buffer raw(entry.raw_size);
+	raw.set_size(entry.raw_size, false);
+	if(!lz_decompress(&packed[0], entry.size, &raw[0], entry.raw_size))
+		return blob();
+	return raw;
+}
+
+blob compress_dtable::find_block(size_t number) const
+{
+	scopelock scope(cache_lock);
+	size_t victim = 0;
+	cached_block * slot;
+	for(size_t i = 0; i < cache.size(); i++)
+		if(cache[i].number == number)
+		{
+			cache[i].last_use = ++cache_clock;
+			return cache[i].data;
+		}
+	/* don't hold up other readers while we decompress the block */
+	scope.unlock();
+	blob data = read_block(number);
+	if(!data.exists())
+		return data;
+	scope.lock();
+	/* another reader may have added it, or changed the cache, meanwhile */
+	for(size_t i = 0; i < cache.size(); i++)
+	{
+		if(cache[i].number == number)
+		{
+			cache[i].last_use = ++cache_clock;
+			return cache[i].data;
+		}
+		if(cache[i].last_use < cache[victim].last_use)
+			victim = i;
+	}
+	if(cache.size() < cache_blocks)
+	{
+		cache.push_back(cached_block());
+		slot = &cache.back();
+	}
+	else
+		slot = &cache[victim];
+	slot->number = number;
+	slot->last_use = ++cache_clock;
+	slot->data = data;
+	return data;
+}
+
+blob compress_dtable::get_value(const blob & locator) const
+{
+	blob data;
+	size_t count, start, end, offset;
+	size_t min = 0, max;
+	uint32_t index;
+	if(!locator.exists())
+		return locator;
+	/* an empty table has no blocks to search */
+	if(blocks.empty())
+		return blob();
+	max = blocks.size() - 1;
+	assert(locator.size() == sizeof(uint32_t));
+	index = locator.index<uint32_t>(0);
+	assert(index < value_count);
+	/* find the last block starting at or before the value */
+	while(min < max)
+	{
+		size_t mid = (min + max + 1) / 2;
+		if(blocks[mid].first_index <= index)
+			min = mid;
+		else
+			max = mid - 1;
+	}
+	data = find_block(min);
+	if(!data.exists())
+		return data;
+	index -= blocks[min].first_index;
+	count = data.index<uint32_t>(0);
+	assert(index < count);
+	start = index ? data.index<uint32_t>(index) : 0;
+	end = data.index<uint32_t>(index + 1);
+	if(start == end)
+		return blob::empty;
+	offset = sizeof(uint32_t) * (count + 1);
+	return blob(end - start, &data[offset + start]);
+}
+
+bool compress_dtable::static_indexed_access(const params & config)
+{
+	const dtable_factory * factory;
+	params base_config;
+	factory = dtable_factory::lookup(config, "base");
+	if(!factory)
+		return false;
+	if(!config.get("base_config", &base_config, params()))
+		return false;
+	return factory->indexed_access(base_config);
+}
+
+int compress_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
+{
+	const dtable_factory * factory;
+	params base_config;
+	data_footer footer;
+	off_t footer_offset;
+	int r, cm_dfd;
+	if(base)
+		deinit();
+	factory = dtable_factory::lookup(config, "base");
+	if(!factory)
+		return -ENOENT;
+	if(!config.get("base_config", &base_config, params()))
+		return -EINVAL;
+	if(!config.get("cache_blocks", &r, CMDTABLE_CACHE_BLOCKS) || r < 1)
+		return -EINVAL;
+	cache_blocks = r;
+	cm_dfd = openat(dfd, file, O_RDONLY);
+	if(cm_dfd < 0)
+		return cm_dfd;
+	base = factory->open(cm_dfd, "base", base_config, sysj);
+	if(!base)
+		goto fail_base;
+	ktype = base->key_type();
+	cmp_name = base->get_cmp_name();
+	
+	fp = rofile::open<16, 4>(cm_dfd, "data");
+	if(!fp)
+		goto fail_data;
+	footer_offset = fp->size() - sizeof(footer);
+	if(footer_offset < 0 || fp->read_type(footer_offset, &footer) < 0)
+		goto fail_footer;
+	if(footer.magic != CMDTABLE_MAGIC || footer.version != CMDTABLE_VERSION)
+		goto fail_footer;
+	if(footer.codec != CODEC_NONE && footer.codec != CODEC_LZ)
+		goto fail_footer;
+	codec = (codec_id) footer.codec;
+	value_count = footer.value_count;
+	blocks.resize(footer.block_count);
+	for(size_t i = 0; i < footer.block_count; i++)
+		if(fp->read_type(footer.index_offset + i * sizeof(block_entry), &blocks[i]) < 0)
+			goto fail_index;
+	cache.reserve(cache_blocks);
+	
+	close(cm_dfd);
+	return 0;
+
+fail_index:
+	blocks.clear();
+fail_footer:
+	delete fp;
+	fp = NULL;
+fail_data:
+	base->destroy();
+	base = NULL;
+fail_base:
+	close(cm_dfd);
+	return -1;
+}
+
+void compress_dtable::deinit()
+{
+	if(base)
+	{
+		cache.clear();
+		blocks.clear();
+		delete fp;
+		fp = NULL;
+		base->destroy();
+		base = NULL;
+		dtable::deinit();
+	}
+}
+
+int compress_dtable::write_block(rwfile * out, codec_id codec, const std::vector<uint32_t> & ends, const blob_buffer & bytes, uint32_t first_index, std::vector<block_entry> * blocks)
+{
+	int r;
+	block_entry entry;
+	blob_buffer raw(sizeof(uint32_t) * (ends.size() + 1) + bytes.size());
+	raw << (uint32_t) ends.size();
+	for(size_t i = 0; i < ends.size(); i++)
+		raw << ends[i];
+	raw.append(bytes);
+	entry.offset = out->end();
+	entry.raw_size = raw.size();
+	entry.size = 0;
+	entry.first_index = first_index;
+	if(codec == CODEC_LZ)
+	{
+		/* only keep the compressed version if it is actually smaller */
+		blob_buffer packed(raw.size());
+		packed.set_size(raw.size(), false);
+		entry.size = lz_compress(&raw[0], raw.size(), &packed[0], raw.size() - 1);
+		if(entry.size && out->append(&packed[0], entry.size) != (ssize_t) entry.size)
+			return -1;
+	}
+	if(!entry.size)
+	{
+		entry.size = raw.size();
+		r = out->append(raw);
+		if(r < 0)
+			return r;
+	}
+	blocks->push_back(entry);
+	return 0;
+}
+
+/* used in create() to wrap source iterators on the way down */
+class value_index_iter : public dtable_wrap_iter
+{
+public:
+	inline virtual bool next() { return advance(false); }
+	inline virtual bool first() { return advance(true); }
+	virtual metablob meta() const;
+	virtual blob value() const;
+	
+	/* the base is not allowed to reject: it will get nice
+	 * predictable values and should be able to store them all */
+	inline virtual bool reject(blob * replacement) { return false; }
+	
+	/* these are not used by create() methods, and
+	 * this iterator is only ever passed to create() */
+	inline virtual bool prev() { abort(); }
+	inline virtual bool last() { abort(); }
+	inline virtual bool seek(const dtype & key) { abort(); }
+	inline virtual bool seek(const dtype_test & test) { abort(); }
+	
+	/* these don't make sense for downward-passed iterators */
+	inline virtual bool seek_index(size_t index) { abort(); }
+	inline virtual size_t get_index() const { abort(); }
+	
+	inline value_index_iter(dtable::iter * base) : dtable_wrap_iter(base) { advance(true); }
+	virtual ~value_index_iter() {}
+private:
+	bool advance(bool do_first);
+	
+	uint32_t value_index;
+	bool value_exists;
+};
+
+metablob value_index_iter::meta() const
+{
+	if(value_exists)
+		return metablob(sizeof(uint32_t));
+	return metablob();
+}
+
+blob value_index_iter::value() const
+{
+	if(value_exists)
+		return blob(sizeof(uint32_t), &value_index);
+	return blob();
+}
+
+bool value_index_iter::advance(bool do_first)
+{
+	bool ok;
+	if(do_first)
+	{
+		ok = base->first();
+		value_index = 0;
+		value_exists = false;
+	}
+	else
+		ok = base->next();
+	if(!ok)
+	{
+		value_exists = false;
+		return false;
+	}
+	if(value_exists)
+		value_index++;
+	value_exists = base->meta().exists();
+	return true;
+}
+
+/* The "codec" parameter selects how blocks are compressed: "lz" (the default)
+ * for the built-in codec above, or "none" to store them as is. The
+ * "block_size" parameter gives the approximate uncompressed size of each
+ * block; larger blocks compress better but cost more to read a single value.
+ * The "cache_blocks" parameter, used when the dtable is opened, gives the
+ * number of decompressed blocks to keep in memory. */
+int compress_dtable::create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow)
+{
+	int cm_dfd, r;
+	rwfile data;
+	codec_id codec;
+	istr codec_name;
+	params base_config;
+	data_footer footer;
+	size_t block_size, value_count = 0;
+	std::vector<uint32_t> ends;
+	std::vector<block_entry> blocks;
+	blob_buffer bytes;
+	const dtable_factory * base = dtable_factory::lookup(config, "base");
+	if(!base)
+		return -ENOENT;
+	if(!config.get("base_config", &base_config, params()))
+		return -EINVAL;
+	if(!config.get("codec", &codec_name, "lz") || !codec_name)
+		return -EINVAL;
+	if(!strcmp(codec_name, "lz"))
+		codec = CODEC_LZ;
+	else if(!strcmp(codec_name, "none"))
+		codec = CODEC_NONE;
+	else
+		return -EINVAL;
+	if(!config.get("block_size", &r, CMDTABLE_BLOCK_SIZE) || r < 256)
+		return -EINVAL;
+	block_size = r;
+	
+	if(!source_shadow_ok(source, shadow))
+		return -EINVAL;
+	
+	r = mkdirat(dfd, file, 0755);
+	if(r < 0)
+		return r;
+	cm_dfd = openat(dfd, file, O_RDONLY);
+	if(cm_dfd < 0)
+		goto fail_open;
+	
+	r = data.create(cm_dfd, "data");
+	if(r < 0)
+		goto fail_data;
+	r = bytes.set_capacity(block_size * 2);
+	if(r < 0)
+		goto fail_write;
+	
+	/* just to be sure */
+	source->first();
+	while(source->valid())
+	{
+		blob value = source->value();
+		source->next();
+		if(!value.exists())
+			/* omit all non-existent entries */
+			continue;
+		if(value_count == (uint32_t) -1)
+		{
+			r = -EINVAL;
+			goto fail_write;
+		}
+		r = bytes.append(value);
+		if(r < 0)
+			goto fail_write;
+		ends.push_back(bytes.size());
+		value_count++;
+		if(bytes.size() >= block_size)
+		{
+			r = write_block(&data, codec, ends, bytes, value_count - ends.size(), &blocks);
+			if(r < 0)
+				goto fail_write;
+			ends.clear();
+			bytes.set_size(0, false);
+		}
+	}
+	if(!ends.empty())
+	{
+		r = write_block(&data, codec, ends, bytes, value_count - ends.size(), &blocks);
+		if(r < 0)
+			goto fail_write;
+	}
+	
+	footer.magic = CMDTABLE_MAGIC;
+	footer.version = CMDTABLE_VERSION;
+	footer.codec = codec;
+	footer.block_count = blocks.size();
+	footer.value_count = value_count;
+	footer.index_offset = data.end();
+	for(size_t i = 0; i < blocks.size(); i++)
+	{
+		r = data.append(&blocks[i]);
+		if(r < 0)
+			goto fail_write;
+	}
+	r = data.append(&footer);
+	if(r < 0)
+		goto fail_write;
+	r = data.close();
+	if(r < 0)
+		goto fail_write;
+	
+	/* now write the keys */
+	{
+		value_index_iter locators(source);
+		r = base->create(cm_dfd, "base", base_config, &locators, shadow);
+		if(r < 0)
+			goto fail_write;
+	}
+	
+	close(cm_dfd);
+	return 0;
+
+fail_write:
+	data.close();
+	unlinkat(cm_dfd, "data", 0);
+fail_data:
+	close(cm_dfd);
+fail_open:
+	unlinkat(dfd, file, AT_REMOVEDIR);
+	return (r < 0) ? r : -1;
+}
+
+DEFINE_RO_FACTORY(compress_dtable);
@@ -0,0 +1,137 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __COMPRESS_DTABLE_H
+#define __COMPRESS_DTABLE_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error compress_dtable.h is a C++ header file
+#endif
+
+#include <vector>
+
+#include "locking.h"
+#include "blob_buffer.h"
+#include "dtable_factory.h"
+#include "dtable_wrap_iter.h"
+
+class rofile;
+class rwfile;
+
+/* The compress dtable stores its values separately from its keys, packed into
+ * blocks of roughly a fixed size which are then compressed. The keys are
+ * stored in an underlying dtable along with the index of their value, which is
+ * enough to find the block containing it. Recently used blocks are kept
+ * decompressed in memory, so scans and lookups of nearby keys do not have to
+ * decompress the same block over and over. These dtables are read-only once
+ * they are created with the ::create() method. */
+
+#define CMDTABLE_MAGIC 0x2E61C0B7
+#define CMDTABLE_VERSION 0
+
+#define CMDTABLE_BLOCK_SIZE 16384
+#define CMDTABLE_CACHE_BLOCKS 16
+
+class compress_dtable : public dtable
+{
+public:
+	virtual iter * iterator(ATX_OPT) const;
+	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
+	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual blob index(size_t index) const;
+	virtual bool contains_index(size_t index) const;
+	virtual size_t size() const;
+	virtual bool key_range(dtype * min, dtype * max) const { return base->key_range(min, max); }
+	
+	inline virtual int set_blob_cmp(const blob_comparator * cmp)
+	{
+		int value = base->set_blob_cmp(cmp);
+		if(value >= 0)
+		{
+			value = dtable::set_blob_cmp(cmp);
+			assert(value >= 0);
+		}
+		return value;
+	}
+	
+	/* compress_dtable supports indexed access if its base does */
+	static bool static_indexed_access(const params & config);
+	
+	static int create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow = NULL);
+	DECLARE_RO_FACTORY(compress_dtable);
+	
+	inline compress_dtable() : base(NULL), fp(NULL), cache_clock(0) {}
+	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
+	
+protected:
+	void deinit();
+	inline virtual ~compress_dtable()
+	{
+		if(base)
+			deinit();
+	}
+	
+private:
+	enum codec_id { CODEC_NONE = 0, CODEC_LZ = 1 };
+	
+	class iter : public iter_source<compress_dtable, dtable_wrap_iter>
+	{
+	public:
+		virtual metablob meta() const;
+		virtual blob value() const;
+		inline iter(dtable::iter * base, const compress_dtable * source);
+		virtual ~iter() {}
+	};
+	
+	/* the footer is at the end of the data file, so
+	 * create() can write the whole file in one pass */
+	struct data_footer {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t codec;
+		uint32_t block_count;
+		uint32_t value_count;
+		uint64_t index_offset;
+	} __attribute__((packed));
+	
+	/* a block is stored compressed unless that would not make it smaller,
+	 * in which case size == raw_size and it is stored as is */
+	struct block_entry {
+		uint64_t offset;
+		uint32_t size;
+		uint32_t raw_size;
+		uint32_t first_index;
+	} __attribute__((packed));
+	
+	struct cached_block
+	{
+		size_t number;
+		size_t last_use;
+		blob data;
+	};
+	
+	static int write_block(rwfile * out, codec_id codec, const std::vector<uint32_t> & ends, const blob_buffer & bytes, uint32_t first_index, std::vector<block_entry> * blocks);
+	
+	blob read_block(size_t number) const;
+	/* returns a copy, so it stays valid if the block is evicted */
+	blob find_block(size_t number) const;
+	blob get_value(const blob & locator) const;
+	
+	dtable * base;
+	rofile * fp;
+	codec_id codec;
+	size_t value_count;
+	std::vector<block_entry> blocks;
+	size_t cache_blocks;
+	/* the cache is shared by all the readers of this dtable */
+	mutable init_mutex cache_lock;
+	mutable size_t cache_clock;
+	mutable std::vector<cached_block> cache;
+};
+
+#endif /* __COMPRESS_DTABLE_H */
@@ -2,7 +2,80 @@
  * of the University of California. It is distributed under the terms of
  * version 2 of the GNU GPL. See the file LICENSE for details. */
 
+#include <vector>
+#include <algorithm>
+
 #include "dtable.h"
 
-/* that's it, that's all this file is here for */
 atomic<abortable_tx> dtable::atx_handle(NO_ABORTABLE_TX);
+
+/* orders indices into an array of keys by the keys they refer to */
+struct lookup_many_order
+{
+	const dtype * keys;
+	const blob_comparator * blob_cmp;
+	inline lookup_many_order(const dtype * keys, const blob_comparator * blob_cmp) : keys(keys), blob_cmp(blob_cmp) {}
+	inline bool operator()(size_t a, size_t b) const
+	{
+		return keys[a].compare(keys[b], blob_cmp) < 0;
+	}
+};
+
+void dtable::lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	size_t i;
+	bool * sorted_found;
+	std::vector<size_t> order;
+	std::vector<dtype> sorted_keys;
+	std::vector<blob> sorted_values;
+	for(i = 1; i < count; i++)
+		if(keys[i - 1].compare(keys[i], blob_cmp) > 0)
+			break;
+	if(i >= count)
+	{
+		/* already sorted (or empty) */
+		if(count)
+			lookup_sorted(keys, count, values, found, atx);
+		return;
+	}
+	order.resize(count);
+	for(i = 0; i < count; i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), lookup_many_order(keys, blob_cmp));
+	sorted_keys.reserve(count);
+	for(i = 0; i < count; i++)
+		sorted_keys.push_back(keys[order[i]]);
+	sorted_values.resize(count);
+	sorted_found = new bool[count];
+	lookup_sorted(&sorted_keys[0], count, &sorted_values[0], sorted_found, atx);
+	for(i = 0; i < count; i++)
+	{
+		values[order[i]] = sorted_values[i];
+		found[order[i]] = sorted_found[i];
+	}
+	delete[] sorted_found;
+}
+
+void dtable::sample_keys(size_t count, std::vector<dtype> * samples) const
+{
+	iter * it;
+	size_t total = size();
+	if(total == (size_t) -1 || !total || !count)
+		return;
+	if(count > total)
+		count = total;
+	it = iterator();
+	for(size_t i = 0; i < count; i++)
+	{
+		if(!it->seek_index(i * total / count))
+			break;
+		samples->push_back(it->key());
+	}
+	delete it;
+}
+
+void dtable::lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	for(size_t i = 0; i < count; i++)
+		values[i] = lookup(keys[i], &found[i], atx);
+}
@@ -11,6 +11,8 @@
 #error dtable.h is a C++ header file
 #endif
 
+#include <vector>
+
 #include "blob.h"
 #include "dtype.h"
 #include "atomic.h"
@@ -143,10 +145,23 @@ public:
 	virtual iter * iterator(ATX_OPT) const = 0;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const = 0;
 	inline blob find(const dtype & key, ATX_OPT) const { bool found; return lookup(key, &found, atx); }
+	/* looks up count keys at once, in any order, storing the results in values
+	 * and found; the keys are sorted once and passed to lookup_sorted() */
+	void lookup_many(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
+	/* like lookup_many(), but the keys must already be sorted; dtables can
+	 * override this to share work between neighboring keys in the batch */
+	virtual void lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	/* index(), contains_index(), and size() only work when iter::seek_index() works, see above */
 	inline virtual blob index(size_t index) const { return blob(); }
 	inline virtual bool contains_index(size_t index) const { return false; }
 	inline virtual size_t size() const { return (size_t) -1; }
+	/* read-only dtables can report the smallest and largest keys they contain
+	 * (including non-existent entries) so that overlays can skip them for keys
+	 * outside that range; returns false if the range is unknown or empty */
+	inline virtual bool key_range(dtype * min, dtype * max) const { return false; }
+	/* appends up to count keys spread evenly through the dtable, in order, to
+	 * samples; the default only samples dtables supporting iter::seek_index() */
+	virtual void sample_keys(size_t count, std::vector<dtype> * samples) const;
 	
 	inline virtual bool writable() const { return false; }
 	/* writable dtables support these */
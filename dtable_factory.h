@@ -37,8 +37,9 @@ public:
 		return -ENOSYS;
 	}
 	
-	/* convenience wrapper */
-	inline int create(int dfd, const char * name, const params & config, const dtable * source, const ktable * shadow = NULL) const
+	/* convenience wrapper; factories which can make use of the whole source
+	 * dtable, rather than just a single iterator, may override it */
+	inline virtual int create(int dfd, const char * name, const params & config, const dtable * source, const ktable * shadow = NULL) const
 	{
 		dtable::iter * iter = source->iterator();
 		int r = create(dfd, name, config, iter, shadow);
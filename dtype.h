@@ -31,6 +31,7 @@ typedef uint32_t abortable_tx;
 
 #ifdef __cplusplus
 
+#include <new>
 #include <ext/hash_map>
 
 #include "blob.h"
@@ -55,22 +56,36 @@ public:
 	};
 	ctype type;
 	
+	/* Only the member for the type exists. The string and blob members
+	 * can't be in the union themselves, since they have constructors, so
+	 * they are constructed in its space and used through str() and blb().
+	 * This way uint32 and double keys are copied without any share counts. */
 	union
 	{
 		uint32_t u32;
 		double dbl;
+		uint8_t str_space[sizeof(istr)];
+		uint8_t blb_space[sizeof(blob)];
 	};
-	/* alas, we can't put these in the union */
-	istr str;
-	blob blb;
+	
+	inline const istr & str() const
+	{
+		assert(type == STRING);
+		return *(const istr *) (const void *) str_space;
+	}
+	inline const blob & blb() const
+	{
+		assert(type == BLOB);
+		return *(const blob *) (const void *) blb_space;
+	}
 	
 	inline dtype(uint32_t x) : type(UINT32), u32(x) {}
 	inline dtype(double x) : type(DOUBLE), dbl(x) {}
-	inline dtype(const istr & x) : type(STRING), u32(0), str(x) {}
+	inline dtype(const istr & x) : type(STRING) { new(str_space) istr(x); }
 	/* have to provide this even though usually istr is transparent */
-	inline dtype(const char * x) : type(STRING), u32(0), str(x) {}
-	inline dtype(const char * x, size_t length) : type(STRING), u32(0), str(x, length) {}
-	inline dtype(const blob & x) : type(BLOB), u32(0), blb(x) {}
+	inline dtype(const char * x) : type(STRING) { new(str_space) istr(x); }
+	inline dtype(const char * x, size_t length) : type(STRING) { new(str_space) istr(x, length); }
+	inline dtype(const blob & x) : type(BLOB) { new(blb_space) blob(x); }
 	inline dtype(const blob & b, ctype t)
 		: type(t)
 	{
@@ -86,14 +101,25 @@ public:
 				dbl = b.index<double>(0);
 				return;
 			case STRING:
-				str = b;
+				new(str_space) istr(b);
 				return;
 			case BLOB:
-				blb = b;
+				new(blb_space) blob(b);
 				return;
 		}
 		abort();
 	}
+	inline dtype(const dtype & x) : type(x.type) { copy(x); }
+	inline dtype & operator=(const dtype & x)
+	{
+		if(this == &x)
+			return *this;
+		kill();
+		type = x.type;
+		copy(x);
+		return *this;
+	}
+	inline ~dtype() { kill(); }
 
 	inline blob flatten() const
 	{
@@ -104,9 +130,9 @@ public:
 			case DOUBLE:
 				return blob(sizeof(double), &dbl);
 			case STRING:
-				return blob(strlen(str), str);
+				return blob(strlen(str()), str());
 			case BLOB:
-				return blb;
+				return blb();
 		}
 		abort();
 	}
@@ -137,13 +163,13 @@ public:
 			case DOUBLE:
 				return (dbl < x.dbl) ? -1 : dbl != x.dbl;
 			case STRING:
-				if(str == x.str)
+				if(str() == x.str())
 					return 0;
-				if(!str || !x.str)
-					return str ? 1 : -1;
-				return strcmp(str, x.str);
+				if(!str() || !x.str())
+					return str() ? 1 : -1;
+				return strcmp(str(), x.str());
 			case BLOB:
-				return blob_cmp ? blob_cmp->compare(blb, x.blb) : blb.compare(x.blb);
+				return blob_cmp ? blob_cmp->compare(blb(), x.blb()) : blb().compare(x.blb());
 		}
 		abort();
 	}
@@ -163,7 +189,7 @@ public:
 	
 	inline int compare(const char * x) const
 	{
-		assert(type == STRING);
+		const istr & str = this->str();
 		if(str == x)
 			return 0;
 		if(!str || !x)
@@ -173,7 +199,7 @@ public:
 	
 	inline int compare(const istr & x) const
 	{
-		assert(type == STRING);
+		const istr & str = this->str();
 		if(str == x)
 			return 0;
 		if(!str || !x)
@@ -183,8 +209,37 @@ public:
 	
 	inline int compare(const blob & x, const blob_comparator * blob_cmp = NULL) const
 	{
-		assert(type == BLOB);
-		return blob_cmp ? blob_cmp->compare(blb, x) : blb.compare(x);
+		return blob_cmp ? blob_cmp->compare(blb(), x) : blb().compare(x);
+	}
+	
+private:
+	/* copy the member for the type, which must already be set */
+	inline void copy(const dtype & x)
+	{
+		switch(type)
+		{
+			case UINT32:
+				u32 = x.u32;
+				return;
+			case DOUBLE:
+				dbl = x.dbl;
+				return;
+			case STRING:
+				new(str_space) istr(x.str());
+				return;
+			case BLOB:
+				new(blb_space) blob(x.blb());
+				return;
+		}
+		abort();
+	}
+	/* destroy the member for the type, if it needs it */
+	inline void kill()
+	{
+		if(type == STRING)
+			((istr *) (void *) str_space)->~istr();
+		else if(type == BLOB)
+			((blob *) (void *) blb_space)->~blob();
 	}
 };
 
@@ -291,18 +346,19 @@ public:
 					return 0;
 				return dtype_hash_helper<double>()(dt.dbl);
 			case dtype::STRING:
-				return __gnu_cxx::hash<const char *>()((const char *) dt.str);
+				return __gnu_cxx::hash<const char *>()((const char *) dt.str());
 			case dtype::BLOB:
 			{
+				const blob & blb = dt.blb();
 				if(blob_cmp)
-					return blob_cmp->hash(dt.blb);
+					return blob_cmp->hash(blb);
 				
 				/* uses FNV hash taken from stl::tr1::hash */
 				size_t r = 2166136261u;
-				size_t length = dt.blb.size();
+				size_t length = blb.size();
 				for(size_t i = 0; i < length; i++)
 				{
-					r ^= dt.blb[i];
+					r ^= blb[i];
 					r *= 16777619;
 				}
 				return r;
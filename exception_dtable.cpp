@@ -240,6 +240,27 @@ blob exception_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return value;
 }
 
+bool exception_dtable::key_range(dtype * min, dtype * max) const
+{
+	dtype alt_min(0u), alt_max(0u);
+	if(!alt->key_range(&alt_min, &alt_max))
+		/* an empty alternate table doesn't change the range */
+		return !alt->size() && base->key_range(min, max);
+	if(!base->key_range(min, max))
+	{
+		if(base->size())
+			return false;
+		*min = alt_min;
+		*max = alt_max;
+		return true;
+	}
+	if(min->compare(alt_min, blob_cmp) > 0)
+		*min = alt_min;
+	if(max->compare(alt_max, blob_cmp) < 0)
+		*max = alt_max;
+	return true;
+}
+
 int exception_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
 {
 	const dtable_factory * base_factory;
@@ -19,6 +19,7 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual bool key_range(dtype * min, dtype * max) const;
 	
 	inline virtual int set_blob_cmp(const blob_comparator * cmp)
 	{
@@ -167,13 +167,31 @@ dtype fixed_dtable::get_key(size_t index, bool * data_exists, off_t * data_offse
 			return dtype(value);
 		}
 		case dtype::STRING:
+			/* the LRU in the string table needs the lock */
+			if(fp->lock_free())
+				return dtype(st.copy(util::read_bytes(bytes, 0, key_size)));
 			return dtype(st.get(util::read_bytes(bytes, 0, key_size)));
 		case dtype::BLOB:
+			if(fp->lock_free())
+				return dtype(st.copy_blob(util::read_bytes(bytes, 0, key_size)));
 			return dtype(st.get_blob(util::read_bytes(bytes, 0, key_size)));
 	}
 	abort();
 }
 
+bool fixed_dtable::probe(const stringtbl::raw_key & key, size_t index, bool * data_exists, off_t * data_offset, int * c) const
+{
+	uint8_t read_size = key_size + 1;
+	uint8_t bytes[read_size];
+	if(fp->read(key_start_off + record_size * index, bytes, read_size, false) != read_size)
+		return false;
+	if(data_exists)
+		*data_exists = bytes[key_size];
+	if(data_offset)
+		*data_offset = index * record_size + read_size;
+	return st.compare(util::read_bytes(bytes, 0, key_size), key.data, key.size, c);
+}
+
 template<class T>
 int fixed_dtable::find_key(const T & test, size_t * index, bool * data_exists, off_t * data_offset) const
 {
@@ -184,8 +202,9 @@ int fixed_dtable::find_key(const T & test, size_t * index, bool * data_exists, o
 	{
 		/* watch out for overflow! */
 		ssize_t mid = min + (max - min) / 2;
-		dtype value = get_key(mid, data_exists, data_offset);
-		int c = test(value);
+		int c;
+		if(!probe(test, mid, data_exists, data_offset, &c))
+			return -EIO;
 		if(c < 0)
 			min = mid + 1;
 		else if(c > 0)
@@ -257,13 +276,30 @@ bool fixed_dtable::contains_index(size_t index) const
 	return data_exists;
 }
 
+bool fixed_dtable::key_range(dtype * min, dtype * max) const
+{
+	if(!key_count)
+		return false;
+	*min = get_key(0);
+	*max = get_key(key_count - 1);
+	return true;
+}
+
+/* If the "mapped" parameter is set, the whole file is mapped into memory, so
+ * that lookups can run concurrently without locking. */
 int fixed_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
 {
 	int r = -1;
+	bool mapped;
 	dtable_header header;
 	if(fp)
 		deinit();
-	fp = rofile::open_mmap<64, 24>(dfd, file);
+	if(!config.get("mapped", &mapped, false))
+		return -EINVAL;
+	if(mapped)
+		fp = rofile::open_mapped<64>(dfd, file);
+	else
+		fp = rofile::open_mmap<64, 24>(dfd, file);
 	if(!fp)
 		return -1;
 	if(fp->read_type(0, &header) < 0)
@@ -381,10 +417,10 @@ int fixed_dtable::create(int dfd, const char * file, const params & config, dtab
 				/* nothing to do */
 				break;
 			case dtype::STRING:
-				strings.push_back(key.str);
+				strings.push_back(key.str());
 				break;
 			case dtype::BLOB:
-				blobs.push_back(key.blb);
+				blobs.push_back(key.blb());
 				break;
 		}
 		key_count++;
@@ -36,6 +36,7 @@ public:
 	virtual blob index(size_t index) const;
 	virtual bool contains_index(size_t index) const;
 	inline virtual size_t size() const { return key_count; }
+	virtual bool key_range(dtype * min, dtype * max) const;
 	
 	static inline bool static_indexed_access(const params & config) { return true; }
 	
@@ -86,12 +87,31 @@ private:
 	};
 	
 	dtype get_key(size_t index, bool * data_exists = NULL, off_t * data_offset = NULL) const;
+	/* string and blob keys in lock-free files are compared in place, rather
+	 * than copying every key that the binary search looks at */
+	inline bool in_place(const dtype & key) const
+	{
+		if(!fp->lock_free())
+			return false;
+		if(ktype == dtype::STRING)
+			return key.str();
+		return ktype == dtype::BLOB && !blob_cmp && key.blb().exists();
+	}
 	inline int find_key(const dtype & key, bool * data_exists, off_t * data_offset = NULL, size_t * index = NULL) const
 	{
+		if(in_place(key))
+			return find_key(stringtbl::raw_key(key), index, data_exists, data_offset);
 		return find_key(dtype_static_test(key, blob_cmp), index, data_exists, data_offset);
 	}
 	template<class T>
 	int find_key(const T & test, size_t * index, bool * data_exists = NULL, off_t * data_offset = NULL) const;
+	template<class T>
+	inline bool probe(const T & test, size_t index, bool * data_exists, off_t * data_offset, int * c) const
+	{
+		*c = test(get_key(index, data_exists, data_offset));
+		return true;
+	}
+	bool probe(const stringtbl::raw_key & key, size_t index, bool * data_exists, off_t * data_offset, int * c) const;
 	blob get_value(size_t index, off_t data_offset) const;
 	blob get_value(size_t index) const;
 	
@@ -0,0 +1,93 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include "io_limiter.h"
+
+/* never cut the rate below 1/IOL_MIN_FRACTION of the configured rate */
+#define IOL_MIN_FRACTION 16
+/* how often to adjust the rate in response to latency, in microseconds */
+#define IOL_ADJUST_INTERVAL 100000
+
+static inline int64_t usecs_between(const struct timeval & a, const struct timeval & b)
+{
+	return (b.tv_sec - a.tv_sec) * (int64_t) 1000000 + (b.tv_usec - a.tv_usec);
+}
+
+void io_limiter::set(size_t rate, size_t burst, unsigned int latency)
+{
+	scopelock scope(lock);
+	max_rate = rate;
+	this->rate = rate;
+	this->burst = burst ? burst : rate;
+	this->latency = latency;
+	average = 0;
+	tokens = this->burst;
+	gettimeofday(&refilled, NULL);
+	adjusted = refilled;
+}
+
+void io_limiter::refill(const struct timeval & now)
+{
+	int64_t usecs = usecs_between(refilled, now);
+	if(usecs <= 0)
+		return;
+	tokens += usecs * (int64_t) rate / 1000000;
+	if(tokens > (int64_t) burst)
+		tokens = burst;
+	refilled = now;
+}
+
+void io_limiter::consume(size_t size)
+{
+	struct timeval now;
+	int64_t wait;
+	scopelock scope(lock);
+	if(!rate)
+		return;
+	gettimeofday(&now, NULL);
+	refill(now);
+	/* take the tokens now, even if that leaves a debt, so that each
+	 * waiting thread sleeps for just its own share of the deficit */
+	tokens -= size;
+	if(tokens >= 0)
+		return;
+	wait = -tokens * (int64_t) 1000000 / rate;
+	scope.unlock();
+	usleep(wait);
+}
+
+void io_limiter::report_latency(unsigned int usecs)
+{
+	struct timeval now;
+	scopelock scope(lock);
+	if(!latency || !max_rate)
+		return;
+	/* exponentially weighted moving average, weighting new samples 1/8 */
+	average = average ? (average * 7 + usecs) / 8 : usecs;
+	gettimeofday(&now, NULL);
+	if(usecs_between(adjusted, now) < IOL_ADJUST_INTERVAL)
+		return;
+	refill(now);
+	adjusted = now;
+	if(average > latency)
+	{
+		/* multiplicative decrease */
+		rate /= 2;
+		if(rate < max_rate / IOL_MIN_FRACTION)
+			rate = max_rate / IOL_MIN_FRACTION;
+		if(!rate)
+			rate = 1;
+	}
+	else if(rate < max_rate)
+	{
+		/* additive increase */
+		rate += max_rate / IOL_MIN_FRACTION;
+		if(rate > max_rate)
+			rate = max_rate;
+	}
+}
+
+__thread io_limiter * io_limiter::current = NULL;
+__thread int io_limiter::deferring = 0;
+__thread size_t io_limiter::deferred = 0;
@@ -0,0 +1,150 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __IO_LIMITER_H
+#define __IO_LIMITER_H
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error io_limiter.h is a C++ header file
+#endif
+
+#include "locking.h"
+
+/* An I/O limiter is a token bucket that throttles the file I/O done by
+ * background work (digests and combines) so that it does not crowd out the
+ * foreground. Each thread may have a current limiter, set with a scope
+ * object; rwfile and rofile call pread()/pwrite() through this class, which
+ * charges the current thread's limiter (if any) before doing the I/O. A
+ * thread holding a lock that other readers need can put off the wait with a
+ * defer object, so that throttled background reads do not stall them. If a
+ * latency target is set, the foreground reports its latencies, and the rate
+ * is cut back while they are over the target and recovers once they are not. */
+
+class io_limiter
+{
+public:
+	/* rate is in bytes per second, 0 for unlimited; burst defaults to one
+	 * second's worth; latency is the foreground target in microseconds */
+	void set(size_t rate, size_t burst = 0, unsigned int latency = 0);
+	inline size_t get_rate() const { return rate; }
+	inline unsigned int get_latency() const { return latency; }
+	
+	/* wait until size more bytes of I/O are allowed */
+	void consume(size_t size);
+	
+	/* report how long a foreground operation took, in microseconds */
+	void report_latency(unsigned int usecs);
+	
+	inline io_limiter() : max_rate(0), rate(0), burst(0), latency(0), average(0), tokens(0) {}
+	
+	/* sets the limiter for the current thread until it goes out of scope */
+	class scope
+	{
+	public:
+		inline scope(io_limiter * limiter) : old(current)
+		{
+			current = limiter;
+		}
+		inline ~scope()
+		{
+			current = old;
+		}
+	private:
+		io_limiter * old;
+		void operator=(const scope &);
+		scope(const scope &);
+	};
+	
+	/* while one of these is in scope, I/O is still charged to the current
+	 * thread's limiter, but the wait is put off until it goes out of scope;
+	 * declare it before a scopelock so the wait comes after the unlock */
+	class defer
+	{
+	public:
+		inline defer()
+		{
+			deferring++;
+		}
+		inline ~defer()
+		{
+			if(!--deferring && deferred)
+			{
+				size_t size = deferred;
+				deferred = 0;
+				if(current)
+					current->consume(size);
+			}
+		}
+	private:
+		void operator=(const defer &);
+		defer(const defer &);
+	};
+	
+	static inline io_limiter * get_current()
+	{
+		return current;
+	}
+	
+	static inline ssize_t pread(int fd, void * data, size_t size, off_t offset)
+	{
+		charge(size);
+		return ::pread(fd, data, size, offset);
+	}
+	
+	static inline ssize_t pwrite(int fd, const void * data, size_t size, off_t offset)
+	{
+		charge(size);
+		return ::pwrite(fd, data, size, offset);
+	}
+	
+#ifdef __linux__
+	static inline ssize_t pwritev(int fd, const struct iovec * iov, int count, off_t offset)
+	{
+		if(current)
+		{
+			size_t size = 0;
+			for(int i = 0; i < count; i++)
+				size += iov[i].iov_len;
+			charge(size);
+		}
+		return ::pwritev(fd, iov, count, offset);
+	}
+#endif
+
+private:
+	size_t max_rate, rate, burst;
+	unsigned int latency, average;
+	/* may be negative, when I/O has been done but not yet waited for */
+	int64_t tokens;
+	struct timeval refilled, adjusted;
+	init_mutex lock;
+	
+	void refill(const struct timeval & now);
+	
+	static inline void charge(size_t size)
+	{
+		if(!current)
+			return;
+		if(deferring)
+			deferred += size;
+		else
+			current->consume(size);
+	}
+	
+	static __thread io_limiter * current;
+	/* the number of defer objects in scope, and the bytes they put off */
+	static __thread int deferring;
+	static __thread size_t deferred;
+	
+	void operator=(const io_limiter &);
+	io_limiter(const io_limiter &);
+};
+
+#endif /* __IO_LIMITER_H */
@@ -7,7 +7,9 @@
 #include <errno.h>
 #include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -19,13 +21,13 @@
 #include "util.h"
 #include "rwfile.h"
 
-/* This is the generic journal module. It uses either ext3 ordered journal mode
- * or Featherstitch dependencies to keep a journal of uninterpreted records,
- * which later can be played back either to commit transactions or to recover
- * them. The records do not necessarily have to describe idempotent actions, but
- * if they do not, the client code must be able to figure out whether a record's
- * action has already been taken or not so as not to perform it twice in the
- * event of recovery. */
+/* This is the generic journal module. It uses either file syncs (or ext3
+ * ordered journal mode) or Featherstitch dependencies to keep a journal of
+ * uninterpreted records, which later can be played back either to commit
+ * transactions or to recover them. The records do not necessarily have to
+ * describe idempotent actions, but if they do not, the client code must be
+ * able to figure out whether a record's action has already been taken or not
+ * so as not to perform it twice in the event of recovery. */
 
 struct data_header {
 	size_t length;
@@ -33,16 +35,33 @@ struct data_header {
 
 journal * journal::create(int dfd, const istr & path, journal * prev)
 {
+	int r = -1;
 	journal * j = new journal(path, dfd, prev);
 	if(!j)
 		return NULL;
-	if(!j->path || j->data_file.create(dfd, path) < 0)
+	if(j->path)
+	{
+#if !HAVE_FSTITCH
+		if(reuse(dfd, path))
+		{
+			struct stat st;
+			r = j->data_file.open(dfd, path, 0);
+			if(r >= 0 && fstat(j->data_file.get_fd(), &st) >= 0)
+				j->allocated = st.st_size;
+		}
+		else
+#endif
+			r = j->data_file.create(dfd, path);
+	}
+	if(r < 0)
 	{
 		int save = errno;
 		delete j;
 		errno = save;
 		return NULL;
 	}
+	j->generation = new_generation();
+	j->preallocate(0);
 #if HAVE_FSTITCH /* {{{ */
 	j->data_file.set_handler(&j->handler);
 #endif /* }}} */
@@ -56,6 +75,64 @@ int journal::wait()
 		return -EINVAL;
 	return patchgroup_sync(last_commit);
 #else /* }}} */
+	scopelock scope(sync_lock);
+	uint64_t ticket = commit_ticket;
+	while(synced_seq < ticket)
+	{
+		int r;
+		uint64_t target;
+		if(sync_error)
+			/* what that sync was writing may be lost */
+			return sync_error;
+		if(syncing)
+		{
+			/* the sync in progress may or may not cover our ticket */
+			scope.wait(sync_done);
+			continue;
+		}
+		syncing = true;
+		if(sync_window)
+		{
+			/* let other committers join this sync */
+			scope.unlock();
+			usleep(sync_window);
+			scope.lock();
+		}
+		target = commit_seq;
+		if(sync_mode == SYNC_FS)
+		{
+			scope.unlock();
+			r = sync_fs();
+		}
+		else
+		{
+			sync_set set;
+			collect_sync_set(&set);
+			scope.unlock();
+			r = sync_files(set);
+		}
+		scope.lock();
+		syncing = false;
+		if(r < 0)
+			sync_error = r;
+		else
+		{
+			/* erase() may have synced past our target already */
+			if(target > synced_seq)
+				synced_seq = target;
+			sync_count++;
+		}
+		scope.broadcast(sync_done);
+		if(r < 0)
+			return r;
+	}
+	return 0;
+#endif
+}
+
+#if !HAVE_FSTITCH
+int journal::sync_fs()
+{
 	int r;
 	/* by changing the timestamp and calling fsync() on a file within
 	 * the target file system, we force the ext3 transaction to end */
@@ -65,29 +142,136 @@ int journal::wait()
 	r = fsync(fs_fd);
 	assert(r >= 0);
 	return 0;
+}
+
+int journal::sync_all()
+{
+#ifdef __linux__
+	if(syncfs(fs_fd) < 0)
+		return -errno;
+#else
+	sync();
 #endif
+	return 0;
+}
+
+/* must be called with sync_lock held, so the journals can't be erased */
+void journal::collect_sync_set(sync_set * set)
+{
+	std::set<int> dirs;
+	for(std::set<journal *>::iterator it = unsynced->begin(); it != unsynced->end(); ++it)
+	{
+		journal * j = *it;
+		set->files.push_back(dup(j->data_file.get_fd()));
+		set->files.push_back(dup(j->crfd));
+		/* for new journal files; usually all the same directory */
+		if(j->dir_dirty && dirs.insert(j->dfd).second)
+			set->dirs.push_back(dup(j->dfd));
+		j->dir_dirty = false;
+	}
+	unsynced->clear();
+}
+
+/* fdatasync the files added with add_sync_fd(), since the next commit
+ * record must not reach the disk before they do */
+int journal::sync_added()
+{
+	int r = 0;
+	std::map<ino_t, int> fds;
+	std::map<ino_t, int>::iterator it;
+	{
+		scopelock scope(sync_lock);
+		fds.swap(*sync_fds);
+	}
+	for(it = fds.begin(); it != fds.end(); ++it)
+	{
+		if(fdatasync(it->second) < 0 && r >= 0)
+			r = -errno;
+		close(it->second);
+	}
+	return r;
+}
+
+int journal::sync_files(const sync_set & set)
+{
+	int r = 0;
+	for(size_t i = 0; i < set.files.size(); i++)
+	{
+		if(set.files[i] < 0)
+			r = -EBADF;
+		else
+		{
+			if(fdatasync(set.files[i]) < 0 && r >= 0)
+				r = -errno;
+			close(set.files[i]);
+		}
+	}
+	/* the directories only after the files */
+	for(size_t i = 0; i < set.dirs.size(); i++)
+	{
+		if(set.dirs[i] < 0)
+			r = -EBADF;
+		else
+		{
+			if(fsync(set.dirs[i]) < 0 && r >= 0)
+				r = -errno;
+			close(set.dirs[i]);
+		}
+	}
+	return r;
+}
+#endif
+
+int journal::add_sync_fd(int fd)
+{
+#if !HAVE_FSTITCH
+	struct stat st;
+	scopelock scope(sync_lock);
+	if(sync_mode == SYNC_FS)
+		/* sync_fs() will get it anyway */
+		return 0;
+	if(!sync_fds)
+		return -EBUSY;
+	if(fstat(fd, &st) < 0)
+		return -errno;
+	if(sync_fds->find(st.st_ino) == sync_fds->end())
+	{
+		int copy = dup(fd);
+		if(copy < 0)
+			return -errno;
+		(*sync_fds)[st.st_ino] = copy;
+	}
+#endif
+	return 0;
+}
+
+void journal::set_sync_window(unsigned int usecs)
+{
+	scopelock scope(sync_lock);
+	sync_window = usecs;
+}
+
+uint64_t journal::syncs()
+{
+	scopelock scope(sync_lock);
+	return sync_count;
 }
 
 int journal::appendv(const struct ovec * ovp, size_t count)
 {
 	data_header header;
-	uint8_t * data;
 	off_t offset;
-	size_t i, cursor;
+	size_t i, pieces;
+	ssize_t size;
+	/* the header and the data go straight to data_file, a batch at a time */
+	struct iovec iov[RWFILE_IOV_BATCH];
 	if(count < 1 || erasure)
 		return -EINVAL;
-	header.length = ovp[0].ov_len;
-	for(i = 1; i < count; i++)
-		header.length += ovp[i].ov_len;
-	data = (uint8_t *) malloc(header.length + sizeof(header));
-	cursor = sizeof(header);
-	util::memcpy(data, &header, sizeof(header));
+	header.length = 0;
 	for(i = 0; i < count; i++)
-	{
-		util::memcpy(&data[cursor], ovp[i].ov_base, ovp[i].ov_len);
-		cursor += ovp[i].ov_len;
-	}
-	assert(cursor == sizeof(header) + header.length);
+		header.length += ovp[i].ov_len;
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
 	
 	if(!records)
 	{
@@ -103,16 +287,26 @@ int journal::appendv(const struct ovec * ovp, size_t count)
 #endif
 	}
 	offset = data_file.end();
-	if(data_file.append(data, header.length + sizeof(header)) != (ssize_t) (sizeof(header) + header.length))
+	pieces = 1;
+	size = sizeof(header);
+	for(i = 0; i < count; i++)
 	{
-		int save = errno;
-		data_file.truncate(offset);
-		/* make sure the pointer is not past the end of the file */
-		errno = save;
-		free(data);
-		return -1;
+		iov[pieces].iov_base = (void *) ovp[i].ov_base;
+		iov[pieces++].iov_len = ovp[i].ov_len;
+		size += ovp[i].ov_len;
+		if(pieces < RWFILE_IOV_BATCH && i < count - 1)
+			continue;
+		if(data_file.appendv(iov, pieces) != size)
+		{
+			int save = errno;
+			data_file.truncate(offset);
+			/* make sure the pointer is not past the end of the file */
+			errno = save;
+			return -1;
+		}
+		pieces = 0;
+		size = 0;
 	}
-	free(data);
 	return 0;
 }
 
@@ -150,6 +344,10 @@ int journal::end_external(bool success)
 		int r = patchgroup_disengage(external);
 		assert(r >= 0);
 	}
+#else
+	/* we don't know which files were written, so commit() will sync them all */
+	if(success)
+		ext_dirty = true;
 #endif
 	return 0;
 }
@@ -180,29 +378,97 @@ int journal::checksum(off_t start, off_t end, uint8_t * checksum)
 	return 0;
 }
 
+void journal::seal(commit_record * cr)
+{
+	MD5_CTX ctx;
+	MD5Init(&ctx);
+	MD5Update(&ctx, (uint8_t *) cr, sizeof(*cr) - J_CHECKSUM_LEN);
+	MD5Final(cr->cr_checksum, &ctx);
+}
+
+/* checks a commit record's own checksum, not that of the records it commits */
+bool journal::valid(const commit_record & cr, uint32_t sequence) const
+{
+	commit_record copy = cr;
+	if(cr.version != J_COMMIT_VERSION || cr.sequence != sequence || cr.generation != generation)
+		return false;
+	seal(&copy);
+	return !memcmp(copy.cr_checksum, cr.cr_checksum, J_CHECKSUM_LEN);
+}
+
+/* reads the record of the given commit, returning false if it isn't valid */
+bool journal::read_cr(uint32_t index, commit_record * cr) const
+{
+	if(legacy_name)
+	{
+		if(index >= legacy.size())
+			return false;
+		*cr = legacy[index];
+		return true;
+	}
+	if(pread(crfd, cr, sizeof(*cr), index * sizeof(*cr)) != sizeof(*cr))
+		return false;
+	return valid(*cr, index);
+}
+
+uint64_t journal::new_generation()
+{
+	/* this just has to differ from any previous use of a recycled file */
+	static uint32_t count = 0;
+	struct timeval now;
+	uint64_t value;
+	gettimeofday(&now, NULL);
+	value = (((uint64_t) now.tv_sec * 1000000 + now.tv_usec) << 16) ^ ((uint64_t) getpid() << 40);
+	value += __sync_add_and_fetch(&count, 1);
+	return value ? value : 1;
+}
+
+void journal::preallocate(off_t end)
+{
+#ifdef __linux__
+	/* allocate the data file in whole segments, so that most commits
+	 * change neither its size nor its block allocation */
+	if(end < allocated)
+		return;
+	end = (end / J_SEGMENT_SIZE + 1) * J_SEGMENT_SIZE;
+	/* if this fails, the file will still grow as it is written */
+	fallocate(data_file.get_fd(), 0, allocated, end - allocated);
+	allocated = end;
+#endif
+}
+
 int journal::commit()
 {
 	commit_record cr;
 	
-	if(erasure)
+	if(erasure || legacy_name)
 		return -EINVAL;
 	if(commits > playbacks)
 		/* must play back previous commit first */
 		return -EINVAL;
 	assert(playbacks == commits);
+#if !HAVE_FSTITCH
+	if(sync_error)
+		return sync_error;
+#endif
 	
 	if(!records)
 		return 0;
 	
-	/* initialize crfd or if it is almost full add more empty records to it */
-	if(crfd < 0 || !(commits % (J_ADD_N_COMMITS * 1000)))
-		if(init_crfd(istr::null) < 0)
-			return -1;
+	/* initialize crfd or if it is full add more empty records to it */
+	if(crfd < 0 && init_crfd(istr::null) < 0)
+		return -1;
+	if((off_t) ((commits + 1) * sizeof(cr)) > cr_size && grow_crfd() < 0)
+		return -1;
 
+	cr.version = J_COMMIT_VERSION;
+	cr.generation = generation;
+	cr.sequence = commits;
 	cr.offset = prev_cr.offset + prev_cr.length;
 	cr.length = data_file.end() - cr.offset;
 	if(checksum(cr.offset, cr.offset + cr.length, cr.checksum) < 0)
 		return -1;
+	seal(&cr);
 #if HAVE_FSTITCH /* {{{ */
 	patchgroup_id_t commit;
 	commit = patchgroup_create(0);
@@ -240,7 +506,25 @@ int journal::commit()
 		return -1;
 	}
 #endif /* }}} */
+	preallocate(data_file.end());
 	data_file.flush();
+#if !HAVE_FSTITCH
+	if(sync_mode == SYNC_FDATASYNC)
+	{
+		/* the added files and external dependencies must be on
+		 * disk before the commit record can be */
+		int r = sync_added();
+		if(r >= 0 && ext_dirty)
+			r = sync_all();
+		if(r < 0)
+		{
+			scopelock scope(sync_lock);
+			sync_error = r;
+			return r;
+		}
+		ext_dirty = false;
+	}
+#endif
 	
 	if(pwrite(crfd, &cr, sizeof(cr), commits * sizeof(cr)) != sizeof(cr))
 	{
@@ -262,20 +546,32 @@ int journal::commit()
 		patchgroup_abandon(last_commit);
 	last_commit = commit;
 #else /* }}} */
-	char commit_number[16];
-	istr old_commit, new_commit;
+	if(sync_mode == SYNC_FS)
+	{
+		/* the commit record is valid on its own, but on ext3 it might
+		 * reach the disk before the data written ahead of it; a rename
+		 * can't, so the name counts the commits that are complete */
+		istr name = cr_path(commits + 1);
+		if(renameat(dfd, cr_name, dfd, name) < 0)
+			return -1;
+		cr_name = name;
+	}
 	last_commit = commits;
-	snprintf(commit_number, sizeof(commit_number), "%d", last_commit);
-	old_commit = path + J_COMMIT_EXT + commit_number;
-	snprintf(commit_number, sizeof(commit_number), "%d", commits + 1);
-	new_commit = path + J_COMMIT_EXT + commit_number;
-	int r = renameat(dfd, old_commit, dfd, new_commit);
-	if(r < 0)
-		return r;
+#endif
+#if defined(__linux__) && !HAVE_FSTITCH
+	/* start writing the records now, so that wait() has less to do */
+	if(sync_mode == SYNC_FDATASYNC)
+		sync_file_range(data_file.get_fd(), cr.offset, cr.length, SYNC_FILE_RANGE_WRITE);
 #endif
 	records = 0;
 	++commits;
 	prev_cr = cr;
+	scopelock scope(sync_lock);
+	commit_ticket = ++commit_seq;
+#if !HAVE_FSTITCH
+	if(sync_mode == SYNC_FDATASYNC)
+		unsynced->insert(this);
+#endif
 	return 0;
 }
 
@@ -285,7 +581,6 @@ int journal::playback(record_processor processor, commit_hook commit, void * par
 	commit_record cr;
 	off_t readoff;
 	uint8_t buffer[65536];
-	uint8_t zero_checksum[J_CHECKSUM_LEN];
 	int r = -1;
 	if(erasure)
 		return -EINVAL;
@@ -322,11 +617,8 @@ int journal::playback(record_processor processor, commit_hook commit, void * par
 		return -1;
 	}
 #endif /* }}} */
-	util::memset(zero_checksum, 0, sizeof(zero_checksum));
-	while(pread(crfd, &cr, sizeof(cr), readoff) == sizeof(cr))
+	while(read_cr(readoff / sizeof(cr), &cr))
 	{
-		if(!cr.offset && !cr.length && !memcmp(&cr.checksum, &zero_checksum, J_CHECKSUM_LEN))
-			break;
 		
 		off_t curoff = cr.offset;
 		while((size_t) (curoff - cr.offset) < cr.length)
@@ -432,15 +724,46 @@ int journal::erase()
 	assert(r >= 0);
 	r = patchgroup_engage(erasure);
 	assert(r >= 0);
+#else /* }}} */
+	if(sync_mode == SYNC_FDATASYNC && commits)
+	{
+		/* The playbacks must be on disk before the journal is gone.
+		 * They may have written to any number of files, so this syncs
+		 * the whole file system; but a journal is only erased once it
+		 * has grown to the transaction log size (or at shutdown), so
+		 * this is once for very many commits. Empty journals, as at
+		 * shutdown, have nothing to wait for. */
+		uint64_t target;
+		{
+			scopelock scope(sync_lock);
+			target = commit_seq;
+		}
+		r = sync_all();
+		if(r < 0)
+		{
+			scopelock scope(sync_lock);
+			sync_error = r;
+			return r;
+		}
+		/* only now can no sync need our descriptors any more */
+		scopelock scope(sync_lock);
+		unsynced->erase(this);
+		if(target > synced_seq)
+			synced_seq = target;
+	}
 #endif /* }}} */
-	unlinkat(dfd, path, 0);
 #if HAVE_FSTITCH /* {{{ */
+	unlinkat(dfd, path, 0);
 	r = patchgroup_disengage(erasure);
 	assert(r >= 0);
 #else /* }}} */
-	char commit_number[16];
-	snprintf(commit_number, sizeof(commit_number), "%d", commits);
-	unlinkat(dfd, path + J_COMMIT_EXT + commit_number, 0);
+	/* in SYNC_FS mode, we'd need another sync to order the recycling */
+	if(sync_mode != SYNC_FDATASYNC || recycle() < 0)
+	{
+		unlinkat(dfd, path, 0);
+		/* a reused journal has one even if we never opened it */
+		unlinkat(dfd, cr_name ? cr_name : cr_path(0), 0);
+	}
 #endif
 	r = data_file.close();
 	assert(r >= 0);
@@ -459,6 +782,112 @@ int journal::erase()
 	return 0;
 }
 
+#if !HAVE_FSTITCH
+/* makes this (erased) journal empty, and renames its files aside for reuse */
+int journal::recycle()
+{
+	int r;
+	struct stat st;
+	char name[32];
+	istr recycled_name;
+	commit_record zero;
+	if(crfd < 0)
+		/* nothing was ever committed, so there is no commit record file */
+		return -ENOENT;
+	if(legacy_name)
+		return -EINVAL;
+	if(fstat(dfd, &st) < 0)
+		return -errno;
+	{
+		scopelock scope(sync_lock);
+		if(recycled->size() >= J_RECYCLE_MAX)
+			return -ENOSPC;
+		snprintf(name, sizeof(name), J_RECYCLE_PREFIX "%08x", recycle_seq++);
+	}
+	recycled_name = name;
+	
+	/* the playbacks are already on disk, so we can now invalidate the
+	 * commit records; it is enough to zero the first one */
+	util::memset(&zero, 0, sizeof(zero));
+	if(pwrite(crfd, &zero, sizeof(zero), 0) != sizeof(zero))
+		return -1;
+	if(fdatasync(crfd) < 0)
+		return -errno;
+	/* the commit record file first: a crash in between leaves a data file
+	 * without one, which recovery treats as an empty journal */
+	r = renameat(dfd, cr_name, dfd, recycled_name + J_COMMIT_NAME);
+	if(r < 0)
+		return r;
+	r = renameat(dfd, path, dfd, recycled_name);
+	if(r < 0)
+	{
+		unlinkat(dfd, recycled_name + J_COMMIT_NAME, 0);
+		return r;
+	}
+	scopelock scope(sync_lock);
+	recycled->push_back(recycled_file(st.st_dev, st.st_ino, recycled_name));
+	return 0;
+}
+
+/* renames a pair of recycled files in this directory to path, if there are any */
+bool journal::reuse(int dfd, const istr & path)
+{
+	struct stat st;
+	istr name;
+	if(fstat(dfd, &st) < 0)
+		return false;
+	{
+		scopelock scope(sync_lock);
+		std::vector<recycled_file>::iterator it;
+		if(!recycled)
+			return false;
+		for(it = recycled->begin(); it != recycled->end(); ++it)
+			if(it->dev == st.st_dev && it->dir == st.st_ino)
+				break;
+		if(it == recycled->end())
+			return false;
+		name = it->name;
+		recycled->erase(it);
+	}
+	/* the data file first, for the same reason as in recycle() */
+	if(renameat(dfd, name, dfd, path) < 0)
+	{
+		unlinkat(dfd, name + J_COMMIT_NAME, 0);
+		return false;
+	}
+	/* if this fails, init_crfd() will just create a new commit record file */
+	renameat(dfd, name + J_COMMIT_NAME, dfd, path + J_COMMIT_NAME);
+	return true;
+}
+#endif
+
+int journal::add_recycled(int dfd, const istr & name, const istr & commit_name)
+{
+#if !HAVE_FSTITCH
+	struct stat st;
+	if(commit_name && sync_mode == SYNC_FDATASYNC && fstat(dfd, &st) >= 0)
+	{
+		uint32_t number = strtoul(name + sizeof(J_RECYCLE_PREFIX) - 1, NULL, 16);
+		scopelock scope(sync_lock);
+		if(recycled && recycled->size() < J_RECYCLE_MAX)
+		{
+			recycled->push_back(recycled_file(st.st_dev, st.st_ino, name));
+			if(number >= recycle_seq)
+				recycle_seq = number + 1;
+			return 0;
+		}
+	}
+#endif
+	/* not a complete pair, or we have enough already */
+	if(commit_name)
+	{
+		int r = unlinkat(dfd, commit_name, 0);
+		if(r < 0)
+			return r;
+	}
+	return unlinkat(dfd, name, 0);
+}
+
 int journal::release()
 {
 	if(!erasure || crfd >= 0)
@@ -477,7 +906,8 @@ int journal::release()
 	return 0;
 }
 
-/* returns 1 for OK, 0 for failure, and < 0 on I/O error */
+/* returns the number of leading commits whose records are intact, or < 0 on
+ * I/O error */
 int journal::verify()
 {
 	commit_record cr;
@@ -486,47 +916,92 @@ int journal::verify()
 		return -1;
 	for(uint32_t i = 0; i < commits; i++)
 	{
-		if(pread(crfd, &cr, sizeof(cr), i * sizeof(cr)) != sizeof(cr))
+		if(!read_cr(i, &cr))
 			return -1;
 		if(checksum(cr.offset, cr.offset + cr.length, actual) < 0)
 			return -1;
 		if(memcmp(cr.checksum, actual, J_CHECKSUM_LEN))
-			return 0;
+			return i;
 	}
-	return 1;
+	return commits;
+}
+
+/* forgets all but the first keep commits, along with their records */
+int journal::discard_commits(uint32_t keep)
+{
+	commit_record zero;
+	assert(keep <= commits);
+	if(legacy_name)
+		/* just forget them; the file is never written */
+		legacy.resize(keep);
+	else
+	{
+		/* invalidate all of them, so later commits can't bring any back */
+		util::memset(&zero, 0, sizeof(zero));
+		for(uint32_t i = keep; i < commits; i++)
+			if(pwrite(crfd, &zero, sizeof(zero), i * sizeof(zero)) != sizeof(zero))
+				return -1;
+		if(fdatasync(crfd) < 0)
+			return -errno;
+	}
+	commits = keep;
+	if(commits)
+	{
+		if(!read_cr(commits - 1, &prev_cr))
+			return -1;
+	}
+	else
+	{
+		prev_cr.offset = 0;
+		prev_cr.length = 0;
+	}
+	return data_file.truncate(prev_cr.offset + prev_cr.length);
+}
+
+/* the name of our commit record file after the given number of commits */
+istr journal::cr_path(uint32_t count) const
+{
+	char name[24];
+#if !HAVE_FSTITCH
+	if(sync_mode == SYNC_FS)
+	{
+		snprintf(name, sizeof(name), J_COMMIT_EXT "%u", count);
+		return path + name;
+	}
+#endif
+	return path + J_COMMIT_NAME;
 }
 
 int journal::init_crfd(const istr & commit_name)
 {
 	int r;
-	off_t filesize, nextcr = 0;
+	off_t nextcr = 0;
 	struct timeval settime[2] = {{0, 0}, {0, 0}};
-	commit_record zero = {0, 0}, cr;
+	commit_record cr;
 	
-	/* Only append more empy records to the commit file if it is already open
-	 * otherwise create a new commit record file. */
+	/* open or create the commit record file; grow_crfd() makes room in it */
 	if(crfd < 0)
 	{
 		istr cname = commit_name;
 		if(!cname)
-		{
-			char commit_number[16];
-			snprintf(commit_number, sizeof(commit_number), "%d", commits);
-			cname = path + J_COMMIT_EXT + commit_number;
-		}
+			cname = cr_path(0);
 		crfd = openat(dfd, cname, O_CREAT | O_RDWR, 0644);
 		if(crfd < 0)
 			return -1;
+		cr_name = cname;
 	}
 
-	filesize = lseek(crfd, 0, SEEK_END);
-	util::memset(zero.checksum, 0, sizeof(zero.checksum));
-	/* find out where the last good commit record is */
+	cr_size = lseek(crfd, 0, SEEK_END);
+	/* find out where the last good commit record is; the file may
+	 * have been recycled, so there may be stale ones after that */
 	while((r = pread(crfd, &cr, sizeof(cr), nextcr)))
 	{
 		if(r < (int) sizeof(cr))
 			break;
-		if(!cr.offset && !cr.length && !memcmp(&cr.checksum, &zero.checksum, J_CHECKSUM_LEN))
+		if(!nextcr && !generation)
+			/* reopening, so take the generation from the first record */
+			generation = cr.generation;
+		if(!valid(cr, nextcr / sizeof(cr)))
 			break;
 		nextcr += r;
 	}
@@ -542,33 +1017,93 @@ int journal::init_crfd(const istr & commit_name)
 	if(settime[1].tv_sec < 2147483647)
 		settime[1].tv_sec = 2147483647;
 	if((r = futimes(crfd, settime)) < 0)
-		goto error;
-	
-	if(filesize < (nextcr + (int) sizeof(cr)))
 	{
-		/* zero out the rest of the file J_ADD_N_COMMITS records at a time */
-		uint8_t zbuffer[1000 * sizeof(zero)];
-		util::memset(zbuffer, 0, sizeof(zbuffer));
-		while((filesize - nextcr) < J_ADD_N_COMMITS * (int) sizeof(zbuffer))
-		{
-			r = pwrite(crfd, zbuffer, sizeof(zbuffer), filesize);
-			if(r <= 0)
-				goto error;
-			filesize += r;
-		}
-		/* necessary? */
-		fsync(crfd);
+		close(crfd);
+		crfd = -1;
+		return r;
 	}
 	
 	return nextcr;
-	
-error:
-	if(crfd > 0)
+}
+
+/* Zero out more of the commit record file, so that writing commit records
+ * only overwrites existing blocks. A new file starts with room for 1000
+ * records, and then doubles up to J_ADD_N_COMMITS thousand at a time, so
+ * that journals with few commits don't write and sync a large file. */
+int journal::grow_crfd()
+{
+	uint8_t zbuffer[1000 * sizeof(commit_record)];
+	off_t step = cr_size, end;
+	if(step < (off_t) sizeof(zbuffer))
+		step = sizeof(zbuffer);
+	else if(step > J_ADD_N_COMMITS * (off_t) sizeof(zbuffer))
+		step = J_ADD_N_COMMITS * sizeof(zbuffer);
+	end = cr_size + step;
+	util::memset(zbuffer, 0, sizeof(zbuffer));
+	while(cr_size < end)
 	{
-		close(crfd);
-		crfd = -1;
+		size_t length = sizeof(zbuffer);
+		if(end - cr_size < (off_t) length)
+			length = end - cr_size;
+		ssize_t r = pwrite(crfd, zbuffer, length, cr_size);
+		if(r <= 0)
+			return (r < 0) ? -errno : -ENOSPC;
+		cr_size += r;
 	}
-	return r < 0 ? r : -1;
+	/* the new size must be on disk before the records it makes room for */
+	if(fdatasync(crfd) < 0)
+		return -errno;
+	return 0;
+}
+
+/* Commit record files from before J_COMMIT_VERSION hold bare records of the
+ * offset, length, and checksum of each commit. Without Featherstitch, the file
+ * was renamed for each commit to count them (so ".0" means none); with it, the
+ * records up to the first zeroed one count. Such a journal is read into memory
+ * with its records converted, so it can be played back and erased like any
+ * other; it is never committed to. Returns the number of commits read. */
+int journal::read_legacy(const istr & commit_name)
+{
+	legacy_commit_record old, zero;
+	commit_record cr;
+	uint32_t count = (uint32_t) -1;
+	if(!commit_name)
+		return 0;
+#if !HAVE_FSTITCH
+	const char * number = strstr(commit_name, J_COMMIT_EXT);
+	if(!number)
+		return 0;
+	count = strtoul(number + strlen(J_COMMIT_EXT), NULL, 10);
+#endif
+	util::memset(&zero, 0, sizeof(zero));
+	generation = new_generation();
+	for(uint32_t i = 0; i < count; i++)
+	{
+		ssize_t r = pread(crfd, &old, sizeof(old), i * sizeof(old));
+#if HAVE_FSTITCH
+		if(r >= 0 && (r < (ssize_t) sizeof(old) || !memcmp(&old, &zero, sizeof(old))))
+			break;
+#endif
+		if(r != (ssize_t) sizeof(old))
+		{
+			legacy.clear();
+			return -1;
+		}
+		cr.version = J_COMMIT_VERSION;
+		cr.generation = generation;
+		cr.sequence = i;
+		cr.offset = old.offset;
+		cr.length = old.length;
+		util::memcpy(cr.checksum, old.checksum, J_CHECKSUM_LEN);
+		seal(&cr);
+		legacy.push_back(cr);
+	}
+	if(legacy.empty())
+		return 0;
+	legacy_name = commit_name;
+	commits = legacy.size();
+	prev_cr = legacy.back();
+	return commits;
 }
 
 int journal::reopen(int dfd, const istr & path, const istr & commit_name, journal ** pj, journal * prev)
@@ -576,9 +1111,6 @@ int journal::reopen(int dfd, const istr & path, const istr & commit_name, journa
 	int r;
 	journal * j;
 	off_t offset;
-#if !HAVE_FSTITCH
-	const char * commit_number;
-#endif
 	
 	if(prev && !prev->last_commit)
 		return -EINVAL;
@@ -590,32 +1122,53 @@ int journal::reopen(int dfd, const istr & path, const istr & commit_name, journa
 	offset = j->init_crfd(commit_name);
 	if(offset < 0)
 		goto error;
-	if(!offset)
-	{
-		/* opening an empty journal file */
-		j->commits = 0;
-		*pj = j;
-		return 0;
-	}
-	
-	offset -= sizeof(j->prev_cr);
-	r = pread(j->crfd, &j->prev_cr, sizeof(j->prev_cr), offset);
-	if(r != (int) sizeof(j->prev_cr))
-		return (r < 0) ? r : -1;
-	j->commits = (offset / sizeof(j->prev_cr)) + 1;
 #if !HAVE_FSTITCH
-	/* get the last commit number from the file name */
-	commit_number = strstr(commit_name, J_COMMIT_EXT);
-	if(commit_number)
+	if(commit_name && strcmp(commit_name, path + J_COMMIT_NAME))
 	{
-		commit_number += strlen(J_COMMIT_EXT);
-		j->commits = atoi(commit_number);
-		assert(j->last_commit <= j->commits);
+		/* named by the number of commits that are complete (or, if
+		 * there are no valid commit records, an old journal) */
+		const char * number = strstr(commit_name, J_COMMIT_EXT);
+		off_t limit = number ? strtoul(number + strlen(J_COMMIT_EXT), NULL, 10) * sizeof(j->prev_cr) : 0;
+		if(offset > limit)
+			offset = limit;
 	}
 #endif
+	if(offset)
+	{
+		offset -= sizeof(j->prev_cr);
+		r = pread(j->crfd, &j->prev_cr, sizeof(j->prev_cr), offset);
+		if(r != (int) sizeof(j->prev_cr))
+			return (r < 0) ? r : -1;
+		j->commits = (offset / sizeof(j->prev_cr)) + 1;
+	}
+	else
+	{
+		/* no current commit records, but it may be an old journal */
+		r = j->read_legacy(commit_name);
+		if(r < 0)
+		{
+			close(j->crfd);
+			goto error;
+		}
+		if(!r)
+		{
+			/* opening an empty journal file */
+			j->commits = 0;
+			*pj = j;
+			return 0;
+		}
+	}
+	
 	/* get rid of any uncommited records that might be in the journal */
 	r = j->data_file.open(dfd, path, j->prev_cr.offset + j->prev_cr.length);
-	if(r < 0 || (r = j->verify()) <= 0)
+	if(r >= 0)
+		r = j->verify();
+	if(r >= 0 && (uint32_t) r < j->commits)
+		/* commit records may reach the disk before their records do; the
+		 * commits missing records never finished, but the ones before them
+		 * did (and may have been reported durable), so keep those */
+		r = j->discard_commits(r);
+	if(r < 0)
 	{
 		if(prev)
 			prev->usage--;
@@ -643,18 +1196,38 @@ error:
 #if !HAVE_FSTITCH
 int journal::fs_fd = -1;
 struct timeval journal::fd_tv[2];
+std::set<journal *> * journal::unsynced = NULL;
+std::map<ino_t, int> * journal::sync_fds = NULL;
+std::vector<journal::recycled_file> * journal::recycled = NULL;
+uint32_t journal::recycle_seq = 0;
+int journal::sync_error = 0;
 #endif
+journal::durability journal::sync_mode = SYNC_FDATASYNC;
+uint64_t journal::commit_seq = 0;
+uint64_t journal::synced_seq = 0;
+uint64_t journal::sync_count = 0;
+unsigned int journal::sync_window = 0;
+bool journal::syncing = false;
+init_mutex journal::sync_lock;
+init_cond journal::sync_done;
 
-int journal::init(int dfd)
+int journal::init(int dfd, durability mode)
 {
+	sync_mode = mode;
 #if !HAVE_FSTITCH
 	if(fs_fd >= 0)
 		return -EBUSY;
+	sync_error = 0;
 	fs_fd = openat(dfd, ".fsync_fs", O_RDWR | O_CREAT | O_TRUNC, 0600);
 	if(fs_fd < 0)
 		return fs_fd;
 	unlinkat(dfd, ".fsync_fs", 0);
 	memset(fd_tv, 0, sizeof(fd_tv));
+	/* allocated here rather than statically, since tx_deinit()
+	 * may erase journals after static destructors have run */
+	unsynced = new std::set<journal *>;
+	sync_fds = new std::map<ino_t, int>;
+	recycled = new std::vector<recycled_file>;
 #endif
 	return 0;
 }
@@ -666,6 +1239,15 @@ int journal::deinit()
 		return -EBUSY;
 	close(fs_fd);
 	fs_fd = -1;
+	for(std::map<ino_t, int>::iterator it = sync_fds->begin(); it != sync_fds->end(); ++it)
+		close(it->second);
+	delete sync_fds;
+	sync_fds = NULL;
+	delete unsynced;
+	unsynced = NULL;
+	/* the recycled files stay on disk for next time */
+	delete recycled;
+	recycled = NULL;
 #endif
 	return 0;
 }
@@ -7,6 +7,8 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
 
 #ifndef __cplusplus
 #error journal.h is a C++ header file
@@ -24,12 +26,28 @@ extern "C" {
 #include <sys/time.h>
 #endif
 
+#include <map>
+#include <set>
+#include <vector>
+
 #include "istr.h"
 #include "rwfile.h"
+#include "locking.h"
 
 #define J_COMMIT_EXT ".commit."
+/* In SYNC_FS mode, the commit record file is still renamed for each commit,
+ * to J_COMMIT_EXT and the number of commits; otherwise it has this name, and
+ * all its valid commit records count */
+#define J_COMMIT_NAME J_COMMIT_EXT "all"
+/* the commit record format; older files have no version (see read_legacy()) */
+#define J_COMMIT_VERSION 1
 #define J_CHECKSUM_LEN 16
-#define J_ADD_N_COMMITS 50 /* in thousands of commits */
+#define J_ADD_N_COMMITS 50 /* in thousands of commits, at most */
+/* data files are allocated this much at a time */
+#define J_SEGMENT_SIZE 1048576
+/* erased journal files kept for reuse are renamed with this prefix */
+#define J_RECYCLE_PREFIX "recycle."
+#define J_RECYCLE_MAX 4
 
 class journal
 {
@@ -59,9 +77,30 @@ public:
 	/* commits a journal atomically, but does not block waiting for it */
 	int commit();
 	
-	/* blocks waiting for a committed journal to be written to disk */
+	/* blocks waiting for a committed journal to be written to disk; this
+	 * may be called by several threads at once, and they will share a
+	 * single file system sync (as will any commits made during the sync
+	 * window, if one is set) rather than each forcing their own */
 	int wait();
 	
+	/* how long the first waiter should wait for others to join its sync
+	 * before starting it, in microseconds; the default is 0 */
+	static void set_sync_window(unsigned int usecs);
+	/* the number of file system syncs actually done by wait() */
+	static uint64_t syncs();
+	
+	/* how wait() makes commits durable: SYNC_FS forces the whole file
+	 * system's journal to commit (which only orders writes correctly on
+	 * ext3-style ordered journaling), while SYNC_FDATASYNC syncs just the
+	 * journal files and their directory; in this mode, commit() first
+	 * syncs any files added with add_sync_fd(), and the whole file system
+	 * is only synced when a commit has external dependencies, or a journal
+	 * is erased. Once a sync fails, commit() and wait() keep failing. */
+	enum durability { SYNC_FS, SYNC_FDATASYNC };
+	static inline durability get_durability() { return sync_mode; }
+	/* make sure this file's data is on disk before the next commit record */
+	static int add_sync_fd(int fd);
+	
 	/* plays back a journal, possibly during recovery */
 	int playback(record_processor processor, commit_hook commit, void * param);
 	
@@ -77,34 +116,105 @@ public:
 	/* reopens an existing journal if it is committed, otherwise leaves it alone */
 	static int reopen(int dfd, const istr & path, const istr & commit_name, journal ** pj, journal * prev);
 	
+	/* In SYNC_FDATASYNC mode, erase() renames the journal files aside rather
+	 * than unlinking them, and create() then reuses them: their blocks are
+	 * already allocated, so writing them is a pure data write. Since they
+	 * hold stale records, commit records carry a checksum and the journal
+	 * generation, and only an unbroken run of valid ones counts as committed.
+	 * During recovery, files with names starting with J_RECYCLE_PREFIX must be
+	 * passed to add_recycled() instead of reopen(); commit_name may be NULL */
+	static inline bool is_recycled(const char * name)
+	{
+		return !strncmp(name, J_RECYCLE_PREFIX, sizeof(J_RECYCLE_PREFIX) - 1);
+	}
+	static int add_recycled(int dfd, const istr & name, const istr & commit_name);
+	
 	/* number of bytes currently occupied by the journal */
 	inline size_t size() const { return data_file.end() + (commits * sizeof(commit_record));}
 	
 	/* initialize the journal system */
-	static int init(int dfd);
+	static int init(int dfd, durability mode = SYNC_FDATASYNC);
 	static int deinit();
 	
 private:
 #if !HAVE_FSTITCH
 	static int fs_fd;
 	static struct timeval fd_tv[2];
+	static int sync_fs();
+	static int sync_all();
+	
+	/* duplicated descriptors to sync, closed once they have been */
+	struct sync_set
+	{
+		std::vector<int> files, dirs;
+	};
+	static void collect_sync_set(sync_set * set);
+	static int sync_files(const sync_set & set);
+	static int sync_added();
+	/* journals with commits that have not yet been synced */
+	static std::set<journal *> * unsynced;
+	/* files added with add_sync_fd(), by inode number */
+	static std::map<ino_t, int> * sync_fds;
+	
+	/* journal files available for reuse, and the directory they are in */
+	struct recycled_file
+	{
+		dev_t dev;
+		ino_t dir;
+		istr name;
+		inline recycled_file(dev_t dev, ino_t dir, const istr & name) : dev(dev), dir(dir), name(name) {}
+	};
+	static std::vector<recycled_file> * recycled;
+	static uint32_t recycle_seq;
+	static bool reuse(int dfd, const istr & path);
+	int recycle();
+#endif
+	static durability sync_mode;
+	/* group commit state: every commit takes a ticket, and each sync
+	 * covers all the tickets taken before it started */
+	static uint64_t commit_seq, synced_seq, sync_count;
+	static unsigned int sync_window;
+	static bool syncing;
+#if !HAVE_FSTITCH
+	/* the error from the first failed sync, after which we refuse to go on */
+	static int sync_error;
 #endif
+	static init_mutex sync_lock;
+	static init_cond sync_done;
 	
 	/* a commit record */
 	struct commit_record {
+		/* J_COMMIT_VERSION */
+		uint32_t version;
+		/* distinguishes these records from those of previous uses of the file */
+		uint64_t generation;
+		uint32_t sequence;
+		off_t offset;
+		size_t length;
+		uint8_t checksum[J_CHECKSUM_LEN];
+		/* of the fields above */
+		uint8_t cr_checksum[J_CHECKSUM_LEN];
+	} __attribute__((packed));
+	/* a commit record from before J_COMMIT_VERSION */
+	struct legacy_commit_record {
 		off_t offset;
 		size_t length;
 		uint8_t checksum[J_CHECKSUM_LEN];
 	} __attribute__((packed));
+	static void seal(commit_record * cr);
+	bool valid(const commit_record & cr, uint32_t sequence) const;
+	bool read_cr(uint32_t index, commit_record * cr) const;
+	static uint64_t new_generation();
 	
 	inline journal(const istr & path, int dfd, journal * prev)
-		: path(path), dfd(dfd), crfd(-1), records(0), last_commit(0),
+		: path(path), dfd(dfd), crfd(-1), cr_size(0), records(0), last_commit(0),
 		  finished(0), erasure(0), external(0),
 #if HAVE_FSTITCH
 		  handler(this),
 #endif
 		  prev(prev), commits(0), playbacks(0), usage(1),
-		  ext_count(0), ext_success(false)
+		  ext_count(0), ext_success(false), commit_ticket(0), ext_dirty(false),
+		  generation(0), allocated(0), dir_dirty(true)
 	{
 		prev_cr.offset = 0;
 		prev_cr.length = 0;
@@ -133,11 +243,19 @@ private:
 #endif
 	
 	int checksum(off_t start, off_t end, uint8_t * checksum);
+	istr cr_path(uint32_t count) const;
 	int init_crfd(const istr & commit_name);
+	int grow_crfd();
+	int read_legacy(const istr & commit_name);
 	int verify();
+	int discard_commits(uint32_t keep);
+	void preallocate(off_t end);
 	
 	istr path;
 	int dfd, crfd;
+	/* the current name of the commit record file, and its size */
+	istr cr_name;
+	off_t cr_size;
 	rwfile data_file;
 #if HAVE_FSTITCH
 	/* the records in this journal */
@@ -167,6 +285,20 @@ private:
 	/* external dependency state */
 	int ext_count;
 	bool ext_success;
+	/* the ticket of the most recent commit */
+	uint64_t commit_ticket;
+	/* whether there have been external dependencies since the last commit */
+	bool ext_dirty;
+	/* the generation written into our commit records */
+	uint64_t generation;
+	/* for a journal with an old commit record file, its name and its
+	 * records, converted; such journals are only played back and erased */
+	istr legacy_name;
+	std::vector<commit_record> legacy;
+	/* how much of the data file has been allocated */
+	off_t allocated;
+	/* whether our directory entries might not be on disk yet */
+	bool dir_dirty;
 };
 
 #endif /* __JOURNAL_H */
@@ -6,73 +6,76 @@
 
 #include "util.h"
 #include "exception.h"
-#include "hack_avl_map.h"
 #include "journal_dtable.h"
 
 bool journal_dtable::iter::valid() const
 {
-	return jit != dt_source->jdt_map.end();
+	return jit != NULL;
 }
 
 bool journal_dtable::iter::next()
 {
-	if(jit != dt_source->jdt_map.end())
-		++jit;
-	return jit != dt_source->jdt_map.end();
+	if(jit)
+		jit = forward(jit->next_node());
+	return jit != NULL;
 }
 
 bool journal_dtable::iter::prev()
 {
-	if(jit == dt_source->jdt_map.begin())
+	const memtable::node * node;
+	if(!jit)
+		/* back up from past the end */
+		return (jit = backward(dt_source->jdt_mem.last())) != NULL;
+	node = backward(jit->prev_node());
+	if(!node)
 		return false;
-	--jit;
+	jit = node;
 	return true;
 }
 
 bool journal_dtable::iter::first()
 {
-	jit = dt_source->jdt_map.begin();
-	return jit != dt_source->jdt_map.end();
+	jit = forward(dt_source->jdt_mem.first());
+	return jit != NULL;
 }
 
 bool journal_dtable::iter::last()
 {
-	jit = dt_source->jdt_map.end();
-	if(jit == dt_source->jdt_map.begin())
-		return false;
-	--jit;
-	return true;
+	jit = backward(dt_source->jdt_mem.last());
+	return jit != NULL;
 }
 
 dtype journal_dtable::iter::key() const
 {
-	return jit->first;
+	return jit->key;
 }
 
 bool journal_dtable::iter::seek(const dtype & key)
 {
-	jit = dt_source->jdt_map.lower_bound(key);
-	if(jit == dt_source->jdt_map.end())
+	jit = forward(dt_source->jdt_mem.lower_bound(key));
+	if(!jit)
 		return false;
-	return !dt_source->jdt_map.key_comp()(key, jit->first);
+	return !jit->key.compare(key, dt_source->blob_cmp);
 }
 
 bool journal_dtable::iter::seek(const dtype_test & test)
 {
-	jit = lower_bound(dt_source->jdt_map, test);
-	if(jit == dt_source->jdt_map.end())
+	jit = forward(dt_source->jdt_mem.lower_bound(test));
+	if(!jit)
 		return false;
-	return !test(jit->first);
+	return !test(jit->key);
 }
 
 metablob journal_dtable::iter::meta() const
 {
-	return *jit->second;
+	memtable::reader reader(dt_source->jdt_mem);
+	return *jit->value(sequence);
 }
 
 blob journal_dtable::iter::value() const
 {
-	return *jit->second;
+	memtable::reader reader(dt_source->jdt_mem);
+	return *jit->value(sequence);
 }
 
 const dtable * journal_dtable::iter::source() const
@@ -87,11 +90,12 @@ dtable::iter * journal_dtable::iterator(ATX_DEF) const
 
 bool journal_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 {
-	journal_dtable_hash::const_iterator it = jdt_hash.find(key);
-	if(it != jdt_hash.end())
+	memtable::reader reader(jdt_mem);
+	const blob * value = jdt_mem.find(key);
+	if(value)
 	{
 		*found = true;
-		return it->second.exists();
+		return value->exists();
 	}
 	*found = false;
 	return false;
@@ -99,16 +103,75 @@ bool journal_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 
 blob journal_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 {
-	journal_dtable_hash::const_iterator it = jdt_hash.find(key);
-	if(it != jdt_hash.end())
+	memtable::reader reader(jdt_mem);
+	const blob * value = jdt_mem.find(key);
+	if(value)
 	{
 		*found = true;
-		return it->second;
+		return *value;
 	}
 	*found = false;
 	return blob();
 }
 
+dtable * journal_dtable::snapshot() const
+{
+	return new snapshot_dtable(this, jdt_mem.sequence());
+}
+
+dtable::iter * journal_dtable::snapshot_dtable::iterator(ATX_DEF) const
+{
+	return new journal_dtable::iter(jdt, sequence);
+}
+
+bool journal_dtable::snapshot_dtable::present(const dtype & key, bool * found, ATX_DEF) const
+{
+	memtable::reader reader(jdt->jdt_mem);
+	const blob * value = jdt->jdt_mem.find(key, sequence);
+	if(value)
+	{
+		*found = true;
+		return value->exists();
+	}
+	*found = false;
+	return false;
+}
+
+blob journal_dtable::snapshot_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
+{
+	memtable::reader reader(jdt->jdt_mem);
+	const blob * value = jdt->jdt_mem.find(key, sequence);
+	if(value)
+	{
+		*found = true;
+		return *value;
+	}
+	*found = false;
+	return blob();
+}
+
+journal_dtable::snapshot_dtable::snapshot_dtable(const journal_dtable * source, uint64_t sequence)
+	: jdt(source), sequence(sequence)
+{
+	/* like an iterator, we keep the journal dtable in use */
+	jdt->retain();
+	jdt->jdt_mem.add_snapshot();
+	ktype = jdt->ktype;
+	cmp_name = jdt->cmp_name;
+	if(jdt->blob_cmp)
+	{
+		jdt->blob_cmp->retain();
+		blob_cmp = jdt->blob_cmp;
+	}
+}
+
+journal_dtable::snapshot_dtable::~snapshot_dtable()
+{
+	dtable::deinit();
+	jdt->jdt_mem.drop_snapshot();
+	jdt->release();
+}
+
 #define JDT_KEY_U32 1
 struct jdt_key_u32
 {
@@ -174,7 +237,7 @@ int journal_dtable::log_blob_cmp()
 	return 0;
 }
 
-template<class T> inline int journal_dtable::log(T * entry, const blob & blob, size_t offset)
+template<class T> inline int journal_dtable::log(T * entry, const blob & blob, size_t offset, sys_journal::batch * batch)
 {
 	int r;
 	size_t size = sizeof(*entry) + offset;
@@ -187,12 +250,12 @@ template<class T> inline int journal_dtable::log(T * entry, const blob & blob, s
 	}
 	else
 		entry->size = -1;
-	r = journal_append(entry, size);
+	r = batch ? batch->add(this, entry, size) : journal_append(entry, size);
 	free(entry);
 	return r;
 }
 
-int journal_dtable::log(const dtype & key, const blob & blob, bool append)
+int journal_dtable::log(const dtype & key, const blob & blob, bool append, sys_journal::batch * batch)
 {
 	if(ktype == dtype::BLOB && blob_cmp && !cmp_name)
 	{
@@ -212,7 +275,7 @@ int journal_dtable::log(const dtype & key, const blob & blob, bool append)
 			entry->type = JDT_KEY_U32;
 			entry->append = append;
 			entry->key = key.u32;
-			return log(entry, blob);
+			return log(entry, blob, 0, batch);
 		}
 		case dtype::DOUBLE:
 		{
@@ -222,31 +285,31 @@ int journal_dtable::log(const dtype & key, const blob & blob, bool append)
 			entry->type = JDT_KEY_DBL;
 			entry->append = append;
 			entry->key = key.dbl;
-			return log(entry, blob);
+			return log(entry, blob, 0, batch);
 		}
 		case dtype::STRING:
 		{
-			jdt_key_str * entry = (jdt_key_str *) malloc(sizeof(*entry) + blob.size() + key.str.length());
+			jdt_key_str * entry = (jdt_key_str *) malloc(sizeof(*entry) + blob.size() + key.str().length());
 			if(!entry)
 				return -ENOMEM;
 			entry->type = JDT_KEY_STR;
 			entry->append = append;
-			entry->key_size = key.str.length();
+			entry->key_size = key.str().length();
 			if(entry->key_size)
-				util::memcpy(entry->data, key.str, entry->key_size);
-			return log(entry, blob, entry->key_size);
+				util::memcpy(entry->data, key.str(), entry->key_size);
+			return log(entry, blob, entry->key_size, batch);
 		}
 		case dtype::BLOB:
 		{
-			jdt_key_blob * entry = (jdt_key_blob *) malloc(sizeof(*entry) + blob.size() + key.blb.size());
+			jdt_key_blob * entry = (jdt_key_blob *) malloc(sizeof(*entry) + blob.size() + key.blb().size());
 			if(!entry)
 				return -ENOMEM;
 			entry->type = JDT_KEY_BLOB;
 			entry->append = append;
-			entry->key_size = key.blb.size();
+			entry->key_size = key.blb().size();
 			if(entry->key_size)
-				util::memcpy(entry->data, &key.blb[0], entry->key_size);
-			return log(entry, blob, entry->key_size);
+				util::memcpy(entry->data, &key.blb()[0], entry->key_size);
+			return log(entry, blob, entry->key_size, batch);
 		}
 	}
 	abort();
@@ -255,7 +318,7 @@ int journal_dtable::log(const dtype & key, const blob & blob, bool append)
 int journal_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
 {
 	int r;
-	if(key.type != ktype || (ktype == dtype::BLOB && !key.blb.exists()))
+	if(key.type != ktype || (ktype == dtype::BLOB && !key.blb().exists()))
 		return -EINVAL;
 	r = log(key, blob, append);
 	if(r < 0)
@@ -263,6 +326,13 @@ int journal_dtable::insert(const dtype & key, const blob & blob, bool append, AT
 	return set_node(key, blob, append);
 }
 
+int journal_dtable::batch_log(sys_journal::batch * batch, const dtype & key, const blob & blob, bool append)
+{
+	if(key.type != ktype || (ktype == dtype::BLOB && !key.blb().exists()))
+		return -EINVAL;
+	return log(key, blob, append, batch);
+}
+
 int journal_dtable::remove(const dtype & key, ATX_DEF)
 {
 	return insert(key, blob());
@@ -274,8 +344,7 @@ int journal_dtable::init(dtype::ctype key_type, sys_journal::listener_id lid, sy
 		return -EINVAL;
 	if(initialized)
 		deinit();
-	assert(jdt_map.empty());
-	assert(jdt_hash.empty());
+	assert(jdt_mem.empty());
 	assert(!cmp_name);
 	ktype = key_type;
 	set_id(lid);
@@ -297,45 +366,28 @@ int journal_dtable::reinit(sys_journal::listener_id lid)
 		blob_cmp = NULL;
 	}
 	cmp_name = NULL;
-	jdt_hash.clear();
-	jdt_map.clear();
+	jdt_mem.clear();
 	set_id(lid);
 	return 0;
 }
 
 void journal_dtable::deinit()
 {
-	jdt_hash.clear();
-	jdt_map.clear();
+	jdt_mem.clear();
 	initialized = false;
 	dtable::deinit();
 }
 
 int journal_dtable::set_node(const dtype & key, const blob & value, bool append)
 {
-	journal_dtable_hash::value_type hash_pair(key, value);
-	std::pair<journal_dtable_hash::iterator, bool> insert = jdt_hash.insert(hash_pair);
-	if(insert.second)
-	{
-		/* add to map as well */
-		journal_dtable_map::value_type map_pair(key, &insert.first->second);
-		if(append)
-			jdt_map.insert(jdt_map.end(), map_pair);
-		else
-			jdt_map.insert(map_pair);
-	}
-	else
-		/* update value in hash */
-		insert.first->second = value;
-	return 0;
+	return jdt_mem.set(key, value, append);
 }
 
 int journal_dtable::real_rollover(listening_dtable * target) const
 {
-	journal_dtable_hash::const_iterator it;
-	for(it = jdt_hash.begin(); it != jdt_hash.end(); ++it)
+	for(const memtable::node * n = jdt_mem.first(); n; n = n->next_node())
 	{
-		int r = send(target, it->first, it->second);
+		int r = send(target, n->key, n->value());
 		if(r < 0)
 			/* FIXME: we're pretty screwed if this occurs... might be best to abort */
 			return r;
@@ -393,7 +445,7 @@ int journal_dtable::journal_replay(void *& entry, size_t length)
 		{
 			jdt_blob_cmp * name = (jdt_blob_cmp *) entry;
 			istr copy(name->name, name->length);
-			assert(cmp_name || jdt_hash.empty());
+			assert(cmp_name || jdt_mem.empty());
 			if(cmp_name && strcmp(cmp_name, copy))
 				return -EINVAL;
 			cmp_name = copy;
@@ -13,18 +13,26 @@
 #error journal_dtable.h is a C++ header file
 #endif
 
-#include <ext/hash_map>
-#include <ext/pool_allocator.h>
 #include "exception.h"
-#include "avl/map.h"
 
 #include "dtable.h"
+#include "memtable.h"
 #include "sys_journal.h"
 
 /* The journal dtable doesn't have an associated file: all its data is stored in
  * a sys_journal. The only identifying part of journal dtables is their listener
  * ID, which must be chosen to be unique for each new journal dtable. */
 
+/* Since its memtable allows it, one thread may modify a journal dtable while
+ * others look up keys in it and use its iterators, without any locking. (The
+ * journal itself is still only used by the writer.) Nothing may be using it
+ * while it is being reinitialized or deinitialized, as after a digest. */
+
+/* The writer can also take snapshots, which keep seeing the data as of the
+ * memtable sequence number when they were taken, and can then be used by any
+ * thread. They don't copy anything: while any snapshot exists, the memtable
+ * keeps the old versions of values, and it can't be cleared. */
+
 class journal_dtable : public sys_journal::listening_dtable
 {
 public:
@@ -33,15 +41,18 @@ public:
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
 	
 	/* journal_dtable supports size() even though it is not otherwise indexable */
-	inline virtual size_t size() const { return jdt_hash.size(); }
+	inline virtual size_t size() const { return jdt_mem.size(); }
+	inline virtual size_t footprint() const { return jdt_mem.size() + jdt_mem.replaced(); }
+	virtual dtable * snapshot() const;
 	inline virtual bool writable() const { return true; }
 	virtual int insert(const dtype & key, const blob & blob, bool append = false, ATX_OPT);
 	virtual int remove(const dtype & key, ATX_OPT);
+	virtual int batch_log(sys_journal::batch * batch, const dtype & key, const blob & blob, bool append = false);
 	
 	inline virtual int set_blob_cmp(const blob_comparator * cmp)
 	{
 		/* we merely add this assertion, but it's important */
-		assert(jdt_hash.empty() || blob_cmp);
+		assert(jdt_mem.empty() || blob_cmp);
 		return listening_dtable::set_blob_cmp(cmp);
 	}
 	
@@ -64,7 +75,7 @@ public:
 	
 protected:
 	/* journal_dtables should only be constructed by a journal_dtable_warehouse */
-	inline journal_dtable() : initialized(false), jdt_map(blob_cmp), jdt_hash(10, blob_cmp, blob_cmp) {}
+	inline journal_dtable() : initialized(false), jdt_mem(blob_cmp) {}
 	int init(dtype::ctype key_type, sys_journal::listener_id lid, sys_journal * sysj);
 	void deinit();
 	inline virtual ~journal_dtable()
@@ -75,16 +86,12 @@ protected:
 	
 	static bool entry_key_type(const void * entry, size_t length, dtype::ctype * key_type);
 	
-	int log(const dtype & key, const blob & blob, bool append);
-	
-	typedef __gnu_cxx::__pool_alloc<std::pair<const dtype, blob *> > tree_pool_allocator;
-	typedef __gnu_cxx::__pool_alloc<std::pair<const dtype, blob> > hash_pool_allocator;
-	typedef avl::map<dtype, blob *, dtype_comparator_refobject, tree_pool_allocator> journal_dtable_map;
-	typedef __gnu_cxx::hash_map<const dtype, blob, dtype_hashing_comparator, dtype_hashing_comparator, hash_pool_allocator> journal_dtable_hash;
+	/* if batch is not NULL, the entry is added to it instead of the journal */
+	int log(const dtype & key, const blob & blob, bool append, sys_journal::batch * batch = NULL);
 	
 	bool initialized;
-	journal_dtable_map jdt_map;
-	journal_dtable_hash jdt_hash;
+	/* the keys and values, freed all at once when we are digested */
+	memtable jdt_mem;
 	
 private:
 	class iter : public iter_source<journal_dtable>
@@ -101,14 +108,49 @@ private:
 		virtual metablob meta() const;
 		virtual blob value() const;
 		virtual const dtable * source() const;
-		inline iter(const journal_dtable * source) : iter_source<journal_dtable>(source), jit(source->jdt_map.begin()) {}
+		/* by default, see every version */
+		inline iter(const journal_dtable * source, uint64_t sequence = (uint64_t) -1)
+			: iter_source<journal_dtable>(source), sequence(sequence), jit(forward(source->jdt_mem.first()))
+		{
+		}
 		virtual ~iter() {}
 	private:
-		journal_dtable_map::const_iterator jit;
+		/* skip the nodes added after our sequence number */
+		inline const memtable::node * forward(const memtable::node * node) const
+		{
+			memtable::reader reader(dt_source->jdt_mem);
+			while(node && !node->value(sequence))
+				node = node->next_node();
+			return node;
+		}
+		inline const memtable::node * backward(const memtable::node * node) const
+		{
+			memtable::reader reader(dt_source->jdt_mem);
+			while(node && !node->value(sequence))
+				node = node->prev_node();
+			return node;
+		}
+		
+		const uint64_t sequence;
+		/* NULL is past the end */
+		const memtable::node * jit;
+	};
+	
+	class snapshot_dtable : public dtable
+	{
+	public:
+		virtual dtable::iter * iterator(ATX_OPT) const;
+		virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
+		virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+		snapshot_dtable(const journal_dtable * source, uint64_t sequence);
+		virtual ~snapshot_dtable();
+	private:
+		const journal_dtable * jdt;
+		const uint64_t sequence;
 	};
 	
 	int log_blob_cmp();
-	template<class T> inline int log(T * entry, const blob & blob, size_t offset = 0);
+	template<class T> inline int log(T * entry, const blob & blob, size_t offset, sys_journal::batch * batch);
 	int set_node(const dtype & key, const blob & value, bool append);
 	
 	virtual int journal_replay(void *& entry, size_t length);
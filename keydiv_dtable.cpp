@@ -204,6 +204,31 @@ blob keydiv_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return sub[index]->lookup(key, found, atx);
 }
 
+bool keydiv_dtable::key_range(dtype * min, dtype * max) const
+{
+	bool known = false;
+	/* the range of a writable dtable can change at any time */
+	if(writable())
+		return false;
+	for(size_t i = 0; i < sub.size(); i++)
+	{
+		dtype sub_min(0u), sub_max(0u);
+		if(!sub[i]->key_range(&sub_min, &sub_max))
+		{
+			/* empty subtables don't matter, but others might have any keys */
+			if(sub[i]->size())
+				return false;
+			continue;
+		}
+		/* the subtables are in key order */
+		if(!known)
+			*min = sub_min;
+		*max = sub_max;
+		known = true;
+	}
+	return known;
+}
+
 int keydiv_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
 {
 	size_t index = key_index(key);
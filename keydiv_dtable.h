@@ -32,6 +32,7 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual bool key_range(dtype * min, dtype * max) const;
 	
 	inline virtual bool writable() const { return sub[0]->writable(); }
 	
@@ -629,6 +629,31 @@ struct {
 	{"sidtable", "Test smallint dtable functionality.", command_sidtable},
 	{"didtable", "Test deltaint dtable functionality.", command_didtable},
 	{"kddtable", "Test keydiv dtable functionality.", command_kddtable},
+	{"pfdtable", "Test prefix dtable functionality.", command_pfdtable},
+	{"bfcheck", "Test blocked bloom filter accuracy.", command_bfcheck},
+	{"cmdtable", "Test compress dtable functionality.", command_cmdtable},
+	{"cdtable", "Test cache dtable functionality.", command_cdtable},
+	{"rocache", "Test shared rofile block cache.", command_rocache},
+	{"romap", "Test mapped rofile concurrent reads.", command_romap},
+	{"multiget", "Test batched dtable lookups.", command_multiget},
+	{"wbatch", "Test journal write batches.", command_wbatch},
+	{"ingest", "Test managed_dtable bulk ingest.", command_ingest},
+	{"oiter", "Test overlay dtable iterators.", command_oiter},
+	{"fences", "Test overlay dtable key range fences.", command_fences},
+	{"compact", "Test leveled and tiered compaction.", command_compact},
+	{"ptdtable", "Test partition dtable functionality.", command_ptdtable},
+	{"bgpool", "Test the shared background pool.", command_bgpool},
+	{"iolimit", "Test background I/O rate limiting.", command_iolimit},
+	{"mdtread", "Test managed dtable lookups from other threads.", command_mdtread},
+	{"snapshot", "Test managed dtable snapshots.", command_snapshot},
+	{"gcommit", "Test group commit.", command_gcommit},
+	{"txsync", "Test transaction syncing.", command_txsync},
+	{"appendv", "Test vectored appends.", command_appendv},
+	{"jrecycle", "Test recycling of erased journal files.", command_jrecycle},
+	{"jlegacy", "Test recovery of journals in the old format.", command_jlegacy},
+	{"memtable", "Test the journal dtable memtable.", command_memtable},
+	{"cmemtable", "Test concurrent memtable reads.", command_cmemtable},
+	{"blob", "Test inline and shared blobs.", command_blob},
 	{"udtable", "Test unique value dtable functionality.", command_udtable},
 	{"ctable", "Test ctable functionality.", command_ctable},
 	{"cctable", "Test column ctable functionality.", command_cctable},
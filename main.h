@@ -55,6 +55,31 @@ int command_ussdtable(int argc, const char * argv[]);
 int command_sidtable(int argc, const char * argv[]);
 int command_didtable(int argc, const char * argv[]);
 int command_kddtable(int argc, const char * argv[]);
+int command_pfdtable(int argc, const char * argv[]);
+int command_bfcheck(int argc, const char * argv[]);
+int command_cmdtable(int argc, const char * argv[]);
+int command_cdtable(int argc, const char * argv[]);
+int command_rocache(int argc, const char * argv[]);
+int command_romap(int argc, const char * argv[]);
+int command_multiget(int argc, const char * argv[]);
+int command_wbatch(int argc, const char * argv[]);
+int command_ingest(int argc, const char * argv[]);
+int command_oiter(int argc, const char * argv[]);
+int command_fences(int argc, const char * argv[]);
+int command_compact(int argc, const char * argv[]);
+int command_ptdtable(int argc, const char * argv[]);
+int command_bgpool(int argc, const char * argv[]);
+int command_iolimit(int argc, const char * argv[]);
+int command_mdtread(int argc, const char * argv[]);
+int command_snapshot(int argc, const char * argv[]);
+int command_gcommit(int argc, const char * argv[]);
+int command_txsync(int argc, const char * argv[]);
+int command_appendv(int argc, const char * argv[]);
+int command_jrecycle(int argc, const char * argv[]);
+int command_jlegacy(int argc, const char * argv[]);
+int command_memtable(int argc, const char * argv[]);
+int command_cmemtable(int argc, const char * argv[]);
+int command_blob(int argc, const char * argv[]);
 int command_udtable(int argc, const char * argv[]);
 int command_ctable(int argc, const char * argv[]);
 int command_cctable(int argc, const char * argv[]);
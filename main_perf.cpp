@@ -1016,23 +1016,41 @@ static int bfdt_mtrc(dtable * table)
 
 int command_bfdtable(int argc, const char * argv[])
 {
+	bool blocked = (argc > 1) && !strcmp(argv[1], "blocked");
+	const char * name = blocked ? "bfdt_blkd" : "bfdt_perf";
+	char base_name[64];
 	sys_journal * sysj = sys_journal::get_global_journal();
 	params config;
 	dtable * dt;
 	int r;
 	
-	r = params::parse(LITERAL(
-	config [
-		"base" class(dt) bloom_dtable
-		"base_config" config [
-			"bloom_k" int 5
-			"base" class(dt) simple_dtable
-		]
-		"digest_interval" int 120
-		"combine_interval" int 960
-		"combine_count" int 10
-		"autocombine" bool false
-	]), &config);
+	if(blocked)
+		r = params::parse(LITERAL(
+		config [
+			"base" class(dt) bloom_dtable
+			"base_config" config [
+				"bloom_blocked" bool true
+				"bloom_bits" int 10
+				"base" class(dt) simple_dtable
+			]
+			"digest_interval" int 120
+			"combine_interval" int 960
+			"combine_count" int 10
+			"autocombine" bool false
+		]), &config);
+	else
+		r = params::parse(LITERAL(
+		config [
+			"base" class(dt) bloom_dtable
+			"base_config" config [
+				"bloom_k" int 5
+				"base" class(dt) simple_dtable
+			]
+			"digest_interval" int 120
+			"combine_interval" int 960
+			"combine_count" int 10
+			"autocombine" bool false
+		]), &config);
 	EXPECT_NOFAIL("params::parse", r);
 	config.print();
 	printf("\n");
@@ -1113,12 +1131,12 @@ int command_bfdtable(int argc, const char * argv[])
 	
 	r = tx_start();
 	EXPECT_NOFAIL("tx_start", r);
-	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "bfdt_perf", config, dtype::UINT32);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, name, config, dtype::UINT32);
 	EXPECT_NOFAIL("dtable::create", r);
 	r = tx_end(0);
 	EXPECT_NOFAIL("tx_end", r);
 	
-	dt = dtable_factory::load("managed_dtable", AT_FDCWD, "bfdt_perf", config, sysj);
+	dt = dtable_factory::load("managed_dtable", AT_FDCWD, name, config, sysj);
 	EXPECT_NONULL("dtable_factory::load", dt);
 	
 	r = tx_start();
@@ -1145,7 +1163,8 @@ int command_bfdtable(int argc, const char * argv[])
 	dt->destroy();
 	
 	printf("Repeat with direct access...\n");
-	dt = dtable_factory::load("simple_dtable", AT_FDCWD, "bfdt_perf/md_data.0/base", params(), sysj);
+	snprintf(base_name, sizeof(base_name), "%s/md_data.0/base", name);
+	dt = dtable_factory::load("simple_dtable", AT_FDCWD, base_name, params(), sysj);
 	EXPECT_NONULL("dtable_factory::load", dt);
 	bfdt_perf(dt);
 	dt->destroy();
@@ -4,19 +4,33 @@
 
 #define _ATFILE_SOURCE
 
+#include <dirent.h>
 #include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
+#include <map>
+#include <set>
+#include <vector>
+
+#include "md5.h"
 #include "main.h"
 #include "openat.h"
+#include "journal.h"
 #include "transaction.h"
 
 #include "util.h"
 #include "sys_journal.h"
 #include "journal_dtable.h"
+#include "memtable.h"
+#include "rofile.h"
+#include "rwfile.h"
+#include "cache_dtable.h"
 #include "simple_dtable.h"
 #include "managed_dtable.h"
 #include "usstate_dtable.h"
 #include "memory_dtable.h"
+#include "overlay_dtable.h"
 #include "simple_stable.h"
 #include "reverse_blob_comparator.h"
 
@@ -852,6 +866,2561 @@ int command_kddtable(int argc, const char * argv[])
 	return 0;
 }
 
+int command_pfdtable(int argc, const char * argv[])
+{
+	int r;
+	params config, iter_config;
+	dtable * table;
+	dtable::iter * ref_it;
+	dtable::iter * test_it;
+	memory_dtable mdt, shadow;
+	size_t count = 0, checked = 0;
+	bool ok = true;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const dtable_factory * base = dtable_factory::lookup("prefix_dtable");
+	
+	if(argc > 1)
+		count = atoi(argv[1]);
+	if(!count)
+		count = 5000;
+	
+	/* small blocks and restart intervals, to exercise the block boundaries */
+	r = params::parse(LITERAL(
+	config [
+		"block_size" int 256
+		"restart_interval" int 4
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	config.print();
+	printf("\n");
+	
+	mdt.init(dtype::STRING, true);
+	shadow.init(dtype::STRING, true);
+	for(size_t i = 0; i < count; i++)
+	{
+		char key[32], value[32];
+		snprintf(key, sizeof(key), "prefix/key/%06zu", i * 2);
+		if(i % 7 == 3)
+		{
+			/* keep some non-existent entries via the shadow */
+			mdt.remove(key);
+			shadow.insert(key, blob::empty);
+			continue;
+		}
+		snprintf(value, sizeof(value), "value %zu", i);
+		mdt.insert(key, (i % 11) ? blob(value) : blob::empty);
+	}
+	
+	r = base->create(AT_FDCWD, "pfdt_test", config, &mdt, &shadow);
+	EXPECT_NOFAIL("pfdt::create", r);
+	table = base->open(AT_FDCWD, "pfdt_test", config, sysj);
+	EXPECT_NONULL("pfdt::open", table);
+	if(!table)
+		return -1;
+	EXPECT_SIZET("pfdt->size", count, table->size());
+	
+	printf("Checking iteration and lookups... ");
+	fflush(stdout);
+	ref_it = mdt.iterator();
+	test_it = table->iterator();
+	while(ref_it->valid() && ok)
+	{
+		bool found;
+		dtype key = ref_it->key();
+		blob value = ref_it->value();
+		ok = false;
+		if(!test_it->valid() || key.compare(test_it->key()))
+			break;
+		if(value.compare(test_it->value()) || value.exists() != test_it->meta().exists())
+			break;
+		if(value.compare(table->lookup(key, &found)) || !found)
+			break;
+		if(value.compare(table->index(test_it->get_index())))
+			break;
+		/* a key just after this one should not be found, and seek should land on the next key */
+		char missing[40];
+		snprintf(missing, sizeof(missing), "%sa", (const char *) key.str());
+		table->lookup(missing, &found);
+		if(found)
+			break;
+		dtable::iter * seek_it = table->iterator();
+		found = seek_it->seek(missing);
+		if(ref_it->next())
+			ok = !found && seek_it->valid() && !ref_it->key().compare(seek_it->key());
+		else
+			ok = !found && !seek_it->valid();
+		delete seek_it;
+		test_it->next();
+		checked++;
+	}
+	if(ok && !test_it->valid())
+	{
+		/* and backwards again */
+		while(ok && ref_it->prev())
+		{
+			ok = test_it->prev() && !ref_it->key().compare(test_it->key()) && !ref_it->value().compare(test_it->value());
+			checked++;
+		}
+		ok = ok && !test_it->prev();
+	}
+	else
+		ok = false;
+	if(ok)
+		printf("%zu entries OK!\n", checked);
+	else
+		EXPECT_NEVER("failed after %zu entries!", checked);
+	delete test_it;
+	delete ref_it;
+	table->destroy();
+	
+	/* an unreadable block should just make its keys missing */
+	printf("Checking a damaged block... ");
+	fflush(stdout);
+	r = open("pfdt_test", O_WRONLY);
+	EXPECT_NOFAIL("open", r);
+	if(r >= 0)
+	{
+		uint8_t zero[512];
+		memset(zero, 0, sizeof(zero));
+		/* this wipes out the first block's restart count */
+		if(pwrite(r, zero, sizeof(zero), 0) != sizeof(zero))
+			EXPECT_NEVER("pwrite failed");
+		close(r);
+	}
+	table = base->open(AT_FDCWD, "pfdt_test", config, sysj);
+	EXPECT_NONULL("pfdt::open", table);
+	if(!table)
+		return -1;
+	test_it = table->iterator();
+	bool found;
+	table->lookup("prefix/key/000000", &found);
+	if(found || test_it->valid() || test_it->seek("prefix/key/000000") || test_it->valid())
+		EXPECT_NEVER("damaged block was readable!");
+	else
+		printf("OK!\n");
+	delete test_it;
+	table->destroy();
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) prefix_dtable
+		"base_config" config [
+			"block_size" int 64
+			"restart_interval" int 2
+		]
+		"digest_interval" int 2
+	]), &iter_config);
+	EXPECT_NOFAIL("params::parse", r);
+	iter_config.print();
+	printf("\n");
+	
+	iterator_test("managed_dtable", "pfdt_iter", iter_config, 100000, false);
+	
+	return 0;
+}
+
+int command_bfcheck(int argc, const char * argv[])
+{
+	int r, bf_dfd;
+	params config;
+	dtable * table;
+	memory_dtable keys, all;
+	size_t count = 0, missing = 0, positives = 0;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const dtable_factory * bloom = dtable_factory::lookup("bloom_dtable");
+	const dtable_factory * simple = dtable_factory::lookup("simple_dtable");
+	
+	if(argc > 1)
+		count = atoi(argv[1]);
+	if(!count)
+		count = 20000;
+	
+	r = params::parse(LITERAL(
+	config [
+		"bloom_blocked" bool true
+		"bloom_bits" int 10
+		"base" class(dt) simple_dtable
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	config.print();
+	printf("\n");
+	
+	/* only the even keys go into the filter */
+	keys.init(dtype::UINT32, true);
+	all.init(dtype::UINT32, true);
+	for(uint32_t i = 0; i < 2 * count; i++)
+	{
+		if(!(i % 2))
+			keys.insert(i, blob("bloom"));
+		all.insert(i, blob("bloom"));
+	}
+	r = bloom->create(AT_FDCWD, "bfck_test", config, &keys);
+	EXPECT_NOFAIL("bfdt::create", r);
+	
+	/* then swap in a base that has the odd keys too, so that
+	 * any false positives show up as keys that are found */
+	bf_dfd = open("bfck_test", O_RDONLY);
+	EXPECT_NOFAIL("open", bf_dfd);
+	r = util::rm_r(bf_dfd, "base");
+	EXPECT_NOFAIL("rm_r", r);
+	r = simple->create(bf_dfd, "base", params(), &all);
+	EXPECT_NOFAIL("sdt::create", r);
+	close(bf_dfd);
+	
+	table = bloom->open(AT_FDCWD, "bfck_test", config, sysj);
+	EXPECT_NONULL("bfdt::open", table);
+	if(!table)
+		return -1;
+	printf("Checking blocked bloom filter... ");
+	fflush(stdout);
+	for(uint32_t i = 0; i < 2 * count; i++)
+	{
+		bool found;
+		table->present(i, &found);
+		if(i % 2 && found)
+			positives++;
+		else if(!(i % 2) && !found)
+			missing++;
+	}
+	printf("%zu false negatives, %zu false positives (%lg%%)\n", missing, positives, 100 * positives / (double) count);
+	if(missing)
+		EXPECT_NEVER("bloom filter lost keys!");
+	/* about 1% in theory; blocking raises it somewhat */
+	if(positives * 50 > count)
+		EXPECT_NEVER("too many false positives!");
+	table->destroy();
+	
+	return 0;
+}
+
+int command_cmdtable(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	memory_dtable mdt, shadow;
+	size_t count = 0;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const dtable_factory * base = dtable_factory::lookup("compress_dtable");
+	const char * codecs[] = {"lz", "none"};
+	const char * words[] = {"carefully", "final", "deposits", "sleep", "furiously", "quickly", "ironic", "packages"};
+	
+	if(argc > 1)
+		count = atoi(argv[1]);
+	if(!count)
+		count = 20000;
+	
+	/* repetitive text values, like the TPC-H comment columns */
+	mdt.init(dtype::UINT32, true);
+	shadow.init(dtype::UINT32, true);
+	for(size_t i = 0; i < count; i++)
+	{
+		char value[96];
+		size_t length = 0;
+		if(i % 13 == 5)
+		{
+			/* keep some non-existent entries via the shadow */
+			mdt.remove((uint32_t) i);
+			shadow.insert((uint32_t) i, blob::empty);
+			continue;
+		}
+		for(size_t j = 0; j < i % 9; j++)
+			length += snprintf(&value[length], sizeof(value) - length, "%s ", words[(i + j * j) % 8]);
+		mdt.insert((uint32_t) i, blob(length, value));
+	}
+	
+	for(size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); c++)
+	{
+		char name[32];
+		dtable * table;
+		dtable::iter * ref_it;
+		dtable::iter * test_it;
+		size_t checked = 0;
+		struct stat st;
+		bool ok = true;
+		
+		r = params::parse(LITERAL(
+		config [
+			"base" class(dt) simple_dtable
+			"block_size" int 1024
+			"cache_blocks" int 2
+		]), &config);
+		EXPECT_NOFAIL("params::parse", r);
+		config.set("codec", codecs[c]);
+		config.print();
+		printf("\n");
+		
+		snprintf(name, sizeof(name), "cmdt_%s", codecs[c]);
+		r = base->create(AT_FDCWD, name, config, &mdt, &shadow);
+		EXPECT_NOFAIL("cmdt::create", r);
+		table = base->open(AT_FDCWD, name, config, sysj);
+		EXPECT_NONULL("cmdt::open", table);
+		if(!table)
+			return -1;
+		EXPECT_SIZET("cmdt->size", count, table->size());
+		snprintf(name, sizeof(name), "cmdt_%s/data", codecs[c]);
+		if(!stat(name, &st))
+			printf("Value data for codec %s: %zu bytes\n", codecs[c], (size_t) st.st_size);
+		
+		printf("Checking iteration and lookups... ");
+		fflush(stdout);
+		ref_it = mdt.iterator();
+		test_it = table->iterator();
+		while(ref_it->valid() && ok)
+		{
+			bool found;
+			dtype key = ref_it->key();
+			blob value = ref_it->value();
+			ok = false;
+			if(!test_it->valid() || key.compare(test_it->key()))
+				break;
+			if(value.compare(test_it->value()) || value.exists() != test_it->meta().exists())
+				break;
+			if(value.compare(table->lookup(key, &found)) || !found)
+				break;
+			if(value.compare(table->index(checked)))
+				break;
+			ok = true;
+			ref_it->next();
+			test_it->next();
+			checked++;
+		}
+		ok = ok && !test_it->valid();
+		delete test_it;
+		delete ref_it;
+		/* and look up some keys out of order, to go around the cache */
+		for(size_t i = 0; ok && i < count; i++)
+		{
+			bool found, ref_found;
+			uint32_t key = (i * 7919) % count;
+			blob value = table->lookup(key, &found);
+			ok = !value.compare(mdt.lookup(key, &ref_found)) && found == ref_found;
+			checked++;
+		}
+		if(ok)
+			printf("%zu entries OK!\n", checked);
+		else
+			EXPECT_NEVER("failed after %zu entries!", checked);
+		table->destroy();
+	}
+	
+	return 0;
+}
+
+int command_cdtable(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	dtable * table;
+	memory_dtable mdt;
+	size_t hits, misses, checked = 0;
+	const size_t count = 4000;
+	bool ok = true;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	
+	mdt.init(dtype::UINT32, true);
+	for(size_t i = 0; i < count; i++)
+	{
+		char value[32];
+		snprintf(value, sizeof(value), "value %08zu", i);
+		mdt.insert((uint32_t) i, blob(value));
+	}
+	r = dtable_factory::lookup("simple_dtable")->create(AT_FDCWD, "cdt_test", params(), &mdt);
+	EXPECT_NOFAIL("sdt::create", r);
+	
+	/* room for a few hundred entries, so a small hot set stays cached */
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"cache_bytes" int 65536
+		"cache_shards" int 4
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	config.print();
+	printf("\n");
+	table = dtable_factory::load("cache_dtable", AT_FDCWD, "cdt_test", config, sysj);
+	EXPECT_NONULL("dtable_factory::load", table);
+	if(!table)
+		return -1;
+	
+	printf("Checking lookups... ");
+	fflush(stdout);
+	for(size_t i = 0; ok && i < count * 10; i++)
+	{
+		bool found, ref_found;
+		/* every other lookup is to one of 64 hot keys */
+		uint32_t key = (i % 2) ? (i * 7919) % count : (i * 31) % 64;
+		blob value = table->lookup(key, &found);
+		ok = !value.compare(mdt.lookup(key, &ref_found)) && found == ref_found;
+		checked++;
+	}
+	if(ok)
+		printf("%zu lookups OK!\n", checked);
+	else
+		EXPECT_NEVER("failed after %zu lookups!", checked);
+	static_cast<cache_dtable *>(table)->cache_stats(&hits, &misses);
+	EXPECT_SIZET("hits + misses", checked, hits + misses);
+	printf("%zu hits, %zu misses\n", hits, misses);
+	/* the hot keys should nearly always hit */
+	EXPECT_TRUE("hits >= checked / 2 - 64", hits >= checked / 2 - 64);
+	table->destroy();
+	
+	return 0;
+}
+
+int command_rocache(int argc, const char * argv[])
+{
+	int r;
+	memory_dtable mdt;
+	dtable * tables[2];
+	size_t hits, misses, bytes, checked = 0;
+	const size_t count = 20000, budget = 262144;
+	bool ok = true;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const dtable_factory * base = dtable_factory::lookup("simple_dtable");
+	
+	mdt.init(dtype::UINT32, true);
+	for(size_t i = 0; i < count; i++)
+	{
+		char value[48];
+		snprintf(value, sizeof(value), "shared block cache value %08zu", i);
+		mdt.insert((uint32_t) i, blob(value));
+	}
+	r = base->create(AT_FDCWD, "rocache_a", params(), &mdt);
+	EXPECT_NOFAIL("sdt::create", r);
+	r = base->create(AT_FDCWD, "rocache_b", params(), &mdt);
+	EXPECT_NOFAIL("sdt::create", r);
+	
+	/* both tables together are several times larger than the cache */
+	rofile::set_shared_cache(budget);
+	tables[0] = base->open(AT_FDCWD, "rocache_a", params(), sysj);
+	EXPECT_NONULL("sdt::open", tables[0]);
+	tables[1] = base->open(AT_FDCWD, "rocache_b", params(), sysj);
+	EXPECT_NONULL("sdt::open", tables[1]);
+	if(!tables[0] || !tables[1])
+		return -1;
+	
+	printf("Checking lookups... ");
+	fflush(stdout);
+	for(size_t i = 0; ok && i < count * 4; i++)
+	{
+		bool found, ref_found;
+		/* mostly a small hot range, with a scan through the rest */
+		uint32_t key = (i % 4) ? (i * 7919) % 1000 : i / 4;
+		blob value = tables[i % 2]->lookup(key, &found);
+		ok = !value.compare(mdt.lookup(key, &ref_found)) && found == ref_found;
+		checked++;
+	}
+	if(ok)
+		printf("%zu lookups OK!\n", checked);
+	else
+		EXPECT_NEVER("failed after %zu lookups!", checked);
+	rofile::shared_cache_stats(&hits, &misses, &bytes);
+	printf("%zu hits, %zu misses, %zu bytes\n", hits, misses, bytes);
+	EXPECT_TRUE("hits > misses", hits > misses);
+	EXPECT_TRUE("bytes <= budget", bytes <= budget);
+	
+	tables[0]->destroy();
+	tables[1]->destroy();
+	rofile::shared_cache_stats(&hits, &misses, &bytes);
+	EXPECT_SIZET("bytes after close", 0, bytes);
+	rofile::set_shared_cache(0);
+	
+	return 0;
+}
+
+struct romap_state
+{
+	const dtable * strings;
+	const dtable * btree;
+	size_t count, start, failures;
+};
+
+static void * romap_thread(void * arg)
+{
+	romap_state * state = (romap_state *) arg;
+	for(size_t n = 0; n < state->count * 2; n++)
+	{
+		bool found;
+		char key[32], expect[32];
+		size_t i = (state->start + n * 7919) % state->count;
+		snprintf(key, sizeof(key), "romap key %06zu", i);
+		snprintf(expect, sizeof(expect), "value %zu", i);
+		blob value = state->strings->lookup(istr(key), &found);
+		if(!found || value.compare(blob(expect)))
+			state->failures++;
+		/* a longer key with the same prefix is not there */
+		snprintf(key, sizeof(key), "romap key %06zu.", i);
+		state->strings->lookup(istr(key), &found);
+		if(found)
+			state->failures++;
+		value = state->btree->lookup((uint32_t) i, &found);
+		if(!found || value.compare(blob(expect)))
+			state->failures++;
+	}
+	return NULL;
+}
+
+int command_romap(int argc, const char * argv[])
+{
+	int r;
+	params config, sdt_config;
+	rofile * fp;
+	memory_dtable strings, numbers;
+	dtable * tables[2];
+	const size_t count = 20000, threads = 4;
+	pthread_t thread[threads];
+	romap_state state[threads];
+	size_t failures = 0;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const dtable_factory * sdt = dtable_factory::lookup("simple_dtable");
+	const dtable_factory * bt = dtable_factory::lookup("btree_dtable");
+	
+	strings.init(dtype::STRING, true);
+	numbers.init(dtype::UINT32, true);
+	for(size_t i = 0; i < count; i++)
+	{
+		char key[32], value[32];
+		snprintf(key, sizeof(key), "romap key %06zu", i);
+		snprintf(value, sizeof(value), "value %zu", i);
+		strings.insert(istr(key), blob(value));
+		numbers.insert((uint32_t) i, blob(value));
+	}
+	r = params::parse(LITERAL(
+	config [
+		"mapped" bool true
+		"base" class(dt) simple_dtable
+		"base_config" config [
+			"mapped" bool true
+		]
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = params::parse(LITERAL(
+	config [
+		"mapped" bool true
+	]), &sdt_config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = sdt->create(AT_FDCWD, "romap_sdt", sdt_config, &strings);
+	EXPECT_NOFAIL("sdt::create", r);
+	r = bt->create(AT_FDCWD, "romap_bt", config, &numbers);
+	EXPECT_NOFAIL("btdt::create", r);
+	
+	fp = rofile::open_mapped<4>(AT_FDCWD, "romap_sdt");
+	EXPECT_NONULL("rofile::open_mapped", fp);
+	if(!fp)
+		return -1;
+	EXPECT_TRUE("lock_free", fp->lock_free());
+	delete fp;
+	
+	tables[0] = sdt->open(AT_FDCWD, "romap_sdt", sdt_config, sysj);
+	EXPECT_NONULL("sdt::open", tables[0]);
+	tables[1] = bt->open(AT_FDCWD, "romap_bt", config, sysj);
+	EXPECT_NONULL("btdt::open", tables[1]);
+	if(!tables[0] || !tables[1])
+		return -1;
+	
+	for(size_t i = 0; i < threads; i++)
+	{
+		state[i].strings = tables[0];
+		state[i].btree = tables[1];
+		state[i].count = count;
+		state[i].start = i * count / threads;
+		state[i].failures = 0;
+		r = pthread_create(&thread[i], NULL, romap_thread, &state[i]);
+		EXPECT_NOFAIL("pthread_create", r);
+	}
+	printf("Checking concurrent lookups... ");
+	fflush(stdout);
+	for(size_t i = 0; i < threads; i++)
+	{
+		pthread_join(thread[i], NULL);
+		failures += state[i].failures;
+	}
+	if(!failures)
+		printf("OK!\n");
+	else
+		EXPECT_NEVER("%zu lookups failed!", failures);
+	
+	tables[0]->destroy();
+	tables[1]->destroy();
+	
+	return 0;
+}
+
+int command_multiget(int argc, const char * argv[])
+{
+	int r;
+	params config[3];
+	memory_dtable mdt[3];
+	dtable * tables[3];
+	overlay_dtable overlay;
+	const size_t count = 6000, batch = 1500;
+	std::vector<dtype> keys;
+	blob * values;
+	bool * found;
+	size_t checked = 0, hits = 0;
+	bool ok = true;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const char * types[3] = {"simple_dtable", "bloom_dtable", "btree_dtable"};
+	const char * names[3] = {"multiget_a", "multiget_b", "multiget_c"};
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+	]), &config[1]);
+	EXPECT_NOFAIL("params::parse", r);
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+	]), &config[2]);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	/* each table has a different subset of the keys, with its own values */
+	for(size_t t = 0; t < 3; t++)
+	{
+		const dtable_factory * factory = dtable_factory::lookup(types[t]);
+		mdt[t].init(dtype::UINT32, true);
+		for(size_t i = 0; i < count; i++)
+		{
+			char value[32];
+			if((t == 0 && i % 2) || (t == 1 && i % 3))
+				continue;
+			snprintf(value, sizeof(value), "%s %zu", names[t], i);
+			mdt[t].insert((uint32_t) i, blob(value));
+		}
+		r = factory->create(AT_FDCWD, names[t], config[t], &mdt[t]);
+		EXPECT_NOFAIL("dtable::create", r);
+		tables[t] = factory->open(AT_FDCWD, names[t], config[t], sysj);
+		EXPECT_NONULL("dtable::open", tables[t]);
+		if(!tables[t])
+			return -1;
+	}
+	r = overlay.init(tables, 3);
+	EXPECT_NOFAIL("overlay::init", r);
+	
+	/* unsorted, with some duplicates and some keys not in any table */
+	for(size_t i = 0; i < batch; i++)
+		keys.push_back((uint32_t) ((i * 7919) % (count + count / 10)));
+	values = new blob[batch];
+	found = new bool[batch];
+	
+	printf("Checking batched lookups... ");
+	fflush(stdout);
+	for(size_t t = 0; ok && t < 4; t++)
+	{
+		const dtable * dt = (t < 3) ? tables[t] : &overlay;
+		dt->lookup_many(&keys[0], batch, values, found);
+		for(size_t i = 0; ok && i < batch; i++)
+		{
+			bool ref_found;
+			blob value = dt->lookup(keys[i], &ref_found);
+			ok = !value.compare(values[i]) && found[i] == ref_found;
+			hits += found[i];
+			checked++;
+		}
+	}
+	if(ok)
+		printf("%zu lookups (%zu found) OK!\n", checked, hits);
+	else
+		EXPECT_NEVER("failed after %zu lookups!", checked);
+	
+	delete[] found;
+	delete[] values;
+	for(size_t t = 0; t < 3; t++)
+		tables[t]->destroy();
+	
+	return 0;
+}
+
+int command_wbatch(int argc, const char * argv[])
+{
+	int r;
+	sys_journal * sysj;
+	journal_dtable * numbers;
+	journal_dtable * strings;
+	journal_dtable::journal_dtable_warehouse warehouse;
+	sys_journal::listener_id number_id, string_id;
+	sys_journal::batch batch;
+	managed_dtable::write_batch writes;
+	managed_dtable * mdts[2];
+	params config;
+	bool ok = true;
+	const size_t count = 500;
+	
+	/* first test: a batch for two listeners is played back as a whole */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj = sys_journal::spawn_init("batch_journal", &warehouse, NULL, true);
+	EXPECT_NONULL("sysj spawn", sysj);
+	if(!sysj)
+		return -1;
+	number_id = sys_journal::get_unique_id(false);
+	string_id = sys_journal::get_unique_id(false);
+	numbers = warehouse.obtain(number_id, dtype::UINT32, sysj);
+	strings = warehouse.obtain(string_id, dtype::STRING, sysj);
+	for(size_t i = 0; i < count; i++)
+	{
+		char value[32];
+		snprintf(value, sizeof(value), "batch %zu", i);
+		r = numbers->batch_log(&batch, (uint32_t) i, blob(value));
+		if(r >= 0)
+			r = strings->batch_log(&batch, istr(value), blob(value));
+		if(r < 0)
+			break;
+	}
+	EXPECT_NOFAIL("batch_log", r);
+	r = numbers->batch_log(&batch, (uint32_t) 7, blob());
+	EXPECT_NOFAIL("batch_log remove", r);
+	r = sysj->append(&batch);
+	EXPECT_NOFAIL("sysj append", r);
+	EXPECT_SIZET("numbers size", 0, numbers->size());
+	delete sysj;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj = sys_journal::spawn_init("batch_journal", &warehouse, NULL, false);
+	EXPECT_NONULL("sysj spawn", sysj);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	if(!sysj)
+		return -1;
+	numbers = warehouse.lookup(number_id);
+	strings = warehouse.lookup(string_id);
+	EXPECT_NONULL("numbers", numbers);
+	EXPECT_NONULL("strings", strings);
+	if(!numbers || !strings)
+		return -1;
+	EXPECT_SIZET("numbers size", count, numbers->size());
+	EXPECT_SIZET("strings size", count, strings->size());
+	EXPECT_FALSE("removed", numbers->find((uint32_t) 7).exists());
+	EXPECT_TRUE("present", numbers->find((uint32_t) 8).exists());
+	
+	/* discarding one listener must keep the other's entries from the batch */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = strings->discard();
+	EXPECT_NOFAIL("discard", r);
+	r = sysj->filter();
+	EXPECT_NOFAIL("filter", r);
+	delete sysj;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	sysj = sys_journal::spawn_init("batch_journal", &warehouse, NULL, false);
+	EXPECT_NONULL("sysj spawn", sysj);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	if(!sysj)
+		return -1;
+	numbers = warehouse.lookup(number_id);
+	EXPECT_NONULL("numbers", numbers);
+	EXPECT_FALSE("strings", warehouse.lookup(string_id));
+	if(numbers)
+		EXPECT_SIZET("numbers size", count, numbers->size());
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	delete sysj;
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	/* second test: a write batch across two managed dtables */
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"digest_size" int 600
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "wbatch_a", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "wbatch_b", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	mdts[0] = (managed_dtable *) dtable_factory::load("managed_dtable", AT_FDCWD, "wbatch_a", config, sys_journal::get_global_journal());
+	EXPECT_NONULL("dtable::load", mdts[0]);
+	mdts[1] = (managed_dtable *) dtable_factory::load("managed_dtable", AT_FDCWD, "wbatch_b", config, sys_journal::get_global_journal());
+	EXPECT_NONULL("dtable::load", mdts[1]);
+	if(!mdts[0] || !mdts[1])
+		return -1;
+	for(size_t round = 0; round < 3; round++)
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			uint32_t key = round * count + i;
+			writes.insert(mdts[i % 2], key, blob("batched"));
+			if(i % 10 == 3)
+				/* removing a key inserted earlier in the same batch */
+				writes.remove(mdts[(i - 2) % 2], key - 2);
+		}
+		EXPECT_SIZET("batch size", count + count / 10, writes.size());
+		r = writes.commit();
+		EXPECT_NOFAIL("write_batch::commit", r);
+		EXPECT_SIZET("batch size", 0, writes.size());
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	for(size_t key = 0; ok && key < 3 * count; key++)
+	{
+		bool expect = key % 10 != 1;
+		if(mdts[key % 2]->find((uint32_t) key).exists() != expect || mdts[1 - key % 2]->find((uint32_t) key).exists())
+		{
+			EXPECT_NEVER("wrong value for key %zu!", key);
+			ok = false;
+		}
+	}
+	if(ok)
+		printf("%zu keys OK!\n", 3 * count);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	mdts[0]->destroy();
+	mdts[1]->destroy();
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+static bool ingest_check(const dtable * dt, size_t count)
+{
+	/* keys below count were digested, key 5 removed by the ingest, keys
+	 * from count to 2 * count ingested, and key 2 * count is in the journal */
+	for(uint32_t key = 0; key <= 2 * count; key++)
+	{
+		blob value = dt->find(key);
+		const char * expect = (key < count) ? "digested" : (key < 2 * count) ? "ingested" : "journal";
+		if(key == 5 ? value.exists() : (!value.exists() || value.compare(blob(expect))))
+		{
+			EXPECT_NEVER("wrong value for key %u!", key);
+			return false;
+		}
+	}
+	return true;
+}
+
+int command_ingest(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	memory_dtable source;
+	dtable::iter * iter;
+	managed_dtable * mdt;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const uint32_t count = 1000;
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"autocombine" bool false
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "ingest_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	mdt = (managed_dtable *) dtable_factory::load("managed_dtable", AT_FDCWD, "ingest_test", config, sysj);
+	EXPECT_NONULL("dtable::load", mdt);
+	if(!mdt)
+		return -1;
+	for(uint32_t key = 0; key < count; key++)
+	{
+		r = mdt->insert(key, blob("digested"));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+	}
+	r = mdt->digest();
+	EXPECT_NOFAIL("digest", r);
+	r = mdt->insert(2 * count, blob("journal"));
+	EXPECT_NOFAIL("insert", r);
+	
+	source.init(dtype::UINT32);
+	source.insert(2 * count, blob("ingested"));
+	/* the journal entry would shadow the ingested one */
+	iter = source.iterator();
+	r = mdt->ingest(iter);
+	delete iter;
+	EXPECT_FAIL("ingest", r);
+	EXPECT_SIZET("disk dtables", 1, mdt->disk_dtables());
+	
+	source.reinit();
+	for(uint32_t key = count; key < 2 * count; key++)
+		source.insert(key, blob("ingested"));
+	source.remove(5u);
+	iter = source.iterator();
+	r = mdt->ingest(iter);
+	delete iter;
+	EXPECT_NOFAIL("ingest", r);
+	EXPECT_SIZET("disk dtables", 2, mdt->disk_dtables());
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	if(ingest_check(mdt, count))
+		printf("Ingest OK!\n");
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	mdt->destroy();
+	mdt = (managed_dtable *) dtable_factory::load("managed_dtable", AT_FDCWD, "ingest_test", config, sysj);
+	EXPECT_NONULL("dtable::load", mdt);
+	if(!mdt)
+		return -1;
+	if(ingest_check(mdt, count))
+		printf("Reload OK!\n");
+	r = mdt->combine();
+	EXPECT_NOFAIL("combine", r);
+	EXPECT_SIZET("disk dtables", 1, mdt->disk_dtables());
+	if(ingest_check(mdt, count))
+		printf("Combine OK!\n");
+	mdt->destroy();
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+/* the newest (lowest numbered) table with each key, and whether it exists there */
+typedef std::map<uint32_t, std::pair<uint8_t, bool> > oiter_map;
+
+static bool oiter_check(const dtable::iter * iter, const oiter_map::const_iterator & expect)
+{
+	blob value;
+	if(!iter->valid() || iter->key().compare(expect->first))
+		return false;
+	value = iter->value();
+	if(value.exists() != expect->second.second)
+		return false;
+	return !value.exists() || value.index<uint8_t>(0) == expect->second.first;
+}
+
+int command_oiter(int argc, const char * argv[])
+{
+	const size_t table_count = 16;
+	memory_dtable tables[table_count];
+	dtable * array[table_count];
+	overlay_dtable overlay;
+	dtable::iter * iter;
+	oiter_map expect;
+	oiter_map::const_iterator it;
+	size_t count = 0;
+	bool ok = true;
+	int r;
+	
+	for(size_t t = 0; t < table_count; t++)
+	{
+		uint8_t index = t;
+		tables[t].init(dtype::UINT32);
+		for(size_t i = 0; i < 2000; i++)
+		{
+			uint32_t key = rand() % 20000;
+			if(rand() % 8)
+				tables[t].insert(key, blob(sizeof(index), &index));
+			else
+				tables[t].remove(key);
+			/* a later duplicate in the same table replaces the earlier one */
+			if(!expect.count(key) || expect[key].first == index)
+				expect[key] = std::make_pair(index, tables[t].find(key).exists());
+		}
+		array[t] = &tables[t];
+	}
+	r = overlay.init(array, table_count);
+	EXPECT_NOFAIL("overlay::init", r);
+	
+	iter = overlay.iterator();
+	for(it = expect.begin(); ok && it != expect.end(); ++it, iter->next())
+		ok = oiter_check(iter, it);
+	if(ok && iter->valid())
+		ok = false;
+	EXPECT_TRUE("forward scan", ok);
+	
+	iter->last();
+	it = expect.end();
+	do {
+		--it;
+		ok = oiter_check(iter, it);
+		iter->prev();
+	} while(ok && it != expect.begin());
+	EXPECT_TRUE("backward scan", ok);
+	
+	/* change direction and reposition at random, staying within the table */
+	iter->first();
+	it = expect.begin();
+	for(size_t i = 0; ok && i < 100000; i++)
+	{
+		int op = rand() % 64;
+		if(!op)
+		{
+			uint32_t key = rand() % 20000;
+			it = expect.lower_bound(key);
+			if(it == expect.end())
+			{
+				--it;
+				iter->last();
+			}
+			else
+				iter->seek(key);
+		}
+		else if(op < 32 && it != expect.begin())
+		{
+			--it;
+			iter->prev();
+		}
+		else if(++it != expect.end())
+			iter->next();
+		else
+			--it;
+		ok = oiter_check(iter, it);
+		count++;
+	}
+	EXPECT_SIZET("random steps", 100000, count);
+	EXPECT_TRUE("random walk", ok);
+	delete iter;
+	
+	return 0;
+}
+
+int command_fences(int argc, const char * argv[])
+{
+	int r;
+	params config[4];
+	memory_dtable mdt[7];
+	dtable * tables[7];
+	overlay_dtable overlay;
+	const uint32_t span = 1000;
+	std::vector<dtype> keys;
+	blob * values;
+	bool * found;
+	bool ok = true;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const char * types[7] = {"simple_dtable", "simple_dtable", "btree_dtable", "fixed_dtable", "array_dtable", "prefix_dtable", "compress_dtable"};
+	const char * names[7] = {"fences_new", "fences_a", "fences_b", "fences_c", "fences_d", "fences_e", "fences_f"};
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+	]), &config[1]);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	/* the newest table has keys spread over the whole range, while the rest
+	 * cover disjoint key ranges, as if digested from time-ordered keys */
+	for(size_t t = 0; t < 7; t++)
+	{
+		const dtable_factory * factory = dtable_factory::lookup(types[t]);
+		const params & table_config = (t == 2 || t == 6) ? config[1] : config[0];
+		dtype min(0u), max(0u);
+		mdt[t].init(dtype::UINT32, true);
+		for(uint32_t i = 0; i < span; i++)
+		{
+			uint32_t key = t ? (t - 1) * span + i : i * 4 + 2;
+			uint32_t value = key + t;
+			if(!t && i % 3 == 1)
+				mdt[t].remove(key);
+			else
+				mdt[t].insert(key, blob(sizeof(value), &value));
+		}
+		r = factory->create(AT_FDCWD, names[t], table_config, &mdt[t]);
+		EXPECT_NOFAIL("dtable::create", r);
+		tables[t] = factory->open(AT_FDCWD, names[t], table_config, sysj);
+		EXPECT_NONULL("dtable::open", tables[t]);
+		if(!tables[t])
+			return -1;
+		EXPECT_TRUE("key_range", tables[t]->key_range(&min, &max));
+		EXPECT_SIZET("min key", t ? (t - 1) * span : 2, min.u32);
+		EXPECT_SIZET("max key", t ? t * span - 1 : span * 4 - 2, max.u32);
+	}
+	EXPECT_FALSE("memory key_range", mdt[0].key_range(NULL, NULL));
+	r = overlay.init(tables, 7);
+	EXPECT_NOFAIL("overlay::init", r);
+	
+	/* compare with asking each table in turn, including keys out of range */
+	for(uint32_t key = 0; key < span * 7; key++)
+		keys.push_back(key);
+	values = new blob[keys.size()];
+	found = new bool[keys.size()];
+	overlay.lookup_many(&keys[0], keys.size(), values, found);
+	for(uint32_t key = 0; ok && key < span * 7; key++)
+	{
+		bool ref_found = false, ov_found, present;
+		blob ref_value, value;
+		for(size_t t = 0; !ref_found && t < 7; t++)
+			ref_value = tables[t]->lookup(key, &ref_found);
+		value = overlay.lookup(key, &ov_found);
+		present = overlay.present(key, &ov_found);
+		ok = ov_found == ref_found && present == ref_value.exists() && !value.compare(ref_value);
+		ok = ok && found[key] == ref_found && !values[key].compare(ref_value);
+		if(!ok)
+			EXPECT_NEVER("wrong value for key %u!", key);
+	}
+	if(ok)
+		printf("%zu keys OK!\n", keys.size());
+	
+	delete[] found;
+	delete[] values;
+	for(size_t t = 0; t < 7; t++)
+		tables[t]->destroy();
+	
+	return 0;
+}
+
+static int compact_test(const char * name, const params & config, size_t rounds, size_t max_disks)
+{
+	int r;
+	managed_dtable * mdt;
+	size_t most = 0;
+	bool ok = true;
+	const uint32_t per_round = 500;
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, name, config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	mdt = (managed_dtable *) dtable_factory::load("managed_dtable", AT_FDCWD, name, config, sys_journal::get_global_journal());
+	EXPECT_NONULL("dtable::load", mdt);
+	if(!mdt)
+		return -1;
+	for(uint32_t round = 0; round < rounds; round++)
+	{
+		for(uint32_t i = 0; i < per_round; i++)
+		{
+			uint32_t key = round * per_round + i;
+			r = mdt->insert(key, blob(sizeof(key), &key));
+			EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+		}
+		r = mdt->maintain(true);
+		EXPECT_NOFAIL_SILENT_BREAK("maintain", r);
+		if(mdt->disk_dtables() > most)
+			most = mdt->disk_dtables();
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	printf("%zu digests, at most %zu disk dtables, %zu at the end\n", rounds, most, mdt->disk_dtables());
+	if(most > max_disks)
+		EXPECT_NEVER("too many disk dtables!");
+	
+	for(uint32_t key = 0; ok && key < rounds * per_round; key++)
+	{
+		blob value = mdt->find(key);
+		if(!value.exists() || value.index<uint32_t>(0) != key)
+		{
+			EXPECT_NEVER("wrong value for key %u!", key);
+			ok = false;
+		}
+	}
+	if(ok)
+		printf("%zu keys OK!\n", rounds * per_round);
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	mdt->destroy();
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	return 0;
+}
+
+int command_compact(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"compaction" string "leveled"
+		"size_ratio" int 2
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	config.print();
+	printf("\n");
+	compact_test("compact_leveled", config, 32, 4);
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"compaction" string "tiered"
+		"size_ratio" int 3
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	config.print();
+	printf("\n");
+	compact_test("compact_tiered", config, 32, 6);
+	
+	return 0;
+}
+
+int command_ptdtable(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	memory_dtable mdt[2];
+	dtable * tables[2];
+	overlay_dtable overlay;
+	dtable * dt;
+	dtable::iter * iter;
+	dtable::iter * expect;
+	managed_dtable * mdt_test;
+	struct stat st;
+	size_t checked = 0;
+	bool ok = true;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	const char * names[2] = {"ptdt_new", "ptdt_old"};
+	const dtable_factory * simple = dtable_factory::lookup("simple_dtable");
+	const dtable_factory * partition = dtable_factory::lookup("partition_dtable");
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"partitions" int 4
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	
+	/* two overlapping tables, so the partitions have to merge them */
+	for(size_t t = 0; t < 2; t++)
+	{
+		mdt[t].init(dtype::UINT32, true);
+		for(uint32_t i = 0; i < 20000; i++)
+		{
+			uint32_t key = t ? i * 2 : i * 3;
+			uint32_t value = key + t;
+			mdt[t].insert(key, blob(sizeof(value), &value));
+		}
+		r = simple->create(AT_FDCWD, names[t], params(), &mdt[t]);
+		EXPECT_NOFAIL("dtable::create", r);
+		tables[t] = simple->open(AT_FDCWD, names[t], params(), sysj);
+		EXPECT_NONULL("dtable::open", tables[t]);
+		if(!tables[t])
+			return -1;
+	}
+	r = overlay.init(tables, 2);
+	EXPECT_NOFAIL("overlay::init", r);
+	
+	r = partition->create(AT_FDCWD, "ptdt_test", config, &overlay);
+	EXPECT_NOFAIL("partition_dtable::create", r);
+	r = stat("ptdt_test/pdt_data.3", &st);
+	EXPECT_NOFAIL("stat last partition", r);
+	dt = partition->open(AT_FDCWD, "ptdt_test", config, sysj);
+	EXPECT_NONULL("partition_dtable::open", dt);
+	if(!dt)
+		return -1;
+	
+	iter = dt->iterator();
+	expect = overlay.iterator();
+	for(; ok && expect->valid(); expect->next(), iter->next())
+	{
+		bool found;
+		blob value;
+		ok = iter->valid() && !iter->key().compare(expect->key()) && !iter->value().compare(expect->value());
+		value = dt->lookup(expect->key(), &found);
+		ok = ok && found && !value.compare(expect->value());
+		checked++;
+	}
+	ok = ok && !iter->valid();
+	delete expect;
+	delete iter;
+	EXPECT_SIZET("partition_dtable size", checked, dt->size());
+	if(ok)
+		printf("%zu keys OK!\n", checked);
+	else
+		EXPECT_NEVER("failed after %zu keys!", checked);
+	dt->destroy();
+	for(size_t t = 0; t < 2; t++)
+		tables[t]->destroy();
+	
+	/* as the base of a managed_dtable, combines are done in parallel */
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) partition_dtable
+		"base_config" config [
+			"base" class(dt) simple_dtable
+		]
+		"fastbase" class(dt) simple_dtable
+		"autocombine" bool false
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "ptdt_managed", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	mdt_test = (managed_dtable *) dtable_factory::load("managed_dtable", AT_FDCWD, "ptdt_managed", config, sysj);
+	EXPECT_NONULL("dtable::load", mdt_test);
+	if(!mdt_test)
+		return -1;
+	for(uint32_t round = 0; round < 3; round++)
+	{
+		for(uint32_t key = round; key < 30000; key += 3)
+		{
+			r = mdt_test->insert(key, blob(sizeof(round), &round));
+			EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+		}
+		r = mdt_test->digest();
+		EXPECT_NOFAIL("digest", r);
+	}
+	for(uint32_t key = 0; key < 30000; key += 5)
+		mdt_test->remove(key);
+	r = mdt_test->combine();
+	EXPECT_NOFAIL("combine", r);
+	EXPECT_SIZET("disk dtables", 1, mdt_test->disk_dtables());
+	r = stat("ptdt_managed/md_data.3/pdt_data.3", &st);
+	EXPECT_NOFAIL("stat last partition", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	ok = true;
+	for(uint32_t key = 0; ok && key < 30000; key++)
+	{
+		blob value = mdt_test->find(key);
+		if(key % 5 ? (!value.exists() || value.index<uint32_t>(0) != key % 3) : value.exists())
+		{
+			EXPECT_NEVER("wrong value for key %u!", key);
+			ok = false;
+		}
+	}
+	if(ok)
+		printf("Combine OK!\n");
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	mdt_test->destroy();
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+struct bgpool_job : public bg_pool::job
+{
+	virtual void run(bg_token * token)
+	{
+		scopelock scope(*lock);
+		running = true;
+		while(*gate)
+			scope.wait(*wait);
+		order->push_back(id);
+	}
+	bgpool_job(bg_token * token, int id, std::vector<int> * order, bool * gate, init_mutex * lock, init_cond * wait)
+		: bg_pool::job(token), id(id), running(false), order(order), gate(gate), lock(lock), wait(wait)
+	{
+	}
+	int id;
+	bool running;
+	std::vector<int> * order;
+	bool * gate;
+	init_mutex * lock;
+	init_cond * wait;
+};
+
+int command_bgpool(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	bool ok = true;
+	std::vector<int> order;
+	managed_dtable * mdts[8];
+	sys_journal * sysj = sys_journal::get_global_journal();
+	bg_pool * global = bg_pool::get_global_pool();
+	
+	/* the first job holds up the only thread until the rest are queued */
+	{
+		bool gate = true;
+		init_mutex lock;
+		init_cond wait;
+		bg_token tokens[4];
+		bg_pool pool(1);
+		bgpool_job gate_job(&tokens[0], 0, &order, &gate, &lock, &wait);
+		bgpool_job low_job(&tokens[1], 1, &order, &gate, &lock, &wait);
+		bgpool_job normal_job(&tokens[2], 2, &order, &gate, &lock, &wait);
+		bgpool_job high_job(&tokens[3], 3, &order, &gate, &lock, &wait);
+		r = pool.submit(&gate_job, bg_pool::LOW);
+		EXPECT_NOFAIL("submit", r);
+		lock.lock();
+		while(!gate_job.running)
+		{
+			lock.unlock();
+			usleep(10000);
+			lock.lock();
+		}
+		lock.unlock();
+		r = pool.submit(&low_job, bg_pool::LOW);
+		EXPECT_NOFAIL("submit", r);
+		r = pool.submit(&normal_job, bg_pool::NORMAL);
+		EXPECT_NOFAIL("submit", r);
+		r = pool.submit(&high_job, bg_pool::HIGH);
+		EXPECT_NOFAIL("submit", r);
+		EXPECT_SIZET("threads", 1, pool.started());
+		r = pool.set_threads(4);
+		EXPECT_FAIL("set_threads", r);
+		lock.lock();
+		gate = false;
+		wait.broadcast();
+		lock.unlock();
+		while(order.size() < 4)
+			usleep(10000);
+		EXPECT_SIZET("first", 0, order[0]);
+		EXPECT_SIZET("second", 3, order[1]);
+		EXPECT_SIZET("third", 2, order[2]);
+		EXPECT_SIZET("fourth", 1, order[3]);
+	}
+	
+	/* many managed dtables digesting in the background share the pool */
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"autocombine" bool false
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(size_t i = 0; i < 8; i++)
+	{
+		char name[32];
+		sprintf(name, "bgp_test.%zu", i);
+		r = dtable_factory::setup("managed_dtable", AT_FDCWD, name, config, dtype::UINT32);
+		EXPECT_NOFAIL("dtable::create", r);
+		mdts[i] = (managed_dtable *) dtable_factory::load("managed_dtable", AT_FDCWD, name, config, sysj);
+		EXPECT_NONULL("dtable::load", mdts[i]);
+		if(!mdts[i])
+			return -1;
+		for(uint32_t key = 0; key < 1000; key++)
+		{
+			uint32_t value = key + i;
+			r = mdts[i]->insert(key, blob(sizeof(value), &value));
+			EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+		}
+	}
+	for(size_t i = 0; i < 8; i++)
+	{
+		r = mdts[i]->digest(true, true);
+		EXPECT_NOFAIL("digest", r);
+	}
+	/* maintaining only the last one must not leave its job stuck behind
+	 * the others, which are waiting for tokens nobody else is loaning */
+	for(int i = 0; mdts[7]->disk_dtables() < 1; i++)
+	{
+		if(i == 3000)
+		{
+			EXPECT_NEVER("background digest did not finish!");
+			return -1;
+		}
+		mdts[7]->background_loan();
+		usleep(10000);
+	}
+	for(size_t i = 0; i < 8; i++)
+	{
+		r = mdts[i]->background_join();
+		EXPECT_NOFAIL("background_join", r);
+		EXPECT_SIZET("disk dtables", 1, mdts[i]->disk_dtables());
+	}
+	EXPECT_SIZET("pool threads", global->threads(), global->started());
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	for(size_t i = 0; ok && i < 8; i++)
+		for(uint32_t key = 0; ok && key < 1000; key++)
+		{
+			blob value = mdts[i]->find(key);
+			if(!value.exists() || value.index<uint32_t>(0) != key + i)
+			{
+				EXPECT_NEVER("wrong value for key %u in dtable %zu!", key, i);
+				ok = false;
+			}
+		}
+	if(ok)
+		printf("Background digests OK!\n");
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(size_t i = 0; i < 8; i++)
+		mdts[i]->destroy();
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+static int64_t iolimit_usecs(const struct timeval & start)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) * (int64_t) 1000000 + now.tv_usec - start.tv_usec;
+}
+
+int command_iolimit(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	io_limiter limiter;
+	struct timeval start;
+	managed_dtable * mdt;
+	uint8_t data[100];
+	sys_journal * sysj = sys_journal::get_global_journal();
+	
+	/* 64K burst, then 256K more at 1M/sec */
+	limiter.set(1048576, 65536);
+	gettimeofday(&start, NULL);
+	for(int i = 0; i < 20; i++)
+		limiter.consume(16384);
+	EXPECT_TRUE("throttled", iolimit_usecs(start) >= 240000);
+	EXPECT_TRUE("unset", io_limiter::get_current() == NULL);
+	{
+		io_limiter::scope limit(&limiter);
+		EXPECT_TRUE("set", io_limiter::get_current() == &limiter);
+	}
+	EXPECT_TRUE("reset", io_limiter::get_current() == NULL);
+	
+	/* slow foreground operations cut the rate, fast ones restore it */
+	limiter.set(1048576, 0, 100);
+	usleep(110000);
+	limiter.report_latency(10000);
+	EXPECT_SIZET("backoff", 524288, limiter.get_rate());
+	for(int i = 0; i < 64; i++)
+		limiter.report_latency(0);
+	usleep(110000);
+	limiter.report_latency(0);
+	EXPECT_SIZET("recover", 524288 + 65536, limiter.get_rate());
+	
+	/* background digests of managed dtables are throttled */
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"bg_io_rate" int 64
+		"bg_io_burst" int 16
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "iol_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	mdt = (managed_dtable *) dtable_factory::load("managed_dtable", AT_FDCWD, "iol_test", config, sysj);
+	EXPECT_NONULL("dtable::load", mdt);
+	if(!mdt)
+		return -1;
+	for(uint32_t key = 0; key < 1000; key++)
+	{
+		memset(data, key, sizeof(data));
+		r = mdt->insert(key, blob(sizeof(data), data));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+	}
+	gettimeofday(&start, NULL);
+	r = mdt->digest(true, true);
+	EXPECT_NOFAIL("digest", r);
+	r = mdt->background_join();
+	EXPECT_NOFAIL("background_join", r);
+	/* about 100K of data at 64K/sec, after a 16K burst */
+	EXPECT_TRUE("throttled", iolimit_usecs(start) >= 1000000);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	for(uint32_t key = 0; key < 1000; key++)
+	{
+		blob value = mdt->find(key);
+		memset(data, key, sizeof(data));
+		if(!value.exists() || value.size() != sizeof(data) || memcmp(&value[0], data, sizeof(data)))
+		{
+			EXPECT_NEVER("wrong value for key %u!", key);
+			break;
+		}
+	}
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	mdt->destroy();
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+struct mdtread_state
+{
+	const dtable * mdt;
+	const volatile bool * done;
+	uint32_t count, start;
+	size_t lookups, failures;
+};
+
+/* the first count keys are always present; the rest may or may not be yet */
+static void * mdtread_thread(void * arg)
+{
+	mdtread_state * state = (mdtread_state *) arg;
+	uint32_t key = state->start;
+	while(!*state->done)
+	{
+		bool found;
+		key = (key + 7919) % (state->count * 2);
+		blob value = state->mdt->lookup(key, &found);
+		if(found ? (value.size() != sizeof(key) || value.index<uint32_t>(0) != key) : key < state->count)
+			state->failures++;
+		state->lookups++;
+	}
+	return NULL;
+}
+
+int command_mdtread(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	managed_dtable * mdt;
+	const uint32_t count = 20000;
+	const size_t threads = 4;
+	pthread_t thread[threads];
+	mdtread_state state[threads];
+	size_t lookups = 0, failures = 0;
+	volatile bool done = false;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"autocombine" bool false
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "mdtr_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	mdt = (managed_dtable *) dtable_factory::load("managed_dtable", AT_FDCWD, "mdtr_test", config, sysj);
+	EXPECT_NONULL("dtable::load", mdt);
+	if(!mdt)
+		return -1;
+	for(uint32_t key = 0; key < count; key++)
+	{
+		r = mdt->insert(key, blob(sizeof(key), &key));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+	}
+	r = mdt->digest();
+	EXPECT_NOFAIL("digest", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	for(size_t i = 0; i < threads; i++)
+	{
+		state[i].mdt = mdt;
+		state[i].done = &done;
+		state[i].count = count;
+		state[i].start = i * count / threads;
+		state[i].lookups = 0;
+		state[i].failures = 0;
+		r = pthread_create(&thread[i], NULL, mdtread_thread, &state[i]);
+		EXPECT_NOFAIL("pthread_create", r);
+	}
+	printf("Checking lookups from other threads during digests and combines... ");
+	fflush(stdout);
+	/* insert the rest of the keys, digesting and combining along the way */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t key = count; key < count * 2; key++)
+	{
+		r = mdt->insert(key, blob(sizeof(key), &key));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+		if(!(key % 2000) || !(key % 5000))
+		{
+			/* there may or may not be one running */
+			mdt->background_join();
+			if(key % 2000)
+				r = mdt->combine();
+			else
+				r = mdt->digest(true, !(key % 4000));
+			EXPECT_NOFAIL_SILENT_BREAK("combine", r);
+		}
+		else
+			mdt->background_loan();
+	}
+	mdt->background_join();
+	r = mdt->combine();
+	EXPECT_NOFAIL("combine", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	done = true;
+	for(size_t i = 0; i < threads; i++)
+	{
+		pthread_join(thread[i], NULL);
+		lookups += state[i].lookups;
+		failures += state[i].failures;
+	}
+	if(!failures)
+		printf("OK!\n");
+	else
+		EXPECT_NEVER("%zu of %zu lookups failed!", failures, lookups);
+	printf("%zu lookups, %zu disk dtables.\n", lookups, mdt->disk_dtables());
+	
+	for(uint32_t key = 0; key < count * 2; key++)
+	{
+		blob value = mdt->find(key);
+		if(!value.exists() || value.index<uint32_t>(0) != key)
+		{
+			EXPECT_NEVER("wrong value for key %u!", key);
+			break;
+		}
+	}
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	mdt->destroy();
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+struct snapshot_state
+{
+	const dtable * snap;
+	const volatile bool * done;
+	uint32_t count;
+	size_t scans, lookups, failures;
+};
+
+/* what the snapshot should see: the first count keys, the even ones updated */
+static bool snapshot_check(const dtype & key, const blob & value, uint32_t count)
+{
+	uint32_t expect = (key.u32 % 2) ? key.u32 : key.u32 + count;
+	if(key.u32 >= count || value.size() != sizeof(expect))
+		return false;
+	return value.index<uint32_t>(0) == expect;
+}
+
+static void * snapshot_thread(void * arg)
+{
+	snapshot_state * state = (snapshot_state *) arg;
+	uint32_t key = 0;
+	while(!*state->done)
+	{
+		uint32_t index = 0;
+		dtable::iter * iter = state->snap->iterator();
+		for(iter->first(); iter->valid(); iter->next())
+		{
+			if(iter->key().u32 != index++ || !snapshot_check(iter->key(), iter->value(), state->count))
+				state->failures++;
+		}
+		delete iter;
+		if(index != state->count)
+			state->failures++;
+		state->scans++;
+		for(int i = 0; i < 100; i++)
+		{
+			bool found;
+			key = (key + 7919) % (state->count * 2);
+			blob value = state->snap->lookup(key, &found);
+			if(found ? !snapshot_check(key, value, state->count) : key < state->count)
+				state->failures++;
+			state->lookups++;
+		}
+	}
+	return NULL;
+}
+
+int command_snapshot(int argc, const char * argv[])
+{
+	int r;
+	params config;
+	managed_dtable * mdt;
+	dtable * snap;
+	const uint32_t count = 10000;
+	pthread_t thread;
+	snapshot_state state;
+	volatile bool done = false;
+	sys_journal * sysj = sys_journal::get_global_journal();
+	
+	r = params::parse(LITERAL(
+	config [
+		"base" class(dt) simple_dtable
+		"autocombine" bool false
+	]), &config);
+	EXPECT_NOFAIL("params::parse", r);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = dtable_factory::setup("managed_dtable", AT_FDCWD, "mdts_test", config, dtype::UINT32);
+	EXPECT_NOFAIL("dtable::create", r);
+	mdt = (managed_dtable *) dtable_factory::load("managed_dtable", AT_FDCWD, "mdts_test", config, sysj);
+	EXPECT_NONULL("dtable::load", mdt);
+	if(!mdt)
+		return -1;
+	/* some keys on disk, and some updates to them in the journal */
+	for(uint32_t key = 0; key < count; key++)
+	{
+		r = mdt->insert(key, blob(sizeof(key), &key));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+	}
+	r = mdt->digest();
+	EXPECT_NOFAIL("digest", r);
+	for(uint32_t key = 0; key < count; key += 2)
+	{
+		uint32_t value = key + count;
+		r = mdt->insert(key, blob(sizeof(value), &value));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+	}
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	snap = mdt->snapshot();
+	EXPECT_NONULL("snapshot", snap);
+	if(!snap)
+		return -1;
+	state.snap = snap;
+	state.done = &done;
+	state.count = count;
+	state.scans = 0;
+	state.lookups = 0;
+	state.failures = 0;
+	r = pthread_create(&thread, NULL, snapshot_thread, &state);
+	EXPECT_NOFAIL("pthread_create", r);
+	printf("Checking a snapshot during inserts, digests, and combines... ");
+	fflush(stdout);
+	/* change every key, remove some, and add more */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	for(uint32_t key = 0; key < count * 2; key++)
+	{
+		if(key < count && !(key % 3))
+			r = mdt->remove(key);
+		else
+			r = mdt->insert(key, blob(sizeof(key), &key));
+		EXPECT_NOFAIL_SILENT_BREAK("insert", r);
+		if(!(key % 2000) || !(key % 5000))
+		{
+			mdt->background_join();
+			if(key % 2000)
+				r = mdt->combine();
+			else
+				r = mdt->digest(true, !(key % 4000));
+			EXPECT_NOFAIL_SILENT_BREAK("combine", r);
+		}
+		else
+			mdt->background_loan();
+	}
+	mdt->background_join();
+	r = mdt->combine();
+	EXPECT_NOFAIL("combine", r);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	done = true;
+	pthread_join(thread, NULL);
+	if(!state.failures)
+		printf("OK!\n");
+	else
+		EXPECT_NEVER("%zu snapshot reads failed!", state.failures);
+	printf("%zu scans and %zu lookups, %zu disk dtables.\n", state.scans, state.lookups, mdt->disk_dtables());
+	
+	for(uint32_t key = 0; key < count * 2; key++)
+	{
+		bool found;
+		blob value = snap->lookup(key, &found);
+		if(found ? !snapshot_check(key, value, count) : key < count)
+		{
+			EXPECT_NEVER("wrong snapshot value for key %u!", key);
+			break;
+		}
+	}
+	snap->destroy();
+	for(uint32_t key = 0; key < count * 2; key++)
+	{
+		blob value = mdt->find(key);
+		if((key < count && !(key % 3)) ? value.exists() : (!value.exists() || value.index<uint32_t>(0) != key))
+		{
+			EXPECT_NEVER("wrong value for key %u!", key);
+			break;
+		}
+	}
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	mdt->destroy();
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+struct gcommit_sync
+{
+	tx_id id;
+	int result;
+};
+
+static void * gcommit_thread(void * arg)
+{
+	gcommit_sync * sync = (gcommit_sync *) arg;
+	sync->result = tx_sync(sync->id);
+	return NULL;
+}
+
+int command_gcommit(int argc, const char * argv[])
+{
+	int r;
+	tx_fd fd;
+	tx_id ids[8];
+	uint64_t syncs;
+	pthread_t threads[8];
+	gcommit_sync sync[8];
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	fd = tx_open(AT_FDCWD, "gcommit_test", 1);
+	EXPECT_NONULL("tx_open", fd);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	/* one sync covers all the transactions committed before it */
+	for(uint32_t i = 0; i < 3; i++)
+	{
+		r = tx_start();
+		EXPECT_NOFAIL("tx_start", r);
+		r = tx_write(fd, &i, sizeof(i), 0);
+		EXPECT_NOFAIL("tx_write", r);
+		ids[i] = tx_end(1);
+		EXPECT_NOFAIL("tx_end", ids[i]);
+	}
+	syncs = journal::syncs();
+	r = tx_sync(ids[2]);
+	EXPECT_NOFAIL("tx_sync", r);
+	r = tx_sync(ids[0]);
+	EXPECT_NOFAIL("tx_sync", r);
+	r = tx_sync(ids[1]);
+	EXPECT_NOFAIL("tx_sync", r);
+	EXPECT_SIZET("syncs", 1, journal::syncs() - syncs);
+	
+	/* transactions committed during the window join the sync */
+	tx_set_sync_window(200000);
+	syncs = journal::syncs();
+	for(uint32_t i = 0; i < 8; i++)
+	{
+		r = tx_start();
+		EXPECT_NOFAIL("tx_start", r);
+		r = tx_write(fd, &i, sizeof(i), 0);
+		EXPECT_NOFAIL("tx_write", r);
+		sync[i].id = tx_end(1);
+		EXPECT_NOFAIL("tx_end", sync[i].id);
+		sync[i].result = -1;
+		r = pthread_create(&threads[i], NULL, gcommit_thread, &sync[i]);
+		EXPECT_NOFAIL("pthread_create", r);
+	}
+	for(uint32_t i = 0; i < 8; i++)
+	{
+		pthread_join(threads[i], NULL);
+		EXPECT_NOFAIL("tx_sync", sync[i].result);
+	}
+	tx_set_sync_window(0);
+	EXPECT_TRUE("shared syncs", journal::syncs() - syncs < 8);
+	printf("%zu syncs for 8 transactions\n", (size_t) (journal::syncs() - syncs));
+	
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	tx_close(fd);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+int command_txsync(int argc, const char * argv[])
+{
+	int r, fd;
+	tx_fd meta;
+	tx_id id;
+	uint64_t syncs;
+	uint32_t value = 0;
+	
+	EXPECT_TRUE("fdatasync", journal::get_durability() == journal::SYNC_FDATASYNC);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	meta = tx_open(AT_FDCWD, "txsync_meta", 1);
+	EXPECT_NONULL("tx_open", meta);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	fd = open("txsync_data", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	EXPECT_NOFAIL("open", fd);
+	
+	/* a file written outside the transaction, but needed by it */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = pwrite(fd, &value, sizeof(value), 0);
+	EXPECT_SIZET("pwrite", sizeof(value), r);
+	r = tx_add_sync_fd(fd);
+	EXPECT_NOFAIL("tx_add_sync_fd", r);
+	r = tx_add_sync_fd(fd);
+	EXPECT_NOFAIL("tx_add_sync_fd again", r);
+	r = tx_add_sync_fd(-1);
+	EXPECT_FAIL("tx_add_sync_fd bad", r);
+	r = tx_write(meta, &value, sizeof(value), 0);
+	EXPECT_NOFAIL("tx_write", r);
+	id = tx_end(1);
+	EXPECT_NOFAIL("tx_end", id);
+	syncs = journal::syncs();
+	r = tx_sync(id);
+	EXPECT_NOFAIL("tx_sync", r);
+	EXPECT_SIZET("syncs", 1, journal::syncs() - syncs);
+	
+	/* external dependencies are synced when the transaction commits */
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	r = tx_start_external();
+	EXPECT_NOFAIL("tx_start_external", r);
+	value = 1;
+	r = pwrite(fd, &value, sizeof(value), 0);
+	EXPECT_SIZET("pwrite", sizeof(value), r);
+	r = tx_end_external(1);
+	EXPECT_NOFAIL("tx_end_external", r);
+	r = tx_write(meta, &value, sizeof(value), 0);
+	EXPECT_NOFAIL("tx_write", r);
+	id = tx_end(1);
+	EXPECT_NOFAIL("tx_end", id);
+	r = tx_sync(id);
+	EXPECT_NOFAIL("tx_sync", r);
+	
+	close(fd);
+	r = tx_start();
+	EXPECT_NOFAIL("tx_start", r);
+	tx_close(meta);
+	r = tx_end(0);
+	EXPECT_NOFAIL("tx_end", r);
+	
+	return 0;
+}
+
+int command_appendv(int argc, const char * argv[])
+{
+	int r;
+	rwfile file(1);
+	uint32_t header = 0;
+	uint8_t small[100], large[3000], check[3000];
+	struct iovec iov[3];
+	off_t offset = 0;
+	bool ok = true;
+	
+	for(size_t i = 0; i < sizeof(large); i++)
+		large[i] = i * 7;
+	for(size_t i = 0; i < sizeof(small); i++)
+		small[i] = i * 3;
+	r = file.create(AT_FDCWD, "appendv_test");
+	EXPECT_NOFAIL("rwfile::create", r);
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	/* alternate records that fit in the 1K buffer with ones that don't */
+	for(header = 0; header < 10; header++)
+	{
+		size_t size = sizeof(header);
+		iov[1].iov_base = (header & 1) ? large : small;
+		iov[1].iov_len = (header & 1) ? sizeof(large) : sizeof(small);
+		iov[2].iov_base = small;
+		iov[2].iov_len = header * 10;
+		size += iov[1].iov_len + iov[2].iov_len;
+		r = file.appendv(iov, 3);
+		EXPECT_SIZET("rwfile::appendv", size, r);
+	}
+	r = file.flush();
+	EXPECT_NOFAIL("rwfile::flush", r);
+	for(uint32_t i = 0; ok && i < 10; i++)
+	{
+		uint32_t value;
+		size_t size = (i & 1) ? sizeof(large) : sizeof(small);
+		ok = file.read(offset, &value) >= 0 && value == i;
+		offset += sizeof(value);
+		ok = ok && file.read(offset, check, size) == (ssize_t) size && !memcmp(check, (i & 1) ? large : small, size);
+		offset += size;
+		ok = ok && file.read(offset, check, i * 10) == (ssize_t) (i * 10) && !memcmp(check, small, i * 10);
+		offset += i * 10;
+		if(!ok)
+			EXPECT_NEVER("record %u is wrong!", i);
+	}
+	if(ok)
+	{
+		/* more pieces than a single pwritev() takes */
+		struct iovec many[RWFILE_IOV_BATCH * 3 + 1];
+		size_t count = sizeof(many) / sizeof(*many);
+		for(size_t i = 0; i < count; i++)
+		{
+			many[i].iov_base = &large[i * 8];
+			many[i].iov_len = 8;
+		}
+		r = file.appendv(many, count);
+		EXPECT_SIZET("rwfile::appendv", count * 8, r);
+		ok = file.read(offset, check, count * 8) == (ssize_t) (count * 8) && !memcmp(check, large, count * 8);
+		if(!ok)
+			EXPECT_NEVER("batched record is wrong!");
+		offset += count * 8;
+	}
+	EXPECT_SIZET("rwfile::end", (size_t) offset, file.end());
+	if(ok)
+		printf("Records OK!\n");
+	r = file.close();
+	EXPECT_NOFAIL("rwfile::close", r);
+	
+	return 0;
+}
+
+static int jrecycle_count(void * data, size_t length, void * param)
+{
+	(*(int *) param)++;
+	return 0;
+}
+
+static int jrecycle_copy(int dfd, const char * from, const char * to)
+{
+	char buffer[65536];
+	ssize_t size;
+	int in, out, r = 0;
+	in = openat(dfd, from, O_RDONLY);
+	if(in < 0)
+		return in;
+	out = openat(dfd, to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(out < 0)
+	{
+		close(in);
+		return out;
+	}
+	while((size = read(in, buffer, sizeof(buffer))) > 0)
+		if(write(out, buffer, size) != size)
+		{
+			r = -1;
+			break;
+		}
+	close(out);
+	close(in);
+	return (size < 0) ? -1 : r;
+}
+
+/* reopens a copy of a journal, as recovery would, and counts its records; if
+ * lose is not negative, the copy's records from that offset on are zeroed, as
+ * if their commit records had reached the disk but they had not */
+static int jrecycle_recover(int dfd, const char * name, off_t lose = -1)
+{
+	int r, count = 0;
+	journal * j;
+	istr copy = istr(name) + ".copy";
+	r = jrecycle_copy(dfd, name, copy);
+	EXPECT_NOFAIL("copy journal", r);
+	r = jrecycle_copy(dfd, istr(name) + J_COMMIT_NAME, copy + J_COMMIT_NAME);
+	EXPECT_NOFAIL("copy commit records", r);
+	if(lose >= 0)
+	{
+		uint8_t zero[256];
+		int fd = openat(dfd, copy, O_WRONLY);
+		EXPECT_NOFAIL("open journal copy", fd);
+		memset(zero, 0, sizeof(zero));
+		r = pwrite(fd, zero, sizeof(zero), lose);
+		EXPECT_NOFAIL("pwrite", r);
+		close(fd);
+	}
+	r = journal::reopen(dfd, copy, copy + J_COMMIT_NAME, &j, NULL);
+	EXPECT_NOFAIL("journal::reopen", r);
+	EXPECT_NONULL("journal::reopen", j);
+	r = j->playback(jrecycle_count, NULL, &count);
+	EXPECT_NOFAIL("journal::playback", r);
+	r = j->erase();
+	EXPECT_NOFAIL("journal::erase", r);
+	r = j->release();
+	EXPECT_NOFAIL("journal::release", r);
+	return count;
+}
+
+int command_jrecycle(int argc, const char * argv[])
+{
+	int r, dfd, count = 0;
+	off_t lose;
+	std::set<ino_t> recycled;
+	struct dirent * ent;
+	struct stat st;
+	journal * j;
+	DIR * dir;
+	
+	if(journal::get_durability() != journal::SYNC_FDATASYNC)
+	{
+		printf("Journals are only recycled in fdatasync mode.\n");
+		return 0;
+	}
+	dfd = open(".", O_RDONLY);
+	EXPECT_NOFAIL("open", dfd);
+	j = journal::create(dfd, "jrecycle.1", NULL);
+	EXPECT_NONULL("journal::create", j);
+	for(int i = 0; i < 3; i++)
+	{
+		r = j->append("record", 6);
+		EXPECT_NOFAIL("journal::append", r);
+		r = j->commit();
+		EXPECT_NOFAIL("journal::commit", r);
+		r = j->playback(jrecycle_count, NULL, &count);
+		EXPECT_NOFAIL("journal::playback", r);
+	}
+	printf("Played back %d records.\n", count);
+	r = j->erase();
+	EXPECT_NOFAIL("journal::erase", r);
+	r = j->release();
+	EXPECT_NOFAIL("journal::release", r);
+	
+	/* if this test has run before, there may be others besides this one */
+	dir = fdopendir(dup(dfd));
+	EXPECT_NONULL("fdopendir", dir);
+	while((ent = readdir(dir)))
+		if(journal::is_recycled(ent->d_name))
+			recycled.insert(ent->d_ino);
+	closedir(dir);
+	j = journal::create(dfd, "jrecycle.2", NULL);
+	EXPECT_NONULL("journal::create", j);
+	r = fstatat(dfd, "jrecycle.2", &st, 0);
+	EXPECT_NOFAIL("fstatat", r);
+	if(recycled.count(st.st_ino))
+		printf("Journal files reused.\n");
+	else
+		EXPECT_NEVER("new journal does not reuse erased journal files");
+	/* the stale commit records must not count */
+	count = jrecycle_recover(dfd, "jrecycle.2");
+	printf("Recovered %d records before commit.\n", count);
+	r = j->append("new record", 10);
+	EXPECT_NOFAIL("journal::append", r);
+	r = j->commit();
+	EXPECT_NOFAIL("journal::commit", r);
+	count = 0;
+	r = j->playback(jrecycle_count, NULL, &count);
+	EXPECT_NOFAIL("journal::playback", r);
+	count = jrecycle_recover(dfd, "jrecycle.2");
+	printf("Recovered %d records after commit.\n", count);
+	/* losing the records of the last few commits must not lose the others;
+	 * the one record so far takes its length (a size_t) and 10 bytes */
+	lose = sizeof(size_t) + 10;
+	for(int i = 0; i < 2; i++)
+	{
+		r = j->append("lost record", 11);
+		EXPECT_NOFAIL("journal::append", r);
+		r = j->commit();
+		EXPECT_NOFAIL("journal::commit", r);
+		r = j->playback(jrecycle_count, NULL, &count);
+		EXPECT_NOFAIL("journal::playback", r);
+	}
+	count = jrecycle_recover(dfd, "jrecycle.2", lose);
+	printf("Recovered %d records after losing 2 commits.\n", count);
+	if(count != 1)
+		EXPECT_NEVER("the first commit was not recovered");
+	r = j->erase();
+	EXPECT_NOFAIL("journal::erase", r);
+	r = j->release();
+	EXPECT_NOFAIL("journal::release", r);
+	close(dfd);
+	
+	return 0;
+}
+
+static int jlegacy_collect(void * data, size_t length, void * param)
+{
+	((std::vector<istr> *) param)->push_back(istr((const char *) data, length));
+	return 0;
+}
+
+/* an old journal, from before commit records had versions */
+int command_jlegacy(int argc, const char * argv[])
+{
+	/* the old commit record format */
+	struct {
+		off_t offset;
+		size_t length;
+		uint8_t checksum[16];
+	} __attribute__((packed)) cr[3];
+	const char * records[] = {"first", "second", "third", "uncommitted"};
+	/* the commits end after these records */
+	const size_t commit_ends[] = {2, 3};
+	std::vector<istr> played;
+	uint8_t data[256];
+	size_t size = 0, record = 0;
+	int r, dfd, fd;
+	journal * j;
+	
+	dfd = open(".", O_RDONLY);
+	EXPECT_NOFAIL("open", dfd);
+	/* each record is its length (a size_t) followed by its data */
+	for(size_t i = 0; i < sizeof(records) / sizeof(*records); i++)
+	{
+		size_t length = strlen(records[i]);
+		memcpy(&data[size], &length, sizeof(length));
+		memcpy(&data[size + sizeof(length)], records[i], length);
+		size += sizeof(length) + length;
+	}
+	memset(cr, 0, sizeof(cr));
+	for(size_t i = 0; i < sizeof(commit_ends) / sizeof(*commit_ends); i++)
+	{
+		MD5_CTX ctx;
+		cr[i].offset = i ? cr[i - 1].offset + cr[i - 1].length : 0;
+		for(; record < commit_ends[i]; record++)
+			cr[i].length += sizeof(size_t) + strlen(records[record]);
+		MD5Init(&ctx);
+		MD5Update(&ctx, &data[cr[i].offset], cr[i].length);
+		MD5Final(cr[i].checksum, &ctx);
+	}
+	fd = openat(dfd, "jlegacy", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	EXPECT_NOFAIL("create journal", fd);
+	r = write(fd, data, size);
+	EXPECT_SIZET("write", size, r);
+	close(fd);
+	/* the old code renamed this file to count the commits */
+	fd = openat(dfd, "jlegacy" J_COMMIT_EXT "2", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	EXPECT_NOFAIL("create commit records", fd);
+	r = write(fd, cr, sizeof(cr));
+	EXPECT_SIZET("write", sizeof(cr), r);
+	close(fd);
+	
+	r = journal::reopen(dfd, "jlegacy", "jlegacy" J_COMMIT_EXT "2", &j, NULL);
+	EXPECT_NOFAIL("journal::reopen", r);
+	EXPECT_NONULL("journal::reopen", j);
+	r = j->playback(jlegacy_collect, NULL, &played);
+	EXPECT_NOFAIL("journal::playback", r);
+	EXPECT_SIZET("records", 3, played.size());
+	for(size_t i = 0; i < played.size() && i < 3; i++)
+		if(strcmp(played[i].str(), records[i]))
+			EXPECT_NEVER("record %zu is wrong", i);
+	r = j->erase();
+	EXPECT_NOFAIL("journal::erase", r);
+	r = j->release();
+	EXPECT_NOFAIL("journal::release", r);
+	r = faccessat(dfd, "jlegacy", F_OK, 0);
+	EXPECT_FAIL("faccessat journal", r);
+	r = faccessat(dfd, "jlegacy" J_COMMIT_EXT "2", F_OK, 0);
+	EXPECT_FAIL("faccessat commit records", r);
+	close(dfd);
+	
+	return 0;
+}
+
+int command_memtable(int argc, const char * argv[])
+{
+	const blob_comparator * blob_cmp = NULL;
+	memtable table(blob_cmp);
+	const memtable::node * node;
+	uint32_t previous = 0;
+	uint64_t sequence;
+	size_t count = 0;
+	int r;
+	
+	/* every key from 0 to 999, in a scrambled order */
+	for(uint32_t i = 0; i < 1000; i++)
+	{
+		uint32_t key = (i * 337) % 1000;
+		r = table.set(key, blob(sizeof(key), &key));
+		EXPECT_NOFAIL("memtable::set", r);
+	}
+	/* then some that belong at the end, and an overwrite */
+	table.add_snapshot();
+	sequence = table.sequence();
+	for(uint32_t i = 1000; i < 1100; i++)
+	{
+		r = table.set(i, blob(sizeof(i), &i), true);
+		EXPECT_NOFAIL("memtable::set append", r);
+	}
+	r = table.set(500u, blob());
+	EXPECT_NOFAIL("memtable::set overwrite", r);
+	EXPECT_SIZET("memtable::size", 1100, table.size());
+	EXPECT_SIZET("memtable::replaced", 1, table.replaced());
+	
+	for(node = table.first(); node; node = node->next_node())
+	{
+		if(count && node->key.u32 <= previous)
+			EXPECT_NEVER("keys out of order at %u", node->key.u32);
+		if(node->key.u32 != 500 && (!node->value().exists() || node->value().index<uint32_t>(0) != node->key.u32))
+			EXPECT_NEVER("wrong value for %u", node->key.u32);
+		previous = node->key.u32;
+		count++;
+	}
+	EXPECT_SIZET("forward count", 1100, count);
+	for(node = table.last(); node; node = node->prev_node())
+		count--;
+	EXPECT_SIZET("backward count", 0, count);
+	
+	if(!table.find(500u) || table.find(500u)->exists())
+		EXPECT_NEVER("key 500 should be a nonexistent value");
+	if(table.find(1100u))
+		EXPECT_NEVER("key 1100 should not be found");
+	node = table.lower_bound(dtype(1050u));
+	if(!node || node->key.u32 != 1050)
+		EXPECT_NEVER("lower_bound(1050) is wrong");
+	/* the old versions are still there */
+	if(!table.find(500u, sequence) || table.find(500u, sequence)->index<uint32_t>(0) != 500)
+		EXPECT_NEVER("key 500 should have its old value");
+	if(table.find(1050u, sequence))
+		EXPECT_NEVER("key 1050 should not be found in the past");
+	/* without a snapshot, the replaced versions are freed and reused */
+	table.drop_snapshot();
+	r = table.set(500u, blob(sizeof(previous), &previous));
+	EXPECT_NOFAIL("memtable::set overwrite", r);
+	EXPECT_SIZET("memtable::replaced", 0, table.replaced());
+	count = table.memory();
+	r = table.set(500u, blob());
+	EXPECT_NOFAIL("memtable::set overwrite", r);
+	EXPECT_SIZET("memtable::replaced", 0, table.replaced());
+	EXPECT_SIZET("memtable::memory", count, table.memory());
+	if(table.find(500u, sequence))
+		EXPECT_NEVER("key 500 should not have its old value");
+	printf("Memtable OK, using %zu bytes of nodes.\n", table.memory());
+	table.clear();
+	if(!table.empty() || table.first() || table.memory() || table.replaced())
+		EXPECT_NEVER("memtable not empty after clear()");
+	
+	return 0;
+}
+
+struct cmemtable_state
+{
+	const memtable * table;
+	const volatile bool * done;
+	uint32_t count;
+	size_t lookups, scans, failures;
+};
+
+/* every value must be the key itself or, once it has been set again, the key plus count */
+static bool cmemtable_check(const memtable::node * node, uint32_t count)
+{
+	const blob & value = node->value();
+	if(value.size() != sizeof(uint32_t))
+		return false;
+	return value.index<uint32_t>(0) == node->key.u32 || value.index<uint32_t>(0) == node->key.u32 + count;
+}
+
+static void * cmemtable_thread(void * arg)
+{
+	cmemtable_state * state = (cmemtable_state *) arg;
+	uint32_t key = 0;
+	while(!*state->done)
+	{
+		const memtable::node * node;
+		uint32_t previous = 0;
+		bool any = false;
+		/* keep the writer from freeing the versions we find */
+		memtable::reader reader(*state->table);
+		for(int i = 0; i < 100; i++)
+		{
+			key = (key + 7919) % state->count;
+			node = state->table->lower_bound(dtype(key));
+			if(node && (node->key.u32 < key || !cmemtable_check(node, state->count)))
+				state->failures++;
+			state->lookups++;
+		}
+		for(node = state->table->first(); node; node = node->next_node())
+		{
+			if((any && node->key.u32 <= previous) || !cmemtable_check(node, state->count))
+				state->failures++;
+			previous = node->key.u32;
+			any = true;
+		}
+		state->scans++;
+	}
+	return NULL;
+}
+
+int command_cmemtable(int argc, const char * argv[])
+{
+	const blob_comparator * blob_cmp = NULL;
+	memtable table(blob_cmp);
+	const uint32_t count = 20000;
+	const size_t threads = 4;
+	pthread_t thread[threads];
+	cmemtable_state state[threads];
+	size_t lookups = 0, scans = 0, failures = 0;
+	volatile bool done = false;
+	int r;
+	
+	for(size_t i = 0; i < threads; i++)
+	{
+		state[i].table = &table;
+		state[i].done = &done;
+		state[i].count = count;
+		state[i].lookups = 0;
+		state[i].scans = 0;
+		state[i].failures = 0;
+		r = pthread_create(&thread[i], NULL, cmemtable_thread, &state[i]);
+		EXPECT_NOFAIL("pthread_create", r);
+	}
+	printf("Checking concurrent reads during inserts... ");
+	fflush(stdout);
+	/* add every key in a scrambled order, then set them all again */
+	for(uint32_t i = 0; i < count * 2; i++)
+	{
+		uint32_t key = (i * 7717) % count;
+		uint32_t value = (i < count) ? key : key + count;
+		r = table.set(key, blob(sizeof(value), &value));
+		EXPECT_NOFAIL_SILENT_BREAK("memtable::set", r);
+	}
+	done = true;
+	for(size_t i = 0; i < threads; i++)
+	{
+		pthread_join(thread[i], NULL);
+		lookups += state[i].lookups;
+		scans += state[i].scans;
+		failures += state[i].failures;
+	}
+	if(!failures)
+		printf("OK!\n");
+	else
+		EXPECT_NEVER("%zu reads failed!", failures);
+	printf("%zu lookups and %zu scans during %u sets.\n", lookups, scans, count * 2);
+	
+	EXPECT_SIZET("memtable::size", count, table.size());
+	for(uint32_t key = 0; key < count; key++)
+	{
+		const blob * value = table.find(key);
+		if(!value || value->index<uint32_t>(0) != key + count)
+			EXPECT_NEVER("wrong final value for %u", key);
+	}
+	
+	return 0;
+}
+
+int command_blob(int argc, const char * argv[])
+{
+	const char * text = "the quick brown fox jumps over the lazy dog";
+	const size_t sizes[] = {0, 1, 4, 8, BLOB_INLINE_SIZE, BLOB_INLINE_SIZE + 1, 40};
+	blob_buffer buffer;
+	blob none, copy;
+	char high[64];
+	
+	memset(high, '~', sizeof(high));
+	EXPECT_SIZET("sizeof(blob)", BLOB_INLINE_SIZE + 1, sizeof(blob));
+	if(none.exists() || none.size() || none.data() || none.shares())
+		EXPECT_NEVER("nonexistent blob is wrong");
+	for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		blob value(sizes[i], text);
+		/* inline blobs can't be shared, but bigger ones are */
+		size_t shares = (sizes[i] > BLOB_INLINE_SIZE) ? 2 : 1;
+		if(!value.exists() || value.size() != sizes[i] || (sizes[i] && memcmp(value.data(), text, sizes[i])))
+			EXPECT_NEVER("blob of size %zu is wrong", sizes[i]);
+		copy = value;
+		if(copy.compare(value) || copy.shares() != shares || value.shares() != shares)
+			EXPECT_NEVER("copy of blob of size %zu is wrong", sizes[i]);
+		/* assigning a blob to itself must not free it */
+		const blob & alias = copy;
+		copy = alias;
+		if(copy.compare(value) || copy.compare(none) <= 0 || none.compare(copy) >= 0)
+			EXPECT_NEVER("blob of size %zu compares wrong", sizes[i]);
+		if(sizes[i] && (value.compare(blob(sizes[i] - 1, text)) <= 0 || value.compare(blob(sizes[i], high)) >= 0))
+			EXPECT_NEVER("blob of size %zu orders wrong", sizes[i]);
+		/* blob_buffers must not change the blobs they came from */
+		buffer = value;
+		buffer << 'x';
+		if(buffer.size() != sizes[i] + 1 || value.size() != sizes[i] || copy.compare(value))
+			EXPECT_NEVER("blob_buffer from blob of size %zu is wrong", sizes[i]);
+		copy = buffer;
+		if(copy.size() != sizes[i] + 1 || copy[sizes[i]] != 'x' || (sizes[i] && memcmp(copy.data(), text, sizes[i])))
+			EXPECT_NEVER("blob from blob_buffer of size %zu is wrong", sizes[i] + 1);
+	}
+	copy = none;
+	if(copy.exists() || blob::empty.size() || !blob::empty.exists() || blob::dne.exists())
+		EXPECT_NEVER("special blobs are wrong");
+	
+	/* dtypes hold just one kind of value, and let go of it when reassigned */
+	EXPECT_SIZET("sizeof(dtype)", sizeof(long) + sizeof(blob), sizeof(dtype));
+	copy = blob(40, text);
+	{
+		dtype key(copy);
+		dtype other(key);
+		if(copy.shares() != 3 || other.compare(key))
+			EXPECT_NEVER("dtype copy of blob is wrong");
+		other = 6u;
+		key = 2.5;
+		if(copy.shares() != 1 || other.type != dtype::UINT32 || other.u32 != 6 || key.type != dtype::DOUBLE || key.dbl != 2.5)
+			EXPECT_NEVER("dtype reassignment is wrong");
+		key = dtype("fox");
+		other = key;
+		if(other.type != dtype::STRING || strcmp(other.str(), "fox") || other.compare(key))
+			EXPECT_NEVER("dtype copy of string is wrong");
+		other = copy;
+		if(copy.shares() != 2 || other.blb().compare(copy))
+			EXPECT_NEVER("dtype assignment of blob is wrong");
+	}
+	if(copy.shares() != 1)
+		EXPECT_NEVER("dtype did not release blob");
+	printf("Blobs OK!\n");
+	
+	return 0;
+}
+
 struct uniq_insert
 {
 	double key;
@@ -27,13 +27,13 @@ void print(const dtype & x)
 			printf("%lg", x.dbl);
 			break;
 		case dtype::STRING:
-			printf("%s", (const char *) x.str);
+			printf("%s", (const char *) x.str());
 			break;
 		case dtype::BLOB:
-			size_t size = x.blb.size();
+			size_t size = x.blb().size();
 			printf("%zu[", size);
 			for(size_t i = 0; i < size && i < 8; i++)
-				printf("%02X%s", x.blb[i], (i < size - 1) ? " " : "");
+				printf("%02X%s", x.blb()[i], (i < size - 1) ? " " : "");
 			printf((size > 8) ? "...]" : "]");
 			break;
 	}
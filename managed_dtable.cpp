@@ -8,6 +8,8 @@
 #include <fcntl.h>
 #include <assert.h>
 
+#include <algorithm>
+
 #include "openat.h"
 #include "transaction.h"
 
@@ -21,9 +23,10 @@
 int managed_dtable::init(int dfd, const char * name, const params & config, sys_journal * sysj)
 {
 	istr fast_config = "fastbase_config";
+	istr policy;
 	tx_fd meta;
 	off_t meta_off;
-	int r = -1, size;
+	int r = -1, size, io_rate, io_burst, io_latency;
 	if(md_dfd >= 0)
 		deinit();
 	this->sysj = sysj;
@@ -52,6 +55,28 @@ int managed_dtable::init(int dfd, const char * name, const params & config, sys_
 		return -EINVAL;
 	if(!config.get("bg_default", &bg_default, false))
 		return -EINVAL;
+	/* background I/O limits: rate and burst in KiB, latency in microseconds */
+	if(!config.get("bg_io_rate", &io_rate, 0) || io_rate < 0)
+		return -EINVAL;
+	if(!config.get("bg_io_burst", &io_burst, io_rate) || io_burst < 0)
+		return -EINVAL;
+	if(!config.get("bg_io_latency", &io_latency, 0) || io_latency < 0)
+		return -EINVAL;
+	bg_limiter.set(io_rate * (size_t) 1024, io_burst * (size_t) 1024, io_latency);
+	if(!config.get("compaction", &policy, "count") || !policy)
+		return -EINVAL;
+	if(!strcmp(policy, "count"))
+		compaction = COMPACT_COUNT;
+	else if(!strcmp(policy, "leveled"))
+		compaction = COMPACT_LEVELED;
+	else if(!strcmp(policy, "tiered"))
+		compaction = COMPACT_TIERED;
+	else
+		return -EINVAL;
+	/* leveled compaction wants fewer, larger levels than tiered compaction */
+	if(!config.get("size_ratio", &size, (compaction == COMPACT_TIERED) ? 4 : 10) || size < 2)
+		return -EINVAL;
+	size_ratio = size;
 	md_dfd = openat(dfd, name, O_RDONLY);
 	if(md_dfd < 0)
 		return md_dfd;
@@ -126,18 +151,7 @@ int managed_dtable::init(int dfd, const char * name, const params & config, sys_
 	/* no more failure possible */
 	tx_close(meta);
 	
-	/* force array scope to end */
-	{
-		size_t count = header.ddt_count;
-		dtable * array[count + 1];
-		for(size_t i = 0; i < count; i++)
-			array[count - i] = disks[i].disk;
-		array[0] = journal;
-		overlay = new overlay_dtable;
-		overlay->init(array, count + 1);
-	}
-	
-	digest_thread.start();
+	publish();
 	
 	return 0;
 	
@@ -160,10 +174,6 @@ void managed_dtable::deinit()
 	if(bg_digesting)
 		background_join();
 	assert(!bg_digesting);
-	digest_thread.request_stop();
-	/* send a STOP message to the queue */
-	digest_queue.send(digest_msg());
-	digest_thread.wait_for_stop();
 	if(!doomed_dtables.empty())
 	{
 		/* FIXME: handle doomed dtables */
@@ -178,7 +188,12 @@ void managed_dtable::deinit()
 			fprintf(stderr, "%s: digest(%s) failed (%d; %s)\n", __PRETTY_FUNCTION__, close_digest_fastbase ? "true" : "false", r, strerror(errno));
 		}
 	}
-	delete overlay;
+	/* there should be no more readers by now */
+	reclaim();
+	assert(!retired);
+	delete current->overlay;
+	delete current;
+	current = NULL;
 	journal->destroy();
 	for(size_t i = 0; i < disks.size(); i++)
 		disks[i].disk->destroy();
@@ -198,8 +213,8 @@ dtable::iter * managed_dtable::iterator(ATX_DEF) const
 			return NULL;
 		return iterator_chain_usage(&chain, it->second.overlay);
 	}
-	/* returns overlay->iterator() */
-	return iterator_chain_usage(&chain, overlay);
+	/* returns current->overlay->iterator() */
+	return iterator_chain_usage(&chain, current->overlay);
 }
 
 bool managed_dtable::present(const dtype & key, bool * found, ATX_DEF) const
@@ -215,7 +230,10 @@ bool managed_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 		}
 		return it->second.overlay->present(key, found);
 	}
-	return overlay->present(key, found);
+	const version * ver = acquire();
+	bool result = ver->overlay->present(key, found);
+	release(ver);
+	return result;
 }
 
 blob managed_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
@@ -231,7 +249,70 @@ blob managed_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 		}
 		return it->second.overlay->lookup(key, found);
 	}
-	return overlay->lookup(key, found);
+	const version * ver = acquire();
+	if(bg_digesting && bg_limiter.get_latency() && !(lookup_count.inc() % MDT_LATENCY_SAMPLE))
+	{
+		/* let the background I/O limiter know how we're doing */
+		struct timeval start, end;
+		gettimeofday(&start, NULL);
+		blob value = ver->overlay->lookup(key, found);
+		gettimeofday(&end, NULL);
+		release(ver);
+		bg_limiter.report_latency((end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec);
+		return value;
+	}
+	blob value = ver->overlay->lookup(key, found);
+	release(ver);
+	return value;
+}
+
+void managed_dtable::lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	if(atx != NO_ABORTABLE_TX)
+	{
+		atx_map::const_iterator it = open_atx_map.find(atx);
+		if(it == open_atx_map.end())
+		{
+			/* bad abortable transaction ID */
+			for(size_t i = 0; i < count; i++)
+			{
+				values[i] = blob();
+				found[i] = false;
+			}
+			return;
+		}
+		it->second.overlay->lookup_sorted(keys, count, values, found);
+		return;
+	}
+	const version * ver = acquire();
+	ver->overlay->lookup_sorted(keys, count, values, found);
+	release(ver);
+}
+
+dtable * managed_dtable::snapshot() const
+{
+	int r;
+	const version * ver;
+	snapshot_dtable * snap;
+	dtable * view = journal->snapshot();
+	if(!view)
+		return NULL;
+	ver = acquire();
+	snap = new snapshot_dtable(this, ver, view);
+	/* use the dtables of the version we hold, not whatever is current now */
+	{
+		std::vector<dtable *> array(ver->tables);
+		array[0] = view;
+		r = snap->init(&array[0], array.size());
+	}
+	if(r >= 0 && blob_cmp)
+		r = snap->set_blob_cmp(blob_cmp);
+	if(r < 0)
+	{
+		delete snap;
+		return NULL;
+	}
+	return snap;
 }
 
 int managed_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
@@ -248,7 +329,7 @@ int managed_dtable::insert(const dtype & key, const blob & blob, bool append, AT
 		return it->second.journal->insert(key, blob, append);
 	}
 	r = journal->insert(key, blob, append);
-	if(r >= 0 && digest_size && journal->size() >= digest_size)
+	if(r >= 0 && digest_size && journal->footprint() >= digest_size)
 		r = digest();
 	return r;
 }
@@ -267,11 +348,65 @@ int managed_dtable::remove(const dtype & key, ATX_DEF)
 		return it->second.journal->remove(key);
 	}
 	r = journal->remove(key);
-	if(r >= 0 && digest_size && journal->size() >= digest_size)
+	if(r >= 0 && digest_size && journal->footprint() >= digest_size)
 		r = digest();
 	return r;
 }
 
+int managed_dtable::write_batch::insert(managed_dtable * mdt, const dtype & key, const blob & blob, bool append)
+{
+	if(key.type != mdt->key_type() || (key.type == dtype::BLOB && !key.blb().exists()))
+		return -EINVAL;
+	/* unlike managed_dtable::remove(), we can't skip removing keys that are
+	 * not present, since they may be inserted earlier in the same batch */
+	ops.push_back(op(mdt, key, blob, append));
+	return 0;
+}
+
+int managed_dtable::write_batch::commit()
+{
+	int r;
+	sys_journal * sysj;
+	sys_journal::batch record;
+	std::vector<managed_dtable *> touched;
+	if(ops.empty())
+		return 0;
+	sysj = ops[0].mdt->sysj;
+	for(size_t i = 0; i < ops.size(); i++)
+	{
+		if(ops[i].mdt->sysj != sysj)
+			return -EINVAL;
+		r = ops[i].mdt->journal->batch_log(&record, ops[i].key, ops[i].value, ops[i].append);
+		if(r < 0)
+			return r;
+	}
+	r = sysj->append(&record);
+	if(r < 0)
+		return r;
+	/* now update all the journal dtables in one pass */
+	for(size_t i = 0; i < ops.size(); i++)
+	{
+		managed_dtable * mdt = ops[i].mdt;
+		r = mdt->journal->batch_apply(ops[i].key, ops[i].value, ops[i].append);
+		assert(r >= 0);
+		if(std::find(touched.begin(), touched.end(), mdt) == touched.end())
+			touched.push_back(mdt);
+	}
+	ops.clear();
+	r = 0;
+	for(size_t i = 0; i < touched.size(); i++)
+	{
+		managed_dtable * mdt = touched[i];
+		if(mdt->digest_size && mdt->journal->footprint() >= mdt->digest_size)
+		{
+			int value = mdt->digest();
+			if(value < 0)
+				r = value;
+		}
+	}
+	return r;
+}
+
 abortable_tx managed_dtable::create_tx()
 {
 	int r;
@@ -296,7 +431,9 @@ abortable_tx managed_dtable::create_tx()
 	
 	state->overlay = new overlay_dtable;
 	assert(state->overlay);
-	r = state->overlay->init(state->journal, overlay, NULL);
+	/* look through to ourselves, rather than to the current version, so
+	 * that the transaction keeps seeing our data after combines */
+	r = state->overlay->init(state->journal, this, NULL);
 	assert(r >= 0);
 	if(blob_cmp)
 		state->overlay->set_blob_cmp(blob_cmp);
@@ -365,7 +502,7 @@ int managed_dtable::set_blob_cmp(const blob_comparator * cmp)
 	if(value < 0)
 		return value;
 	/* if we get here, everything else should work fine */
-	value = overlay->set_blob_cmp(cmp);
+	value = current->overlay->set_blob_cmp(cmp);
 	assert(value >= 0);
 	value = journal->set_blob_cmp(cmp);
 	assert(value >= 0);
@@ -387,8 +524,7 @@ int managed_dtable::combine(size_t first, size_t last, bool use_fastbase, bool b
 	{
 		digest_msg msg;
 		msg.init_combine(first, last, use_fastbase);
-		digest_queue.send(msg);
-		bg_digesting = true;
+		r = digest_submit(msg);
 	}
 	else
 	{
@@ -408,7 +544,10 @@ int managed_dtable::combine(size_t first, size_t last, bool use_fastbase, T * to
 	if(r < 0)
 		return r;
 	holds = scope.full_release();
-	r = worker.run();
+	{
+		io_limiter::scope limit(token_limiter(token));
+		r = worker.run();
+	}
 	scope.full_acquire(holds);
 	if(r < 0)
 		/* will call worker.fail() */
@@ -416,6 +555,99 @@ int managed_dtable::combine(size_t first, size_t last, bool use_fastbase, T * to
 	return worker.finish();
 }
 
+int managed_dtable::ingest(dtable::iter * source, bool use_fastbase)
+{
+	const dtable_factory * factory = use_fastbase ? fastbase : base;
+	const params & config = use_fastbase ? fastbase_config : base_config;
+	overlay_dtable * shadow = NULL;
+	dtable * result;
+	bool first = true;
+	dtype last(0u);
+	char name[32];
+	int r;
+	
+	if(bg_digesting)
+		return -EBUSY;
+	/* can't check the key order if we don't have the requisite comparator */
+	if(cmp_name && !blob_cmp)
+		return -EBUSY;
+	if(source->key_type() != ktype)
+		return -EINVAL;
+	
+	/* the keys must be sorted, and newer journal entries must not shadow them */
+	for(source->first(); source->valid(); source->next())
+	{
+		dtype key = source->key();
+		if(!first && last.compare(key, blob_cmp) >= 0)
+			return -EINVAL;
+		if(journal->contains(key))
+			return -EEXIST;
+		last = key;
+		first = false;
+	}
+	
+	/* the existing disk dtables shadow any non-existent entries in the source */
+	if(disks.size())
+	{
+		dtable * array[disks.size()];
+		for(size_t i = 0; i < disks.size(); i++)
+			array[disks.size() - i - 1] = disks[i].disk;
+		shadow = new overlay_dtable;
+		shadow->init(array, disks.size());
+		if(blob_cmp)
+			shadow->set_blob_cmp(blob_cmp);
+	}
+	
+	sprintf(name, "md_data.%u", header.ddt_next);
+	/* make the current transaction depend on having written the new file */
+	r = tx_start_external();
+	if(r < 0)
+		goto fail_create;
+	/* there might be one around from a previous failed ingest */
+	util::rm_r(md_dfd, name);
+	r = factory->create(md_dfd, name, config, source, shadow);
+	tx_end_external(r >= 0);
+	if(r < 0)
+		goto fail_create;
+	if(shadow)
+	{
+		delete shadow;
+		shadow = NULL;
+	}
+	
+	result = factory->open(md_dfd, name, config, sysj);
+	if(!result)
+	{
+		r = -1;
+		goto fail_create;
+	}
+	if(blob_cmp)
+		result->set_blob_cmp(blob_cmp);
+	disks.push_back(dtable_list_entry(result, header.ddt_next, use_fastbase));
+	header.ddt_count++;
+	header.ddt_next++;
+	
+	r = write_meta(disks);
+	if(r < 0)
+	{
+		disks.pop_back();
+		header.ddt_count--;
+		header.ddt_next--;
+		result->destroy();
+		goto fail_create;
+	}
+	
+	publish();
+	
+	return 0;
+
+fail_create:
+	if(shadow)
+		delete shadow;
+	util::rm_r(md_dfd, name);
+	return r;
+}
+
 /* set up the source and shadow overlay dtables */
 int managed_dtable::combiner::prepare(bool shift_journal)
 {
@@ -441,7 +673,7 @@ int managed_dtable::combiner::prepare(bool shift_journal)
 		assert(mdt->header.journal_id != sys_journal::NO_ID);
 		mdt->header.ddt_count++;
 		
-		r = write_meta(mdt->disks);
+		r = mdt->write_meta(mdt->disks);
 		if(r < 0)
 		{
 			dtable_list_entry orig = mdt->disks.back();
@@ -456,22 +688,7 @@ int managed_dtable::combiner::prepare(bool shift_journal)
 		if(mdt->blob_cmp)
 			mdt->journal->set_blob_cmp(mdt->blob_cmp);
 		
-		/* force array scope to end */
-		{
-			dtable * array[mdt->header.ddt_count + 1];
-			for(uint32_t i = 0; i < mdt->header.ddt_count; i++)
-				array[mdt->header.ddt_count - i] = mdt->disks[i].disk;
-			array[0] = mdt->journal;
-			if(mdt->overlay->in_use())
-			{
-				doomed_dtable * doomed = new doomed_dtable(mdt, mdt->overlay);
-				mdt->doomed_dtables.insert(doomed);
-				mdt->overlay = new overlay_dtable;
-			}
-			mdt->overlay->init(array, mdt->header.ddt_count + 1);
-			if(mdt->blob_cmp)
-				mdt->overlay->set_blob_cmp(mdt->blob_cmp);
-		}
+		mdt->publish();
 		
 		/* now it should look like we're not digesting the journal after all */
 		assert(last < mdt->disks.size());
@@ -539,7 +756,7 @@ int managed_dtable::combiner::run() const
 int managed_dtable::combiner::finish()
 {
 	sys_journal::listener_id old_id = sys_journal::NO_ID;
-	dtable_list copy;
+	dtable_list copy, replaced;
 	dtable * result;
 	int r;
 	
@@ -574,7 +791,7 @@ int managed_dtable::combiner::finish()
 	mdt->header.ddt_count = copy.size();
 	mdt->header.ddt_next++;
 	
-	r = write_meta(copy);
+	r = mdt->write_meta(copy);
 	if(r < 0)
 	{
 		mdt->header.ddt_next--;
@@ -588,75 +805,35 @@ int managed_dtable::combiner::finish()
 	
 	mdt->disks.swap(copy);
 	
-	/* unlink the source files in the transaction, which depends on writing the new data */
+	/* readers may still be using the source dtables, so they are only
+	 * destroyed (and their files unlinked) once the version is reclaimed */
 	if(last != (size_t) -1)
 		for(size_t i = first; i <= last; i++)
-		{
-			if(copy[i].disk->in_use())
-			{
-				doomed_dtable * doomed;
-				if(copy[i].type == MDTE_TYPE_JOURNAL)
-					doomed = new doomed_dtable(mdt, copy[i].journal);
-				else
-					doomed = new doomed_dtable(mdt, copy[i].disk, copy[i].ddt_number);
-				mdt->doomed_dtables.insert(doomed);
-			}
-			else if(copy[i].type == MDTE_TYPE_JOURNAL)
-				/* also destroys it */
-				copy[i].journal->discard();
-			else
-			{
-				copy[i].disk->destroy();
-				sprintf(name, "md_data.%u", copy[i].ddt_number);
-				/* recursive unlink */
-				tx_unlink(mdt->md_dfd, name, 1);
-			}
-		}
-	
-	/* force array scope to end */
-	{
-		dtable * array[mdt->header.ddt_count + 1];
-		for(uint32_t i = 0; i < mdt->header.ddt_count; i++)
-			array[mdt->header.ddt_count - i] = mdt->disks[i].disk;
-		array[0] = mdt->journal;
-		if(mdt->overlay->in_use())
-		{
-			doomed_dtable * doomed = new doomed_dtable(mdt, mdt->overlay);
-			mdt->doomed_dtables.insert(doomed);
-			mdt->overlay = new overlay_dtable;
-		}
-		mdt->overlay->init(array, mdt->header.ddt_count + 1);
-		if(mdt->blob_cmp)
-			mdt->overlay->set_blob_cmp(mdt->blob_cmp);
-	}
+			replaced.push_back(copy[i]);
 	
 	if(reset_journal)
 	{
-		if(mdt->journal->in_use())
-		{
-			doomed_dtable * doomed = new doomed_dtable(mdt, mdt->journal);
-			/* FIXME: we can actually discard the sysj entries now, as long as we keep them in memory */
-			mdt->doomed_dtables.insert(doomed);
-			mdt->journal = mdt->sysj->warehouse_obtain(mdt->header.journal_id, mdt->ktype);
-		}
-		else
-			mdt->journal->reinit(mdt->header.journal_id);
+		/* likewise, the journal dtable can't be reinitialized in place */
+		replaced.push_back(dtable_list_entry(mdt->journal, old_id));
+		mdt->journal = mdt->sysj->warehouse_obtain(mdt->header.journal_id, mdt->ktype);
 		if(mdt->blob_cmp)
 			mdt->journal->set_blob_cmp(mdt->blob_cmp);
 	}
 	
+	mdt->publish(replaced);
+	
 	return 0;
 }
 
 /* actually write the md_meta file */
-int managed_dtable::combiner::write_meta(const dtable_list & list) const
+int managed_dtable::write_meta(const dtable_list & list) const
 {
-	tx_fd fd = tx_open(mdt->md_dfd, "md_meta", 0);
+	tx_fd fd = tx_open(md_dfd, "md_meta", 0);
 	if(!fd)
 		return -1;
 	
 	/* TODO: really the file should be truncated, but it's not important */
-	int r = tx_write(fd, &mdt->header, sizeof(mdt->header), 0);
+	int r = tx_write(fd, &header, sizeof(header), 0);
 	if(r < 0)
 	{
 		tx_close(fd);
@@ -665,8 +842,8 @@ int managed_dtable::combiner::write_meta(const dtable_list & list) const
 	
 	/* force array scope to end */
 	{
-		mdtable_entry array[mdt->header.ddt_count];
-		for(uint32_t i = 0; i < mdt->header.ddt_count; i++)
+		mdtable_entry array[header.ddt_count];
+		for(uint32_t i = 0; i < header.ddt_count; i++)
 		{
 			if(list[i].type == MDTE_TYPE_JOURNAL)
 			{
@@ -680,7 +857,7 @@ int managed_dtable::combiner::write_meta(const dtable_list & list) const
 			}
 		}
 		/* hmm... would sizeof(array) work here? */
-		r = tx_write(fd, array, mdt->header.ddt_count * sizeof(array[0]), sizeof(mdt->header));
+		r = tx_write(fd, array, header.ddt_count * sizeof(array[0]), sizeof(header));
 		if(r < 0)
 		{
 			/* umm... we are screwed? */
@@ -694,6 +871,108 @@ int managed_dtable::combiner::write_meta(const dtable_list & list) const
 	return 0;
 }
 
+const managed_dtable::version * managed_dtable::acquire() const
+{
+	const version * ver;
+	acquiring.inc();
+	ver = *(version * const volatile *) &current;
+	ver->refs.inc();
+	acquiring.dec();
+	return ver;
+}
+
+/* make a new version from the current constituent dtables, and retire the old one */
+void managed_dtable::publish(const dtable_list & replaced)
+{
+	version * ver = new version;
+	ver->tables.resize(header.ddt_count + 1);
+	for(uint32_t i = 0; i < header.ddt_count; i++)
+		ver->tables[header.ddt_count - i] = disks[i].disk;
+	ver->tables[0] = journal;
+	ver->overlay = new overlay_dtable;
+	ver->overlay->init(&ver->tables[0], ver->tables.size());
+	if(blob_cmp)
+		ver->overlay->set_blob_cmp(blob_cmp);
+	if(current)
+	{
+		current->replaced = replaced;
+		current->next = retired;
+		retired = current;
+	}
+	else
+		assert(replaced.empty());
+	/* the new version must be complete before readers can see it */
+	__sync_synchronize();
+	*(version * volatile *) &current = ver;
+	reclaim();
+}
+
+/* get rid of the retired versions that no reader can be using */
+void managed_dtable::reclaim()
+{
+	version ** link = &retired;
+	/* the dtables replaced when newer versions were retired may also be
+	 * part of older ones, so they go with the next older version we keep */
+	dtable_list pending;
+	if(!retired || acquiring.get())
+		return;
+	while(*link)
+	{
+		version * ver = *link;
+		if(ver->refs.get())
+		{
+			for(size_t i = 0; i < pending.size(); i++)
+				ver->replaced.push_back(pending[i]);
+			pending.clear();
+			link = &ver->next;
+			continue;
+		}
+		*link = ver->next;
+		if(ver->overlay->in_use())
+		{
+			doomed_dtable * doomed = new doomed_dtable(this, ver->overlay);
+			doomed_dtables.insert(doomed);
+		}
+		else
+			delete ver->overlay;
+		for(size_t i = 0; i < ver->replaced.size(); i++)
+			pending.push_back(ver->replaced[i]);
+		delete ver;
+	}
+	for(size_t i = 0; i < pending.size(); i++)
+		dispose(pending[i]);
+}
+
+/* destroy a dtable that is no longer part of any version, or doom it if it is in use */
+void managed_dtable::dispose(const dtable_list_entry & entry)
+{
+	char name[32];
+	if(entry.disk->in_use())
+	{
+		doomed_dtable * doomed;
+		if(entry.type == MDTE_TYPE_JOURNAL)
+			doomed = new doomed_dtable(this, entry.journal);
+		else
+			doomed = new doomed_dtable(this, entry.disk, entry.ddt_number);
+		doomed_dtables.insert(doomed);
+		return;
+	}
+	/* make sure we have a transaction; usually we are already in one,
+	 * which depends on having written the dtable that replaced this one */
+	tx_start_r();
+	if(entry.type == MDTE_TYPE_JOURNAL)
+		/* also destroys it */
+		entry.journal->discard();
+	else
+	{
+		entry.disk->destroy();
+		sprintf(name, "md_data.%u", entry.ddt_number);
+		/* recursive unlink */
+		tx_unlink(md_dfd, name, 1);
+	}
+	tx_end_r();
+}
+
 void managed_dtable::combiner::fail()
 {
 	if(source)
@@ -711,11 +990,17 @@ void managed_dtable::background_loan()
 	if(bg_digesting)
 	{
 		reply_msg reply;
-		if(digest_thread.wants_token())
-			digest_thread.loan_token();
+		if(digest_token.wanted())
+			digest_token.try_loan();
 		if(reply_queue.try_receive(&reply))
 			bg_digesting = false;
 	}
+	/* the pool's workers may all be waiting for the tokens of other
+	 * managed dtables, which would hold up everybody's jobs (ours too)
+	 * if those dtables are not otherwise being maintained; see join */
+	bg_pool::get_global_pool()->loan_tokens();
+	/* versions retired while readers were using them can go now */
+	reclaim();
 }
 
 int managed_dtable::background_join()
@@ -723,38 +1008,57 @@ int managed_dtable::background_join()
 	if(!bg_digesting)
 		return -EBUSY;
 	reply_msg reply;
+	bg_pool * pool = bg_pool::get_global_pool();
 	while(!reply_queue.try_receive(&reply))
 	{
-		if(digest_thread.wants_token())
-			digest_thread.loan_token();
+		/* our job may be queued behind jobs of other managed
+		 * dtables that are waiting for their tokens, so loan
+		 * them all rather than just our own */
+		if(digest_token.wanted())
+			digest_token.try_loan();
 		else
+		{
+			pool->loan_tokens();
 			usleep(50000); /* 1/20 sec */
+		}
 	}
 	bg_digesting = false;
 	return reply.return_value;
 }
 
-void managed_dtable::digest_thread_main(bg_token * token)
+int managed_dtable::digest_submit(const digest_msg & msg)
 {
-	while(!digest_thread.stop_requested())
+	bg_pool::priority priority = bg_pool::NORMAL;
+	if(msg.type == digest_msg::COMBINE)
 	{
-		reply_msg reply;
-		digest_msg message;
-		digest_queue.receive(&message);
-		switch(message.type)
-		{
-			case digest_msg::COMBINE:
-				reply.return_value = combine(message.combine.first, message.combine.last, message.combine.use_fastbase, token);
-				reply_queue.send(reply);
-				break;
-			case digest_msg::MAINTAIN:
-				reply.return_value = maintain(message.maintain.force, token);
-				reply_queue.send(reply);
-				break;
-			case digest_msg::STOP:
-				/* fall out */ ;
-		}
+		/* digests keep the journal small, so they go first; other
+		 * combines can wait until there is nothing else to do */
+		bool digest = msg.combine.first == disks.size() && msg.combine.last == disks.size();
+		priority = digest ? bg_pool::HIGH : bg_pool::LOW;
 	}
+	bg_job.message = msg;
+	int r = bg_pool::get_global_pool()->submit(&bg_job, priority);
+	if(r >= 0)
+		bg_digesting = true;
+	return r;
+}
+
+void managed_dtable::digest_job::run(bg_token * token)
+{
+	switch(message.type)
+	{
+		case digest_msg::COMBINE:
+			reply.return_value = mdt->combine(message.combine.first, message.combine.last, message.combine.use_fastbase, token);
+			break;
+		case digest_msg::MAINTAIN:
+			reply.return_value = mdt->maintain(message.maintain.force, token);
+			break;
+	}
+}
+
+void managed_dtable::digest_job::done()
+{
+	mdt->reply_queue.send(reply);
 }
 
 void managed_dtable::doomed_dtable::invoke()
@@ -809,8 +1113,69 @@ int managed_dtable::maintain_autocombine(T * token)
 	return 0;
 }
 
+/* the number of bytes used by a disk dtable, or 0 for shifted journal dtables */
+off_t managed_dtable::disk_size(size_t index) const
+{
+	char name[32];
+	off_t size;
+	if(disks[index].type == MDTE_TYPE_JOURNAL)
+		return 0;
+	sprintf(name, "md_data.%u", disks[index].ddt_number);
+	size = util::du(md_dfd, name);
+	return (size < 0) ? 0 : size;
+}
+
+/* Leveled compaction keeps each disk dtable at least size_ratio times larger
+ * than all the newer ones put together, by combining the oldest one for which
+ * that does not hold with all the newer ones, until it holds for all of them;
+ * there are then only logarithmically many disk dtables. Tiered compaction instead waits for size_ratio dtables of
+ * similar size to collect at the newest end and combines them into one, which
+ * writes the data fewer times at the cost of having more dtables to read. */
+template<class T>
+int managed_dtable::maintain_compaction(T * token)
+{
+	scopetoken<T> scope(token);
+	for(;;)
+	{
+		size_t count = disks.size();
+		size_t first = count - 1;
+		std::vector<off_t> sizes(count);
+		int r;
+		if(count < 2)
+			return 0;
+		/* du() walks the whole directory, so do it once per disk dtable */
+		for(size_t i = 0; i < count; i++)
+			sizes[i] = disk_size(i);
+		if(compaction == COMPACT_LEVELED)
+		{
+			off_t newer = 0;
+			first = count;
+			for(size_t i = count - 1; i > 0; i--)
+			{
+				newer += sizes[i];
+				if(sizes[i - 1] < newer * (off_t) size_ratio)
+					first = i - 1;
+			}
+			if(first == count)
+				return 0;
+		}
+		else
+		{
+			while(first && sizes[first - 1] < sizes[count - 1] * (off_t) size_ratio)
+				first--;
+			if(count - first < size_ratio)
+				return 0;
+		}
+		/* will rewrite header for us! */
+		r = combine(first, count - 1, false, token);
+		if(r < 0)
+			return r;
+	}
+}
+
 int managed_dtable::maintain(bool force, bool background)
 {
+	reclaim();
 	if(bg_digesting)
 	{
 		/* sync with the background thread and finish its work first */
@@ -824,8 +1189,7 @@ int managed_dtable::maintain(bool force, bool background)
 	{
 		digest_msg msg;
 		msg.init_maintain(force);
-		digest_queue.send(msg);
-		bg_digesting = true;
+		r = digest_submit(msg);
 	}
 	else
 	{
@@ -876,18 +1240,25 @@ int managed_dtable::maintain(bool force, T * token)
 		if(journal->size())
 		{
 			size_t size = disks.size();
-			if(autocombine)
+			if(autocombine && compaction == COMPACT_COUNT)
 				header.autocombine_digest_count++;
 			/* will rewrite header for us! */
 			/* "digest()" */
 			r = combine(size, size, true, token);
 			if(r < 0)
 			{
-				header.autocombine_digest_count--;
+				if(autocombine && compaction == COMPACT_COUNT)
+					header.autocombine_digest_count--;
 				header.digested = old;
 				return r;
 			}
-			if(autocombine && header.autocombine_digest_count == header.autocombine_digests)
+			if(autocombine && compaction != COMPACT_COUNT)
+			{
+				r = maintain_compaction(token);
+				if(r < 0)
+					return r;
+			}
+			else if(autocombine && header.autocombine_digest_count == header.autocombine_digests)
 			{
 				header.autocombine_digest_count = 0;
 				/* will rewrite header for us! */
@@ -23,7 +23,9 @@
 #include "overlay_dtable.h"
 #include "sys_journal.h"
 
-#include "bg_thread.h"
+#include "atomic.h"
+#include "bg_pool.h"
+#include "io_limiter.h"
 #include "msg_queue.h"
 
 /* A managed dtable is really a collection of dtables: zero or more disk dtables
@@ -31,9 +33,20 @@
  * everything together. It supports merging together various numbers of these
  * constituent dtables into new, combined disk dtables with the same data. */
 
+/* The present(), lookup(), and lookup_sorted() methods may be called from any
+ * number of threads at once, even while the owning thread (or the background
+ * pool, on its behalf) is inserting or combining. They read from an immutable
+ * version of the list of constituent dtables, which they grab without locking;
+ * each combine publishes a new version, and the dtables it replaces are only
+ * destroyed once no reader is using an older version. All other methods,
+ * including iterator(), must still be called only from the owning thread. */
+
 #define MDTABLE_MAGIC 0x784D3DB7
 #define MDTABLE_VERSION 1
 
+/* time one in this many lookups while digesting, if there is a latency target */
+#define MDT_LATENCY_SAMPLE 16
+
 class managed_dtable : public dtable
 {
 public:
@@ -41,6 +54,7 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	
 	inline virtual bool writable() const { return true; }
 	
@@ -54,6 +68,13 @@ public:
 	virtual int commit_tx(ATX_REQ);
 	virtual void abort_tx(ATX_REQ);
 	
+	/* Returns a read-only dtable of our current contents, which later inserts
+	 * and combines will not affect, or NULL if the journal dtable does not
+	 * support snapshots. Unlike us, it can be used from any thread. It keeps
+	 * the constituent dtables it uses from being destroyed, so it should be
+	 * destroyed (with destroy()) once it is no longer needed, and before us. */
+	dtable * snapshot() const;
+	
 	/* return the number of disk dtables */
 	inline size_t disk_dtables()
 	{
@@ -65,9 +86,9 @@ public:
 	 * is meant to be used by external callers in the main thread. Passing
 	 * false (usually the default) causes these methods to assume they are
 	 * running in the main thread, and perform the requested operation
-	 * before returning. Passing true causes them to send a message to the
-	 * background thread, requesting it to perform the operation. They will
-	 * return success immediately.
+	 * before returning. Passing true causes them to submit a job to the
+	 * global background pool, requesting it to perform the operation. They
+	 * will return success immediately.
 	 * 
 	 * For internal calls to these methods, for instance in calls to
 	 * combine() or digest() from within maintain(), the private template
@@ -102,22 +123,55 @@ public:
 		return digest_internal(use_fastbase, background);
 	}
 	
+	/* add a new disk dtable built directly from the sorted source iterator,
+	 * bypassing the journal so that large loads are written only once; the
+	 * new dtable is the newest disk dtable, so none of its keys may already
+	 * be present in the journal dtable (returns -EEXIST if any are) */
+	int ingest(dtable::iter * source, bool use_fastbase = false);
+	
 	/* do maintenance based on parameters */
 	inline virtual int maintain(bool force = false) { return maintain(force, bg_default); }
 	int maintain(bool force, bool background);
 	
 	virtual int set_blob_cmp(const blob_comparator * cmp);
 	
-	/* loan the background thread the token, if it wants it, so it can proceed */
+	/* loan the background thread the token, if it wants it, so it can
+	 * proceed; also loans the tokens of any other jobs in the pool that
+	 * want theirs, since they may be using all the pool's threads */
 	void background_loan();
 	/* wait for a background operation to finish and return its return value */
 	int background_join();
 	
+	/* A write batch collects inserts and removes for any number of managed
+	 * dtables sharing a sys_journal, and commits them all at once as a single
+	 * journal record. Abortable transactions are not used by write batches. */
+	class write_batch
+	{
+	public:
+		int insert(managed_dtable * mdt, const dtype & key, const blob & blob, bool append = false);
+		inline int remove(managed_dtable * mdt, const dtype & key) { return insert(mdt, key, blob()); }
+		/* the batch is cleared if this succeeds */
+		int commit();
+		inline void clear() { ops.clear(); }
+		inline size_t size() const { return ops.size(); }
+	
+	private:
+		struct op
+		{
+			managed_dtable * mdt;
+			dtype key;
+			blob value;
+			bool append;
+			inline op(managed_dtable * mdt, const dtype & key, const blob & value, bool append) : mdt(mdt), key(key), value(value), append(append) {}
+		};
+		std::vector<op> ops;
+	};
+	
 	static int create(int dfd, const char * name, const params & config, dtype::ctype key_type);
 	DECLARE_RW_FACTORY(managed_dtable);
 	
 	inline managed_dtable()
-		: digest_thread(this, &managed_dtable::digest_thread_main), bg_digesting(false), bg_default(false), md_dfd(-1), chain(this)
+		: lookup_count(0), bg_job(this), bg_digesting(false), bg_default(false), md_dfd(-1), current(NULL), retired(NULL), chain(this)
 	{
 	}
 	int init(int dfd, const char * name, const params & config, sys_journal * sysj);
@@ -192,6 +246,9 @@ private:
 	int maintain(bool force, T * token);
 	template<class T>
 	int maintain_autocombine(T * token);
+	template<class T>
+	int maintain_compaction(T * token);
+	off_t disk_size(size_t index) const;
 	
 	template<class T>
 	int digest_internal(bool use_fastbase, T extra)
@@ -222,8 +279,6 @@ private:
 		}
 		
 	private:
-		int write_meta(const dtable_list & copy) const;
-		
 		managed_dtable * mdt;
 		size_t first, last;
 		const bool use_fastbase;
@@ -233,11 +288,11 @@ private:
 		char name[32];
 	};
 	
-	/* each managed dtable has a background thread for doing
-	 * digest/combine operations; these members are used for it */
+	/* each managed dtable submits its background digest/combine
+	 * operations to the global bg_pool; these members are used for it */
 	struct digest_msg
 	{
-		enum { STOP, COMBINE, MAINTAIN } type;
+		enum { COMBINE, MAINTAIN } type;
 		union
 		{
 			struct
@@ -250,7 +305,7 @@ private:
 				bool force;
 			} maintain;
 		};
-		inline digest_msg() : type(STOP) {}
+		inline digest_msg() : type(MAINTAIN) { maintain.force = false; }
 		inline void init_combine(size_t first, size_t last, bool use_fastbase)
 		{
 			type = COMBINE;
@@ -268,11 +323,74 @@ private:
 	{
 		int return_value;
 	};
-	bg_thread<managed_dtable> digest_thread;
-	msg_queue<digest_msg> digest_queue;
+	/* only one operation is ever outstanding for each managed dtable, so
+	 * one busy dtable can't keep the pool from getting to the others */
+	class digest_job : public bg_pool::job
+	{
+	public:
+		virtual void run(bg_token * token);
+		virtual void done();
+		inline digest_job(managed_dtable * mdt) : bg_pool::job(&mdt->digest_token), mdt(mdt) {}
+		digest_msg message;
+	private:
+		managed_dtable * mdt;
+		reply_msg reply;
+	};
+	bg_token digest_token;
+	/* only background work is throttled */
+	mutable io_limiter bg_limiter;
+	mutable atomic<size_t> lookup_count;
+	inline io_limiter * token_limiter(bg_token * token) { return &bg_limiter; }
+	inline io_limiter * token_limiter(fg_token * token) { return NULL; }
+	digest_job bg_job;
 	msg_queue<reply_msg> reply_queue;
 	bool bg_digesting, bg_default;
-	void digest_thread_main(bg_token * token);
+	int digest_submit(const digest_msg & msg);
+	
+	/* A version is the overlay of the constituent dtables, as seen by readers.
+	 * The owning thread publishes a new one whenever the constituents change,
+	 * and retires the old one, along with any dtables replaced in the new
+	 * one. Readers count themselves in "acquiring" while they take a
+	 * reference to the current version, so that once that count has been
+	 * zero after the publication, a retired version with no references can
+	 * never get any more, and can be reclaimed. (But its replaced dtables
+	 * may also be in older versions, so they are kept until those go too.) */
+	struct version
+	{
+		overlay_dtable * overlay;
+		/* the dtables in the overlay, newest (the journal dtable) first */
+		std::vector<dtable *> tables;
+		mutable atomic<int> refs;
+		/* dtables to get rid of when this version is reclaimed */
+		dtable_list replaced;
+		/* the next (older) retired version */
+		version * next;
+		inline version() : overlay(NULL), next(NULL) {}
+	};
+	const version * acquire() const;
+	inline void release(const version * ver) const { ver->refs.dec(); }
+	void publish(const dtable_list & replaced = dtable_list());
+	void reclaim();
+	void dispose(const dtable_list_entry & entry);
+	
+	/* a snapshot overlays the constituent dtables of the version it holds a
+	 * reference to, with a snapshot of the journal dtable in its place */
+	class snapshot_dtable : public overlay_dtable
+	{
+	public:
+		inline snapshot_dtable(const managed_dtable * mdt, const version * ver, dtable * view) : mdt(mdt), ver(ver), view(view) {}
+		inline virtual ~snapshot_dtable()
+		{
+			/* the overlay must go before the dtables it uses */
+			overlay_dtable::deinit();
+			view->destroy();
+			mdt->release(ver);
+		}
+	private:
+		const managed_dtable * mdt;
+		const version * ver;
+		dtable * view;
+	};
 	
 	/* preexisting iterators may be using dtables that will be destroyed by
 	 * a combine - we delay destroying these dtables and register callbacks
@@ -324,12 +442,15 @@ private:
 	atx_map open_atx_map;
 	
 	int commit_abort_tx(ATX_REQ, bool commit);
+	int write_meta(const dtable_list & list) const;
 	
 	int md_dfd;
 	mdtable_header header;
 	
 	dtable_list disks;
-	overlay_dtable * overlay;
+	version * current;
+	version * retired;
+	mutable atomic<int> acquiring;
 	mutable chain_callback chain;
 	sys_journal::listening_dtable * journal;
 	sys_journal * sysj;
@@ -338,6 +459,11 @@ private:
 	params base_config, fastbase_config;
 	size_t digest_size;
 	bool digest_on_close, close_digest_fastbase, autocombine;
+	/* how to choose what to combine after each digest when autocombining:
+	 * COMPACT_COUNT uses the autocombine_* counters in the header, while the
+	 * other two compare the sizes of the disk dtables using size_ratio */
+	enum { COMPACT_COUNT, COMPACT_LEVELED, COMPACT_TIERED } compaction;
+	size_t size_ratio;
 };
 
 #endif /* __MANAGED_DTABLE_H */
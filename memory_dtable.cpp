@@ -110,7 +110,7 @@ blob memory_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 
 int memory_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
 {
-	if(key.type != ktype || (ktype == dtype::BLOB && !key.blb.exists()))
+	if(key.type != ktype || (ktype == dtype::BLOB && !key.blb().exists()))
 		return -EINVAL;
 	return set_node(key, blob, append);
 }
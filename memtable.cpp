@@ -0,0 +1,181 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#include <new>
+#include <errno.h>
+
+#include "memtable.h"
+
+template<class T>
+inline memtable::node * memtable::find_preds(const T & less, node ** preds) const
+{
+	node * x = NULL, * next = NULL;
+	for(int level = read_height() - 1; level >= 0; level--)
+	{
+		next = read(x ? x->next[level] : head[level]);
+		while(next && less(next))
+		{
+			x = next;
+			next = read(x->next[level]);
+		}
+		if(preds)
+			preds[level] = x;
+	}
+	/* not x->next[0] again: a node added since then may be less */
+	return next;
+}
+
+const memtable::node * memtable::lower_bound(const dtype & key) const
+{
+	return find_preds(key_less(key, blob_cmp), NULL);
+}
+
+const memtable::node * memtable::lower_bound(const dtype_test & test) const
+{
+	return find_preds(test_less(test), NULL);
+}
+
+int memtable::random_height()
+{
+	int value = 1;
+	for(;;)
+	{
+		/* xorshift */
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		if(value >= MEMTABLE_MAX_HEIGHT || (random % MEMTABLE_BRANCHING))
+			break;
+		value++;
+	}
+	return value;
+}
+
+memtable::version * memtable::add_version(const blob & value, version * older)
+{
+	void * memory = spare;
+	if(memory)
+		spare = *(void **) memory;
+	else
+	{
+		memory = nodes.alloc(sizeof(version));
+		if(!memory)
+			return NULL;
+	}
+	return new(memory) version(value, older, ++seq);
+}
+
+/* free the retired versions once no reader can be using them */
+void memtable::reclaim()
+{
+	if(!retired || readers.get())
+		return;
+	while(retired)
+	{
+		version * v = retired;
+		retired = v->older;
+		v->~version();
+		*(void **) v = spare;
+		spare = v;
+		old_count--;
+	}
+}
+
+int memtable::set(const dtype & key, const blob & value, bool append)
+{
+	int level;
+	void * memory;
+	version * v;
+	node * n, * preds[MEMTABLE_MAX_HEIGHT];
+	if(append && tail[0] && tail[0]->key.compare(key, blob_cmp) < 0)
+	{
+		/* we don't need to search at all */
+		for(level = 0; level < height; level++)
+			preds[level] = tail[level];
+	}
+	else
+	{
+		n = find_preds(key_less(key, blob_cmp), preds);
+		if(n && !n->key.compare(key, blob_cmp))
+		{
+			/* readers may be using the current version, so add a new one */
+			version * old = n->latest;
+			bool keep = snapshots.get() != 0;
+			v = add_version(value, keep ? old : NULL);
+			if(!v)
+				return -ENOMEM;
+			publish(n->latest, v);
+			old_count++;
+			if(!keep)
+			{
+				/* nothing can reach the old versions any more, so
+				 * retire them until the readers that found them go */
+				version * last = old;
+				while(last->older)
+					last = last->older;
+				last->older = retired;
+				retired = old;
+				reclaim();
+			}
+			return 0;
+		}
+	}
+	
+	level = random_height();
+	memory = nodes.alloc(sizeof(node) + level * sizeof(node *));
+	if(!memory)
+		return -ENOMEM;
+	v = add_version(value, NULL);
+	if(!v)
+		return -ENOMEM;
+	n = new(memory) node(key, v, level);
+	for(; height < level; height++)
+		preds[height] = NULL;
+	/* link the node in from the bottom up, so that any reader which finds
+	 * it at some level will also find it at all the levels below that */
+	n->prev = preds[0];
+	for(level = 0; level < n->height; level++)
+		n->next[level] = preds[level] ? preds[level]->next[level] : head[level];
+	for(level = 0; level < n->height; level++)
+	{
+		publish(preds[level] ? preds[level]->next[level] : head[level], n);
+		if(!n->next[level])
+			publish(tail[level], n);
+	}
+	if(n->next[0])
+		publish(n->next[0]->prev, n);
+	count++;
+	reclaim();
+	return 0;
+}
+
+void memtable::clear()
+{
+	node * n = head[0];
+	while(n)
+	{
+		node * next = n->next[0];
+		for(version * v = n->latest; v;)
+		{
+			version * older = v->older;
+			v->~version();
+			v = older;
+		}
+		n->~node();
+		n = next;
+	}
+	while(retired)
+	{
+		version * older = retired->older;
+		retired->~version();
+		retired = older;
+	}
+	spare = NULL;
+	nodes.clear();
+	for(int i = 0; i < MEMTABLE_MAX_HEIGHT; i++)
+		head[i] = tail[i] = NULL;
+	count = 0;
+	old_count = 0;
+	height = 1;
+}
@@ -0,0 +1,237 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __MEMTABLE_H
+#define __MEMTABLE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error memtable.h is a C++ header file
+#endif
+
+#include "arena.h"
+#include "blob.h"
+#include "dtype.h"
+#include "atomic.h"
+
+/* A memtable is the sorted in-memory key/value structure of a journal dtable.
+ * It is a skip list whose nodes are allocated from an arena, so each key is
+ * stored just once, in sorted order, and there is no per-node allocation or
+ * rebalancing; since the nodes never move or go away individually, a removal
+ * just stores a nonexistent blob. The whole thing is thrown away at once by
+ * clear(), when the journal dtable is digested. The bottom level of the list
+ * is doubly linked, so that iterators can move in either direction. */
+
+/* The key and value data are not copied into the arena: the nodes hold
+ * ordinary dtypes and blobs, which share their data with the caller. Lookups
+ * and iterators hand out blobs that may outlive clear(), so values in the
+ * arena would have to be copied out on every read; sharing them costs one
+ * reference count instead, and blobs of up to BLOB_INLINE_SIZE bytes are in
+ * the node itself anyway. */
+
+/* One thread may call set() while any number of others call find(),
+ * lower_bound(), and walk the list, without any locking. Nodes are fully
+ * initialized before they are linked in, and values are never modified in
+ * place: setting a key that is already present links a new version of the
+ * value to its node. Readers hold a memtable::reader while they use the
+ * versions they find, so a reader that has found a value can keep using it
+ * until it lets go. (A reader walking the list backward may miss a node being
+ * linked in at that moment, and one walking forward may or may not see it;
+ * either way it sees a consistent list.) Nothing else may be running when
+ * clear() is called. */
+
+/* Each set() gets the next sequence number, which is stored in the version it
+ * adds. While any snapshots are registered with add_snapshot(), the old
+ * versions are kept, so readers can look up the value a key had as of any
+ * earlier sequence number, and skip the keys added after it, to get a
+ * consistent snapshot of the memtable while it continues to change. Otherwise
+ * only the latest version of a key can be reached, and set() frees the ones
+ * it replaces (for reuse) as soon as no reader is left that might have found
+ * them. Only the writer may add a snapshot, but any thread may drop one. */
+
+#define MEMTABLE_MAX_HEIGHT 12
+/* each level has about 1/MEMTABLE_BRANCHING as many nodes as the one below */
+#define MEMTABLE_BRANCHING 4
+
+class memtable
+{
+public:
+	struct version
+	{
+		const blob value;
+		/* the version this one replaced, or NULL (also links the
+		 * retired versions, which no reader follows) */
+		version * older;
+		/* the sequence number of the set() that added it */
+		const uint64_t sequence;
+		
+		inline version(const blob & value, version * older, uint64_t sequence) : value(value), older(older), sequence(sequence) {}
+	};
+	
+	struct node
+	{
+		const dtype key;
+		
+		inline const blob & value() const { return read(latest)->value; }
+		inline const node * next_node() const { return read(next[0]); }
+		inline const node * prev_node() const { return read(prev); }
+		
+		/* the value as of the given sequence number, or NULL if the key
+		 * had not been added yet at that point */
+		inline const blob * value(uint64_t sequence) const
+		{
+			for(const version * v = read(latest); v; v = v->older)
+				if(v->sequence <= sequence)
+					return &v->value;
+			return NULL;
+		}
+		
+	private:
+		/* the current version; never NULL */
+		version * latest;
+		node * prev;
+		int height;
+		/* actually of length height */
+		node * next[0];
+		
+		inline node(const dtype & key, version * value, int height)
+			: key(key), latest(value), prev(NULL), height(height)
+		{
+		}
+		friend class memtable;
+	};
+	
+	/* a reader in another thread holds one of these while it uses nodes and
+	 * values, so that set() does not free the versions it may have found */
+	class reader
+	{
+	public:
+		inline reader(const memtable & table) : table(table) { table.readers.inc(); }
+		inline ~reader() { table.readers.dec(); }
+	private:
+		const memtable & table;
+	};
+	
+	/* returns the value, or NULL if the key is not present; the value stays
+	 * valid even if the key is set again, while the reader is held */
+	inline const blob * find(const dtype & key) const
+	{
+		const node * n = lower_bound(key);
+		if(n && !n->key.compare(key, blob_cmp))
+			return &n->value();
+		return NULL;
+	}
+	/* likewise, but as of the given sequence number */
+	inline const blob * find(const dtype & key, uint64_t sequence) const
+	{
+		const node * n = lower_bound(key);
+		if(n && !n->key.compare(key, blob_cmp))
+			return n->value(sequence);
+		return NULL;
+	}
+	
+	/* the first node with a key not less than the given key, or NULL */
+	const node * lower_bound(const dtype & key) const;
+	const node * lower_bound(const dtype_test & test) const;
+	
+	inline const node * first() const { return read(head[0]); }
+	inline const node * last() const { return read(tail[0]); }
+	
+	/* sets the value, adding the key if it is not present; the append flag
+	 * says that the key is probably greater than all the present keys */
+	int set(const dtype & key, const blob & value, bool append = false);
+	
+	/* the sequence number of the last set(); only for the writer to use */
+	inline uint64_t sequence() const { return seq; }
+	
+	inline size_t size() const { return *(const volatile size_t *) &count; }
+	inline bool empty() const { return !size(); }
+	/* snapshots need the old versions as of their sequence numbers */
+	inline void add_snapshot() const { snapshots.inc(); }
+	inline void drop_snapshot() const { snapshots.dec(); }
+	
+	/* the number of old versions not yet freed, since snapshots or readers
+	 * may still be using them */
+	inline size_t replaced() const { return old_count; }
+	/* memory used by the nodes and their inline data, but not shared data */
+	inline size_t memory() const { return nodes.size(); }
+	
+	/* destroys all the nodes and frees their memory at once */
+	void clear();
+	
+	inline memtable(const blob_comparator * const & blob_cmp)
+		: count(0), old_count(0), seq(0), height(1), random(0x2545f491), retired(NULL), spare(NULL), blob_cmp(blob_cmp)
+	{
+		for(int i = 0; i < MEMTABLE_MAX_HEIGHT; i++)
+			head[i] = tail[i] = NULL;
+	}
+	inline ~memtable()
+	{
+		clear();
+	}
+	
+private:
+	/* Readers load links with read(), and the writer stores them with
+	 * publish(), which makes sure that everything written before (like the
+	 * contents of a new node) is visible to any reader that sees the link.
+	 * Readers only follow the links they load, so they need no barrier. */
+	template<class T>
+	static inline T * read(T * const & link)
+	{
+		return *(T * const volatile *) &link;
+	}
+	template<class T>
+	static inline void publish(T *& link, T * value)
+	{
+		__sync_synchronize();
+		*(T * volatile *) &link = value;
+	}
+	inline int read_height() const
+	{
+		return *(const volatile int *) &height;
+	}
+	
+	/* finds the last node at each level whose key is less than the target
+	 * (NULL meaning the head of the list), and returns the next node */
+	template<class T>
+	node * find_preds(const T & less, node ** preds) const;
+	int random_height();
+	version * add_version(const blob & value, version * older);
+	void reclaim();
+	
+	struct key_less
+	{
+		const dtype & key;
+		const blob_comparator * blob_cmp;
+		inline bool operator()(const node * n) const { return n->key.compare(key, blob_cmp) < 0; }
+		inline key_less(const dtype & key, const blob_comparator * blob_cmp) : key(key), blob_cmp(blob_cmp) {}
+	};
+	struct test_less
+	{
+		const dtype_test & test;
+		inline bool operator()(const node * n) const { return test(n->key) < 0; }
+		inline test_less(const dtype_test & test) : test(test) {}
+	};
+	
+	arena nodes;
+	size_t count, old_count;
+	uint64_t seq;
+	int height;
+	uint32_t random;
+	mutable atomic<size_t> readers, snapshots;
+	/* replaced versions waiting for the readers to go, and freed ones */
+	version * retired;
+	void * spare;
+	node * head[MEMTABLE_MAX_HEIGHT];
+	node * tail[MEMTABLE_MAX_HEIGHT];
+	const blob_comparator * const & blob_cmp;
+	
+	/* no copying */
+	memtable(const memtable &);
+	memtable & operator=(const memtable &);
+};
+
+#endif /* __MEMTABLE_H */
@@ -5,13 +5,18 @@
 #include <errno.h>
 #include <stdarg.h>
 
+#include <vector>
+#include <algorithm>
+
 #include "util.h"
 #include "overlay_dtable.h"
 
 overlay_dtable::iter::iter(const overlay_dtable * source)
-	: iter_source<overlay_dtable>(source), lastdir(FORWARD), past_beginning(false)
+	: iter_source<overlay_dtable>(source), heap_size(0), pending_count(0), heap_ready(false), lastdir(FORWARD), past_beginning(false)
 {
 	subs = new sub[source->table_count];
+	heap = new size_t[source->table_count];
+	pending = new size_t[source->table_count];
 	for(size_t i = 0; i < source->table_count; i++)
 	{
 		subs[i].iter = source->tables[i]->iterator();
@@ -19,7 +24,6 @@ overlay_dtable::iter::iter(const overlay_dtable * source)
 		if(!subs[i].empty)
 			subs[i].key = subs[i].iter->key();
 		subs[i].valid = subs[i].iter->valid();
-		subs[i].shadow = false;
 	}
 	next();
 }
@@ -28,6 +32,8 @@ overlay_dtable::iter::~iter()
 {
 	for(size_t i = 0; i < dt_source->table_count; i++)
 		delete subs[i].iter;
+	delete[] pending;
+	delete[] heap;
 	delete[] subs;
 }
 
@@ -36,13 +42,63 @@ bool overlay_dtable::iter::valid() const
 	return current_index < dt_source->table_count;
 }
 
+/* fill in the empty slots and add them to the heap: only the subs consumed by
+ * the last step need to be refilled, unless the heap must be rebuilt entirely
+ * (after changing direction or repositioning the iterator) */
+void overlay_dtable::iter::heap_fill()
+{
+	const bool forward = lastdir == FORWARD;
+	heap_order order(subs, dt_source->blob_cmp, forward);
+	size_t count = heap_ready ? pending_count : dt_source->table_count;
+	if(!heap_ready)
+		heap_size = 0;
+	for(size_t p = 0; p < count; p++)
+	{
+		size_t i = heap_ready ? pending[p] : p;
+		if(subs[i].empty && subs[i].valid)
+		{
+			subs[i].valid = forward ? subs[i].iter->next() : subs[i].iter->prev();
+			subs[i].empty = !subs[i].valid;
+			if(!subs[i].empty)
+				subs[i].key = subs[i].iter->key();
+		}
+		if(!subs[i].valid)
+			/* skip exhausted tables */
+			continue;
+		heap[heap_size++] = i;
+		if(heap_ready)
+			std::push_heap(heap, &heap[heap_size], order);
+	}
+	if(!heap_ready)
+		std::make_heap(heap, &heap[heap_size], order);
+	pending_count = 0;
+	heap_ready = true;
+}
+
+/* remove the top of the heap, along with any entries it shadows; they will all
+ * be refilled by the next call to heap_fill() */
+size_t overlay_dtable::iter::heap_pop()
+{
+	heap_order order(subs, dt_source->blob_cmp, lastdir == FORWARD);
+	size_t top = heap[0];
+	std::pop_heap(heap, &heap[heap_size--], order);
+	subs[top].empty = true;
+	pending[pending_count++] = top;
+	while(heap_size && !subs[heap[0]].key.compare(subs[top].key, order.blob_cmp))
+	{
+		/* skip shadowed entry */
+		size_t index = heap[0];
+		std::pop_heap(heap, &heap[heap_size--], order);
+		subs[index].empty = true;
+		pending[pending_count++] = index;
+	}
+	return top;
+}
+
 /* this will let non-existent blobs shadow extant ones just like we want
  * without any special handling, since next() and valid() still return true */
 bool overlay_dtable::iter::next()
 {
-	bool first = true;
-	dtype min_key(0u);
-	const blob_comparator * blob_cmp = dt_source->blob_cmp;
 	current_index = dt_source->table_count;
 	
 	if(lastdir == BACKWARD)
@@ -62,9 +118,9 @@ bool overlay_dtable::iter::next()
 				subs[i].empty = true;
 				subs[i].valid = true;
 			}
-			subs[i].shadow = false;
 		}
 		lastdir = FORWARD;
+		heap_ready = false;
 		if(past_beginning)
 		{
 			past_beginning = false;
@@ -72,50 +128,15 @@ bool overlay_dtable::iter::next()
 		}
 	}
 	
-	for(size_t i = 0; i < dt_source->table_count; i++)
-	{
-		int c;
-		if(subs[i].empty && subs[i].valid)
-		{
-			/* fill in empty slots */
-			subs[i].valid = subs[i].iter->next();
-			subs[i].empty = !subs[i].valid;
-			if(!subs[i].empty)
-				subs[i].key = subs[i].iter->key();
-		}
-		if(!subs[i].valid || subs[i].shadow)
-			/* skip exhausted and shadowed tables */
-			continue;
-		if(first || (c = subs[i].key.compare(min_key, blob_cmp)) < 0)
-		{
-			first = false;
-			current_index = i;
-			min_key = subs[i].key;
-		}
-		else if(!c)
-			/* shadow this entry */
-			subs[i].shadow = true;
-	}
-	if(current_index == dt_source->table_count)
+	heap_fill();
+	if(!heap_size)
 		return false;
-	subs[current_index].empty = true;
-	for(size_t i = current_index + 1; i < dt_source->table_count; i++)
-		if(subs[i].shadow)
-		{
-			/* skip shadowed entry */
-			subs[i].empty = true;
-			subs[i].shadow = false;
-		}
+	current_index = heap_pop();
 	return true;
 }
 
 bool overlay_dtable::iter::prev()
 {
-	bool first = true;
-	dtype max_key(0u);
-	const blob_comparator * blob_cmp = dt_source->blob_cmp;
-	size_t next_index = dt_source->table_count;
-	
 	if(lastdir == FORWARD)
 	{
 		for(size_t i = 0; i < dt_source->table_count; i++)
@@ -123,36 +144,13 @@ bool overlay_dtable::iter::prev()
 			assert(subs[i].empty || subs[i].valid);
 			subs[i].empty = true;
 			subs[i].valid = true;
-			subs[i].shadow = false;
 		}
 		lastdir = BACKWARD;
+		heap_ready = false;
 	}
 	
-	for(size_t i = 0; i < dt_source->table_count; i++)
-	{
-		int c;
-		if(subs[i].empty && subs[i].valid)
-		{
-			/* fill in empty slots */
-			subs[i].valid = subs[i].iter->prev();
-			subs[i].empty = !subs[i].valid;
-			if(!subs[i].empty)
-				subs[i].key = subs[i].iter->key();
-		}
-		if(!subs[i].valid || subs[i].shadow)
-			/* skip exhausted and shadowed tables */
-			continue;
-		if(first || (c = subs[i].key.compare(max_key, blob_cmp)) > 0)
-		{
-			first = false;
-			next_index = i;
-			max_key = subs[i].key;
-		}
-		else if(!c)
-			/* shadow this entry */
-			subs[i].shadow = true;
-	}
-	if(next_index == dt_source->table_count)
+	heap_fill();
+	if(!heap_size)
 	{
 		/* we have gone "past the beginning" and when we reverse direction
 		 * again, we'll find the first element rather than the second as we
@@ -161,15 +159,7 @@ bool overlay_dtable::iter::prev()
 		past_beginning = true;
 		return false;
 	}
-	current_index = next_index;
-	subs[current_index].empty = true;
-	for(size_t i = current_index + 1; i < dt_source->table_count; i++)
-		if(subs[i].shadow)
-		{
-			/* skip shadowed entry */
-			subs[i].empty = true;
-			subs[i].shadow = false;
-		}
+	current_index = heap_pop();
 	return true;
 }
 
@@ -182,9 +172,9 @@ bool overlay_dtable::iter::first()
 		if(!subs[i].empty)
 			subs[i].key = subs[i].iter->key();
 		subs[i].valid = subs[i].iter->valid();
-		subs[i].shadow = false;
 	}
 	lastdir = FORWARD;
+	heap_ready = false;
 	past_beginning = false;
 	return next();
 }
@@ -198,9 +188,9 @@ bool overlay_dtable::iter::last()
 			subs[i].iter->next();
 		subs[i].valid = false;
 		subs[i].empty = true;
-		subs[i].shadow = false;
 	}
 	lastdir = FORWARD;
+	heap_ready = false;
 	past_beginning = false;
 	return prev();
 }
@@ -221,9 +211,9 @@ bool overlay_dtable::iter::seek(const dtype & key)
 		if(!subs[i].empty)
 			subs[i].key = subs[i].iter->key();
 		subs[i].valid = subs[i].iter->valid();
-		subs[i].shadow = false;
 	}
 	lastdir = FORWARD;
+	heap_ready = false;
 	past_beginning = false;
 	next();
 	return found;
@@ -240,9 +230,9 @@ bool overlay_dtable::iter::seek(const dtype_test & test)
 		if(!subs[i].empty)
 			subs[i].key = subs[i].iter->key();
 		subs[i].valid = subs[i].iter->valid();
-		subs[i].shadow = false;
 	}
 	lastdir = FORWARD;
+	heap_ready = false;
 	past_beginning = false;
 	next();
 	return found;
@@ -272,7 +262,10 @@ bool overlay_dtable::present(const dtype & key, bool * found, ATX_DEF) const
 {
 	for(size_t i = 0; i < table_count; i++)
 	{
-		bool result = tables[i]->present(key, found);
+		bool result;
+		if(outside(i, key))
+			continue;
+		result = tables[i]->present(key, found);
 		if(*found)
 			return result;
 	}
@@ -284,7 +277,10 @@ blob overlay_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 {
 	for(size_t i = 0; i < table_count; i++)
 	{
-		blob value = tables[i]->lookup(key, found);
+		blob value;
+		if(outside(i, key))
+			continue;
+		value = tables[i]->lookup(key, found);
 		if(*found)
 			return value;
 	}
@@ -292,6 +288,87 @@ blob overlay_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return blob();
 }
 
+void overlay_dtable::lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	/* each table gets the batch of keys not found in the tables above it,
+	 * which stay sorted since we remove keys from the batch in order; the
+	 * keys within a table's key range are a contiguous part of the batch */
+	size_t pending = count;
+	std::vector<size_t> indices(count);
+	std::vector<dtype> batch;
+	std::vector<blob> batch_values(count);
+	bool * batch_found = new bool[count];
+	for(size_t i = 0; i < count; i++)
+	{
+		indices[i] = i;
+		values[i] = blob();
+		found[i] = false;
+	}
+	for(size_t i = 0; pending && i < table_count; i++)
+	{
+		size_t low = 0, high = pending, left;
+		while(low < high && outside(i, keys[indices[low]]))
+			low++;
+		while(high > low && outside(i, keys[indices[high - 1]]))
+			high--;
+		if(low == high)
+			continue;
+		/* until some key is found, the batch is still the original keys */
+		if(pending == count && !low && high == count)
+			tables[i]->lookup_sorted(keys, count, &batch_values[0], batch_found);
+		else
+		{
+			batch.clear();
+			for(size_t j = low; j < high; j++)
+				batch.push_back(keys[indices[j]]);
+			tables[i]->lookup_sorted(&batch[0], high - low, &batch_values[0], batch_found);
+		}
+		left = low;
+		for(size_t j = low; j < high; j++)
+			if(batch_found[j - low])
+			{
+				values[indices[j]] = batch_values[j - low];
+				found[indices[j]] = true;
+			}
+			else
+				indices[left++] = indices[j];
+		for(size_t j = high; j < pending; j++)
+			indices[left++] = indices[j];
+		pending = left;
+	}
+	delete[] batch_found;
+}
+
+/* sample each table in proportion to its size, then pick evenly among the
+ * combined samples; tables that don't know their size are not sampled */
+void overlay_dtable::sample_keys(size_t count, std::vector<dtype> * samples) const
+{
+	size_t total = 0;
+	std::vector<dtype> all;
+	for(size_t i = 0; i < table_count; i++)
+	{
+		size_t size = tables[i]->size();
+		if(size != (size_t) -1)
+			total += size;
+	}
+	if(!total || !count)
+		return;
+	for(size_t i = 0; i < table_count; i++)
+	{
+		size_t size = tables[i]->size();
+		if(size == (size_t) -1 || !size)
+			continue;
+		tables[i]->sample_keys(count * size / total + 1, &all);
+	}
+	if(all.empty())
+		return;
+	std::sort(all.begin(), all.end(), dtype_comparator_object(blob_cmp));
+	if(count > all.size())
+		count = all.size();
+	for(size_t i = 0; i < count; i++)
+		samples->push_back(all[i * all.size() / count]);
+}
+
 int overlay_dtable::set_blob_cmp(const blob_comparator * cmp)
 {
 	for(size_t i = 0; i < table_count; i++)
@@ -335,6 +412,9 @@ int overlay_dtable::init(dtable * dt1, ...)
 	for(count = 1; count < table_count; count++)
 		tables[count] = va_arg(ap, dtable *);
 	va_end(ap);
+	fences = new fence[count];
+	for(size_t i = 0; i < count; i++)
+		fences[i].known = tables[i]->key_range(&fences[i].min, &fences[i].max);
 	return 0;
 }
 
@@ -355,6 +435,9 @@ int overlay_dtable::init(dtable ** dts, size_t count)
 		return -ENOMEM;
 	table_count = count;
 	util::memcpy(tables, dts, sizeof(*dts) * count);
+	fences = new fence[count];
+	for(size_t i = 0; i < count; i++)
+		fences[i].known = tables[i]->key_range(&fences[i].min, &fences[i].max);
 	return 0;
 }
 
@@ -362,6 +445,8 @@ void overlay_dtable::deinit()
 {
 	if(!tables)
 		return;
+	delete[] fences;
+	fences = NULL;
 	delete[] tables;
 	tables = NULL;
 	table_count = 0;
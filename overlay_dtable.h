@@ -25,10 +25,12 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
+	virtual void sample_keys(size_t count, std::vector<dtype> * samples) const;
 	
 	virtual int set_blob_cmp(const blob_comparator * cmp);
 	
-	inline overlay_dtable() : tables(NULL), table_count(0) {}
+	inline overlay_dtable() : tables(NULL), fences(NULL), table_count(0) {}
 	int init(dtable * dt1, ...);
 	int init(dtable ** dts, size_t count);
 	/* overlay_dtable has a public destructor (and no factory) */
@@ -63,18 +65,60 @@ private:
 		struct sub
 		{
 			dtable::iter * iter;
-			bool empty, valid, shadow;
+			bool empty, valid;
 			dtype key;
 			inline sub() : key(0u) {}
 		};
 		
+		/* orders the heap so that the next key in the current direction is on
+		 * top, with ties going to the lowest index (which shadows the rest) */
+		struct heap_order
+		{
+			const sub * subs;
+			const blob_comparator * blob_cmp;
+			bool forward;
+			inline heap_order(const sub * subs, const blob_comparator * blob_cmp, bool forward) : subs(subs), blob_cmp(blob_cmp), forward(forward) {}
+			inline bool operator()(size_t a, size_t b) const
+			{
+				int c = subs[a].key.compare(subs[b].key, blob_cmp);
+				if(c)
+					return forward ? c > 0 : c < 0;
+				return a > b;
+			}
+		};
+		
+		void heap_fill();
+		size_t heap_pop();
+		
 		sub * subs;
+		/* the subs with keys loaded, and the subs consumed by the last step */
+		size_t * heap;
+		size_t * pending;
+		size_t heap_size, pending_count;
+		bool heap_ready;
 		size_t current_index;
 		enum direction {FORWARD, BACKWARD} lastdir;
 		bool past_beginning;
 	};
 	
+	/* the key ranges of the underlying dtables, if they report them */
+	struct fence
+	{
+		dtype min, max;
+		bool known;
+		inline fence() : min(0u), max(0u), known(false) {}
+	};
+	inline bool outside(size_t index, const dtype & key) const
+	{
+		const fence & range = fences[index];
+		/* without the comparator, we can't tell where blob keys belong */
+		if(!range.known || (cmp_name && !blob_cmp))
+			return false;
+		return key.compare(range.min, blob_cmp) < 0 || key.compare(range.max, blob_cmp) > 0;
+	}
+	
 	dtable ** tables;
+	fence * fences;
 	size_t table_count;
 };
 
@@ -0,0 +1,328 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#define _ATFILE_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "openat.h"
+
+#include "util.h"
+#include "partition_dtable.h"
+
+bool partition_dtable::range_iter::valid() const
+{
+	const blob_comparator * blob_cmp;
+	dtype key(0u);
+	if(!base->valid())
+		return false;
+	blob_cmp = base->get_blob_cmp();
+	key = base->key();
+	if(low && key.compare(*low, blob_cmp) < 0)
+		return false;
+	return !high || key.compare(*high, blob_cmp) < 0;
+}
+
+bool partition_dtable::range_iter::next()
+{
+	base->next();
+	return valid();
+}
+
+bool partition_dtable::range_iter::prev()
+{
+	if(!base->prev())
+		return false;
+	return valid();
+}
+
+bool partition_dtable::range_iter::first()
+{
+	if(low)
+		base->seek(*low);
+	else
+		base->first();
+	return valid();
+}
+
+bool partition_dtable::range_iter::last()
+{
+	if(high)
+	{
+		/* find the first key past the range, then back up */
+		base->seek(*high);
+		if(base->valid())
+			base->prev();
+		else
+			base->last();
+	}
+	else
+		base->last();
+	return valid();
+}
+
+bool partition_dtable::range_iter::seek(const dtype & key)
+{
+	bool found = base->seek(key);
+	return found && valid();
+}
+
+bool partition_dtable::range_iter::seek(const dtype_test & test)
+{
+	bool found = base->seek(test);
+	return found && valid();
+}
+
+size_t partition_dtable::size() const
+{
+	/* the partitions are disjoint, so we can just add up their sizes */
+	size_t total = 0;
+	for(size_t i = 0; i < parts.size(); i++)
+	{
+		size_t size = parts[i]->size();
+		if(size == (size_t) -1)
+			return size;
+		total += size;
+	}
+	return total;
+}
+
+bool partition_dtable::key_range(dtype * min, dtype * max) const
+{
+	bool known = false;
+	for(size_t i = 0; i < parts.size(); i++)
+	{
+		dtype part_min(0u), part_max(0u);
+		if(!parts[i]->key_range(&part_min, &part_max))
+		{
+			/* empty partitions don't matter, but others might have any keys */
+			if(parts[i]->size())
+				return false;
+			continue;
+		}
+		if(!known)
+			*min = part_min;
+		*max = part_max;
+		known = true;
+	}
+	return known;
+}
+
+int partition_dtable::set_blob_cmp(const blob_comparator * cmp)
+{
+	/* also sets it on all the partitions */
+	int value = overlay->set_blob_cmp(cmp);
+	if(value >= 0)
+	{
+		value = dtable::set_blob_cmp(cmp);
+		assert(value >= 0);
+	}
+	return value;
+}
+
+int partition_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
+{
+	const dtable_factory * base;
+	params base_config;
+	pdtable_header header;
+	int r = -1, pdt_dfd, meta;
+	if(overlay)
+		deinit();
+	base = dtable_factory::lookup(config, "base");
+	if(!base)
+		return -ENOENT;
+	if(!config.get("base_config", &base_config, params()))
+		return -EINVAL;
+	pdt_dfd = openat(dfd, file, O_RDONLY);
+	if(pdt_dfd < 0)
+		return pdt_dfd;
+	meta = openat(pdt_dfd, "pdt_meta", O_RDONLY);
+	if(meta < 0)
+		goto fail_meta;
+	r = pread(meta, &header, sizeof(header), 0);
+	close(meta);
+	if(r != sizeof(header))
+		goto fail_meta;
+	if(header.magic != PDTABLE_MAGIC || header.version != PDTABLE_VERSION || !header.part_count)
+		goto fail_meta;
+	
+	for(uint32_t i = 0; i < header.part_count; i++)
+	{
+		char name[32];
+		dtable * part;
+		sprintf(name, "pdt_data.%u", i);
+		part = base->open(pdt_dfd, name, base_config, sysj);
+		if(!part)
+			goto fail_parts;
+		parts.push_back(part);
+	}
+	ktype = parts[0]->key_type();
+	cmp_name = parts[0]->get_cmp_name();
+	
+	overlay = new overlay_dtable;
+	r = overlay->init(&parts[0], parts.size());
+	if(r < 0)
+		goto fail_overlay;
+	
+	close(pdt_dfd);
+	return 0;
+
+fail_overlay:
+	delete overlay;
+	overlay = NULL;
+fail_parts:
+	for(size_t i = 0; i < parts.size(); i++)
+		parts[i]->destroy();
+	parts.clear();
+fail_meta:
+	close(pdt_dfd);
+	return (r < 0) ? r : -1;
+}
+
+void partition_dtable::deinit()
+{
+	if(overlay)
+	{
+		delete overlay;
+		overlay = NULL;
+		for(size_t i = 0; i < parts.size(); i++)
+			parts[i]->destroy();
+		parts.clear();
+		dtable::deinit();
+	}
+}
+
+void * partition_dtable::create_part(void * arg)
+{
+	part_job * job = (part_job *) arg;
+	io_limiter::scope limit(job->limiter);
+	job->result = job->base->create(job->dfd, job->name, *job->config, job->source, job->shadow);
+	return NULL;
+}
+
+/* create one partition for each range between the dividers, using the
+ * corresponding source iterator; if there is more than one source iterator,
+ * each is used from a separate thread, otherwise they may all be the same */
+int partition_dtable::create_parts(int dfd, const char * file, const params & config, dtable::iter ** sources, const std::vector<dtype> & dividers, const ktable * shadow)
+{
+	int r, pdt_dfd, meta;
+	params base_config;
+	pdtable_header header;
+	size_t count = dividers.size() + 1;
+	std::vector<part_job> jobs(count);
+	std::vector<pthread_t> threads(count);
+	std::vector<bool> started(count, false);
+	const dtable_factory * base = dtable_factory::lookup(config, "base");
+	if(!base)
+		return -ENOENT;
+	if(!config.get("base_config", &base_config, params()))
+		return -EINVAL;
+	
+	r = mkdirat(dfd, file, 0755);
+	if(r < 0)
+		return r;
+	pdt_dfd = openat(dfd, file, O_RDONLY);
+	if(pdt_dfd < 0)
+	{
+		unlinkat(dfd, file, AT_REMOVEDIR);
+		return pdt_dfd;
+	}
+	
+	for(size_t i = 0; i < count; i++)
+	{
+		jobs[i].base = base;
+		jobs[i].config = &base_config;
+		jobs[i].shadow = shadow;
+		jobs[i].limiter = io_limiter::get_current();
+		jobs[i].source = new range_iter(sources[i], i ? &dividers[i - 1] : NULL, (i < count - 1) ? &dividers[i] : NULL);
+		jobs[i].dfd = pdt_dfd;
+		jobs[i].result = -1;
+		sprintf(jobs[i].name, "pdt_data.%zu", i);
+	}
+	for(size_t i = 0; i < count; i++)
+	{
+		if(count > 1 && sources[i] != sources[0])
+			started[i] = !pthread_create(&threads[i], NULL, create_part, &jobs[i]);
+		if(!started[i])
+			/* no thread for this partition, so just do it here */
+			create_part(&jobs[i]);
+	}
+	r = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		if(started[i])
+			pthread_join(threads[i], NULL);
+		if(jobs[i].result < 0 && r >= 0)
+			r = jobs[i].result;
+		delete jobs[i].source;
+	}
+	if(r < 0)
+		goto fail;
+	
+	header.magic = PDTABLE_MAGIC;
+	header.version = PDTABLE_VERSION;
+	header.part_count = count;
+	meta = openat(pdt_dfd, "pdt_meta", O_WRONLY | O_CREAT, 0644);
+	if(meta < 0)
+	{
+		r = meta;
+		goto fail;
+	}
+	r = pwrite(meta, &header, sizeof(header), 0);
+	close(meta);
+	if(r != sizeof(header))
+		goto fail;
+	close(pdt_dfd);
+	return 0;
+
+fail:
+	close(pdt_dfd);
+	util::rm_r(dfd, file);
+	return (r < 0) ? r : -1;
+}
+
+int partition_dtable::create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow)
+{
+	if(!source_shadow_ok(source, shadow))
+		return -EINVAL;
+	return create_parts(dfd, file, config, &source, std::vector<dtype>(), shadow);
+}
+
+/* The "partitions" parameter gives the number of partitions (and threads) to
+ * use; the default is 4. There may be fewer if the source does not have enough
+ * distinct sampled keys, or if it can't be sampled at all. */
+int partition_dtable::create(int dfd, const char * file, const params & config, const dtable * source, const ktable * shadow)
+{
+	int r, count;
+	std::vector<dtype> samples, dividers;
+	std::vector<dtable::iter *> sources;
+	const blob_comparator * blob_cmp = source->get_blob_cmp();
+	if(!config.get("partitions", &count, 4) || count < 1)
+		return -EINVAL;
+	if(!source_shadow_ok(source, shadow))
+		return -EINVAL;
+	
+	source->sample_keys(count * PDTABLE_SAMPLES, &samples);
+	for(int i = 1; i < count && samples.size(); i++)
+	{
+		const dtype & divider = samples[i * samples.size() / count];
+		/* skip duplicate dividers, which would make empty partitions */
+		if(!dividers.size() || dividers.back().compare(divider, blob_cmp) < 0)
+			dividers.push_back(divider);
+	}
+	
+	/* create the iterators here, rather than in the threads */
+	for(size_t i = 0; i <= dividers.size(); i++)
+		sources.push_back(source->iterator());
+	r = create_parts(dfd, file, config, &sources[0], dividers, shadow);
+	for(size_t i = 0; i < sources.size(); i++)
+		delete sources[i];
+	return r;
+}
+
+const partition_dtable_factory partition_dtable::factory;
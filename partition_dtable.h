@@ -0,0 +1,136 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __PARTITION_DTABLE_H
+#define __PARTITION_DTABLE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error partition_dtable.h is a C++ header file
+#endif
+
+#include <vector>
+
+#include "dtable_factory.h"
+#include "io_limiter.h"
+#include "dtable_wrap_iter.h"
+#include "overlay_dtable.h"
+
+/* A partition dtable splits the keyspace among several underlying read-only
+ * dtables, like keydiv_dtable, except that it chooses the dividers itself when
+ * it is created, using keys sampled from the source. When it is created from a
+ * whole source dtable (as in managed_dtable combines) rather than an iterator,
+ * each partition is written by its own thread. At runtime the partitions are
+ * joined with an overlay dtable, whose key range fences direct each lookup to
+ * the only partition which might contain the key. */
+
+#define PDTABLE_MAGIC 0x5A7E1D09
+#define PDTABLE_VERSION 0
+
+/* keys to sample per partition when choosing the dividers */
+#define PDTABLE_SAMPLES 32
+
+class partition_dtable_factory;
+
+class partition_dtable : public dtable
+{
+public:
+	virtual iter * iterator(ATX_OPT) const
+	{
+		/* returns overlay->iterator() */
+		return iterator_chain_usage(&chain, overlay, atx);
+	}
+	virtual bool present(const dtype & key, bool * found, ATX_OPT) const { return overlay->present(key, found); }
+	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const { return overlay->lookup(key, found); }
+	virtual void lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const
+	{
+		overlay->lookup_sorted(keys, count, values, found);
+	}
+	virtual size_t size() const;
+	virtual bool key_range(dtype * min, dtype * max) const;
+	virtual void sample_keys(size_t count, std::vector<dtype> * samples) const { overlay->sample_keys(count, samples); }
+	
+	virtual int set_blob_cmp(const blob_comparator * cmp);
+	
+	static inline bool static_indexed_access(const params & config) { return false; }
+	
+	/* with only an iterator, there is nothing to sample and just one partition */
+	static int create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow = NULL);
+	static int create(int dfd, const char * file, const params & config, const dtable * source, const ktable * shadow = NULL);
+	static const partition_dtable_factory factory;
+	
+	inline partition_dtable() : overlay(NULL), chain(this) {}
+	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
+	
+protected:
+	void deinit();
+	inline virtual ~partition_dtable()
+	{
+		if(overlay)
+			deinit();
+	}
+	
+private:
+	struct pdtable_header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t part_count;
+	} __attribute__((packed));
+	
+	/* limits an iterator to the keys in [low, high), where NULL is unbounded */
+	class range_iter : public dtable_wrap_iter_noindex
+	{
+	public:
+		virtual bool valid() const;
+		virtual bool next();
+		virtual bool prev();
+		virtual bool first();
+		virtual bool last();
+		virtual bool seek(const dtype & key);
+		virtual bool seek(const dtype_test & test);
+		inline range_iter(dtable::iter * base, const dtype * low, const dtype * high)
+			: dtable_wrap_iter_noindex(base), low(low), high(high)
+		{
+		}
+	
+	private:
+		const dtype * low;
+		const dtype * high;
+	};
+	
+	struct part_job
+	{
+		const dtable_factory * base;
+		const params * config;
+		const ktable * shadow;
+		range_iter * source;
+		/* the creating thread's I/O limiter, to use in the new thread */
+		io_limiter * limiter;
+		int dfd, result;
+		char name[32];
+	};
+	static void * create_part(void * arg);
+	static int create_parts(int dfd, const char * file, const params & config, dtable::iter ** sources, const std::vector<dtype> & dividers, const ktable * shadow);
+	
+	std::vector<dtable *> parts;
+	overlay_dtable * overlay;
+	mutable chain_callback chain;
+};
+
+class partition_dtable_factory : public dtable_ro_factory<partition_dtable>
+{
+public:
+	partition_dtable_factory() : dtable_ro_factory<partition_dtable>("partition_dtable") {}
+	using dtable_ro_factory<partition_dtable>::create;
+	inline virtual int create(int dfd, const char * name, const params & config, const dtable * source, const ktable * shadow = NULL) const
+	{
+		return partition_dtable::create(dfd, name, config, source, shadow);
+	}
+	virtual ~partition_dtable_factory() {}
+};
+
+#endif /* __PARTITION_DTABLE_H */
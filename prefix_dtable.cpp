@@ -0,0 +1,806 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#define _ATFILE_SOURCE
+
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <string.h>
+
+#include "openat.h"
+
+#include "util.h"
+#include "rofile.h"
+#include "rwfile.h"
+#include "prefix_dtable.h"
+
+/* prefix dtable file format:
+ * blocks:
+ * [] = entries, then restart offsets (4 bytes each), then restart count (4 bytes)
+ * block index (one per block):
+ * [] = bytes 0-7: block offset
+ *      bytes 8-11: block size
+ *      bytes 12-15: index of the first entry in the block
+ *      bytes 16-19: first key length
+ *      bytes 20-n: first key
+ * if key type is blob and there is one, blob comparator name
+ * footer (dtable_footer) at the very end of the file
+ * 
+ * each entry:
+ * varint: bytes of key shared with previous key (0 at restart points)
+ * varint: bytes of key not shared
+ * varint: data length (stored incremented by 1, 0 for non-existent entries)
+ * unshared key bytes
+ * data bytes
+ * 
+ * Keys are stored as bytes: uint32 keys in big endian order, so that nearby
+ * keys share prefixes; doubles as they are in memory; and strings and blobs
+ * literally, without any terminator. Varints use 7 bits per byte, low bits
+ * first, with the high bit set on all but the last byte. */
+
+static inline size_t layout_varint(uint8_t * bytes, uint32_t value)
+{
+	size_t i = 0;
+	while(value >= 0x80)
+	{
+		bytes[i++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	bytes[i++] = value;
+	return i;
+}
+
+static inline bool read_varint(const uint8_t * bytes, size_t end, size_t * offset, size_t * value)
+{
+	size_t result = 0;
+	for(int shift = 0; shift < 35 && *offset < end; shift += 7)
+	{
+		uint8_t byte = bytes[(*offset)++];
+		result |= (size_t) (byte & 0x7F) << shift;
+		if(!(byte & 0x80))
+		{
+			*value = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* walks the entries of one block, reconstructing the full keys */
+class prefix_block_reader
+{
+public:
+	inline prefix_block_reader(const blob & raw)
+		: data((const uint8_t *) raw.data()), restarts(0), offset(0), data_end(0)
+	{
+		size_t size = raw.size();
+		if(size < 4)
+			return;
+		restarts = util::read_bytes(data, size - 4, 4);
+		if(!restarts || (size - 4) / 4 < restarts)
+		{
+			restarts = 0;
+			return;
+		}
+		data_end = size - 4 - restarts * 4;
+	}
+	
+	inline size_t restart_count() const
+	{
+		return restarts;
+	}
+	
+	inline void seek_restart(size_t restart)
+	{
+		assert(restart < restarts);
+		offset = util::read_bytes(data, data_end + restart * 4, 4);
+		key.clear();
+	}
+	
+	/* returns false at the end of the block or if the block is malformed */
+	inline bool next_entry()
+	{
+		size_t shared, unshared;
+		if(offset >= data_end)
+			return false;
+		if(!read_varint(data, data_end, &offset, &shared))
+			return false;
+		if(!read_varint(data, data_end, &offset, &unshared))
+			return false;
+		if(!read_varint(data, data_end, &offset, &value_length))
+			return false;
+		if(shared > key.size() || unshared > data_end - offset)
+			return false;
+		key.resize(shared);
+		key.insert(key.end(), &data[offset], &data[offset + unshared]);
+		offset += unshared;
+		value_offset = offset;
+		if(value_length && value_length - 1 > data_end - offset)
+			return false;
+		if(value_length)
+			offset += value_length - 1;
+		return true;
+	}
+	
+	inline const uint8_t * key_data() const
+	{
+		return key.size() ? &key[0] : data;
+	}
+	
+	inline size_t key_size() const
+	{
+		return key.size();
+	}
+	
+	/* stored incremented by 1, as in the file */
+	size_t value_offset, value_length;
+	
+private:
+	const uint8_t * data;
+	size_t restarts;
+	size_t offset, data_end;
+	std::vector<uint8_t> key;
+};
+
+prefix_dtable::iter::iter(const prefix_dtable * source)
+	: iter_source<prefix_dtable>(source), index(0)
+{
+	load();
+}
+
+bool prefix_dtable::iter::valid() const
+{
+	return index < dt_source->key_count;
+}
+
+bool prefix_dtable::iter::next()
+{
+	if(index == dt_source->key_count)
+		return false;
+	index++;
+	return load();
+}
+
+bool prefix_dtable::iter::prev()
+{
+	if(!index)
+		return false;
+	index--;
+	return load();
+}
+
+bool prefix_dtable::iter::first()
+{
+	if(!dt_source->key_count)
+		return false;
+	index = 0;
+	return load();
+}
+
+bool prefix_dtable::iter::last()
+{
+	if(!dt_source->key_count)
+		return false;
+	index = dt_source->key_count - 1;
+	return load();
+}
+
+bool prefix_dtable::iter::load()
+{
+	size_t number;
+	if(index >= dt_source->key_count)
+		return false;
+	if(block.number < dt_source->blocks.size() && index >= dt_source->blocks[block.number].first_index &&
+	   index - dt_source->blocks[block.number].first_index < block.entries.size())
+		return true;
+	number = block.number + 1;
+	/* usually, we are just moving to the next block */
+	if(number >= dt_source->blocks.size() || index < dt_source->blocks[number].first_index ||
+	   (number + 1 < dt_source->blocks.size() && index >= dt_source->blocks[number + 1].first_index))
+		number = dt_source->find_block(index);
+	if(dt_source->decode_block(number, &block) < 0)
+	{
+		/* an unreadable block ends the iteration */
+		index = dt_source->key_count;
+		return false;
+	}
+	return true;
+}
+
+const prefix_dtable::decoded_block::entry & prefix_dtable::iter::current() const
+{
+	/* load() has already decoded the block */
+	assert(index < dt_source->key_count && block.number < dt_source->blocks.size());
+	return block.entries[index - dt_source->blocks[block.number].first_index];
+}
+
+dtype prefix_dtable::iter::key() const
+{
+	const decoded_block::entry & entry = current();
+	return dt_source->make_key(&((const uint8_t *) block.keys.data())[entry.key_offset], entry.key_length);
+}
+
+bool prefix_dtable::iter::seek(const dtype & key)
+{
+	int r = dt_source->find_key(key, &index);
+	return load() && r >= 0;
+}
+
+bool prefix_dtable::iter::seek(const dtype_test & test)
+{
+	int r = dt_source->find_key(test, &index);
+	return load() && r >= 0;
+}
+
+bool prefix_dtable::iter::seek_index(size_t index)
+{
+	/* we allow seeking to one past the end, just
+	 * as we allow getting there with next() */
+	if(index < 0 || index > dt_source->key_count)
+		return false;
+	this->index = index;
+	return load();
+}
+
+size_t prefix_dtable::iter::get_index() const
+{
+	return index;
+}
+
+metablob prefix_dtable::iter::meta() const
+{
+	const decoded_block::entry & entry = current();
+	return entry.value_length ? metablob(entry.value_length - 1) : metablob();
+}
+
+blob prefix_dtable::iter::value() const
+{
+	const decoded_block::entry & entry = current();
+	if(!entry.value_length)
+		return blob();
+	return blob(entry.value_length - 1, &((const uint8_t *) block.raw.data())[entry.value_offset]);
+}
+
+const dtable * prefix_dtable::iter::source() const
+{
+	return dt_source;
+}
+
+dtable::iter * prefix_dtable::iterator(ATX_DEF) const
+{
+	return new iter(this);
+}
+
+bool prefix_dtable::present(const dtype & key, bool * found, ATX_DEF) const
+{
+	size_t index, value_length;
+	if(find_key(key, &index, NULL, &value_length) < 0)
+	{
+		*found = false;
+		return false;
+	}
+	*found = true;
+	return value_length != 0;
+}
+
+blob prefix_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
+{
+	blob raw;
+	size_t index, value_offset, value_length;
+	if(find_key(key, &index, &value_offset, &value_length, &raw) < 0)
+	{
+		*found = false;
+		return blob();
+	}
+	*found = true;
+	if(!value_length)
+		return blob();
+	return blob(value_length - 1, &((const uint8_t *) raw.data())[value_offset]);
+}
+
+blob prefix_dtable::index(size_t index) const
+{
+	blob raw;
+	size_t value_offset, value_length;
+	if(index < 0 || index >= key_count)
+		return blob();
+	if(locate_index(index, &value_offset, &value_length, &raw) < 0 || !value_length)
+		return blob();
+	return blob(value_length - 1, &((const uint8_t *) raw.data())[value_offset]);
+}
+
+bool prefix_dtable::key_range(dtype * min, dtype * max) const
+{
+	decoded_block block;
+	if(!key_count)
+		return false;
+	/* the index has the first key, but the last key is only in the last block */
+	if(decode_block(blocks.size() - 1, &block) < 0)
+		return false;
+	const decoded_block::entry & last = block.entries.back();
+	*min = blocks[0].first_key;
+	*max = make_key(&((const uint8_t *) block.keys.data())[last.key_offset], last.key_length);
+	return true;
+}
+
+bool prefix_dtable::contains_index(size_t index) const
+{
+	blob raw;
+	size_t value_offset, value_length;
+	if(index < 0 || index >= key_count)
+		return false;
+	if(locate_index(index, &value_offset, &value_length, &raw) < 0)
+		return false;
+	return value_length != 0;
+}
+
+const uint8_t * prefix_dtable::key_bytes(const dtype & key, uint8_t * buffer, size_t * length)
+{
+	switch(key.type)
+	{
+		case dtype::UINT32:
+			util::layout_bytes(buffer, (size_t) 0, key.u32, sizeof(uint32_t));
+			*length = sizeof(uint32_t);
+			return buffer;
+		case dtype::DOUBLE:
+			util::memcpy(buffer, &key.dbl, sizeof(double));
+			*length = sizeof(double);
+			return buffer;
+		case dtype::STRING:
+			*length = key.str().length();
+			return (const uint8_t *) key.str().str();
+		case dtype::BLOB:
+			*length = key.blb().size();
+			return (const uint8_t *) key.blb().data();
+	}
+	abort();
+}
+
+dtype prefix_dtable::make_key(const uint8_t * bytes, size_t length) const
+{
+	switch(ktype)
+	{
+		case dtype::UINT32:
+			assert(length == sizeof(uint32_t));
+			return dtype(util::read_bytes(bytes, 0, sizeof(uint32_t)));
+		case dtype::DOUBLE:
+		{
+			double value;
+			assert(length == sizeof(double));
+			util::memcpy(&value, bytes, sizeof(double));
+			return dtype(value);
+		}
+		case dtype::STRING:
+			return dtype((const char *) bytes, length);
+		case dtype::BLOB:
+			return dtype(blob(length, bytes));
+	}
+	abort();
+}
+
+size_t prefix_dtable::find_block(size_t index) const
+{
+	/* binary search for the last block starting at or before index */
+	ssize_t min = 0, max = blocks.size() - 1;
+	assert(index < key_count);
+	while(min < max)
+	{
+		/* round up so that min always advances */
+		ssize_t mid = max - (max - min) / 2;
+		if(blocks[mid].first_index <= index)
+			min = mid;
+		else
+			max = mid - 1;
+	}
+	return min;
+}
+
+template<class T>
+ssize_t prefix_dtable::find_block(const T & test) const
+{
+	/* binary search for the last block whose first key is not too big */
+	ssize_t min = 0, max = blocks.size() - 1;
+	while(min <= max)
+	{
+		/* watch out for overflow! */
+		ssize_t mid = min + (max - min) / 2;
+		int c = test(blocks[mid].first_key);
+		if(c < 0)
+			min = mid + 1;
+		else if(c > 0)
+			max = mid - 1;
+		else
+			return mid;
+	}
+	/* -1 if the key is before the first block */
+	return max;
+}
+
+blob prefix_dtable::read_block(size_t number) const
+{
+	const block_info & info = blocks[number];
+	blob_buffer raw(info.size);
+	raw.set_size(info.size, false);
+	if(fp->read(info.offset, &raw[0], info.size) != (ssize_t) info.size)
+		return blob();
+	return raw;
+}
+
+int prefix_dtable::decode_block(size_t number, decoded_block * block) const
+{
+	size_t count;
+	assert(number < blocks.size());
+	count = ((number + 1 < blocks.size()) ? blocks[number + 1].first_index : key_count) - blocks[number].first_index;
+	block->number = (size_t) -1;
+	block->raw = read_block(number);
+	if(!block->raw.exists())
+		return -EIO;
+	prefix_block_reader reader(block->raw);
+	if(!reader.restart_count())
+		return -EINVAL;
+	block->keys.set_size(0);
+	block->entries.clear();
+	block->entries.reserve(count);
+	reader.seek_restart(0);
+	while(reader.next_entry())
+	{
+		decoded_block::entry entry;
+		entry.key_offset = block->keys.size();
+		entry.key_length = reader.key_size();
+		entry.value_offset = reader.value_offset;
+		entry.value_length = reader.value_length;
+		if(block->keys.append(reader.key_data(), reader.key_size()) < 0)
+			return -ENOMEM;
+		block->entries.push_back(entry);
+	}
+	if(block->entries.size() != count)
+		return -EINVAL;
+	block->number = number;
+	return 0;
+}
+
+int prefix_dtable::locate_index(size_t index, size_t * value_offset, size_t * value_length, blob * raw) const
+{
+	size_t number = find_block(index);
+	size_t position = index - blocks[number].first_index;
+	size_t restart = position / restart_interval;
+	*raw = read_block(number);
+	if(!raw->exists())
+		return -EIO;
+	prefix_block_reader reader(*raw);
+	if(restart >= reader.restart_count())
+		return -EINVAL;
+	/* skip to the nearest restart point, then walk forward */
+	reader.seek_restart(restart);
+	for(position -= restart * restart_interval; reader.next_entry(); position--)
+		if(!position)
+		{
+			*value_offset = reader.value_offset;
+			*value_length = reader.value_length;
+			return 0;
+		}
+	return -EINVAL;
+}
+
+template<class T>
+int prefix_dtable::find_key(const T & test, size_t * index, size_t * value_offset, size_t * value_length, blob * raw) const
+{
+	blob block;
+	size_t position;
+	ssize_t min, max, number = find_block(test);
+	assert(ktype != dtype::BLOB || !cmp_name == !blob_cmp);
+	if(number < 0)
+	{
+		*index = 0;
+		return -ENOENT;
+	}
+	block = read_block(number);
+	prefix_block_reader reader(block);
+	if(!reader.restart_count())
+	{
+		/* the block could not be read, or is malformed */
+		*index = key_count;
+		return block.exists() ? -EINVAL : -EIO;
+	}
+	
+	/* binary search the restart points, which store their keys in full */
+	min = 0;
+	max = reader.restart_count() - 1;
+	while(min < max)
+	{
+		/* round up so that min always advances */
+		ssize_t mid = max - (max - min) / 2;
+		reader.seek_restart(mid);
+		if(!reader.next_entry())
+		{
+			*index = key_count;
+			return -EINVAL;
+		}
+		if(test(make_key(reader.key_data(), reader.key_size())) <= 0)
+			min = mid;
+		else
+			max = mid - 1;
+	}
+	
+	/* then walk forward from the last restart point not after the key */
+	reader.seek_restart(min);
+	position = blocks[number].first_index + min * restart_interval;
+	while(reader.next_entry())
+	{
+		int c = test(make_key(reader.key_data(), reader.key_size()));
+		if(c > 0)
+			break;
+		if(!c)
+		{
+			*index = position;
+			if(value_offset)
+				*value_offset = reader.value_offset;
+			if(value_length)
+				*value_length = reader.value_length;
+			if(raw)
+				*raw = block;
+			return 0;
+		}
+		position++;
+	}
+	/* if we ran off the end of the block, position
+	 * is now the first index of the next block */
+	*index = position;
+	return -ENOENT;
+}
+
+int prefix_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
+{
+	dtable_footer footer;
+	off_t offset;
+	if(fp)
+		deinit();
+	fp = rofile::open_mmap<64, 24>(dfd, file);
+	if(!fp)
+		return -1;
+	if(fp->size() < (off_t) sizeof(footer))
+		goto fail;
+	if(fp->read_type(fp->size() - sizeof(footer), &footer) < 0)
+		goto fail;
+	if(footer.magic != PFDTABLE_MAGIC || footer.version != PFDTABLE_VERSION)
+		goto fail;
+	if(!footer.restart_interval)
+		goto fail;
+	key_count = footer.key_count;
+	restart_interval = footer.restart_interval;
+	switch(footer.key_type)
+	{
+		case 1:
+			ktype = dtype::UINT32;
+			break;
+		case 2:
+			ktype = dtype::DOUBLE;
+			break;
+		case 3:
+			ktype = dtype::STRING;
+			break;
+		case 4:
+			ktype = dtype::BLOB;
+			if(footer.cmp_name_length)
+			{
+				cmp_name = fp->read_string(fp->size() - sizeof(footer) - footer.cmp_name_length, footer.cmp_name_length);
+				if(!cmp_name)
+					goto fail;
+			}
+			break;
+		default:
+			goto fail;
+	}
+	
+	/* read the block index into memory */
+	offset = footer.index_offset;
+	blocks.reserve(footer.block_count);
+	for(uint32_t i = 0; i < footer.block_count; i++)
+	{
+		index_entry entry;
+		if(fp->read_type(offset, &entry) < 0)
+			goto fail;
+		offset += sizeof(entry);
+		if((ktype == dtype::UINT32 && entry.key_length != sizeof(uint32_t)) ||
+		   (ktype == dtype::DOUBLE && entry.key_length != sizeof(double)))
+			goto fail;
+		if(entry.first_index >= key_count || (i && entry.first_index <= blocks[i - 1].first_index))
+			goto fail;
+		uint8_t bytes[entry.key_length];
+		if(fp->read(offset, bytes, entry.key_length) != (ssize_t) entry.key_length)
+			goto fail;
+		offset += entry.key_length;
+		blocks.push_back(block_info(entry, make_key(bytes, entry.key_length)));
+	}
+	if(key_count && (blocks.empty() || blocks[0].first_index))
+		goto fail;
+	
+	return 0;
+
+fail:
+	blocks.clear();
+	delete fp;
+	fp = NULL;
+	return -1;
+}
+
+void prefix_dtable::deinit()
+{
+	if(fp)
+	{
+		blocks.clear();
+		delete fp;
+		fp = NULL;
+		dtable::deinit();
+	}
+}
+
+/* write out the block we have been building up, and start a new one */
+static int finish_block(rwfile * out, blob_buffer * block, std::vector<uint32_t> * restarts)
+{
+	int r;
+	for(size_t i = 0; i < restarts->size(); i++)
+	{
+		r = block->layout_append((*restarts)[i], 4);
+		if(r < 0)
+			return r;
+	}
+	r = block->layout_append(restarts->size(), 4);
+	if(r < 0)
+		return r;
+	r = out->append(*block);
+	if(r < 0)
+		return r;
+	block->set_size(0);
+	restarts->clear();
+	return 0;
+}
+
+int prefix_dtable::create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow)
+{
+	std::vector<index_entry> index;
+	std::vector<blob> first_keys;
+	std::vector<uint32_t> restarts;
+	std::vector<uint8_t> last_key;
+	blob_buffer block;
+	dtype::ctype key_type = source->key_type();
+	const blob_comparator * blob_cmp = source->get_blob_cmp();
+	int block_size, interval;
+	size_t key_count = 0, block_keys = 0;
+	dtable_footer footer;
+	rwfile out;
+	int r;
+	if(!source_shadow_ok(source, shadow))
+		return -EINVAL;
+	if(!config.get("block_size", &block_size, PFDTABLE_BLOCK_SIZE) || block_size < 64)
+		return -EINVAL;
+	if(!config.get("restart_interval", &interval, PFDTABLE_RESTART_INTERVAL) || interval < 1)
+		return -EINVAL;
+	
+	r = out.create(dfd, file);
+	if(r < 0)
+		return r;
+	
+	/* just to be sure */
+	source->first();
+	while(source->valid())
+	{
+		size_t length, shared = 0, header_size = 0;
+		uint8_t buffer[sizeof(double)];
+		uint8_t header[15];
+		const uint8_t * bytes;
+		dtype key = source->key();
+		blob value = source->value();
+		source->next();
+		if(!value.exists())
+			/* omit non-existent entries no longer needed */
+			if(!shadow || !shadow->contains(key))
+				continue;
+		assert(key.type == key_type);
+		bytes = key_bytes(key, buffer, &length);
+		
+		/* start a new block if this entry would overflow the current one */
+		if(block_keys && block.size() + (restarts.size() + 2) * 4 + sizeof(header) + length + value.size() > (size_t) block_size)
+		{
+			r = finish_block(&out, &block, &restarts);
+			if(r < 0)
+				goto fail_unlink;
+			index.back().size = out.end() - index.back().offset;
+			block_keys = 0;
+		}
+		if(!block_keys)
+		{
+			index_entry entry;
+			entry.offset = out.end();
+			entry.size = 0;
+			entry.first_index = key_count;
+			entry.key_length = length;
+			index.push_back(entry);
+			first_keys.push_back(blob(length, bytes));
+		}
+		
+		if(block_keys % interval)
+			while(shared < length && shared < last_key.size() && bytes[shared] == last_key[shared])
+				shared++;
+		else
+			restarts.push_back(block.size());
+		header_size += layout_varint(&header[header_size], shared);
+		header_size += layout_varint(&header[header_size], length - shared);
+		/* we reserve size 0 for non-existent entries, so add 1 */
+		header_size += layout_varint(&header[header_size], value.exists() ? value.size() + 1 : 0);
+		r = block.append(header, header_size);
+		if(r >= 0 && length > shared)
+			r = block.append(&bytes[shared], length - shared);
+		if(r >= 0)
+			r = block.append(value);
+		if(r < 0)
+			goto fail_unlink;
+		last_key.assign(bytes, &bytes[length]);
+		block_keys++;
+		key_count++;
+	}
+	if(block_keys)
+	{
+		r = finish_block(&out, &block, &restarts);
+		if(r < 0)
+			goto fail_unlink;
+		index.back().size = out.end() - index.back().offset;
+	}
+	
+	/* now the block index */
+	footer.index_offset = out.end();
+	for(size_t i = 0; i < index.size(); i++)
+	{
+		r = out.append(&index[i]);
+		if(r >= 0)
+			r = out.append(first_keys[i]);
+		if(r < 0)
+			goto fail_unlink;
+	}
+	
+	footer.magic = PFDTABLE_MAGIC;
+	footer.version = PFDTABLE_VERSION;
+	footer.key_count = key_count;
+	footer.block_count = index.size();
+	footer.restart_interval = interval;
+	footer.cmp_name_length = 0;
+	switch(key_type)
+	{
+		case dtype::UINT32:
+			footer.key_type = 1;
+			break;
+		case dtype::DOUBLE:
+			footer.key_type = 2;
+			break;
+		case dtype::STRING:
+			footer.key_type = 3;
+			break;
+		case dtype::BLOB:
+			footer.key_type = 4;
+			if(blob_cmp)
+			{
+				footer.cmp_name_length = strlen(blob_cmp->name);
+				r = out.append(istr(blob_cmp->name));
+				if(r < 0)
+					goto fail_unlink;
+			}
+			break;
+	}
+	r = out.append(&footer);
+	if(r < 0)
+		goto fail_unlink;
+	
+	r = out.close();
+	if(r < 0)
+		goto fail_unlink;
+	return 0;
+
+fail_unlink:
+	out.close();
+	unlinkat(dfd, file, 0);
+	return (r < 0) ? r : -1;
+}
+
+DEFINE_RO_FACTORY(prefix_dtable);
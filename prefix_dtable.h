@@ -0,0 +1,165 @@
+/* This file is part of Anvil. Anvil is copyright 2007-2010 The Regents
+ * of the University of California. It is distributed under the terms of
+ * version 2 of the GNU GPL. See the file LICENSE for details. */
+
+#ifndef __PREFIX_DTABLE_H
+#define __PREFIX_DTABLE_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/types.h>
+
+#ifndef __cplusplus
+#error prefix_dtable.h is a C++ header file
+#endif
+
+#include <vector>
+
+#include "blob_buffer.h"
+#include "dtable_factory.h"
+
+class rofile;
+
+/* The prefix dtable packs its sorted entries into blocks of roughly a fixed
+ * size. Within a block, each key is stored as the length of the prefix it
+ * shares with the previous key followed by the rest of its bytes, except at
+ * every "restart_interval" entries, where the key is stored in full. A small
+ * array of these restart points at the end of each block allows a binary
+ * search within the block. An index of the first key in each block is kept in
+ * memory, so a lookup reads exactly one block. These dtables are read-only
+ * once they are created with the ::create() method. */
+
+#define PFDTABLE_MAGIC 0x7F3E1B5D
+#define PFDTABLE_VERSION 1
+
+#define PFDTABLE_BLOCK_SIZE 4096
+#define PFDTABLE_RESTART_INTERVAL 16
+
+class prefix_dtable : public dtable
+{
+public:
+	virtual iter * iterator(ATX_OPT) const;
+	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
+	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual blob index(size_t index) const;
+	virtual bool contains_index(size_t index) const;
+	inline virtual size_t size() const { return key_count; }
+	virtual bool key_range(dtype * min, dtype * max) const;
+	
+	static inline bool static_indexed_access(const params & config) { return true; }
+	
+	static int create(int dfd, const char * file, const params & config, dtable::iter * source, const ktable * shadow = NULL);
+	DECLARE_RO_FACTORY(prefix_dtable);
+	
+	inline prefix_dtable() : fp(NULL) {}
+	int init(int dfd, const char * file, const params & config, sys_journal * sysj);
+	
+protected:
+	void deinit();
+	inline virtual ~prefix_dtable()
+	{
+		if(fp)
+			deinit();
+	}
+	
+private:
+	/* the footer is at the end of the file, so that
+	 * create() can write the whole file in one pass */
+	struct dtable_footer {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t key_count;
+		uint32_t block_count;
+		uint64_t index_offset;
+		uint32_t restart_interval;
+		uint32_t cmp_name_length;
+		uint8_t key_type;
+	} __attribute__((packed));
+	
+	struct index_entry {
+		uint64_t offset;
+		uint32_t size;
+		uint32_t first_index;
+		uint32_t key_length;
+	} __attribute__((packed));
+	
+	struct block_info
+	{
+		off_t offset;
+		size_t size;
+		size_t first_index;
+		dtype first_key;
+		inline block_info(const index_entry & entry, const dtype & key)
+			: offset(entry.offset), size(entry.size), first_index(entry.first_index), first_key(key)
+		{
+		}
+	};
+	
+	/* a fully decoded block, for iterators and indexed access */
+	struct decoded_block
+	{
+		struct entry
+		{
+			size_t key_offset, key_length;
+			size_t value_offset;
+			/* stored incremented by 1, as in the file */
+			size_t value_length;
+		};
+		size_t number;
+		blob raw;
+		blob_buffer keys;
+		std::vector<entry> entries;
+		inline decoded_block() : number((size_t) -1) {}
+	};
+	
+	class iter : public iter_source<prefix_dtable>
+	{
+	public:
+		virtual bool valid() const;
+		virtual bool next();
+		virtual bool prev();
+		virtual bool first();
+		virtual bool last();
+		virtual dtype key() const;
+		virtual bool seek(const dtype & key);
+		virtual bool seek(const dtype_test & test);
+		virtual bool seek_index(size_t index);
+		virtual size_t get_index() const;
+		virtual metablob meta() const;
+		virtual blob value() const;
+		virtual const dtable * source() const;
+		inline iter(const prefix_dtable * source);
+		virtual ~iter() {}
+	private:
+		/* decodes the current entry's block, or ends the iteration if it can't */
+		bool load();
+		const decoded_block::entry & current() const;
+		
+		size_t index;
+		decoded_block block;
+	};
+	
+	static const uint8_t * key_bytes(const dtype & key, uint8_t * buffer, size_t * length);
+	dtype make_key(const uint8_t * bytes, size_t length) const;
+	
+	size_t find_block(size_t index) const;
+	template<class T>
+	ssize_t find_block(const T & test) const;
+	blob read_block(size_t number) const;
+	int decode_block(size_t number, decoded_block * block) const;
+	int locate_index(size_t index, size_t * value_offset, size_t * value_length, blob * raw) const;
+	
+	/* finds the key, or the index where it would be, and its value location */
+	inline int find_key(const dtype & key, size_t * index, size_t * value_offset = NULL, size_t * value_length = NULL, blob * raw = NULL) const
+	{
+		return find_key(dtype_static_test(key, blob_cmp), index, value_offset, value_length, raw);
+	}
+	template<class T>
+	int find_key(const T & test, size_t * index, size_t * value_offset = NULL, size_t * value_length = NULL, blob * raw = NULL) const;
+	
+	rofile * fp;
+	size_t key_count, restart_interval;
+	std::vector<block_info> blocks;
+};
+
+#endif /* __PREFIX_DTABLE_H */
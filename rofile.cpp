@@ -4,6 +4,9 @@
 
 #define _ATFILE_SOURCE
 
+#include <map>
+#include <list>
+
 #include "openat.h"
 
 #include "rofile.h"
@@ -29,3 +32,364 @@ void rofile::close()
 		fd = -1;
 	}
 }
+
+/* The shared block cache uses segmented LRU eviction, which resists being
+ * flushed by large scans: new blocks start out on the probationary list, and
+ * only move to the protected list if they are used again while cached. The
+ * protected list is limited to most, but not all, of the budget; when it is
+ * full, its least recently used blocks fall back to the probationary list.
+ * Blocks are always evicted from the probationary list first. Blocks that an
+ * rofile still refers to (in its last_block) may be evicted, but are not
+ * freed until that reference is released. */
+
+struct rofile_shared_block
+{
+	uint64_t file_id;
+	off_t index;
+	ssize_t size;
+	int refs;
+	bool cached, hot;
+	std::list<rofile_shared_block *>::iterator position;
+	uint8_t data[0];
+};
+
+class rofile_block_cache
+{
+public:
+	rofile_shared_block * acquire(uint64_t file_id, off_t index, int fd, ssize_t block_size);
+	void release(rofile_shared_block * block);
+	/* removes all the blocks of the given file from the cache */
+	void drop(uint64_t file_id);
+	void set_budget(size_t bytes);
+	
+	inline size_t get_budget()
+	{
+		scopelock scope(lock);
+		return budget;
+	}
+	
+	inline uint64_t new_file_id()
+	{
+		scopelock scope(lock);
+		return ++last_file_id;
+	}
+	
+	inline void stats(size_t * hits, size_t * misses, size_t * bytes)
+	{
+		scopelock scope(lock);
+		*hits = this->hits;
+		*misses = this->misses;
+		*bytes = used;
+	}
+	
+	inline rofile_block_cache() : budget(0), used(0), hot_used(0), last_file_id(0), hits(0), misses(0) {}
+	
+private:
+	typedef std::pair<uint64_t, off_t> block_key;
+	typedef std::map<block_key, rofile_shared_block *> block_map;
+	typedef std::list<rofile_shared_block *> block_list;
+	
+	/* these must be called with the lock held */
+	void touch(rofile_shared_block * block);
+	void uncache(rofile_shared_block * block);
+	void evict();
+	
+	init_mutex lock;
+	block_map blocks;
+	block_list cold, hot;
+	size_t budget, used, hot_used;
+	uint64_t last_file_id;
+	size_t hits, misses;
+};
+
+static rofile_block_cache * shared_cache()
+{
+	/* never freed, so rofiles destroyed during exit can still use it */
+	static rofile_block_cache * cache = new rofile_block_cache;
+	return cache;
+}
+
+void rofile_block_cache::touch(rofile_shared_block * block)
+{
+	if(block->hot)
+		hot.splice(hot.begin(), hot, block->position);
+	else
+	{
+		/* promote it to the protected list */
+		cold.erase(block->position);
+		hot.push_front(block);
+		block->position = hot.begin();
+		block->hot = true;
+		hot_used += block->size;
+		/* keep the protected list to 80% of the budget */
+		while(hot_used > budget / 5 * 4 && hot.size() > 1)
+		{
+			rofile_shared_block * demote = hot.back();
+			hot.pop_back();
+			hot_used -= demote->size;
+			demote->hot = false;
+			cold.push_front(demote);
+			demote->position = cold.begin();
+		}
+	}
+}
+
+void rofile_block_cache::uncache(rofile_shared_block * block)
+{
+	assert(block->cached);
+	if(block->hot)
+	{
+		hot.erase(block->position);
+		hot_used -= block->size;
+	}
+	else
+		cold.erase(block->position);
+	used -= block->size;
+	blocks.erase(block_key(block->file_id, block->index));
+	block->cached = false;
+	if(!block->refs)
+		free(block);
+}
+
+void rofile_block_cache::evict()
+{
+	while(used > budget)
+	{
+		block_list * list = cold.empty() ? &hot : &cold;
+		if(list->empty())
+			break;
+		uncache(list->back());
+	}
+}
+
+rofile_shared_block * rofile_block_cache::acquire(uint64_t file_id, off_t index, int fd, ssize_t block_size)
+{
+	rofile_shared_block * block;
+	block_map::iterator it;
+	scopelock scope(lock);
+	it = blocks.find(block_key(file_id, index));
+	if(it != blocks.end())
+	{
+		hits++;
+		block = it->second;
+		touch(block);
+		block->refs++;
+		return block;
+	}
+	misses++;
+	/* don't hold the lock while reading the file */
+	scope.unlock();
+	block = (rofile_shared_block *) malloc(sizeof(*block) + block_size);
+	if(!block)
+		return NULL;
+	block->size = io_limiter::pread(fd, block->data, block_size, index * block_size);
+	if(block->size <= 0)
+	{
+		free(block);
+		return NULL;
+	}
+	block->file_id = file_id;
+	block->index = index;
+	block->refs = 1;
+	block->cached = true;
+	block->hot = false;
+	scope.lock();
+	it = blocks.find(block_key(file_id, index));
+	if(it != blocks.end())
+	{
+		/* another thread read it in the meantime */
+		free(block);
+		block = it->second;
+		touch(block);
+		block->refs++;
+		return block;
+	}
+	blocks[block_key(file_id, index)] = block;
+	cold.push_front(block);
+	block->position = cold.begin();
+	used += block->size;
+	evict();
+	return block;
+}
+
+void rofile_block_cache::release(rofile_shared_block * block)
+{
+	scopelock scope(lock);
+	assert(block->refs > 0);
+	if(!--block->refs && !block->cached)
+		free(block);
+}
+
+void rofile_block_cache::drop(uint64_t file_id)
+{
+	scopelock scope(lock);
+	block_map::iterator it = blocks.lower_bound(block_key(file_id, 0));
+	while(it != blocks.end() && it->first.first == file_id)
+	{
+		rofile_shared_block * block = it->second;
+		++it;
+		uncache(block);
+	}
+}
+
+void rofile_block_cache::set_budget(size_t bytes)
+{
+	scopelock scope(lock);
+	budget = bytes;
+	evict();
+}
+
+void rofile::set_shared_cache(size_t bytes)
+{
+	shared_cache()->set_budget(bytes);
+}
+
+bool rofile::shared_cache_enabled()
+{
+	return shared_cache()->get_budget() > 0;
+}
+
+void rofile::shared_cache_stats(size_t * hits, size_t * misses, size_t * bytes)
+{
+	shared_cache()->stats(hits, misses, bytes);
+}
+
+ssize_t rofile_shared::read(off_t offset, void * data, ssize_t size, bool do_lock) const
+{
+	ssize_t left = size;
+	if(size > block_size)
+		return io_limiter::pread(fd, data, size, offset);
+	io_limiter::defer defer;
+	scopelock scope(lock, do_lock);
+	lock.assert_locked();
+	while(left)
+	{
+		off_t index = offset / block_size;
+		ssize_t start = offset - index * block_size;
+		ssize_t total;
+		const rofile_shared_block * block = get_block(index);
+		if(!block || start >= block->size)
+			break;
+		total = block->size - start;
+		if(left < total)
+			total = left;
+		util::memcpy(data, &block->data[start], total);
+		offset += total;
+		data = &((uint8_t *) data)[total];
+		left -= total;
+	}
+	return size - left;
+}
+
+const void * rofile_shared::page(off_t index)
+{
+	const rofile_shared_block * block;
+	lock.assert_locked();
+	block = get_block(index);
+	return block ? block->data : NULL;
+}
+
+const rofile_shared_block * rofile_shared::get_block(off_t index) const
+{
+	rofile_shared_block * block;
+	if(last_block && last_block->index == index)
+		return last_block;
+	if(index * block_size >= f_size)
+		return NULL;
+	block = shared_cache()->acquire(file_id, index, fd, block_size);
+	if(!block)
+		return NULL;
+	if(last_block)
+		shared_cache()->release(last_block);
+	last_block = block;
+	return block;
+}
+
+void rofile_shared::reset()
+{
+	if(last_block)
+	{
+		shared_cache()->release(last_block);
+		last_block = NULL;
+	}
+	if(file_id)
+		shared_cache()->drop(file_id);
+	/* a new file ID, since the file may have changed */
+	file_id = shared_cache()->new_file_id();
+}
+
+rofile_shared::~rofile_shared()
+{
+	if(last_block)
+		shared_cache()->release(last_block);
+	if(file_id)
+		shared_cache()->drop(file_id);
+}
+
+ssize_t rofile_mapped::read(off_t offset, void * data, ssize_t size, bool do_lock) const
+{
+	/* pread() is thread-safe too, so this never needs the lock */
+	if(!map)
+		return io_limiter::pread(fd, data, size, offset);
+	if(offset < 0 || offset >= f_size)
+		return 0;
+	if(size > f_size - offset)
+		size = f_size - offset;
+	util::memcpy(data, &map[offset], size);
+	return size;
+}
+
+const void * rofile_mapped::page(off_t index)
+{
+	off_t offset = index * page_size;
+	if(offset < 0 || offset >= f_size)
+		return NULL;
+	if(map)
+		return &map[offset];
+	lock.assert_locked();
+	if(buffer_index == index)
+		return buffer;
+	if(!buffer)
+	{
+		buffer = (uint8_t *) malloc(page_size);
+		if(!buffer)
+			return NULL;
+	}
+	buffer_index = -1;
+	if(io_limiter::pread(fd, buffer, page_size, offset) <= 0)
+		return NULL;
+	buffer_index = index;
+	return buffer;
+}
+
+void rofile_mapped::unmap()
+{
+	if(map)
+	{
+		munmap((void *) map, map_size);
+		map = NULL;
+		map_size = 0;
+	}
+}
+
+void rofile_mapped::reset()
+{
+	void * data;
+	unmap();
+	buffer_index = -1;
+	/* files too large for the address space will just use pread() */
+	if(f_size <= 0 || (off_t) (size_t) f_size != f_size)
+		return;
+	data = mmap(NULL, f_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(data == MAP_FAILED)
+		return;
+	map = (const uint8_t *) data;
+	map_size = f_size;
+}
+
+rofile_mapped::~rofile_mapped()
+{
+	unmap();
+	if(buffer)
+		free(buffer);
+}
@@ -18,6 +18,7 @@
 #include "istr.h"
 #include "util.h"
 #include "locking.h"
+#include "io_limiter.h"
 
 /* This class provides a stdio-like wrapper around a read-only file descriptor,
  * keeping track of several buffers for file data preread from different parts
@@ -25,6 +26,16 @@
  * the file system buffer cache to do most of the real caching work; this class
  * just amortizes the cost of system calls over many small read requests. */
 
+/* For immutable files which are read concurrently, the whole file can instead
+ * be mapped into memory at once, so that reads need no locking at all. See
+ * open_mapped() below. */
+
+/* Alternatively, all rofile instances can share a single process-wide cache of
+ * file blocks, with one overall memory budget, instead of each having its own
+ * fixed set of buffers. See set_shared_cache() below. */
+
+struct rofile_shared_block;
+
 class rofile
 {
 public:
@@ -66,6 +77,11 @@ public:
 	 * acquiring the init_mutex lock (see below) on this rofile instance */
 	virtual const void * page(off_t index) = 0;
 	
+	/* returns true if neither read() nor page() needs the lock below to be
+	 * held, in which case the pointers returned by page() remain valid for
+	 * as long as this rofile is open */
+	virtual bool lock_free() const { return false; }
+	
 	/* buffer_size is in KiB */
 	template<ssize_t buffer_size, int buffer_count>
 	static rofile * open(int dfd, const char * file);
@@ -74,9 +90,21 @@ public:
 	template<ssize_t buffer_size, int buffer_count>
 	static rofile * open_mmap(int dfd, const char * file);
 	
+	/* maps the whole file, falling back to pread() if it can't be mapped;
+	 * page_size is in KiB, and is only used by page() */
+	template<ssize_t page_size>
+	static rofile * open_mapped(int dfd, const char * file);
+	
 	/* size of file in bytes */
 	inline off_t size() const { return f_size; }
 	
+	/* sets the memory budget of the shared block cache in bytes; if it is
+	 * nonzero, rofiles opened afterward (with either method above) will use
+	 * the shared cache instead of their own buffers, and will use pread() */
+	static void set_shared_cache(size_t bytes);
+	static bool shared_cache_enabled();
+	static void shared_cache_stats(size_t * hits, size_t * misses, size_t * bytes);
+	
 	/* public so callers can lock it with scopelocks */
 	mutable init_mutex lock;
 	
@@ -112,7 +140,7 @@ private:
 		inline bool load(int fd, off_t byte, off_t f_size, int lru_count)
 		{
 			offset = byte - (byte % buffer_size);
-			size = pread(fd, data, buffer_size, offset);
+			size = io_limiter::pread(fd, data, buffer_size, offset);
 			if(size <= 0)
 			{
 				offset = -1;
@@ -210,7 +238,8 @@ public:
 	{
 		ssize_t left = size;
 		if(size > buffer_size)
-			return pread(fd, data, size, offset);
+			return io_limiter::pread(fd, data, size, offset);
+		io_limiter::defer defer;
 		scopelock scope(lock, do_lock);
 		lock.assert_locked();
 		/* we will need at most two buffers now */
@@ -303,6 +332,50 @@ private:
 	}
 };
 
+/* a rofile using the shared block cache; block_size is in bytes */
+class rofile_shared : public rofile
+{
+public:
+	virtual ssize_t read(off_t offset, void * data, ssize_t size, bool do_lock) const;
+	virtual const void * page(off_t index);
+	
+	inline rofile_shared(ssize_t block_size) : block_size(block_size), file_id(0), last_block(NULL) {}
+	virtual ~rofile_shared();
+	
+private:
+	virtual void reset();
+	
+	/* returns the requested block and keeps a reference to it in last_block */
+	const rofile_shared_block * get_block(off_t index) const;
+	
+	ssize_t block_size;
+	uint64_t file_id;
+	mutable rofile_shared_block * last_block;
+};
+
+/* a rofile with the whole file mapped into memory; page_size is in bytes */
+class rofile_mapped : public rofile
+{
+public:
+	virtual ssize_t read(off_t offset, void * data, ssize_t size, bool do_lock) const;
+	virtual const void * page(off_t index);
+	virtual bool lock_free() const { return map != NULL; }
+	
+	inline rofile_mapped(ssize_t page_size) : page_size(page_size), map(NULL), map_size(0), buffer(NULL), buffer_index(-1) {}
+	virtual ~rofile_mapped();
+	
+private:
+	virtual void reset();
+	void unmap();
+	
+	ssize_t page_size;
+	const uint8_t * map;
+	size_t map_size;
+	/* used by page() only if the file could not be mapped */
+	uint8_t * buffer;
+	off_t buffer_index;
+};
+
 /* the buffer sizes must all match */
 #define ROFILE_IMPL(buffer_size, buffer_count, method) \
 	rofile_impl<(buffer_size) * 1024, buffer_count, buffer<(buffer_size) * 1024, method##_buffer<(buffer_size) * 1024> > >
@@ -310,7 +383,11 @@ private:
 template<ssize_t buffer_size, int buffer_count>
 rofile * rofile::open(int dfd, const char * file)
 {
-	rofile * size = new ROFILE_IMPL(buffer_size, buffer_count, pread);
+	rofile * size;
+	if(shared_cache_enabled())
+		size = new rofile_shared(buffer_size * 1024);
+	else
+		size = new ROFILE_IMPL(buffer_size, buffer_count, pread);
 	if(size)
 	{
 		int r = size->open(dfd, file);
@@ -326,7 +403,32 @@ rofile * rofile::open(int dfd, const char * file)
 template<ssize_t buffer_size, int buffer_count>
 rofile * rofile::open_mmap(int dfd, const char * file)
 {
-	rofile * size = new ROFILE_IMPL(buffer_size, buffer_count, mmap);
+	rofile * size;
+	if(shared_cache_enabled())
+		size = new rofile_shared(buffer_size * 1024);
+	else
+		size = new ROFILE_IMPL(buffer_size, buffer_count, mmap);
+	if(size)
+	{
+		int r = size->open(dfd, file);
+		if(r < 0)
+		{
+			delete size;
+			size = NULL;
+		}
+	}
+	return size;
+}
+
+template<ssize_t page_size>
+rofile * rofile::open_mapped(int dfd, const char * file)
+{
+	rofile * size;
+	/* the shared cache has a memory budget, which mapping would ignore */
+	if(shared_cache_enabled())
+		size = new rofile_shared(page_size * 1024);
+	else
+		size = new rofile_mapped(page_size * 1024);
 	if(size)
 	{
 		int r = size->open(dfd, file);
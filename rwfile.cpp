@@ -12,6 +12,7 @@
 
 #include "util.h"
 #include "transaction.h"
+#include "io_limiter.h"
 #include "rwfile.h"
 
 int rwfile::create(int dfd, const char * file, bool tx_external, mode_t mode)
@@ -67,7 +68,7 @@ int rwfile::flush()
 		tx_start_external();
 	while(written < filled)
 	{
-		r = pwrite(fd, &buffer[written], filled - written, write_offset);
+		r = io_limiter::pwrite(fd, &buffer[written], filled - written, write_offset);
 		if(r <= 0)
 		{
 			if(errno == EINTR)
@@ -178,7 +179,7 @@ ssize_t rwfile::append(const void * data, ssize_t size)
 		while(written < size)
 		{
 			/* can't use void * in arithmetic... */
-			r = pwrite(fd, &((uint8_t *) data)[written], size - written, write_offset);
+			r = io_limiter::pwrite(fd, &((uint8_t *) data)[written], size - written, write_offset);
 			if(r <= 0)
 			{
 				if(errno == EINTR)
@@ -219,6 +220,86 @@ ssize_t rwfile::append(const void * data, ssize_t size)
 	return orig;
 }
 
+ssize_t rwfile::appendv(const struct iovec * iov, int count)
+{
+	ssize_t r, total = 0;
+	for(int i = 0; i < count; i++)
+		total += iov[i].iov_len;
+	
+#ifdef __linux__
+	if(total > buffer_size)
+	{
+		ssize_t written = 0;
+		bool failed = false;
+		struct iovec left[RWFILE_IOV_BATCH];
+		/* switch to write mode if necessary */
+		if(!write_mode)
+		{
+			write_mode = true;
+			filled = 0;
+		}
+		r = flush();
+		if(r < 0)
+			return r;
+		if(handler)
+		{
+			r = handler->pre();
+			if(r < 0)
+				return r;
+		}
+		if(external)
+			tx_start_external();
+		for(int base = 0; !failed && base < count; base += RWFILE_IOV_BATCH)
+		{
+			int first = 0, batch = count - base;
+			ssize_t size = 0;
+			if(batch > RWFILE_IOV_BATCH)
+				batch = RWFILE_IOV_BATCH;
+			util::memcpy(left, &iov[base], batch * sizeof(*left));
+			for(int i = 0; i < batch; i++)
+				size += left[i].iov_len;
+			while(size > 0)
+			{
+				r = io_limiter::pwritev(fd, &left[first], batch - first, write_offset);
+				if(r <= 0)
+				{
+					if(errno == EINTR)
+						continue;
+					failed = true;
+					break;
+				}
+				written += r;
+				write_offset += r;
+				size -= r;
+				/* skip over whatever was written */
+				while(first < batch && (size_t) r >= left[first].iov_len)
+					r -= left[first++].iov_len;
+				if(r)
+				{
+					/* can't use void * in arithmetic... */
+					left[first].iov_base = &((uint8_t *) left[first].iov_base)[r];
+					left[first].iov_len -= r;
+				}
+			}
+		}
+		if(handler)
+			handler->post();
+		if(external)
+			tx_end_external(true);
+		return written ? written : r;
+	}
+#endif
+	
+	/* small enough to buffer (or no pwritev()), so just append each piece */
+	for(int i = 0; i < count; i++)
+	{
+		r = append(iov[i].iov_base, iov[i].iov_len);
+		if(r != (ssize_t) iov[i].iov_len)
+			return (r < 0) ? r : -1;
+	}
+	return total;
+}
+
 int rwfile::pad(ssize_t size)
 {
 	/* this should suffice for now; it can certainly be improved */
@@ -247,14 +328,14 @@ ssize_t rwfile::read(off_t offset, void * data, ssize_t size)
 	
 	/* handle large reads without the buffer */
 	if(size > buffer_size)
-		return pread(fd, data, size, offset);
+		return io_limiter::pread(fd, data, size, offset);
 	
 	if(write_mode || offset < read_offset || read_offset + filled <= offset)
 	{
 		/* current buffer is useless, switch it out */
 		write_mode = false;
 		read_offset = offset;
-		filled = pread(fd, buffer, buffer_size, offset);
+		filled = io_limiter::pread(fd, buffer, buffer_size, offset);
 		if(filled <= 0)
 			return filled;
 	}
@@ -277,7 +358,7 @@ ssize_t rwfile::read(off_t offset, void * data, ssize_t size)
 	
 	/* get the next buffer, which should be sufficient */
 	read_offset = offset;
-	filled = pread(fd, buffer, buffer_size, offset);
+	filled = io_limiter::pread(fd, buffer, buffer_size, offset);
 	if(filled > 0)
 	{
 		ssize_t left = (size < filled) ? size : filled;
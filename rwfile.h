@@ -6,8 +6,10 @@
 #define __RWFILE_H
 
 #include <assert.h>
+#include <limits.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 
 #ifndef __cplusplus
@@ -17,6 +19,13 @@
 #include "blob.h"
 #include "istr.h"
 
+/* appendv() passes at most this many pieces to each pwritev() */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define RWFILE_IOV_BATCH IOV_MAX
+#else
+#define RWFILE_IOV_BATCH 64
+#endif
+
 /* This class provides a stdio-like wrapper around a read/write file descriptor,
  * allowing data to be appended to the file (starting at a given position) and
  * optionally either calling a given handler or starting an external transaction
@@ -77,6 +86,12 @@ public:
 		return external;
 	}
 	
+	/* for syncing the file, e.g. with tx_add_sync_fd() */
+	inline int get_fd() const
+	{
+		return fd;
+	}
+	
 	/* return the current idea of the end of the file */
 	inline off_t end() const
 	{
@@ -86,6 +101,10 @@ public:
 	/* append some data to the file */
 	ssize_t append(const void * data, ssize_t size);
 	
+	/* append several pieces of data to the file; if they won't fit in the
+	 * buffer, they are written directly, RWFILE_IOV_BATCH pieces per call */
+	ssize_t appendv(const struct iovec * iov, int count);
+	
 	/* appends padding zeroes to the file */
 	int pad(ssize_t size);
 	
@@ -172,26 +172,46 @@ dtype simple_dtable::get_key(size_t index, size_t * data_length, off_t * data_of
 			return dtype(value);
 		}
 		case dtype::STRING:
+			/* the LRU in the string table needs the lock */
+			if(fp->lock_free())
+				return dtype(st.copy(util::read_bytes(bytes, 0, key_size)));
 			return dtype(st.get(util::read_bytes(bytes, 0, key_size), lock));
 		case dtype::BLOB:
+			if(fp->lock_free())
+				return dtype(st.copy_blob(util::read_bytes(bytes, 0, key_size)));
 			return dtype(st.get_blob(util::read_bytes(bytes, 0, key_size), lock));
 	}
 	abort();
 }
 
+bool simple_dtable::probe(const stringtbl::raw_key & key, size_t index, size_t * data_length, off_t * data_offset, int * c) const
+{
+	uint8_t size = key_size + length_size + offset_size;
+	uint8_t bytes[size];
+	if(fp->read(key_start_off + size * index, bytes, size, false) != size)
+		return false;
+	if(data_length)
+		*data_length = ((size_t) util::read_bytes(bytes, key_size, length_size)) - 1;
+	if(data_offset)
+		*data_offset = util::read_bytes(bytes, key_size + length_size, offset_size);
+	return st.compare(util::read_bytes(bytes, 0, key_size), key.data, key.size, c);
+}
+
 template<class T>
-int simple_dtable::find_key(const T & test, size_t * index, size_t * data_length, off_t * data_offset) const
+int simple_dtable::find_key(const T & test, size_t * index, size_t * data_length, off_t * data_offset, size_t first) const
 {
 	/* binary search */
-	ssize_t min = 0, max = key_count - 1;
+	ssize_t min = first, max = key_count - 1;
 	assert(ktype != dtype::BLOB || !cmp_name == !blob_cmp);
-	scopelock scope(fp->lock);
+	io_limiter::defer defer;
+	scopelock scope(fp->lock, !fp->lock_free());
 	while(min <= max)
 	{
 		/* watch out for overflow! */
 		ssize_t mid = min + (max - min) / 2;
-		dtype value = get_key(mid, data_length, data_offset, false);
-		int c = test(value);
+		int c;
+		if(!probe(test, mid, data_length, data_offset, &c))
+			return -EIO;
 		if(c < 0)
 			min = mid + 1;
 		else if(c > 0)
@@ -245,6 +265,24 @@ blob simple_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
 	return get_value(data_length, data_offset);
 }
 
+void simple_dtable::lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_DEF) const
+{
+	/* each key can only be at or after the position of the one before it,
+	 * so each binary search can start where the last one ended */
+	size_t first = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t data_length;
+		off_t data_offset;
+		int r = find_key(keys[i], &data_length, &data_offset, &first, first);
+		found[i] = r >= 0;
+		if(r < 0 || data_length == (size_t) -1)
+			values[i] = blob();
+		else
+			values[i] = get_value(data_length, data_offset);
+	}
+}
+
 blob simple_dtable::index(size_t index) const
 {
 	if(index < 0 || index >= key_count)
@@ -261,13 +299,30 @@ bool simple_dtable::contains_index(size_t index) const
 	return data_length != (size_t) -1;
 }
 
+bool simple_dtable::key_range(dtype * min, dtype * max) const
+{
+	if(!key_count)
+		return false;
+	*min = get_key(0);
+	*max = get_key(key_count - 1);
+	return true;
+}
+
+/* If the "mapped" parameter is set, the whole file is mapped into memory, so
+ * that lookups can run concurrently without locking. */
 int simple_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
 {
 	int r = -1;
+	bool mapped;
 	dtable_header header;
 	if(fp)
 		deinit();
-	fp = rofile::open_mmap<64, 24>(dfd, file);
+	if(!config.get("mapped", &mapped, false))
+		return -EINVAL;
+	if(mapped)
+		fp = rofile::open_mapped<64>(dfd, file);
+	else
+		fp = rofile::open_mmap<64, 24>(dfd, file);
 	if(!fp)
 		return -1;
 	if(fp->read_type(0, &header) < 0)
@@ -343,23 +398,37 @@ int simple_dtable::create(int dfd, const char * file, const params & config, dta
 {
 	std::vector<istr> strings;
 	std::vector<blob> blobs;
+	std::vector<create_entry> entries;
 	dtype::ctype key_type = source->key_type();
 	const blob_comparator * blob_cmp = source->get_blob_cmp();
 	size_t key_count = 0, max_data_size = 0, total_data_size = 0;
 	uint32_t max_key = 0;
 	dtable_header header;
 	int r, size;
-	rwfile out;
+	rwfile out, data;
+	char data_name[strlen(file) + 6];
 	if(!source_shadow_ok(source, shadow))
 		return -EINVAL;
+	
+	/* We make only one pass over the source iterator, since it is often an
+	 * overlay of several other dtables and thus expensive to iterate. Keys
+	 * are kept in memory (we need all the strings or blobs for the string
+	 * table anyway), while the values are spooled to a temporary file and
+	 * copied into place once we know where the data section will start. */
+	sprintf(data_name, "%s.data", file);
+	r = data.create(dfd, data_name);
+	if(r < 0)
+		return r;
+	
 	/* just to be sure */
 	source->first();
 	while(source->valid())
 	{
+		create_entry entry;
 		dtype key = source->key();
-		metablob meta = source->meta();
+		blob value = source->value();
 		source->next();
-		if(!meta.exists())
+		if(!value.exists())
 			/* omit non-existent entries no longer needed */
 			if(!shadow || !shadow->contains(key))
 				continue;
@@ -370,21 +439,34 @@ int simple_dtable::create(int dfd, const char * file, const params & config, dta
 			case dtype::UINT32:
 				if(key.u32 > max_key)
 					max_key = key.u32;
+				entry.u32 = key.u32;
 				break;
 			case dtype::DOUBLE:
-				/* nothing to do */
+				entry.dbl = key.dbl;
 				break;
 			case dtype::STRING:
-				strings.push_back(key.str);
+				strings.push_back(key.str());
 				break;
 			case dtype::BLOB:
-				blobs.push_back(key.blb);
+				blobs.push_back(key.blb());
 				break;
 		}
-		if(meta.size() > max_data_size)
-			max_data_size = meta.size();
-		total_data_size += meta.size();
+		/* we reserve size 0 for non-existent entries, so add 1 */
+		entry.length = value.exists() ? value.size() + 1 : 0;
+		entries.push_back(entry);
+		if(value.size() > max_data_size)
+			max_data_size = value.size();
+		total_data_size += value.size();
+		/* nonexistent blobs have size 0 */
+		if(!value.size())
+			continue;
+		r = data.append(value);
+		if(r < 0)
+			goto fail_data;
 	}
+	r = data.flush();
+	if(r < 0)
+		goto fail_data;
 	
 	/* now write the file */
 	header.magic = SDTABLE_MAGIC;
@@ -416,7 +498,7 @@ int simple_dtable::create(int dfd, const char * file, const params & config, dta
 	
 	r = out.create(dfd, file);
 	if(r < 0)
-		return r;
+		goto fail_data;
 	r = out.append(&header);
 	if(r < 0)
 		goto fail_unlink;
@@ -441,71 +523,86 @@ int simple_dtable::create(int dfd, const char * file, const params & config, dta
 	}
 	
 	/* now the key array */
-	max_key = 0;
 	total_data_size = 0;
-	source->first();
-	while(source->valid())
+	for(size_t index = 0; index < key_count; index++)
 	{
 		int i = 0;
 		uint8_t bytes[size];
-		dtype key = source->key();
-		metablob meta = source->meta();
-		source->next();
-		if(!meta.exists())
-			/* omit non-existent entries no longer needed */
-			if(!shadow || !shadow->contains(key))
-				continue;
-		switch(key.type)
+		const create_entry & entry = entries[index];
+		switch(key_type)
 		{
 			case dtype::UINT32:
-				util::layout_bytes(bytes, &i, key.u32, header.key_size);
+				util::layout_bytes(bytes, &i, entry.u32, header.key_size);
 				break;
 			case dtype::DOUBLE:
-				util::memcpy(bytes, &key.dbl, sizeof(double));
+				util::memcpy(bytes, &entry.dbl, sizeof(double));
 				i += sizeof(double);
 				break;
 			case dtype::STRING:
-				/* no need to locate the string; it's the next one */
-				util::layout_bytes(bytes, &i, max_key, header.key_size);
-				max_key++;
-				break;
 			case dtype::BLOB:
-				/* no need to locate the blob; it's the next one */
-				util::layout_bytes(bytes, &i, max_key, header.key_size);
-				max_key++;
+				/* no need to locate the string or blob; it's the next one */
+				util::layout_bytes(bytes, &i, index, header.key_size);
 				break;
 		}
-		util::layout_bytes(bytes, &i, meta.exists() ? meta.size() + 1 : 0, header.length_size);
+		util::layout_bytes(bytes, &i, entry.length, header.length_size);
 		util::layout_bytes(bytes, &i, total_data_size, header.offset_size);
 		r = out.append(bytes, i);
 		if(r != i)
 			goto fail_unlink;
-		total_data_size += meta.size();
+		if(entry.length)
+			total_data_size += entry.length - 1;
 	}
 	
-	/* and the data itself */
-	source->first();
-	while(source->valid())
-	{
-		blob value = source->value();
-		source->next();
-		/* nonexistent blobs have size 0 */
-		if(!value.size())
-			continue;
-		r = out.append(value);
-		if(r < 0)
-			goto fail_unlink;
-	}
+	/* and the data itself, copied from the temporary file */
+	r = copy_data(&out, &data, total_data_size);
+	if(r < 0)
+		goto fail_unlink;
 	
 	r = out.close();
 	if(r < 0)
 		goto fail_unlink;
+	data.close();
+	unlinkat(dfd, data_name, 0);
 	return 0;
 	
 fail_unlink:
 	out.close();
 	unlinkat(dfd, file, 0);
+fail_data:
+	data.close();
+	unlinkat(dfd, data_name, 0);
 	return (r < 0) ? r : -1;
 }
 
+int simple_dtable::copy_data(rwfile * out, rwfile * data, size_t total_size)
+{
+	/* larger than the rwfile buffer, so reads go straight to pread() */
+	const ssize_t chunk_size = 65536;
+	uint8_t * chunk = new uint8_t[chunk_size];
+	off_t offset = 0;
+	int r = 0;
+	if(!chunk)
+		return -ENOMEM;
+	while(offset < (off_t) total_size)
+	{
+		ssize_t size = total_size - offset;
+		if(size > chunk_size)
+			size = chunk_size;
+		size = data->read(offset, chunk, size);
+		if(size <= 0)
+		{
+			r = size ? (int) size : -EIO;
+			break;
+		}
+		if(out->append(chunk, size) != size)
+		{
+			r = -1;
+			break;
+		}
+		offset += size;
+	}
+	delete[] chunk;
+	return r;
+}
+
 DEFINE_RO_FACTORY(simple_dtable);
@@ -18,6 +18,7 @@
 #include "dtable_factory.h"
 
 class rofile;
+class rwfile;
 
 /* The simple dtable does nothing fancy to store the blobs efficiently. It just
  * stores the key and the blob literally, including size information. These
@@ -38,9 +39,11 @@ public:
 	virtual iter * iterator(ATX_OPT) const;
 	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
 	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
+	virtual void lookup_sorted(const dtype * keys, size_t count, blob * values, bool * found, ATX_OPT) const;
 	virtual blob index(size_t index) const;
 	virtual bool contains_index(size_t index) const;
 	inline virtual size_t size() const { return key_count; }
+	virtual bool key_range(dtype * min, dtype * max) const;
 	
 	static inline bool static_indexed_access(const params & config) { return true; }
 	
@@ -69,6 +72,18 @@ private:
 		uint8_t offset_size;
 	} __attribute__((packed));
 	
+	/* used by create() to remember the key array while spooling values */
+	struct create_entry
+	{
+		union
+		{
+			uint32_t u32;
+			double dbl;
+		};
+		/* stored incremented by 1, as in the file */
+		uint32_t length;
+	};
+	
 	class iter : public iter_source<simple_dtable>
 	{
 	public:
@@ -92,15 +107,36 @@ private:
 	};
 	
 	dtype get_key(size_t index, size_t * data_length = NULL, off_t * data_offset = NULL, bool lock = true) const;
-	inline int find_key(const dtype & key, size_t * data_length, off_t * data_offset = NULL, size_t * index = NULL) const
+	/* string and blob keys in lock-free files are compared in place, rather
+	 * than copying every key that the binary search looks at */
+	inline bool in_place(const dtype & key) const
+	{
+		if(!fp->lock_free())
+			return false;
+		if(ktype == dtype::STRING)
+			return key.str();
+		return ktype == dtype::BLOB && !blob_cmp && key.blb().exists();
+	}
+	inline int find_key(const dtype & key, size_t * data_length, off_t * data_offset = NULL, size_t * index = NULL, size_t first = 0) const
 	{
-		return find_key(dtype_static_test(key, blob_cmp), index, data_length, data_offset);
+		if(in_place(key))
+			return find_key(stringtbl::raw_key(key), index, data_length, data_offset, first);
+		return find_key(dtype_static_test(key, blob_cmp), index, data_length, data_offset, first);
 	}
 	template<class T>
-	int find_key(const T & test, size_t * index, size_t * data_length = NULL, off_t * data_offset = NULL) const;
+	int find_key(const T & test, size_t * index, size_t * data_length = NULL, off_t * data_offset = NULL, size_t first = 0) const;
+	template<class T>
+	inline bool probe(const T & test, size_t index, size_t * data_length, off_t * data_offset, int * c) const
+	{
+		*c = test(get_key(index, data_length, data_offset, false));
+		return true;
+	}
+	bool probe(const stringtbl::raw_key & key, size_t index, size_t * data_length, off_t * data_offset, int * c) const;
 	blob get_value(size_t data_length, off_t data_offset) const;
 	blob get_value(size_t index) const;
 	
+	static int copy_data(rwfile * out, rwfile * data, size_t total_size);
+	
 	rofile * fp;
 	size_t key_count;
 	stringtbl st;
@@ -126,7 +126,7 @@ int simple_ext_index::add(const dtype & key, const dtype & pri)
 	if(!old.exists())
 		return -1;
 	if(ref_key_type == dtype::STRING)
-		old << strlen(pri.str);
+		old << strlen(pri.str());
 	return rw_store->insert(key, old << pri);
 }
 
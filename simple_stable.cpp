@@ -223,7 +223,7 @@ int simple_stable::load_columns()
 		dtype key = source->key();
 		assert(key.type == dtype::STRING);
 		/* skip internal entries */
-		if(key.str[0] == '_')
+		if(key.str()[0] == '_')
 		{
 			source->next();
 			continue;
@@ -234,7 +234,7 @@ int simple_stable::load_columns()
 		/* skip removed columns */
 		if(!value.exists())
 			continue;
-		column_info * c = &column_map[key.str];
+		column_info * c = &column_map[key.str()];
 		c->row_count = value.index<size_t>(0);
 		switch(value[sizeof(size_t)])
 		{
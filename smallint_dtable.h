@@ -24,6 +24,7 @@ public:
 	virtual blob index(size_t index) const;
 	virtual bool contains_index(size_t index) const;
 	virtual size_t size() const;
+	virtual bool key_range(dtype * min, dtype * max) const { return base->key_range(min, max); }
 	/* writable, insert, remove? */
 	
 	inline virtual int set_blob_cmp(const blob_comparator * cmp)
@@ -29,6 +29,7 @@ int stringtbl::init(const rofile * fp, off_t start, bool do_lock)
 	off_t offset = start + sizeof(header);
 	if(this->fp)
 		deinit();
+	io_limiter::defer defer;
 	scopelock scope(fp->lock, do_lock);
 	r = fp->read_type(start, &header, false);
 	if(r < 0)
@@ -83,12 +84,23 @@ void stringtbl::deinit()
 	}
 }
 
+int stringtbl::read_entry(ssize_t index, ssize_t * length, off_t * offset) const
+{
+	int r, bc = 0;
+	uint8_t buffer[8];
+	r = fp->read(start + sizeof(st_header) + index * bytes[2], buffer, bytes[2], false);
+	if(r != bytes[2])
+		return (r < 0) ? r : -1;
+	*length = util::read_bytes(buffer, &bc, bytes[0]);
+	*offset = util::read_bytes(buffer, &bc, bytes[1]) + start;
+	return 0;
+}
+
 const char * stringtbl::get(ssize_t index, bool do_lock) const
 {
-	int i, bc = 0;
+	int i;
 	off_t offset;
 	ssize_t length;
-	uint8_t buffer[8];
 	char * string;
 	if(index < 0 || index >= count)
 		return NULL;
@@ -96,14 +108,10 @@ const char * stringtbl::get(ssize_t index, bool do_lock) const
 		if(lru[i].index == index)
 			return lru[i].string;
 	/* not in LRU */
+	io_limiter::defer defer;
 	scopelock scope(fp->lock, do_lock);
-	offset = start + sizeof(st_header) + index * bytes[2];
-	i = fp->read(offset, buffer, bytes[2], false);
-	if(i != bytes[2])
+	if(read_entry(index, &length, &offset) < 0)
 		return NULL;
-	length = util::read_bytes(buffer, &bc, bytes[0]);
-	offset = util::read_bytes(buffer, &bc, bytes[1]) + start;
-	/* now we have the length and offset */
 	string = (char *) malloc(length + 1);
 	if(!string)
 		return NULL;
@@ -126,24 +134,19 @@ const char * stringtbl::get(ssize_t index, bool do_lock) const
 
 const blob & stringtbl::get_blob(ssize_t index, bool do_lock) const
 {
-	int i, bc = 0;
+	int i;
 	off_t offset;
 	ssize_t length;
-	uint8_t buffer[8];
 	if(index < 0 || index >= count)
 		return blob::dne;
 	for(i = 0; i < ST_LRU; i++)
 		if(lru[i].index == index)
 			return lru[i].binary;
 	/* not in LRU */
+	io_limiter::defer defer;
 	scopelock scope(fp->lock, do_lock);
-	offset = start + sizeof(st_header) + index * bytes[2];
-	i = fp->read(offset, buffer, bytes[2], false);
-	if(i != bytes[2])
+	if(read_entry(index, &length, &offset) < 0)
 		return blob::dne;
-	length = util::read_bytes(buffer, &bc, bytes[0]);
-	offset = util::read_bytes(buffer, &bc, bytes[1]) + start;
-	/* now we have the length and offset */
 	blob_buffer data(length);
 	data.set_size(length, false);
 	assert(length);
@@ -161,8 +164,65 @@ const blob & stringtbl::get_blob(ssize_t index, bool do_lock) const
 	return lru[i].binary;
 }
 
+istr stringtbl::copy(ssize_t index) const
+{
+	blob value = copy_blob(index);
+	if(!value.exists())
+		return NULL;
+	return istr(value);
+}
+
+blob stringtbl::copy_blob(ssize_t index) const
+{
+	off_t offset;
+	ssize_t length;
+	if(index < 0 || index >= count)
+		return blob();
+	if(read_entry(index, &length, &offset) < 0)
+		return blob();
+	if(!length)
+		return blob::empty;
+	blob_buffer data(length);
+	data.set_size(length, false);
+	if(fp->read(offset, &data[0], length, false) != length)
+		return blob();
+	return data;
+}
+
+bool stringtbl::compare(ssize_t index, const void * data, size_t size, int * result) const
+{
+	off_t offset;
+	ssize_t length;
+	size_t done = 0;
+	if(index < 0 || index >= count)
+		return false;
+	if(read_entry(index, &length, &offset) < 0)
+		return false;
+	/* a piece at a time, so there is nothing to allocate */
+	while(done < (size_t) length && done < size)
+	{
+		int c;
+		uint8_t buffer[64];
+		size_t piece = ((size_t) length < size ? length : size) - done;
+		if(piece > sizeof(buffer))
+			piece = sizeof(buffer);
+		if(fp->read(offset + done, buffer, piece, false) != (ssize_t) piece)
+			return false;
+		c = memcmp(buffer, (const uint8_t *) data + done, piece);
+		if(c)
+		{
+			*result = c;
+			return true;
+		}
+		done += piece;
+	}
+	*result = ((size_t) length < size) ? -1 : (size_t) length > size;
+	return true;
+}
+
 ssize_t stringtbl::locate(const char * string, bool do_lock) const
 {
+	io_limiter::defer defer;
 	scopelock scope(fp->lock, do_lock);
 	/* binary search */
 	ssize_t min = 0, max = count - 1;
@@ -187,6 +247,7 @@ ssize_t stringtbl::locate(const char * string, bool do_lock) const
 
 ssize_t stringtbl::locate(const blob & search, const blob_comparator * blob_cmp, bool do_lock) const
 {
+	io_limiter::defer defer;
 	scopelock scope(fp->lock, do_lock);
 	/* binary search */
 	ssize_t min = 0, max = count - 1;
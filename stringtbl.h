@@ -14,7 +14,9 @@
 
 #include <vector>
 
+#include "istr.h"
 #include "blob.h"
+#include "dtype.h"
 
 /* A string table is a section of a file which maintains a collection of unique
  * strings in sorted order. String tables are immutable once created. */
@@ -52,6 +54,34 @@ public:
 	 * more calls to get(), or one call to locate(). */
 	const char * get(ssize_t index, bool do_lock = true) const;
 	const blob & get_blob(ssize_t index, bool do_lock = true) const;
+	/* These return copies and do not use the LRU, so they can be called
+	 * concurrently without any locking if the rofile is lock_free(). */
+	istr copy(ssize_t index) const;
+	blob copy_blob(ssize_t index) const;
+	/* Compares a string with the given bytes without copying it, like
+	 * memcmp() and then by length; returns false if it can't be read. */
+	bool compare(ssize_t index, const void * data, size_t size, int * result) const;
+	
+	/* the bytes of a string or blob key, to pass to compare() */
+	struct raw_key
+	{
+		const void * data;
+		size_t size;
+		inline raw_key(const dtype & key)
+		{
+			if(key.type == dtype::STRING)
+			{
+				data = key.str().str();
+				size = key.str().length();
+			}
+			else
+			{
+				data = key.blb().data();
+				size = key.blb().size();
+			}
+		}
+	};
+	
 	ssize_t locate(const char * string, bool do_lock = true) const;
 	ssize_t locate(const blob & search, const blob_comparator * blob_cmp = NULL, bool do_lock = true) const;
 	
@@ -61,6 +91,9 @@ public:
 	static int create(rwfile * fp, const std::vector<blob> & blobs);
 	
 private:
+	/* reads the length and offset of the given string */
+	int read_entry(ssize_t index, ssize_t * length, off_t * offset) const;
+	
 	struct lru_ent
 	{
 		ssize_t index;
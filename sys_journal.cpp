@@ -131,6 +131,82 @@ int sys_journal::append(listening_dtable * listener, void * entry, size_t length
 	return 0;
 }
 
+int sys_journal::batch::add(listening_dtable * listener, const void * entry, size_t length)
+{
+	int r;
+	entry_header header;
+	header.id = listener->id();
+	assert(listener->get_journal()->warehouse_lookup(header.id) == listener);
+	if(length == (size_t) -1 || length == (size_t) -2)
+		return -EINVAL;
+	header.length = length;
+	if(data.size() + sizeof(header) + length > data.capacity())
+	{
+		/* grow geometrically, since batches can get large */
+		size_t capacity = data.size() + sizeof(header) + length;
+		r = data.set_capacity((capacity < 2 * data.capacity()) ? 2 * data.capacity() : capacity);
+		if(r < 0)
+			return r;
+	}
+	r = data.append(&header, sizeof(header));
+	if(r < 0)
+		return r;
+	r = data.append(entry, length);
+	if(r < 0)
+	{
+		data.set_size(data.size() - sizeof(header));
+		return r;
+	}
+	ids.push_back(header.id);
+	return 0;
+}
+
+int sys_journal::append(const batch * batch)
+{
+	int r;
+	entry_header header;
+	SYSJ_DEBUG("%zu entries, %zu bytes", batch->ids.size(), batch->data.size());
+	
+	if(batch->empty())
+		return 0;
+	/* batch records are identified by the otherwise unused NO_ID */
+	header.id = NO_ID;
+	header.length = batch->data.size();
+	
+	assert_data_size();
+	if(!dirty)
+	{
+		if(!handle.registered)
+			tx_register_pre_end(&handle);
+		dirty = true;
+	}
+	r = data.append(&header);
+	if(r < 0)
+		return r;
+	r = data.append(batch->data.data(), header.length);
+	if(r != (int) header.length)
+	{
+		data.truncate(-sizeof(header));
+		return (r < 0) ? r : -1;
+	}
+	data_size += sizeof(header) + header.length;
+	
+	for(size_t i = 0; i < batch->ids.size(); i++)
+	{
+		listener_id lid = batch->ids[i];
+		live_entry_map::iterator count = live_entry_count.find(lid);
+		assert(!discarded.count(lid));
+		if(count != live_entry_count.end())
+			count->second++;
+		else
+			live_entry_count[lid] = 1;
+		live_entries++;
+	}
+	
+	assert_data_size();
+	return 0;
+}
+
 int sys_journal::discard(listener_id lid)
 {
 	int r;
@@ -283,6 +359,34 @@ int sys_journal::filter()
 	return r;
 }
 
+int sys_journal::filter_batch(rwfile * out, const void * batch_data, size_t length)
+{
+	size_t offset = 0;
+	const uint8_t * bytes = (const uint8_t *) batch_data;
+	while(offset < length)
+	{
+		int r;
+		entry_header entry;
+		if(length - offset < sizeof(entry))
+			return -EIO;
+		util::memcpy(&entry, &bytes[offset], sizeof(entry));
+		offset += sizeof(entry);
+		if(entry.length > length - offset)
+			return -EIO;
+		if(!discarded.count(entry.id))
+		{
+			r = out->append(&entry);
+			if(r < 0)
+				return r;
+			r = out->append(&bytes[offset], entry.length);
+			if(r != (int) entry.length)
+				return (r < 0) ? r : -1;
+		}
+		offset += entry.length;
+	}
+	return 0;
+}
+
 int sys_journal::filter(int dfd, const char * file, size_t * new_size)
 {
 	rwfile out;
@@ -335,6 +439,16 @@ int sys_journal::filter(int dfd, const char * file, size_t * new_size)
 				goto fail;
 			}
 			offset += entry_length;
+			if(entry.id == NO_ID && entry.length != (size_t) -2)
+			{
+				/* a batch record; keep its live entries as separate
+				 * records, since this whole file is written atomically */
+				r = filter_batch(&out, entry_data, entry_length);
+				free(entry_data);
+				if(r < 0)
+					goto fail;
+				continue;
+			}
 			r = out.append(&entry);
 			if(r < 0)
 			{
@@ -528,6 +642,33 @@ void sys_journal::discard_rollover_ids(listener_id lid)
 	}
 }
 
+int sys_journal::playback_entry(listener_id lid, void * entry, size_t length, listener_id_set * temporary)
+{
+	int r;
+	listening_dtable * listener;
+	live_entry_map::iterator count = live_entry_count.find(lid);
+	if(count != live_entry_count.end())
+		count->second++;
+	else
+		live_entry_count[lid] = 1;
+	live_entries++;
+	
+	if(is_temporary(lid))
+		temporary->insert(lid);
+	
+	listener = warehouse_obtain(lid, entry, length);
+	if(!listener)
+	{
+		free(entry);
+		return -EIO;
+	}
+	/* data is passed by reference */
+	r = listener->journal_replay(entry, length);
+	if(entry)
+		free(entry);
+	return r;
+}
+
 int sys_journal::playback()
 {
 	listener_id_set temporary;
@@ -606,16 +747,6 @@ int sys_journal::playback()
 			continue;
 		}
 		SYSJ_DEBUG_IN("record for ID %d, length %zu", entry.id, entry.length);
-		live_entry_map::iterator count = live_entry_count.find(entry.id);
-		if(count != live_entry_count.end())
-			count->second++;
-		else
-			live_entry_count[entry.id] = 1;
-		live_entries++;
-		
-		if(is_temporary(entry.id))
-			temporary.insert(entry.id);
-		
 		entry_data = malloc(entry.length);
 		if(!entry_data)
 			return -ENOMEM;
@@ -626,16 +757,42 @@ int sys_journal::playback()
 		}
 		offset += entry.length;
 		
-		listener = warehouse_obtain(entry.id, entry_data, entry.length);
-		if(!listener)
+		if(entry.id == NO_ID)
 		{
+			/* this is a batch record, containing complete entries */
+			size_t batch_offset = 0;
+			while(batch_offset < entry.length)
+			{
+				void * sub_data;
+				entry_header sub;
+				if(entry.length - batch_offset < sizeof(sub))
+					break;
+				util::memcpy(&sub, &((uint8_t *) entry_data)[batch_offset], sizeof(sub));
+				batch_offset += sizeof(sub);
+				if(sub.id == NO_ID || sub.length > entry.length - batch_offset)
+					break;
+				sub_data = malloc(sub.length);
+				if(!sub_data)
+				{
+					free(entry_data);
+					return -ENOMEM;
+				}
+				util::memcpy(sub_data, &((uint8_t *) entry_data)[batch_offset], sub.length);
+				batch_offset += sub.length;
+				r = playback_entry(sub.id, sub_data, sub.length, &temporary);
+				if(r < 0)
+				{
+					free(entry_data);
+					return r;
+				}
+			}
 			free(entry_data);
-			return -EIO;
+			if(batch_offset != entry.length)
+				return -EIO;
+			continue;
 		}
-		/* data is passed by reference */
-		r = listener->journal_replay(entry_data, entry.length);
-		if(entry_data)
-			free(entry_data);
+		
+		r = playback_entry(entry.id, entry_data, entry.length, &temporary);
 		if(r < 0)
 			return r;
 	}
@@ -785,6 +942,10 @@ int sys_journal::flush_tx()
 		return 0;
 	assert_data_size();
 	r = data.flush();
+	if(r < 0)
+		return r;
+	/* the new size in the metafile needs the data to be there */
+	r = tx_add_sync_fd(data.get_fd());
 	if(r < 0)
 		return r;
 	
@@ -19,11 +19,13 @@
 #include <ext/hash_set>
 #include <ext/hash_map>
 #include <ext/pool_allocator.h>
+#include <vector>
 #include "concat_queue.h"
 
 #include "istr.h"
 #include "rwfile.h"
 #include "dtable.h"
+#include "blob_buffer.h"
 
 class sys_journal
 {
@@ -32,6 +34,7 @@ public:
 	static const listener_id NO_ID = (listener_id) -1;
 	
 	class listening_dtable;
+	class batch;
 	
 	class listening_dtable_warehouse
 	{
@@ -83,6 +86,14 @@ public:
 		
 		/* listening dtables must implement size() */
 		virtual size_t size() const = 0;
+		/* the number of values held in memory, including any that have been
+		 * replaced but not yet freed; this decides when to digest */
+		inline virtual size_t footprint() const { return size(); }
+		
+		/* returns a read-only dtable of the current contents, which later
+		 * changes will not affect, or NULL if this is not supported; it must
+		 * be destroyed before this dtable is reinitialized or destroyed */
+		inline virtual dtable * snapshot() const { return NULL; }
 		
 		inline listener_id id() const { return local_id; }
 		inline listening_dtable_warehouse * get_warehouse() const { return warehouse; }
@@ -108,6 +119,12 @@ public:
 			return 0;
 		}
 		
+		/* Adds the journal entry for an insert to a batch (see below) instead
+		 * of appending it to the journal. Once the batch has been appended,
+		 * batch_apply() must be called to update the in-memory state. */
+		virtual int batch_log(batch * batch, const dtype & key, const blob & value, bool append = false) { return -ENOSYS; }
+		inline int batch_apply(const dtype & key, const blob & value, bool append = false) { return accept(key, value, append); }
+		
 		/* only actually destroy if we're not in a warehouse */
 		inline virtual void destroy() const { if(!warehouse) delete this; }
 		inline virtual ~listening_dtable() { assert(!warehouse); }
@@ -293,6 +310,30 @@ public:
 		id_ptr_map map;
 	};
 	
+	/* A batch collects journal entries for any number of listeners, which
+	 * are then appended to the journal as a single record: during playback,
+	 * either all of them will be replayed or none of them will be. */
+	class batch
+	{
+	public:
+		/* copies the entry */
+		int add(listening_dtable * listener, const void * entry, size_t length);
+		inline bool empty() const { return ids.empty(); }
+		inline void clear()
+		{
+			data.set_size(0);
+			ids.clear();
+		}
+		
+	private:
+		blob_buffer data;
+		std::vector<listener_id> ids;
+		friend class sys_journal;
+	};
+	
+	/* append a batch of entries as a single record; the batch is not cleared */
+	int append(const batch * batch);
+	
 	/* remove any discarded entries from this journal */
 	int filter();
 	
@@ -415,10 +456,14 @@ private:
 	void roll_over_rollover_ids(listener_id from, listener_id to, listener_id_set * remove = NULL);
 	void discard_rollover_ids(listener_id lid);
 	
+	/* play back a single entry, which is freed, as part of playback() */
+	int playback_entry(listener_id lid, void * entry, size_t length, listener_id_set * temporary);
 	/* play back the entire journal, creating listeners as necessary */
 	int playback();
 	/* copy the entries in this journal to a new one, omitting the discarded entries */
 	int filter(int dfd, const char * file, size_t * new_size);
+	/* like filter(), for the entries in a batch record */
+	int filter_batch(rwfile * out, const void * batch_data, size_t length);
 	/* flushes the data file and tx_write()s the meta file */
 	int flush_tx();
 	/* actual function used for tx_register_pre_end */
@@ -19,17 +19,47 @@ dtable::iter * temp_journal_dtable::iterator(ATX_DEF) const
 	return journal_dtable::iterator(atx);
 }
 
+bool temp_journal_dtable::present(const dtype & key, bool * found, ATX_DEF) const
+{
+	temp_journal_dtable_hash::const_iterator it;
+	if(!temporary)
+		return journal_dtable::present(key, found, atx);
+	it = temp_hash.find(key);
+	if(it != temp_hash.end())
+	{
+		*found = true;
+		return it->second.exists();
+	}
+	*found = false;
+	return false;
+}
+
+blob temp_journal_dtable::lookup(const dtype & key, bool * found, ATX_DEF) const
+{
+	temp_journal_dtable_hash::const_iterator it;
+	if(!temporary)
+		return journal_dtable::lookup(key, found, atx);
+	it = temp_hash.find(key);
+	if(it != temp_hash.end())
+	{
+		*found = true;
+		return it->second;
+	}
+	*found = false;
+	return blob();
+}
+
 int temp_journal_dtable::insert(const dtype & key, const blob & blob, bool append, ATX_DEF)
 {
 	int r;
 	if(!temporary)
 		return journal_dtable::insert(key, blob, append, atx);
-	if(key.type != ktype || (ktype == dtype::BLOB && !key.blb.exists()))
+	if(key.type != ktype || (ktype == dtype::BLOB && !key.blb().exists()))
 		return -EINVAL;
 	r = log(key, blob, append);
 	if(r < 0)
 		return r;
-	jdt_hash[key] = blob;
+	temp_hash[key] = blob;
 	return 0;
 }
 
@@ -50,6 +80,7 @@ int temp_journal_dtable::reinit(sys_journal::listener_id lid)
 	if(lid == sys_journal::NO_ID)
 		return -EINVAL;
 	temporary = true;
+	temp_hash.clear();
 	return journal_dtable::reinit(lid);
 }
 
@@ -57,15 +88,34 @@ int temp_journal_dtable::accept(const dtype & key, const blob & value, bool appe
 {
 	if(!temporary)
 		return journal_dtable::accept(key, value, append);
-	jdt_hash[key] = value;
+	temp_hash[key] = value;
+	return 0;
+}
+
+int temp_journal_dtable::real_rollover(listening_dtable * target) const
+{
+	temp_journal_dtable_hash::const_iterator it;
+	if(!temporary)
+		return journal_dtable::real_rollover(target);
+	for(it = temp_hash.begin(); it != temp_hash.end(); ++it)
+	{
+		int r = send(target, it->first, it->second);
+		if(r < 0)
+			return r;
+	}
 	return 0;
 }
 
 int temp_journal_dtable::degrade()
 {
-	journal_dtable_hash::iterator it;
-	for(it = jdt_hash.begin(); it != jdt_hash.end(); ++it)
-		jdt_map[it->first] = &it->second;
+	temp_journal_dtable_hash::iterator it;
+	for(it = temp_hash.begin(); it != temp_hash.end(); ++it)
+	{
+		int r = journal_dtable::accept(it->first, it->second);
+		if(r < 0)
+			return r;
+	}
+	temp_hash.clear();
 	temporary = false;
 	return 0;
 }
@@ -9,6 +9,9 @@
 #error temp_journal_dtable.h is a C++ header file
 #endif
 
+#include <ext/hash_map>
+#include <ext/pool_allocator.h>
+
 #include "journal_dtable.h"
 
 /* A normal journal dtable keeps its keys in sorted order, which is necessary to
@@ -19,17 +22,26 @@
  * need to traverse the source data in sorted order. If the application does not
  * itself create an iterator, the work of maintaining a sorted tree is wasted.
  * This variant of the journal dtable defers the work of creating the sorted
- * tree until its iterator() method is called; until then it uses a hash table.
- * If the iterator() method is never called, then the extra work is avoided. */
+ * memtable until its iterator() method is called; until then it uses a hash table.
+ * If the iterator() method is never called, then the extra work is avoided.
+ * The hash table does not allow concurrent readers, so unlike a normal journal
+ * dtable, a temporary one can only be used by one thread at a time. */
 
 class temp_journal_dtable : public journal_dtable
 {
 public:
 	virtual dtable::iter * iterator(ATX_OPT) const;
+	virtual bool present(const dtype & key, bool * found, ATX_OPT) const;
+	virtual blob lookup(const dtype & key, bool * found, ATX_OPT) const;
 	
+	inline virtual size_t size() const { return temporary ? temp_hash.size() : journal_dtable::size(); }
+	inline virtual size_t footprint() const { return temporary ? temp_hash.size() : journal_dtable::footprint(); }
+	/* the hash table doesn't keep old versions, so only after degrading */
+	inline virtual dtable * snapshot() const { return temporary ? NULL : journal_dtable::snapshot(); }
 	virtual int insert(const dtype & key, const blob & blob, bool append = false, ATX_OPT);
 	
 	/* for rollover */
+	virtual int real_rollover(listening_dtable * target) const;
 	virtual int accept(const dtype & key, const blob & value, bool append = false);
 	
 	class temp_journal_dtable_warehouse : public sys_journal::listening_dtable_warehouse_impl<temp_journal_dtable>
@@ -47,14 +59,19 @@ public:
 	
 protected:
 	/* temp_journal_dtables should only be constructed by a temp_journal_dtable_warehouse */
-	inline temp_journal_dtable() {}
+	inline temp_journal_dtable() : temp_hash(10, blob_cmp, blob_cmp) {}
 	int init(dtype::ctype key_type, sys_journal::listener_id lid, sys_journal * sysj);
 	inline virtual ~temp_journal_dtable() {}
 	
 private:
 	int degrade();
 	
+	typedef __gnu_cxx::__pool_alloc<std::pair<const dtype, blob> > hash_pool_allocator;
+	typedef __gnu_cxx::hash_map<const dtype, blob, dtype_hashing_comparator, dtype_hashing_comparator, hash_pool_allocator> temp_journal_dtable_hash;
+	
 	bool temporary;
+	/* until we degrade, the data is here instead of in the memtable */
+	temp_journal_dtable_hash temp_hash;
 };
 
 #endif /* __TEMP_JOURNAL_DTABLE_H */
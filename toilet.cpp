@@ -612,16 +612,16 @@ const t_value * toilet_row_value(t_row * row, const char * key, t_type type)
 		case dtype::STRING:
 			if(type != T_STRING)
 				return NULL;
-			converted = (t_value *) strdup(value.str);
+			converted = (t_value *) strdup(value.str());
 			row->values[key] = converted;
 			return converted;
 		case dtype::BLOB:
 			if(type != T_BLOB)
 				return NULL;
 			converted = (t_value *) malloc(sizeof(*converted));
-			converted->v_blob.length = value.blb.size();
+			converted->v_blob.length = value.blb().size();
 			converted->v_blob.data = malloc(converted->v_blob.length);
-			util::memcpy(converted->v_blob.data, &value.blb[0], converted->v_blob.length);
+			util::memcpy(converted->v_blob.data, &value.blb()[0], converted->v_blob.length);
 			return converted;
 	}
 	abort();
@@ -749,7 +749,7 @@ bool toilet_cursor_seek_magic(t_cursor * cursor, int (*magic)(const void *, size
 		virtual int operator()(const dtype & key) const
 		{
 			assert(key.type == dtype::BLOB);
-			return test(&key.blb[0], key.blb.size(), user);
+			return test(&key.blb()[0], key.blb().size(), user);
 		}
 		
 		local(test_fnp test, void * user) : test(test), user(user) {}
@@ -791,8 +791,10 @@ const void * toilet_cursor_row_blobkey(t_cursor * cursor, size_t * key_size)
 {
 	dtype key = cursor->iter->key();
 	assert(key.type == dtype::BLOB);
-	*key_size = key.blb.size();
-	return &key.blb[0];
+	/* small blobs keep their data inline, so it must not be in a temporary */
+	cursor->key = key.blb();
+	*key_size = cursor->key.size();
+	return &cursor->key[0];
 }
 
 void toilet_close_cursor(t_cursor * cursor)
@@ -289,6 +289,8 @@ struct t_cursor
 {
 	dtable::key_iter * iter;
 	t_gtable * gtable;
+	/* holds the data returned by toilet_cursor_row_blobkey() */
+	blob key;
 	inline t_cursor() : iter(NULL) {}
 	inline ~t_cursor() { if(iter) delete iter; }
 };
@@ -35,7 +35,10 @@
  * It is also safe to call tx_register_pre_end() and tx_unregister_pre_end().
  * All other calls must be made by a single thread; furthermore, it is not safe
  * for other threads to use tx_write() while that single thread executes any
- * other transaction library function (e.g. tx_start() or tx_end()). */
+ * other transaction library function (e.g. tx_start() or tx_end()). The
+ * exceptions are tx_sync() and tx_forget(), which may be called by any thread
+ * for transaction IDs returned by tx_end(); concurrent tx_sync() calls share
+ * a single file system sync (see tx_set_sync_window()). */
 
 #define MF_TX_WRITE 1
 #define MF_TX_UNLINK 2
@@ -171,6 +174,7 @@ tx_id metafile::last_tx_id = -1;
 tx_pre_end * metafile::pre_end_handlers = NULL;
 init_mutex metafile::pre_end_handler_lock;
 metafile::tx_map_t metafile::tx_map;
+init_mutex metafile::tx_map_lock;
 
 int metafile::record_processor(void * data, size_t length, void * param)
 {
@@ -247,7 +251,7 @@ class cpp_atexit
 cpp_atexit cpp_atexit::singleton;
 
 /* scans journal dir, recovers transactions */
-int metafile::tx_init(int dfd, size_t log_size)
+int metafile::tx_init(int dfd, size_t log_size, int durability)
 {
 	DIR * dir;
 	int copy, error = -1;
@@ -256,11 +260,13 @@ int metafile::tx_init(int dfd, size_t log_size)
 	
 	if(journal_dir >= 0)
 		return -EBUSY;
+	if(durability != TX_SYNC_FS && durability != TX_SYNC_FDATASYNC)
+		return -EINVAL;
 	
 	journal_dir = openat(dfd, "journals", O_RDONLY);
 	if(journal_dir < 0)
 		return journal_dir;
-	copy = journal::init(dfd);
+	copy = journal::init(dfd, (durability == TX_SYNC_FS) ? journal::SYNC_FS : journal::SYNC_FDATASYNC);
 	if(copy < 0)
 	{
 		error = copy;
@@ -296,9 +302,17 @@ int metafile::tx_init(int dfd, size_t log_size)
 	{
 		const char * name = entries[i];
 		const char * commit_name = NULL;
-		last_tx_id = strtol(name, NULL, 16);
 		if(i + 1 < entries.size() && strstr(entries[i + 1], name) && strstr(entries[i + 1], J_COMMIT_EXT))
 			commit_name = entries[++i];
+		if(journal::is_recycled(name))
+		{
+			/* an old journal kept for reuse, not one to recover */
+			error = journal::add_recycled(journal_dir, name, commit_name);
+			if(error < 0)
+				goto fail;
+			continue;
+		}
+		last_tx_id = strtol(name, NULL, 16);
 		
 		error = journal::reopen(journal_dir, name, commit_name, &current_journal, last_journal);
 		if(error < 0)
@@ -380,6 +394,7 @@ int metafile::tx_start()
 	if(!current_journal)
 	{
 		char name[16];
+		scopelock scope(tx_map_lock);
 		if(journal_dir < 0)
 			return -EBUSY;
 		snprintf(name, sizeof(name), "%08x.jnl", last_tx_id + 1);
@@ -402,6 +417,7 @@ int metafile::switch_journal()
 	int r = current_journal->erase();
 	if(r < 0)
 		return r;
+	scopelock scope(tx_map_lock);
 	last_journal = current_journal;
 	current_journal = NULL;
 	return 0;
@@ -439,8 +455,11 @@ tx_id metafile::tx_end(bool assign_id)
 	}
 	MF_S_DEBUG("%d", tx_recursion);
 	if(assign_id)
+	{
+		scopelock scope(tx_map_lock);
 		if(!tx_map.insert(std::make_pair(last_tx_id, current_journal)).second)
 			return -ENOENT;
+	}
 	r = current_journal->commit();
 	if(r < 0)
 		goto fail;
@@ -460,7 +479,10 @@ tx_id metafile::tx_end(bool assign_id)
 	
 fail:
 	if(assign_id) 
+	{
+		scopelock scope(tx_map_lock);
 		tx_map.erase(last_tx_id);
+	}
 	return r;
 }
 
@@ -501,13 +523,20 @@ void metafile::tx_unregister_pre_end(tx_pre_end * handle)
 int metafile::tx_sync(tx_id id)
 {
 	int r;
-	tx_map_t::iterator itr = tx_map.find(id);
+	journal * j;
+	tx_map_t::iterator itr;
+	scopelock scope(tx_map_lock);
+	itr = tx_map.find(id);
 	if(itr == tx_map.end())
 		return -EINVAL;
-	journal * j = itr->second;
+	j = itr->second;
+	/* don't hold the lock while waiting, so that other threads can
+	 * sync their transactions at the same time (sharing the sync) */
+	scope.unlock();
 	r = j->wait();
 	if(r < 0)
 		return r;
+	scope.lock();
 	tx_map.erase(id);
 	if(j != last_journal)
 		j->release();
@@ -516,6 +545,7 @@ int metafile::tx_sync(tx_id id)
 
 int metafile::tx_forget(tx_id id)
 {
+	scopelock scope(tx_map_lock);
 	tx_map_t::iterator itr = tx_map.find(id);
 	if(itr == tx_map.end())
 		return -EINVAL;
@@ -526,6 +556,16 @@ int metafile::tx_forget(tx_id id)
 	return 0;
 }
 
+void metafile::tx_set_sync_window(unsigned int usecs)
+{
+	journal::set_sync_window(usecs);
+}
+
+int metafile::tx_add_sync_fd(int fd)
+{
+	return journal::add_sync_fd(fd);
+}
+
 int metafile::tx_start_r()
 {
 	if(!tx_recursion)
@@ -593,7 +633,12 @@ int tx_unlink(int dfd, const char * name, int recursive)
 
 int tx_init(int dfd, size_t log_size)
 {
-	return metafile::tx_init(dfd, log_size);
+	return metafile::tx_init(dfd, log_size, TX_SYNC_FDATASYNC);
+}
+
+int tx_init_durability(int dfd, size_t log_size, int durability)
+{
+	return metafile::tx_init(dfd, log_size, durability);
 }
 
 void tx_deinit(void)
@@ -641,6 +686,16 @@ int tx_forget(tx_id id)
 	return metafile::tx_forget(id);
 }
 
+void tx_set_sync_window(unsigned int usecs)
+{
+	metafile::tx_set_sync_window(usecs);
+}
+
+int tx_add_sync_fd(int fd)
+{
+	return metafile::tx_add_sync_fd(fd);
+}
+
 int tx_start_r(void)
 {
 	return metafile::tx_start_r();
@@ -27,7 +27,13 @@ struct tx_pre_end {
 	struct tx_pre_end * _next;
 };
 
+/* how tx_sync() makes transactions durable; see journal::durability */
+#define TX_SYNC_FS 0
+#define TX_SYNC_FDATASYNC 1
+
+/* tx_init() uses TX_SYNC_FDATASYNC */
 int tx_init(int dfd, size_t log_size);
+int tx_init_durability(int dfd, size_t log_size, int durability);
 void tx_deinit(void);
 
 int tx_start(void);
@@ -45,6 +51,11 @@ void tx_unregister_pre_end(struct tx_pre_end * handle);
 
 int tx_sync(tx_id id);
 int tx_forget(tx_id id);
+/* tx_sync() waits this long for other threads to join its file system sync */
+void tx_set_sync_window(unsigned int usecs);
+/* the file's data will be on disk when the current transaction has been synced;
+ * for files written outside of transactions but referred to by them */
+int tx_add_sync_fd(int fd);
 
 /* metafiles */
 typedef struct metafile * tx_fd;
@@ -145,7 +156,7 @@ public:
 	static int unlink(int dfd, const char * name, bool recursive);
 	
 	/* transactions */
-	static int tx_init(int dfd, size_t log_size);
+	static int tx_init(int dfd, size_t log_size, int durability);
 	static void tx_deinit();
 	
 	static int tx_start();
@@ -159,6 +170,8 @@ public:
 	
 	static int tx_sync(tx_id id);
 	static int tx_forget(tx_id id);
+	static void tx_set_sync_window(unsigned int usecs);
+	static int tx_add_sync_fd(int fd);
 	
 	static int tx_start_r();
 	static int tx_end_r();
@@ -205,6 +218,8 @@ private:
 	static init_mutex pre_end_handler_lock;
 	typedef std::map<tx_id, journal *> tx_map_t;
 	static tx_map_t tx_map; 
+	/* protects tx_map and last_journal, for tx_sync() and tx_forget() */
+	static init_mutex tx_map_lock;
 	
 	static int switch_journal();
 	static istr full_path(int dfd, const char * name);
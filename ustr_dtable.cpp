@@ -194,6 +194,7 @@ int ustr_dtable::find_key(const T & test, size_t * index, size_t * data_length,
 	/* binary search */
 	ssize_t min = 0, max = key_count - 1;
 	assert(ktype != dtype::BLOB || !cmp_name == !blob_cmp);
+	io_limiter::defer defer;
 	scopelock scope(fp->lock);
 	while(min <= max)
 	{
@@ -305,6 +306,15 @@ bool ustr_dtable::contains_index(size_t index) const
 	return data_length != (size_t) -1;
 }
 
+bool ustr_dtable::key_range(dtype * min, dtype * max) const
+{
+	if(!key_count)
+		return false;
+	*min = get_key(0);
+	*max = get_key(key_count - 1);
+	return true;
+}
+
 int ustr_dtable::init(int dfd, const char * file, const params & config, sys_journal * sysj)
 {
 	int r = -1;
@@ -531,10 +541,10 @@ int ustr_dtable::create(int dfd, const char * file, const params & config, dtabl
 				/* nothing to do */
 				break;
 			case dtype::STRING:
-				strings.push_back(key.str);
+				strings.push_back(key.str());
 				break;
 			case dtype::BLOB:
-				blobs.push_back(key.blb);
+				blobs.push_back(key.blb());
 				break;
 		}
 		if(blob_size)
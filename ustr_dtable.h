@@ -43,6 +43,7 @@ public:
 	virtual blob index(size_t index) const;
 	virtual bool contains_index(size_t index) const;
 	inline virtual size_t size() const { return key_count; }
+	virtual bool key_range(dtype * min, dtype * max) const;
 	
 	static inline bool static_indexed_access(const params & config) { return true; }
 	
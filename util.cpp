@@ -53,6 +53,51 @@ int util::rm_r(int dfd, const char * path)
 	return unlinkat(dfd, path, AT_REMOVEDIR);
 }
 
+off_t util::du(int dfd, const char * path)
+{
+	DIR * dir;
+	off_t total = 0;
+	struct stat64 st;
+	struct dirent * ent;
+	int fd, copy, r = fstatat64(dfd, path, &st, AT_SYMLINK_NOFOLLOW);
+	if(r < 0)
+		return r;
+	if(!S_ISDIR(st.st_mode))
+		return st.st_size;
+	fd = openat(dfd, path, O_RDONLY);
+	if(fd < 0)
+		return fd;
+	copy = dup(fd);
+	if(copy < 0)
+	{
+		close(fd);
+		return copy;
+	}
+	dir = fdopendir(copy);
+	if(!dir)
+	{
+		close(copy);
+		close(fd);
+		return -1;
+	}
+	while((ent = readdir(dir)))
+	{
+		off_t size;
+		if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		size = du(fd, ent->d_name);
+		if(size < 0)
+		{
+			total = size;
+			break;
+		}
+		total += size;
+	}
+	closedir(dir);
+	close(fd);
+	return total;
+}
+
 istr util::tilde_home(const istr & path)
 {
 	size_t length;
@@ -7,6 +7,7 @@
 
 #include <string.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #ifndef __cplusplus
 #error util.h is a C++ header file
@@ -137,6 +138,8 @@ public:
 	
 	/* rm -r */
 	static int rm_r(int dfd, const char * path);
+	/* du -sb: the total size of the files under path */
+	static off_t du(int dfd, const char * path);
 	static istr tilde_home(const istr & path);
 };
 